@@ -0,0 +1,1026 @@
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <iterator>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "BatchDecoder.h"
+#include "Crc.h"
+#include "Filter.h"
+#include "ImageCache.h"
+#include "Inflate.h"
+#include "MappedOutput.h"
+#include "PNG_Decoder.h"
+#include "PNG_Encoder.h"
+#include "PushDecoder.h"
+#include "ThreadPool.h"
+#include "zlib.h"
+
+struct Format {
+  unsigned char colorType;
+  unsigned char bitDepth;
+  unsigned int channels;
+};
+
+static const Format formats[] = {
+  {0, 1, 1}, {0, 8, 1}, {0, 16, 1}, {2, 8, 3}, {2, 16, 3}, {3, 4, 1}, {3, 8, 1}, {4, 8, 2}, {4, 16, 2}, {6, 8, 4}, {6, 16, 4}
+};
+
+// Removes filters with the generic loops, choosing the routine and prior scan line per row.
+static void UnfilterGeneric(std::vector<char>& decompressed, std::vector<char>& unfiltered, unsigned int scanLineWidth,
+  unsigned int height, unsigned int bpp) {
+  for (unsigned int i = 0; i < height; ++i) {
+    char * scanLine = decompressed.data() + static_cast<size_t>(i) * (scanLineWidth + 1);
+    char * buffer = unfiltered.data() + static_cast<size_t>(i) * scanLineWidth;
+    char * priorScanLine = (i > 0) ? buffer - scanLineWidth : nullptr;
+    unsigned char filterType = static_cast<unsigned char>(scanLine[0]);
+    if (filterType == 0) {
+      std::copy(scanLine + 1, scanLine + 1 + scanLineWidth, buffer);
+    } else if (filterType == 1) {
+      Filter::RemoveSubFilter(scanLine + 1, scanLineWidth, buffer, bpp);
+    } else if (filterType == 2) {
+      Filter::RemoveUpFilter(scanLine + 1, scanLineWidth, buffer, priorScanLine);
+    } else if (filterType == 3) {
+      Filter::RemoveAverageFilter(scanLine + 1, scanLineWidth, buffer, bpp, priorScanLine);
+    } else {
+      Filter::RemovePaethFilter(scanLine + 1, scanLineWidth, buffer, bpp, priorScanLine);
+    }
+  }
+}
+
+// Removes filters with a ScanLineFilters table looked up once for the image.
+static void UnfilterSpecialized(std::vector<char>& decompressed, std::vector<char>& unfiltered, unsigned int scanLineWidth,
+  unsigned int height, const ScanLineFilters& filters) {
+  for (unsigned int i = 0; i < height; ++i) {
+    char * scanLine = decompressed.data() + static_cast<size_t>(i) * (scanLineWidth + 1);
+    char * buffer = unfiltered.data() + static_cast<size_t>(i) * scanLineWidth;
+    char * priorScanLine = (i > 0) ? buffer - scanLineWidth : nullptr;
+    Filter::UnfilterScanLine(filters, static_cast<unsigned char>(scanLine[0]), scanLine + 1, scanLineWidth, buffer, priorScanLine);
+  }
+}
+
+// Mean seconds per call after one warm-up call.
+template <typename Function>
+static double MeasureSeconds(int iterations, Function function) {
+  function();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    function();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+template <typename Function>
+static double MeasureMegabytesPerSecond(size_t bytes, int iterations, Function function) {
+  return static_cast<double>(bytes) / MeasureSeconds(iterations, function) / 1e6;
+}
+
+// Times the generic unfilter loops against the specialized filters for every color type and bit depth.
+void BenchFilters(unsigned int width, unsigned int height, int iterations) {
+  std::mt19937 random(42);
+  std::cout << "Unfilter throughput (MB/s), " << width << "x" << height << ", mixed filter types" << std::endl;
+  std::cout << std::setw(6) << "color" << std::setw(6) << "depth" << std::setw(12) << "generic" << std::setw(12) << "scalar"
+    << std::setw(12) << "simd" << std::setw(10) << "speedup" << std::endl;
+
+  for (const Format& format : formats) {
+    unsigned int bits = format.channels * format.bitDepth;
+    unsigned int scanLineWidth = (width * bits + 7) / 8;
+    unsigned int bpp = (bits / 8 == 0) ? 1 : bits / 8;
+    std::vector<char> decompressed(static_cast<size_t>(scanLineWidth + 1) * height);
+    std::vector<char> unfiltered(static_cast<size_t>(scanLineWidth) * height);
+    for (unsigned int i = 0; i < height; ++i) {
+      char * scanLine = decompressed.data() + static_cast<size_t>(i) * (scanLineWidth + 1);
+      scanLine[0] = static_cast<char>(random() % 5);
+      for (unsigned int j = 1; j <= scanLineWidth; ++j) {
+        scanLine[j] = static_cast<char>(random());
+      }
+    }
+
+    ScanLineFilters scalar = Filter::GetScanLineFilters(bpp, SIMD_TYPES::SCALAR);
+    ScanLineFilters simd = Filter::GetScanLineFilters(bpp);
+    size_t bytes = unfiltered.size();
+    double generic = MeasureMegabytesPerSecond(bytes, iterations, [&]() {
+      UnfilterGeneric(decompressed, unfiltered, scanLineWidth, height, bpp);
+    });
+    double specialized = MeasureMegabytesPerSecond(bytes, iterations, [&]() {
+      UnfilterSpecialized(decompressed, unfiltered, scanLineWidth, height, scalar);
+    });
+    double vectorized = MeasureMegabytesPerSecond(bytes, iterations, [&]() {
+      UnfilterSpecialized(decompressed, unfiltered, scanLineWidth, height, simd);
+    });
+
+    std::cout << std::fixed << std::setprecision(0) << std::setw(6) << static_cast<int>(format.colorType)
+      << std::setw(6) << static_cast<int>(format.bitDepth) << std::setw(12) << generic << std::setw(12) << specialized
+      << std::setw(12) << vectorized << std::setprecision(2) << std::setw(9) << (vectorized / generic) << "x" << std::endl;
+  }
+}
+
+// Times chunk CRC verification: slicing-by-8, the dispatched (PCLMULQDQ when available) CRC and zlib.
+void BenchCrc(size_t size, int iterations) {
+  std::mt19937 random(7);
+  std::vector<char> data(size);
+  for (char& byte : data) {
+    byte = static_cast<char>(random());
+  }
+  volatile unsigned int sink = 0;
+  double slicing = MeasureMegabytesPerSecond(size, iterations, [&]() { sink = sink + Crc::SlicingCrc32(data.data(), size); });
+  double dispatched = MeasureMegabytesPerSecond(size, iterations, [&]() { sink = sink + Crc::Crc32(data.data(), size); });
+  double zlib = MeasureMegabytesPerSecond(size, iterations, [&]() {
+    sink = sink + crc32(0, reinterpret_cast<const Bytef *>(data.data()), static_cast<uInt>(size));
+  });
+
+  std::cout << "CRC-32 throughput (MB/s), " << size << " bytes" << (Crc::pclmulSupported ? ", PCLMULQDQ" : "") << std::endl;
+  std::cout << std::fixed << std::setprecision(0) << std::setw(12) << "slicing" << std::setw(12) << "dispatched"
+    << std::setw(12) << "zlib" << std::endl;
+  std::cout << std::setw(12) << slicing << std::setw(12) << dispatched << std::setw(12) << zlib << std::endl;
+}
+
+static void AppendUint32(std::vector<char>& out, unsigned int value) {
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    out.push_back(static_cast<char>((value >> shift) & 0xFF));
+  }
+}
+
+static void AppendChunk(std::vector<char>& out, const char * type, const std::vector<char>& data) {
+  AppendUint32(out, static_cast<unsigned int>(data.size()));
+  size_t typeStart = out.size();
+  out.insert(out.end(), type, type + 4);
+  out.insert(out.end(), data.begin(), data.end());
+  AppendUint32(out, Crc::Crc32(out.data() + typeStart, data.size() + 4));
+}
+
+/* Writes a PNG of smooth noise with random filter bytes. The filter bytes are not applied to the samples,
+so the pixels decode to noise, but every filter path is exercised and the data compresses realistically.*/
+// Writes a PNG whose IDAT holds raw (filtered scan lines, each with its filter byte) compressed at level.
+static void WritePng(const std::filesystem::path& fileName, unsigned int width, unsigned int height, unsigned char bitDepth,
+  unsigned char colorType, int level, const std::vector<char>& raw) {
+  uLongf compressedSize = compressBound(static_cast<uLong>(raw.size()));
+  std::vector<char> compressed(compressedSize);
+  compress2(reinterpret_cast<Bytef *>(compressed.data()), &compressedSize, reinterpret_cast<const Bytef *>(raw.data()),
+    static_cast<uLong>(raw.size()), level);
+  compressed.resize(compressedSize);
+
+  std::vector<char> ihdr;
+  AppendUint32(ihdr, width);
+  AppendUint32(ihdr, height);
+  ihdr.push_back(static_cast<char>(bitDepth));
+  ihdr.push_back(static_cast<char>(colorType));
+  ihdr.insert(ihdr.end(), 3, 0);
+
+  const char signature[] = {static_cast<char>(137), 80, 78, 71, 13, 10, 26, 10};
+  std::vector<char> png(signature, signature + 8);
+  AppendChunk(png, "IHDR", ihdr);
+  if (colorType == 3) {
+    AppendChunk(png, "PLTE", std::vector<char>(3 * (1 << bitDepth)));
+  }
+  AppendChunk(png, "IDAT", compressed);
+  AppendChunk(png, "IEND", std::vector<char>());
+
+  std::ofstream outputStream(fileName, std::ofstream::binary);
+  outputStream.write(png.data(), static_cast<std::streamsize>(png.size()));
+}
+
+static std::vector<char> GetScanLines(unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType,
+  unsigned int seed) {
+  std::mt19937 random(seed);
+  unsigned int channels = (colorType == 2) ? 3 : (colorType == 4) ? 2 : (colorType == 6) ? 4 : 1;
+  unsigned int scanLineWidth = (width * channels * bitDepth + 7) / 8;
+  std::vector<char> raw(static_cast<size_t>(scanLineWidth + 1) * height);
+  for (unsigned int i = 0; i < height; ++i) {
+    char * scanLine = raw.data() + static_cast<size_t>(i) * (scanLineWidth + 1);
+    scanLine[0] = static_cast<char>(random() % 5);
+    for (unsigned int j = 1; j <= scanLineWidth; ++j) {
+      scanLine[j] = static_cast<char>((random() % 8) + ((j * 7 + i * 3) & 0x3F));
+    }
+  }
+  return raw;
+}
+
+static void WritePng(const std::filesystem::path& fileName, unsigned int width, unsigned int height, unsigned char bitDepth,
+  unsigned char colorType, int level, unsigned int seed) {
+  WritePng(fileName, width, height, bitDepth, colorType, level, GetScanLines(width, height, bitDepth, colorType, seed));
+}
+
+/* Writes an RGBA8 PNG split into numSegments bands of rows the way Apple's encoder writes screenshots: the stream is
+fully flushed between bands, every band gets its own IDAT chunk, and an iDOT chunk lists them.*/
+static void WriteIdotPng(const std::filesystem::path& fileName, unsigned int width, unsigned int height, unsigned int numSegments,
+  unsigned int seed) {
+  std::vector<char> raw = GetScanLines(width, height, 8, 6, seed);
+  unsigned long rowSize = static_cast<unsigned long>(width) * 4 + 1;
+  std::vector<std::vector<char>> pieces;
+  z_stream stream = {};
+  deflateInit(&stream, 6);
+  for (unsigned int i = 0; i < numSegments; ++i) {
+    unsigned long start = rowSize * (static_cast<unsigned long>(height) * i / numSegments);
+    unsigned long end = rowSize * (static_cast<unsigned long>(height) * (i + 1) / numSegments);
+    std::vector<char> piece(deflateBound(&stream, end - start) + 64);
+    stream.next_in = reinterpret_cast<Bytef *>(raw.data() + start);
+    stream.avail_in = static_cast<uInt>(end - start);
+    stream.next_out = reinterpret_cast<Bytef *>(piece.data());
+    stream.avail_out = static_cast<uInt>(piece.size());
+    deflate(&stream, (i + 1 == numSegments) ? Z_FINISH : Z_FULL_FLUSH);
+    piece.resize(piece.size() - stream.avail_out);
+    pieces.push_back(piece);
+  }
+  deflateEnd(&stream);
+
+  std::vector<char> ihdr;
+  AppendUint32(ihdr, width);
+  AppendUint32(ihdr, height);
+  ihdr.push_back(8);
+  ihdr.push_back(6);
+  ihdr.insert(ihdr.end(), 3, 0);
+  std::vector<char> idot;
+  AppendUint32(idot, numSegments);
+  unsigned int chunkOffset = 12 + 4 + 12 * numSegments;
+  for (unsigned int i = 0; i < numSegments; ++i) {
+    unsigned int firstRow = static_cast<unsigned int>(static_cast<unsigned long>(height) * i / numSegments);
+    AppendUint32(idot, firstRow);
+    AppendUint32(idot, static_cast<unsigned int>(static_cast<unsigned long>(height) * (i + 1) / numSegments) - firstRow);
+    AppendUint32(idot, chunkOffset);
+    chunkOffset += 12 + static_cast<unsigned int>(pieces[i].size());
+  }
+
+  const char signature[] = {static_cast<char>(137), 80, 78, 71, 13, 10, 26, 10};
+  std::vector<char> png(signature, signature + 8);
+  AppendChunk(png, "IHDR", ihdr);
+  AppendChunk(png, "iDOT", idot);
+  for (const std::vector<char>& piece : pieces) {
+    AppendChunk(png, "IDAT", piece);
+  }
+  AppendChunk(png, "IEND", std::vector<char>());
+  std::ofstream outputStream(fileName, std::ofstream::binary);
+  outputStream.write(png.data(), static_cast<std::streamsize>(png.size()));
+}
+
+// Compares BatchDecoder against starting one std::thread per file.
+void BenchBatch(unsigned int numFiles, unsigned int width, unsigned int height) {
+  std::filesystem::path directory = std::filesystem::temp_directory_path() / "png_decoder_bench_batch";
+  std::filesystem::create_directories(directory);
+  std::vector<std::filesystem::path> fileNames;
+  for (unsigned int i = 0; i < numFiles; ++i) {
+    fileNames.push_back(directory / ("image" + std::to_string(i) + ".png"));
+    WritePng(fileNames.back(), width, height, 8, 6, 6, i);
+  }
+  double megabytes = static_cast<double>(numFiles) * width * height * 4 / 1e6;
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (const std::filesystem::path& fileName : fileNames) {
+    threads.emplace_back([fileName]() {
+      PNG_Decoder decoder(fileName);
+      char * decompressedData = nullptr;
+      char * unfilteredData = nullptr;
+      decoder.AllocateDecompressedData(decompressedData);
+      PNG_Decoder::AllocateUnfilteredData(decompressedData, unfilteredData, decoder.GetWidth(), decoder.GetHeight(),
+        decoder.GetBitDepth(), decoder.GetColorType());
+      std::free(decompressedData);
+      std::free(unfilteredData);
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> naive = std::chrono::steady_clock::now() - start;
+
+  BatchDecoder batchDecoder;
+  std::atomic<unsigned int> decoded(0);
+  start = std::chrono::steady_clock::now();
+  batchDecoder.Decode(fileNames, [&decoded](DecodedImage& image) {
+    decoded += image.success ? 1 : 0;
+  });
+  std::chrono::duration<double> batch = std::chrono::steady_clock::now() - start;
+
+  std::cout << "Batch decode, " << numFiles << " files of " << width << "x" << height << " RGBA8, " << batchDecoder.GetNumThreads()
+    << " threads (" << decoded << " decoded)" << std::endl;
+  std::cout << std::fixed << std::setprecision(1) << std::setw(18) << "thread per file" << std::setw(12) << (numFiles / naive.count())
+    << " files/s" << std::setw(10) << (megabytes / naive.count()) << " MB/s" << std::endl;
+  std::cout << std::setw(18) << "BatchDecoder" << std::setw(12) << (numFiles / batch.count()) << " files/s" << std::setw(10)
+    << (megabytes / batch.count()) << " MB/s" << std::endl;
+  std::filesystem::remove_all(directory);
+}
+
+// Times one large image decoded serially against inflate and unfilter pipelined on two threads.
+void BenchPipeline(unsigned int width, unsigned int height, int iterations) {
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_bench_pipeline.png";
+  WritePng(fileName, width, height, 8, 6, 6, 7);
+  PNG_Decoder decoder(fileName, LOAD_TYPES::MMAP);
+  unsigned long unfilteredDataSize = PNG_Decoder::GetUnfilteredDataSize(width, height, 8, 6);
+  std::vector<char> unfiltered(unfilteredDataSize);
+
+  std::cout << "Pipelined decode, " << width << "x" << height << " RGBA8, " << std::thread::hardware_concurrency()
+    << " hardware threads" << std::endl;
+  for (int pipelined = 0; pipelined <= 1; ++pipelined) {
+    double megabytesPerSecond = MeasureMegabytesPerSecond(unfilteredDataSize, iterations, [&]() {
+      decoder.DecodeDataInto(unfiltered.data(), unfiltered.size(), PIXEL_FORMATS::RAW, pipelined);
+    });
+    std::cout << std::fixed << std::setprecision(1) << std::setw(18) << (pipelined ? "pipelined" : "serial") << std::setw(10)
+      << megabytesPerSecond << " MB/s" << std::endl;
+  }
+  std::filesystem::remove(fileName);
+}
+
+// Times decoding to RAW and converting afterwards against converting each scan line while it is unfiltered.
+void BenchConvert(unsigned int width, unsigned int height, int iterations) {
+  struct Conversion { unsigned char colorType, bitDepth; PIXEL_FORMATS format; const char * name; };
+  const Conversion conversions[] = {{6, 16, PIXEL_FORMATS::RGBA8, "RGBA16 -> RGBA8"}, {2, 16, PIXEL_FORMATS::HOST_ENDIAN, "RGB16 -> host"},
+    {2, 8, PIXEL_FORMATS::RGBA8, "RGB8 -> RGBA8"}, {2, 8, PIXEL_FORMATS::GRAY8, "RGB8 -> GRAY8"}, {0, 4, PIXEL_FORMATS::RGB8, "GRAY4 -> RGB8"}};
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_bench_convert.png";
+
+  std::cout << "Pixel conversion, " << width << "x" << height << std::endl;
+  std::cout << std::setw(18) << "conversion" << std::setw(16) << "two-pass" << std::setw(16) << "fused" << std::endl;
+  for (const Conversion& conversion : conversions) {
+    WritePng(fileName, width, height, conversion.bitDepth, conversion.colorType, 6, 11);
+    PNG_Decoder decoder(fileName, LOAD_TYPES::MMAP);
+    PixelConverter converter = decoder.GetPixelConverter(conversion.format);
+    unsigned long rawScanLineWidth = PNG_Decoder::GetUnfilteredDataSize(width, 1, conversion.bitDepth, conversion.colorType);
+    unsigned long outputScanLineWidth = converter.GetOutputScanLineWidth(width);
+    std::vector<char> raw(rawScanLineWidth * height);
+    std::vector<char> output(converter.GetOutputDataSize(width, height));
+
+    double twoPass = MeasureMegabytesPerSecond(raw.size(), iterations, [&]() {
+      decoder.DecodeDataInto(raw.data(), raw.size());
+      for (unsigned int i = 0; i < height; ++i) {
+        converter.ConvertScanLine(raw.data() + i * rawScanLineWidth, width, output.data() + i * outputScanLineWidth);
+      }
+    });
+    double fused = MeasureMegabytesPerSecond(raw.size(), iterations, [&]() {
+      decoder.DecodeDataInto(output.data(), output.size(), conversion.format);
+    });
+    std::cout << std::fixed << std::setprecision(1) << std::setw(18) << conversion.name << std::setw(11) << twoPass << " MB/s"
+      << std::setw(11) << fused << " MB/s" << std::endl;
+  }
+  std::filesystem::remove(fileName);
+}
+
+// Times a full decode against decoding bands of rows, which stop inflating below the band.
+void BenchRegion(unsigned int width, unsigned int height, int iterations) {
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_bench_region.png";
+  WritePng(fileName, width, height, 8, 6, 6, 5);
+  PNG_Decoder decoder(fileName, LOAD_TYPES::MMAP);
+  std::vector<char> unfiltered(PNG_Decoder::GetUnfilteredDataSize(width, height, 8, 6));
+
+  std::cout << "Region decode, " << width << "x" << height << " RGBA8" << std::endl;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    decoder.DecodeDataInto(unfiltered.data(), unfiltered.size());
+  }
+  std::chrono::duration<double> full = std::chrono::steady_clock::now() - start;
+  std::cout << std::fixed << std::setprecision(2) << std::setw(18) << "full image" << std::setw(10)
+    << (1000 * full.count() / iterations) << " ms" << std::endl;
+
+  const Region regions[] = {{0, height / 8, 0, width}, {0, height / 8, 0, width / 4}, {height / 2, height / 2 + height / 8, 0, width}};
+  const char * names[] = {"top 1/8", "top-left 1/32", "middle 1/8"};
+  for (unsigned int i = 0; i < 3; ++i) {
+    start = std::chrono::steady_clock::now();
+    for (int j = 0; j < iterations; ++j) {
+      decoder.DecodeRegionInto(unfiltered.data(), unfiltered.size(), regions[i]);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << std::setw(18) << names[i] << std::setw(10) << (1000 * elapsed.count() / iterations) << " ms" << std::endl;
+  }
+  std::filesystem::remove(fileName);
+}
+
+// Times probing a directory of PNG headers against opening each file with the full decoder.
+void BenchInflate(unsigned int width, unsigned int height, int iterations) {
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_bench_inflate.png";
+  unsigned long decompressedDataSize = PNG_Decoder::GetDecompressedDataSize(width, height, 8, 6);
+  std::vector<char> decompressed(decompressedDataSize);
+  INFLATE_BACKENDS defaultBackend = Inflate::backend;
+
+  std::cout << "Inflate backends, " << width << "x" << height << " RGBA8 (MB/s of decompressed data)" << std::endl;
+  for (int level : {1, 6, 9}) {
+    WritePng(fileName, width, height, 8, 6, level, 9);
+    PNG_Decoder decoder(fileName, LOAD_TYPES::MMAP);
+    std::cout << std::setw(18) << ("level " + std::to_string(level));
+    for (INFLATE_BACKENDS backend : {INFLATE_BACKENDS::ZLIB, INFLATE_BACKENDS::NATIVE}) {
+      Inflate::backend = backend;
+      double megabytesPerSecond = MeasureMegabytesPerSecond(decompressedDataSize, iterations, [&]() {
+        decoder.DecompressDataInto(decompressed.data(), decompressed.size());
+      });
+      std::cout << std::fixed << std::setprecision(1) << std::setw(10) << (backend == INFLATE_BACKENDS::ZLIB ? "zlib" : "native")
+        << std::setw(10) << megabytesPerSecond << " MB/s";
+    }
+    std::cout << std::endl;
+  }
+  Inflate::backend = defaultBackend;
+  std::filesystem::remove(fileName);
+}
+
+/* Makes a thumbnail by decoding the whole image and then area-averaging it, against averaging each scan line
+into the thumbnail as it is decoded.*/
+void BenchDownscale(unsigned int width, unsigned int height, unsigned int outputWidth, unsigned int outputHeight, int iterations) {
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_bench_downscale.png";
+  WritePng(fileName, width, height, 8, 6, 6, 17);
+  PNG_Decoder decoder(fileName, LOAD_TYPES::MMAP);
+  std::vector<char> thumbnail(decoder.GetDownscaledDataSize(outputWidth, outputHeight));
+  unsigned long scanLineWidth = PNG_Decoder::GetUnfilteredDataSize(width, 1, 8, 6);
+
+  double separate = MeasureSeconds(iterations, [&]() {
+    std::vector<char> unfiltered(scanLineWidth * height);
+    decoder.DecodeDataInto(unfiltered.data(), unfiltered.size());
+    Downscaler downscaler(width, height, outputWidth, outputHeight, 8, 4);
+    for (unsigned int i = 0; i < height; ++i) {
+      downscaler.AddScanLine(unfiltered.data() + i * scanLineWidth, thumbnail.data());
+    }
+  });
+  double fused = MeasureSeconds(iterations, [&]() {
+    decoder.DecodeDownscaledInto(thumbnail.data(), thumbnail.size(), outputWidth, outputHeight);
+  });
+
+  std::cout << "Thumbnail, " << width << "x" << height << " RGBA8 to " << outputWidth << "x" << outputHeight << std::endl;
+  std::cout << std::fixed << std::setprecision(2) << std::setw(18) << "decode, resize" << std::setw(10) << (separate * 1e3) << " ms"
+    << std::setw(10) << (scanLineWidth * height / 1024) << " KB" << std::endl;
+  std::cout << std::setw(18) << "fused" << std::setw(10) << (fused * 1e3) << " ms" << std::setw(10) << (2 * (scanLineWidth + 1) / 1024)
+    << " KB" << std::endl;
+  std::filesystem::remove(fileName);
+}
+
+/* Decodes one small image again and again, allocating fresh buffers and a fresh inflater for each decode,
+against reopening one decoder and decoding into one warmed-up DecoderContext.*/
+void BenchContext(unsigned int width, unsigned int height, int iterations) {
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_bench_context.png";
+  WritePng(fileName, width, height, 8, 6, 6, 13);
+  std::ifstream inputStream(fileName, std::ifstream::binary);
+  std::vector<char> png((std::istreambuf_iterator<char>(inputStream)), std::istreambuf_iterator<char>());
+  const uint8_t * data = reinterpret_cast<const uint8_t *>(png.data());
+  INFLATE_BACKENDS defaultBackend = Inflate::backend;
+
+  std::cout << "Repeated decodes, " << width << "x" << height << " RGBA8 (images/s)" << std::endl;
+  for (INFLATE_BACKENDS backend : {INFLATE_BACKENDS::ZLIB, INFLATE_BACKENDS::NATIVE}) {
+    Inflate::backend = backend;
+    double fresh = MeasureSeconds(iterations, [&]() {
+      PNG_Decoder decoder(data, png.size());
+      std::vector<char> decompressed(PNG_Decoder::GetDecompressedDataSize(width, height, 8, 6));
+      std::vector<char> unfiltered(PNG_Decoder::GetUnfilteredDataSize(width, height, 8, 6));
+      decoder.DecompressDataInto(decompressed.data(), decompressed.size());
+      PNG_Decoder::UnfilterDataInto(decompressed.data(), unfiltered.data(), unfiltered.size(), width, height, 8, 6);
+    });
+    DecoderContext context;
+    PNG_Decoder decoder;
+    double reused = MeasureSeconds(iterations, [&]() {
+      unsigned long size = 0;
+      decoder.Open(data, png.size());
+      decoder.Decode(context, size);
+    });
+    std::cout << std::fixed << std::setprecision(0) << std::setw(18) << (backend == INFLATE_BACKENDS::ZLIB ? "zlib" : "native")
+      << std::setw(10) << "fresh" << std::setw(10) << (1 / fresh) << std::setw(10) << "context" << std::setw(10) << (1 / reused)
+      << std::endl;
+  }
+  Inflate::backend = defaultBackend;
+  std::filesystem::remove(fileName);
+}
+
+/* Requests a few hot images over and over from several threads, decoding every request against looking each
+one up in an ImageCache that holds them all.*/
+void BenchCache(unsigned int width, unsigned int height, unsigned int numImages, unsigned int requests) {
+  std::filesystem::path directory = std::filesystem::temp_directory_path() / "png_decoder_bench_cache";
+  std::filesystem::create_directories(directory);
+  std::vector<std::filesystem::path> fileNames;
+  for (unsigned int i = 0; i < numImages; ++i) {
+    fileNames.push_back(directory / ("image" + std::to_string(i) + ".png"));
+    WritePng(fileNames[i], width, height, 8, 6, 6, 40 + i);
+  }
+  unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+  auto run = [&](const std::function<void(const std::filesystem::path&)>& request) {
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < numThreads; ++t) {
+      threads.emplace_back([&, t]() {
+        for (unsigned int i = t; i < requests; i += numThreads) {
+          request(fileNames[i % numImages]);
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  };
+
+  double uncached = MeasureSeconds(1, [&]() {
+    run([](const std::filesystem::path& fileName) {
+      DecodedImage image = DecodedImage();
+      DecoderContext context;
+      image.fileName = fileName;
+      BatchDecoder::DecodeFile(image, PIXEL_FORMATS::RAW, context);
+    });
+  });
+  ImageCache cache(static_cast<unsigned long>(numImages) * PNG_Decoder::GetUnfilteredDataSize(width, height, 8, 6));
+  double cached = MeasureSeconds(1, [&]() {
+    run([&cache](const std::filesystem::path& fileName) {
+      cache.Get(fileName);
+    });
+  });
+  ImageCacheCounters counters = cache.GetCounters();
+
+  std::cout << "Hot images, " << numImages << " x " << width << "x" << height << " RGBA8, " << requests << " requests on "
+    << numThreads << " threads (requests/s)" << std::endl;
+  std::cout << std::fixed << std::setprecision(0) << std::setw(18) << "decode" << std::setw(10) << (requests / uncached) << std::endl;
+  std::cout << std::setw(18) << "cache" << std::setw(10) << (requests / cached) << std::setw(10) << counters.hits << " hits"
+    << std::setw(6) << counters.misses << " misses" << std::setw(6) << counters.coalesced << " coalesced" << std::endl;
+  std::filesystem::remove_all(directory);
+}
+
+/* Decodes an image split into iDOT segments serially, against inflating and unfiltering its segments on separate
+cores: two segments as Apple writes them, and one per hardware thread.*/
+void BenchSegments(unsigned int width, unsigned int height, int iterations) {
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_bench_segments.png";
+  unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<char> unfiltered(PNG_Decoder::GetUnfilteredDataSize(width, height, 8, 6));
+  double megabytes = static_cast<double>(unfiltered.size()) / 1e6;
+
+  std::cout << "Segmented decode, " << width << "x" << height << " RGBA8 on " << numThreads << " threads (MB/s)" << std::endl;
+  std::vector<unsigned int> segmentCounts = {2};
+  if (numThreads > 2) {
+    segmentCounts.push_back(numThreads);
+  }
+  for (unsigned int numSegments : segmentCounts) {
+    WriteIdotPng(fileName, width, height, numSegments, 23);
+    PNG_Decoder decoder(fileName, LOAD_TYPES::MMAP);
+    double serial = MeasureSeconds(iterations, [&]() {
+      decoder.DecodeDataInto(unfiltered.data(), unfiltered.size());
+    });
+    double segmented = MeasureSeconds(iterations, [&]() {
+      decoder.DecodeSegmentsInto(unfiltered.data(), unfiltered.size());
+    });
+    std::cout << std::fixed << std::setprecision(1) << std::setw(12) << numSegments << " segments" << std::setw(10) << "serial"
+      << std::setw(10) << (megabytes / serial) << std::setw(12) << "segmented" << std::setw(10) << (megabytes / segmented) << std::endl;
+  }
+  std::filesystem::remove(fileName);
+}
+
+/* Unfilters an image with random filter types serially, against splitting it at its None and Sub rows and
+unfiltering the bands on a pool of one thread per hardware thread.*/
+void BenchParallelUnfilter(unsigned int width, unsigned int height, int iterations) {
+  std::vector<char> decompressed = GetScanLines(width, height, 8, 6, 29);
+  std::vector<char> unfiltered(PNG_Decoder::GetUnfilteredDataSize(width, height, 8, 6));
+  double megabytes = static_cast<double>(unfiltered.size()) / 1e6;
+  ThreadPool pool;
+
+  double serial = MeasureSeconds(iterations, [&]() {
+    PNG_Decoder::UnfilterDataInto(decompressed.data(), unfiltered.data(), unfiltered.size(), width, height, 8, 6);
+  });
+  double parallel = MeasureSeconds(iterations, [&]() {
+    PNG_Decoder::UnfilterDataInto(decompressed.data(), unfiltered.data(), unfiltered.size(), width, height, 8, 6, 0, nullptr, nullptr,
+      &pool);
+  });
+  std::cout << "Unfilter, " << width << "x" << height << " RGBA8 on " << pool.GetNumThreads() << " threads (MB/s)" << std::endl;
+  std::cout << std::fixed << std::setprecision(1) << std::setw(18) << "serial" << std::setw(10) << (megabytes / serial) << std::endl;
+  std::cout << std::setw(18) << "restart rows" << std::setw(10) << (megabytes / parallel) << std::endl;
+}
+
+// Resident memory of this process now, from /proc/self/statm; 0 where that is not available.
+static unsigned long GetResidentBytes() {
+  std::ifstream statm("/proc/self/statm");
+  unsigned long pages = 0;
+  unsigned long resident = 0;
+  statm >> pages >> resident;
+  return resident * static_cast<unsigned long>(sysconf(_SC_PAGESIZE));
+}
+
+/* Decodes into memory and out of core into a file-backed output, released every residentMegabytes. Reports
+throughput and how much of the mapped output is still resident once the decode returns.*/
+void BenchMapped(unsigned int width, unsigned int height, int iterations) {
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_bench_mapped.png";
+  std::filesystem::path outputName = std::filesystem::temp_directory_path() / "png_decoder_bench_mapped.raw";
+  WritePng(fileName, width, height, 8, 6, 6, 31);
+  PNG_Decoder decoder(fileName, LOAD_TYPES::MMAP);
+  unsigned long size = PNG_Decoder::GetUnfilteredDataSize(width, height, 8, 6);
+  double megabytes = static_cast<double>(size) / 1e6;
+
+  std::cout << "Out-of-core decode, " << width << "x" << height << " RGBA8 (MB/s, output MB resident after)" << std::endl;
+  {
+    std::vector<char> unfiltered(size);
+    double seconds = MeasureSeconds(iterations, [&]() {
+      decoder.DecodeDataInto(unfiltered.data(), unfiltered.size());
+    });
+    std::cout << std::fixed << std::setprecision(1) << std::setw(18) << "memory" << std::setw(10) << (megabytes / seconds)
+      << std::setw(10) << megabytes << std::endl;
+  }
+  for (unsigned long residentMegabytes : {64ul, 4ul}) {
+    MappedOutput output(outputName, size);
+    unsigned long resident = 0;
+    double seconds = MeasureSeconds(iterations, [&]() {
+      unsigned long before = GetResidentBytes();
+      decoder.DecodeMappedInto(output, PIXEL_FORMATS::RAW, residentMegabytes << 20);
+      unsigned long after = GetResidentBytes();
+      resident = (after > before) ? after - before : 0;
+    });
+    std::cout << std::setw(12) << "mapped, " << std::setw(3) << residentMegabytes << " MB" << std::setw(10) << (megabytes / seconds)
+      << std::setw(10) << (static_cast<double>(resident) / 1e6) << std::endl;
+  }
+  std::filesystem::remove(fileName);
+  std::filesystem::remove(outputName);
+}
+
+/* Times filling a normalized NCHW float32 tensor from a batch of RGB8 files: decoding each image whole and then
+normalizing it into the tensor, against DecodeTensor writing each row into place as it is unfiltered.*/
+void BenchTensor(unsigned int numFiles, unsigned int width, unsigned int height, int iterations) {
+  std::filesystem::path directory = std::filesystem::temp_directory_path() / "png_decoder_bench_tensor";
+  std::filesystem::create_directories(directory);
+  std::vector<std::filesystem::path> fileNames;
+  for (unsigned int i = 0; i < numFiles; ++i) {
+    fileNames.push_back(directory / ("image" + std::to_string(i) + ".png"));
+    WritePng(fileNames.back(), width, height, 8, 2, 6, i);
+  }
+  TensorOptions options = {width, height, PIXEL_FORMATS::RGB8, TENSOR_LAYOUTS::NCHW, TENSOR_TYPES::FLOAT32, 1.0f / 255,
+    {0.485f, 0.456f, 0.406f, 0}, {0.229f, 0.224f, 0.225f, 1}};
+  BatchDecoder batchDecoder(0, 0, PIXEL_FORMATS::RGB8);
+  std::vector<char> tensor(TensorWriter(options).GetTensorSize(numFiles));
+  unsigned long planeSize = static_cast<unsigned long>(width) * height;
+
+  double decodeThenNormalize = MeasureSeconds(iterations, [&]() {
+    batchDecoder.Decode(fileNames, [&](DecodedImage& image) {
+      float * output = reinterpret_cast<float *>(tensor.data()) + image.index * 3 * planeSize;
+      const unsigned char * pixels = reinterpret_cast<const unsigned char *>(image.unfilteredData.data());
+      for (unsigned long p = 0; p < planeSize; ++p) {
+        for (unsigned int c = 0; c < 3; ++c) {
+          output[c * planeSize + p] = (pixels[3 * p + c] * options.scale - options.mean[c]) / options.std[c];
+        }
+      }
+    });
+  });
+  double fused = MeasureSeconds(iterations, [&]() {
+    batchDecoder.DecodeTensor(fileNames, options, tensor.data(), tensor.size());
+  });
+
+  std::cout << "Tensor batch, " << numFiles << " files of " << width << "x" << height << " RGB8 into NCHW float32, "
+    << batchDecoder.GetNumThreads() << " threads (files/s)" << std::endl;
+  std::cout << std::fixed << std::setprecision(1) << std::setw(22) << "decode, then normalize" << std::setw(12)
+    << (numFiles / decodeThenNormalize) << std::endl;
+  std::cout << std::setw(22) << "DecodeTensor" << std::setw(12) << (numFiles / fused) << std::endl;
+  std::filesystem::remove_all(directory);
+}
+
+/* Times re-encoding a decoded image: filtered and deflated as one stream on one thread, the way a serial encoder
+works, against bands compressed in parallel with and without adaptive filters.*/
+void BenchEncode(unsigned int width, unsigned int height, int iterations) {
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_bench_encode.png";
+  WritePng(fileName, width, height, 8, 6, 6, 41);
+  PNG_Decoder decoder(fileName, LOAD_TYPES::MMAP);
+  std::vector<char> unfiltered(PNG_Decoder::GetUnfilteredDataSize(width, height, 8, 6));
+  decoder.DecodeDataInto(unfiltered.data(), unfiltered.size());
+  double megabytes = static_cast<double>(unfiltered.size()) / 1e6;
+  ThreadPool serialPool(1);
+  ThreadPool pool;
+
+  std::cout << "Encode, " << width << "x" << height << " RGBA8, level 6 (MB/s, output MB)" << std::endl;
+  struct Variant { const char * name; ThreadPool * pool; unsigned long bandSize; bool adaptiveFilters; };
+  const Variant variants[] = {
+    {"one stream, 1 thread", &serialPool, ULONG_MAX, true}, {"bands, 1 thread", &serialPool, PNG_Encoder::defaultBandSize, true},
+    {"bands", &pool, PNG_Encoder::defaultBandSize, true}, {"bands, no filters", &pool, PNG_Encoder::defaultBandSize, false}
+  };
+  for (const Variant& variant : variants) {
+    PNG_Encoder encoder(width, height, 8, 6, 6, variant.pool);
+    encoder.SetBandSize(variant.bandSize);
+    encoder.SetAdaptiveFilters(variant.adaptiveFilters);
+    std::vector<char> png;
+    double seconds = MeasureSeconds(iterations, [&]() {
+      encoder.Encode(unfiltered.data(), unfiltered.size(), png);
+    });
+    unsigned int numThreads = variant.pool->GetNumThreads();
+    std::string name = std::string(variant.name) + ((variant.pool == &pool) ? ", " + std::to_string(numThreads) +
+      ((numThreads == 1) ? " thread" : " threads") : "");
+    std::cout << std::fixed << std::setprecision(1) << std::setw(28) << name << std::setw(10) << (megabytes / seconds) << std::setw(10)
+      << (static_cast<double>(png.size()) / 1e6) << std::endl;
+  }
+  std::filesystem::remove(fileName);
+}
+
+/* Simulates receiving a PNG over a link of megabytesPerSecond in 64 KiB pieces, and times from the first byte to
+the last decoded pixel: receiving the whole buffer and then decoding it, against pushing each piece as it arrives.*/
+void BenchPush(unsigned int width, unsigned int height, double megabytesPerSecond) {
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_bench_push.png";
+  WritePng(fileName, width, height, 8, 6, 6, 11);
+  std::ifstream inputStream(fileName, std::ifstream::binary);
+  std::vector<char> png((std::istreambuf_iterator<char>(inputStream)), std::istreambuf_iterator<char>());
+  std::vector<char> unfiltered(PNG_Decoder::GetUnfilteredDataSize(width, height, 8, 6));
+  const size_t pieceSize = 65536;
+  std::chrono::duration<double> pieceTime(pieceSize / (megabytesPerSecond * 1e6));
+
+  // Waits until the piece ending at offset would have arrived.
+  auto receive = [&](std::chrono::steady_clock::time_point start, size_t offset) {
+    std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(pieceTime *
+      (static_cast<double>(offset) / pieceSize)));
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<char> received;
+  for (size_t offset = 0; offset < png.size(); offset += pieceSize) {
+    size_t size = std::min(pieceSize, png.size() - offset);
+    receive(start, offset + size);
+    received.insert(received.end(), png.begin() + offset, png.begin() + offset + size);
+  }
+  PNG_Decoder decoder(reinterpret_cast<const uint8_t *>(received.data()), received.size());
+  decoder.DecodeDataInto(unfiltered.data(), unfiltered.size());
+  std::chrono::duration<double> buffered = std::chrono::steady_clock::now() - start;
+
+  unsigned long scanLineWidth = unfiltered.size() / height;
+  start = std::chrono::steady_clock::now();
+  PushDecoder pushDecoder([&](const char * scanLine, unsigned int row) {
+    std::memcpy(unfiltered.data() + row * scanLineWidth, scanLine, scanLineWidth);
+  });
+  for (size_t offset = 0; offset < png.size(); offset += pieceSize) {
+    size_t size = std::min(pieceSize, png.size() - offset);
+    receive(start, offset + size);
+    pushDecoder.Push(reinterpret_cast<const uint8_t *>(png.data() + offset), size);
+  }
+  std::chrono::duration<double> pushed = std::chrono::steady_clock::now() - start;
+
+  std::cout << "Receive and decode, " << width << "x" << height << " RGBA8, " << (png.size() / 1024) << " KB at " << megabytesPerSecond
+    << " MB/s (" << (pushDecoder.IsComplete() ? "complete" : "incomplete") << ")" << std::endl;
+  std::cout << std::fixed << std::setprecision(2) << std::setw(18) << "buffer, decode" << std::setw(10) << (buffered.count() * 1e3)
+    << " ms" << std::endl;
+  std::cout << std::setw(18) << "PushDecoder" << std::setw(10) << (pushed.count() * 1e3) << " ms" << std::endl;
+  std::filesystem::remove(fileName);
+}
+
+void BenchProbe(unsigned int numFiles) {
+  std::filesystem::path directory = std::filesystem::temp_directory_path() / "png_decoder_bench_probe";
+  std::filesystem::create_directories(directory);
+  std::vector<std::filesystem::path> fileNames;
+  for (unsigned int i = 0; i < numFiles; ++i) {
+    fileNames.push_back(directory / ("image" + std::to_string(i) + ".png"));
+    WritePng(fileNames.back(), 64, 64, 8, 2, 6, i);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  unsigned long opened = 0;
+  for (const std::filesystem::path& fileName : fileNames) {
+    PNG_Decoder decoder(fileName);
+    opened += decoder.IsOpen() ? 1 : 0;
+  }
+  std::chrono::duration<double> open = std::chrono::steady_clock::now() - start;
+
+  BatchDecoder batchDecoder(4 * std::max(1u, std::thread::hardware_concurrency()));
+  start = std::chrono::steady_clock::now();
+  std::vector<ProbedImage> images = batchDecoder.Probe(directory);
+  std::chrono::duration<double> probe = std::chrono::steady_clock::now() - start;
+
+  std::cout << "Header probe, " << numFiles << " files, " << batchDecoder.GetNumThreads() << " threads (" << opened << " opened, "
+    << images.size() << " probed)" << std::endl;
+  std::cout << std::fixed << std::setprecision(1) << std::setw(18) << "PNG_Decoder" << std::setw(12) << (numFiles / open.count())
+    << " files/s" << std::endl;
+  std::cout << std::setw(18) << "Probe" << std::setw(12) << (numFiles / probe.count()) << " files/s" << std::endl;
+  std::filesystem::remove_all(directory);
+}
+
+// One image of the benchmark corpus. filterType 0 - 4 filters every scan line with that type; 5 cycles through all five.
+struct CorpusImage {
+  std::string name;
+  unsigned int width;
+  unsigned int height;
+  unsigned char bitDepth;
+  unsigned char colorType;
+  unsigned int filterType;
+  int level;
+};
+
+// Seconds per call of one decode stage, and the bytes it produces (or reads, for load and parse).
+struct StageResult {
+  std::string name;
+  unsigned long bytes;
+  double seconds;
+};
+
+struct CorpusResult {
+  CorpusImage image;
+  unsigned long fileBytes;
+  std::vector<StageResult> stages;
+};
+
+static const char * filterNames[] = {"none", "sub", "up", "average", "paeth", "mixed"};
+
+/* Every color type and bit depth at 512x512, every filter type, three sizes and three compression levels. The
+corpus is fixed, so results can be compared across commits.*/
+static std::vector<CorpusImage> GetCorpus() {
+  const Format allFormats[] = {
+    {0, 1, 1}, {0, 2, 1}, {0, 4, 1}, {0, 8, 1}, {0, 16, 1}, {2, 8, 3}, {2, 16, 3}, {3, 1, 1}, {3, 2, 1}, {3, 4, 1}, {3, 8, 1},
+    {4, 8, 2}, {4, 16, 2}, {6, 8, 4}, {6, 16, 4}
+  };
+  std::vector<CorpusImage> corpus;
+  auto add = [&corpus](unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType,
+    unsigned int filterType, int level) {
+    std::string name = "c" + std::to_string(colorType) + "d" + std::to_string(bitDepth) + "_" + filterNames[filterType] + "_" +
+      std::to_string(width) + "x" + std::to_string(height) + "_l" + std::to_string(level);
+    corpus.push_back(CorpusImage{name, width, height, bitDepth, colorType, filterType, level});
+  };
+
+  for (const Format& format : allFormats) {
+    add(512, 512, format.bitDepth, format.colorType, 5, 6);
+  }
+  for (unsigned int filterType = 0; filterType < 5; ++filterType) {
+    add(1024, 1024, 8, 6, filterType, 6);
+  }
+  for (unsigned int size : {64, 1024, 2048}) {
+    add(size, size, 8, 2, 5, 6);
+  }
+  for (int level : {1, 9}) {
+    add(1024, 1024, 8, 2, 5, level);
+  }
+  return corpus;
+}
+
+static unsigned char PaethPredictor(int a, int b, int c) {
+  int pa = std::abs(b - c);
+  int pb = std::abs(a - c);
+  int pc = std::abs(a + b - 2 * c);
+  return static_cast<unsigned char>((pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c);
+}
+
+// Writes a smooth, slightly noisy image, filtering each scan line the way an encoder would.
+static void WriteCorpusImage(const std::filesystem::path& fileName, const CorpusImage& image, unsigned int seed) {
+  std::mt19937 random(seed);
+  unsigned int channels = (image.colorType == 2) ? 3 : (image.colorType == 4) ? 2 : (image.colorType == 6) ? 4 : 1;
+  unsigned int bits = channels * image.bitDepth;
+  unsigned int scanLineWidth = (image.width * bits + 7) / 8;
+  unsigned int bpp = (bits < 8) ? 1 : bits / 8;
+  std::vector<unsigned char> prior(scanLineWidth, 0);
+  std::vector<unsigned char> current(scanLineWidth);
+  std::vector<char> raw(static_cast<size_t>(scanLineWidth + 1) * image.height);
+
+  for (unsigned int i = 0; i < image.height; ++i) {
+    for (unsigned int j = 0; j < scanLineWidth; ++j) {
+      current[j] = static_cast<unsigned char>((j / bpp) * 3 + i * 2 + (j % bpp) * 50 + random() % 6);
+    }
+    unsigned int filterType = (image.filterType == 5) ? i % 5 : image.filterType;
+    char * scanLine = raw.data() + static_cast<size_t>(i) * (scanLineWidth + 1);
+    scanLine[0] = static_cast<char>(filterType);
+    for (unsigned int j = 0; j < scanLineWidth; ++j) {
+      int a = (j >= bpp) ? current[j - bpp] : 0;
+      int b = prior[j];
+      int c = (j >= bpp) ? prior[j - bpp] : 0;
+      int predictor = (filterType == 1) ? a : (filterType == 2) ? b : (filterType == 3) ? (a + b) / 2 :
+        (filterType == 4) ? PaethPredictor(a, b, c) : 0;
+      scanLine[j + 1] = static_cast<char>(current[j] - predictor);
+    }
+    prior.swap(current);
+  }
+  WritePng(fileName, image.width, image.height, image.bitDepth, image.colorType, image.level, raw);
+}
+
+static void WriteCorpus(const std::filesystem::path& directory, const std::vector<CorpusImage>& corpus) {
+  std::filesystem::create_directories(directory);
+  for (size_t i = 0; i < corpus.size(); ++i) {
+    WriteCorpusImage(directory / (corpus[i].name + ".png"), corpus[i], static_cast<unsigned int>(i));
+  }
+}
+
+// Walks and CRC checks the chunks of a loaded PNG, as opening it with verifyCrc does.
+static unsigned int ParseChunks(char * bytes, unsigned long size) {
+  std::vector<Chunk> chunks;
+  unsigned int valid = 0;
+  for (char * cur = bytes + 8; cur < bytes + size;) {
+    Chunk chunk(cur);
+    valid += chunk.IsCrcValid() ? 1 : 0;
+    chunks.push_back(chunk);
+    cur += 12 + chunk.GetDataLength();
+  }
+  return valid;
+}
+
+// Peak resident set size of this process in kilobytes (ru_maxrss is in kilobytes on Linux).
+static long GetPeakRss() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+/* Times each decode stage of every corpus image: reading the file (LoadBytes, with CRC checks off), chunk
+parsing with CRC checks, inflating the IDAT chunks in place, and unfiltering.*/
+static std::vector<CorpusResult> RunCorpus(const std::vector<CorpusImage>& corpus) {
+  std::filesystem::path directory = std::filesystem::temp_directory_path() / "png_decoder_bench_corpus";
+  WriteCorpus(directory, corpus);
+
+  std::vector<CorpusResult> results;
+  unsigned int sink = 0;
+  for (const CorpusImage& image : corpus) {
+    std::filesystem::path fileName = directory / (image.name + ".png");
+    int iterations = static_cast<int>(std::min<unsigned long>(200, std::max<unsigned long>(3,
+      (1ul << 24) / (static_cast<unsigned long>(image.width) * image.height))));
+    PNG_Decoder decoder(fileName, LOAD_TYPES::STREAM);
+    unsigned long fileBytes = std::filesystem::file_size(fileName);
+    std::vector<char> decompressed(PNG_Decoder::GetDecompressedDataSize(image.width, image.height, image.bitDepth, image.colorType));
+    std::vector<char> unfiltered(PNG_Decoder::GetUnfilteredDataSize(image.width, image.height, image.bitDepth, image.colorType));
+
+    CorpusResult result = {image, fileBytes, std::vector<StageResult>()};
+    result.stages.push_back(StageResult{"load", fileBytes, MeasureSeconds(iterations, [&]() {
+      PNG_Decoder loaded(fileName, LOAD_TYPES::STREAM, false);
+      sink += loaded.IsOpen() ? 1 : 0;
+    })});
+    result.stages.push_back(StageResult{"parse", fileBytes, MeasureSeconds(iterations, [&]() {
+      sink += ParseChunks(decoder.GetBytes(), fileBytes);
+    })});
+    result.stages.push_back(StageResult{"inflate", decompressed.size(), MeasureSeconds(iterations, [&]() {
+      decoder.DecompressDataInto(decompressed.data(), decompressed.size());
+    })});
+    result.stages.push_back(StageResult{"unfilter", unfiltered.size(), MeasureSeconds(iterations, [&]() {
+      PNG_Decoder::UnfilterDataInto(decompressed.data(), unfiltered.data(), unfiltered.size(), image.width, image.height,
+        image.bitDepth, image.colorType);
+    })});
+    results.push_back(result);
+  }
+  std::filesystem::remove_all(directory);
+  if (sink == 0) {
+    std::cerr << "No corpus image opened." << std::endl;
+  }
+  return results;
+}
+
+void BenchCorpus() {
+  std::vector<CorpusResult> results = RunCorpus(GetCorpus());
+  std::cout << "Decode stages, synthetic corpus (MB/s and ns/pixel)" << std::endl;
+  std::cout << std::setw(26) << "image" << std::setw(10) << "file KB";
+  for (const StageResult& stage : results.front().stages) {
+    std::cout << std::setw(18) << stage.name;
+  }
+  std::cout << std::endl;
+  for (const CorpusResult& result : results) {
+    double pixels = static_cast<double>(result.image.width) * result.image.height;
+    std::cout << std::setw(26) << result.image.name << std::setw(10) << (result.fileBytes / 1024);
+    for (const StageResult& stage : result.stages) {
+      std::cout << std::fixed << std::setprecision(1) << std::setw(10) << (stage.bytes / stage.seconds / 1e6) << std::setprecision(2)
+        << std::setw(8) << (stage.seconds * 1e9 / pixels);
+    }
+    std::cout << std::endl;
+  }
+  std::cout << "Peak RSS " << GetPeakRss() << " KB" << std::endl;
+}
+
+// Writes corpus results as JSON, one object per image with the throughput of every stage.
+static void WriteJson(std::ostream& output, const std::vector<CorpusResult>& results) {
+  output << std::fixed << std::setprecision(3);
+  output << "{\n  \"inflateBackend\": \"" << (Inflate::backend == INFLATE_BACKENDS::NATIVE ? "native" : "zlib") << "\",\n";
+  output << "  \"simdType\": " << static_cast<int>(Filter::systemType) << ",\n";
+  output << "  \"hardwareThreads\": " << std::thread::hardware_concurrency() << ",\n";
+  output << "  \"images\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const CorpusResult& result = results[i];
+    double pixels = static_cast<double>(result.image.width) * result.image.height;
+    output << "    {\"name\": \"" << result.image.name << "\", \"width\": " << result.image.width << ", \"height\": "
+      << result.image.height << ", \"bitDepth\": " << static_cast<int>(result.image.bitDepth) << ", \"colorType\": "
+      << static_cast<int>(result.image.colorType) << ", \"filter\": \"" << filterNames[result.image.filterType]
+      << "\", \"level\": " << result.image.level << ", \"fileBytes\": " << result.fileBytes << ",\n      \"stages\": {";
+    for (size_t j = 0; j < result.stages.size(); ++j) {
+      const StageResult& stage = result.stages[j];
+      output << (j == 0 ? "" : ", ") << "\"" << stage.name << "\": {\"bytes\": " << stage.bytes << ", \"megabytesPerSecond\": "
+        << (stage.bytes / stage.seconds / 1e6) << ", \"nanosecondsPerPixel\": " << (stage.seconds * 1e9 / pixels) << "}";
+    }
+    output << "}}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  output << "  ],\n  \"peakRssKilobytes\": " << GetPeakRss() << "\n}\n";
+}
+
+/* With no arguments, runs every benchmark. --json <file> times only the corpus and writes the results as JSON
+(to stdout for "-"); --corpus <directory> writes the corpus PNGs and exits.*/
+int main(int argc, char * argv[]) {
+  if (argc == 3 && std::string(argv[1]) == "--json") {
+    std::vector<CorpusResult> results = RunCorpus(GetCorpus());
+    if (std::string(argv[2]) == "-") {
+      WriteJson(std::cout, results);
+    } else {
+      std::ofstream output(argv[2]);
+      WriteJson(output, results);
+    }
+    return 0;
+  }
+  if (argc == 3 && std::string(argv[1]) == "--corpus") {
+    WriteCorpus(argv[2], GetCorpus());
+    return 0;
+  }
+  if (argc != 1) {
+    std::cerr << "Usage: " << argv[0] << " [--json <file> | --corpus <directory>]" << std::endl;
+    return 1;
+  }
+
+  BenchFilters(2048, 1024, 10);
+  BenchCrc(1 << 22, 50);
+  BenchBatch(256, 512, 512);
+  BenchPipeline(4096, 4096, 5);
+  BenchProbe(5000);
+  BenchConvert(4096, 2048, 5);
+  BenchRegion(4096, 4096, 5);
+  BenchInflate(4096, 4096, 5);
+  BenchPush(2048, 2048, 100);
+  BenchContext(32, 32, 20000);
+  BenchDownscale(4096, 4096, 256, 256, 3);
+  BenchCache(256, 256, 8, 4000);
+  BenchSegments(4096, 4096, 3);
+  BenchParallelUnfilter(4096, 4096, 5);
+  BenchMapped(8192, 8192, 3);
+  BenchTensor(256, 224, 224, 5);
+  BenchEncode(2048, 2048, 3);
+  BenchCorpus();
+  return 0;
+}
@@ -0,0 +1,126 @@
+#ifndef BATCH_DECODER_H
+#define BATCH_DECODER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "PNG_Decoder.h"
+#include "TensorWriter.h"
+#include "ThreadPool.h"
+
+struct DecodedImage {
+  std::filesystem::path fileName; // Empty for images decoded from a buffer
+  size_t index; // Position of the file in its batch
+  bool success;
+  unsigned int width;
+  unsigned int height;
+  unsigned char bitDepth;
+  unsigned char colorType;
+  PIXEL_FORMATS pixelFormat; // Format of unfilteredData
+  std::vector<char> unfilteredData;
+  DecodeStats stats; // Filled in when built with -DPNG_DECODER_STATS
+};
+
+struct ProbedImage {
+  std::filesystem::path fileName;
+  bool success;
+  IHDR ihdr; // Only set when success is true
+};
+
+// Receives each decoded image on the worker thread that decoded it. The image may be moved from.
+typedef std::function<void(DecodedImage& image)> DecodedImageCallback;
+
+/* Decodes many PNGs in parallel on a work-stealing thread pool. Each pool worker thread keeps a DecoderContext,
+with its inflate state and scratch buffers, between images; no other thread keeps one. At most maxInFlight images are being decoded or
+delivered at once; submitting more blocks until one finishes, which bounds memory use.*/
+class BatchDecoder {
+private:
+  ThreadPool pool;
+  PIXEL_FORMATS pixelFormat;
+  unsigned int maxInFlight;
+  unsigned int inFlight;
+  std::atomic<unsigned long> maxBufferSize;
+  std::atomic<unsigned long> maxRetainedSize;
+  std::mutex mutex;
+  std::condition_variable slotFree;
+
+  // Releases a slot taken with AcquireSlot when it goes out of scope, however the task holding it ends.
+  class SlotGuard {
+  private:
+    BatchDecoder& batchDecoder;
+  public:
+    explicit SlotGuard(BatchDecoder& batchDecoder);
+    ~SlotGuard();
+  };
+
+  void AcquireSlot();
+  void ReleaseSlot();
+  // Marks image as failed, with no size and no data.
+  static void ResetImage(DecodedImage& image, PIXEL_FORMATS pixelFormat);
+  // Throws std::length_error if size is over context's maximum buffer size.
+  static void CheckBufferSize(const DecoderContext& context, unsigned long size);
+  /* The context a pool worker keeps between images, or temporary on any other thread, such as a caller that
+  runs tasks while it waits in ParallelFor, so that thread keeps no scratch buffers once its decode is done.
+  A worker's context takes the buffer limits of temporary.*/
+  static DecoderContext& GetThreadContext(DecoderContext& temporary);
+  static void DecodeImage(PNG_Decoder& decoder, DecodedImage& image, PIXEL_FORMATS pixelFormat, DecoderContext& context);
+  static bool DecodeTensorImage(PNG_Decoder& decoder, const std::string& name, const TensorWriter& writer, char * image,
+    DecoderContext& context);
+  unsigned long DecodeTensor(size_t numImages, const std::function<void(size_t index, PNG_Decoder& decoder, std::string& name)>& open,
+    const TensorOptions& options, char * tensor, unsigned long tensorCapacity, std::vector<bool> * decoded);
+
+public:
+  /* numThreads 0 uses one thread per hardware thread; maxInFlight 0 allows two images per thread. Images are
+  converted to pixelFormat while they are unfiltered.*/
+  BatchDecoder(unsigned int numThreads = 0, unsigned int maxInFlight = 0, PIXEL_FORMATS pixelFormat = PIXEL_FORMATS::RAW);
+
+  /* Decode image.fileName, or a borrowed buffer, into image on the calling thread with context's inflate state
+  and scratch buffers. Keep one context per thread to reuse them across images, or pass a temporary one to free
+  them on return. Images whose decompressed or decoded size is over the context's maximum buffer size fail
+  before anything is allocated, and the context is trimmed after every image. Neither throws: any error,
+  including running out of memory, is reported on stderr and leaves image.success false.*/
+  static void DecodeFile(DecodedImage& image, PIXEL_FORMATS pixelFormat, DecoderContext& context);
+  static void DecodeBuffer(DecodedImage& image, const uint8_t * data, size_t size, PIXEL_FORMATS pixelFormat, DecoderContext& context);
+
+  unsigned int GetNumThreads() const;
+  unsigned int GetMaxInFlight() const;
+  PIXEL_FORMATS GetPixelFormat() const;
+  /* Limits for the DecoderContext of every image decoded after the call: images needing a buffer larger than
+  maxBufferSize fail, and worker threads free buffers larger than maxRetainedSize after each image. Both
+  default to the DecoderContext defaults.*/
+  void SetBufferLimits(unsigned long maxBufferSize, unsigned long maxRetainedSize);
+  unsigned long GetMaxBufferSize() const;
+  unsigned long GetMaxRetainedSize() const;
+  /* Decodes every file, calling onDecoded as each one finishes, with success false for files that fail.
+  Blocks until the whole batch is done.*/
+  void Decode(const std::vector<std::filesystem::path>& fileNames, const DecodedImageCallback& onDecoded);
+  // Queues one file. Blocks while maxInFlight images are already being decoded. A file that fails gives success false.
+  std::future<DecodedImage> Submit(const std::filesystem::path& fileName);
+  // Queues one PNG already in memory. The buffer is borrowed without a copy and must stay valid until the future is ready.
+  std::future<DecodedImage> Submit(const uint8_t * data, size_t size);
+  /* Probes the IHDR of every regular file in directory, reading only 33 bytes of each, with the reads spread
+  across the pool. Results are in directory order. Probing is I/O bound, so a pool with more threads than
+  cores finishes large scans sooner.*/
+  std::vector<ProbedImage> Probe(const std::filesystem::path& directory);
+  /* Decodes every image straight into tensor, a preallocated batch of same-sized images laid out and typed as
+  options says, image i at i * TensorWriter(options).GetImageSize(). Images are spread across the pool, and each
+  row is converted, normalized and written into place as it is unfiltered, so no decoded copy is kept. Every
+  image must be options.width by options.height. Images that fail are zero-filled and reported on stderr, and
+  decoded, if given, says which images succeeded. Returns the number of images decoded, which is 0 if tensor is
+  smaller than TensorWriter(options).GetTensorSize(number of images) or options are invalid.*/
+  unsigned long DecodeTensor(const std::vector<std::filesystem::path>& fileNames, const TensorOptions& options, char * tensor,
+    unsigned long tensorCapacity, std::vector<bool> * decoded = nullptr);
+  // Same as above for PNGs already in memory, as (data, size) pairs. The buffers are borrowed without a copy.
+  unsigned long DecodeTensor(const std::vector<std::pair<const uint8_t *, size_t>>& buffers, const TensorOptions& options,
+    char * tensor, unsigned long tensorCapacity, std::vector<bool> * decoded = nullptr);
+};
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef BLOCK_RING_H
+#define BLOCK_RING_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/* A lock-free single-producer single-consumer ring of fixed-size byte blocks. The producer fills a block
+returned by AcquireWrite and publishes it with CommitWrite; the consumer reads blocks in the same order
+with AcquireRead and CommitRead. Either side can Cancel, which makes every later Acquire return nullptr.*/
+class BlockRing {
+private:
+  std::vector<char> storage;
+  unsigned long blockSize;
+  unsigned long numBlocks;
+  alignas(64) std::atomic<unsigned long> head; // Blocks written by the producer
+  alignas(64) std::atomic<unsigned long> tail; // Blocks read by the consumer
+  alignas(64) std::atomic<bool> cancelled;
+
+public:
+  BlockRing(unsigned long blockSize, unsigned long numBlocks);
+  BlockRing(const BlockRing&) = delete;
+  BlockRing& operator=(const BlockRing&) = delete;
+
+  unsigned long GetBlockSize() const;
+  // Waits for a free block. Returns nullptr if the ring was cancelled.
+  char * AcquireWrite();
+  void CommitWrite();
+  // Waits for a written block. Returns nullptr if the ring was cancelled.
+  char * AcquireRead();
+  void CommitRead();
+  void Cancel();
+  bool IsCancelled() const;
+};
+
+#endif
@@ -5,6 +5,7 @@
 #include <string>
 #include <stdexcept>
 
+#include "Crc.h"
 #include "Endian.h"
 
 struct ChunkType {
@@ -13,6 +14,8 @@ public:
   static const unsigned int PLTE = 1347179589;
   static const unsigned int IDAT = 1229209940;
   static const unsigned int IEND = 1229278788;
+  static const unsigned int tRNS = 1951551059;
+  static const unsigned int iDOT = 1766084436; // Apple's split of IDAT into independently inflatable segments
 };
 
 class Chunk {
@@ -35,6 +38,8 @@ public:
   char * GetChunkData() const;
   unsigned int GetCrc() const;
   bool IsAncillary() const;
+  // Recomputes the CRC over the chunk type and data and compares it with the stored CRC.
+  bool IsCrcValid() const;
 
 };
 
@@ -0,0 +1,30 @@
+#ifndef CRC_H
+#define CRC_H
+
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PNG_DECODER_X86
+#endif
+
+// CRC-32 as used by PNG chunks (ISO 3309, reflected polynomial 0xEDB88320).
+class Crc {
+private:
+  static unsigned int tables[8][256];
+  static bool tablesLoaded;
+  static bool LoadTables();
+  static unsigned int SlicingUpdate(unsigned int state, const unsigned char * data, size_t length);
+
+public:
+  // True if this CPU supports PCLMULQDQ and SSE4.1, detected once at startup.
+  static bool pclmulSupported;
+  static bool LoadPclmulSupported();
+
+  /* Returns the CRC of data continued from crc (0 for a new CRC). Uses carry-less multiplication folding
+  when pclmulSupported, and slicing-by-8 tables for short inputs and on other CPUs.*/
+  static unsigned int Crc32(const char * data, size_t length, unsigned int crc = 0);
+  // Portable slicing-by-8 CRC. Crc32 must always match it.
+  static unsigned int SlicingCrc32(const char * data, size_t length, unsigned int crc = 0);
+};
+
+#endif
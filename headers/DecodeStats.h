@@ -0,0 +1,167 @@
+#ifndef DECODE_STATS_H
+#define DECODE_STATS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+enum DECODE_STAGES {
+  LOAD,        // Reading or mapping the file
+  CHUNK_PARSE, // Walking the chunks and checking their CRCs
+  IDAT_GATHER, // Joining IDAT chunk data into one buffer (AllocateCompressedData)
+  INFLATE,
+  UNFILTER,    // Unfiltering and converting scan lines, including any scan line callback of a streaming decode
+  DECODE_STAGE_COUNT
+};
+
+// Buckets of the latency histograms: bucket i counts durations of [2^i, 2^(i+1)) nanoseconds.
+const unsigned int LATENCY_BUCKETS = 40;
+
+struct DecodeStats;
+// Called with the stats of every decode as its DecodeStatsScope ends, on the thread that decoded it.
+typedef void (*DecodeStatsHook)(const DecodeStats& stats);
+
+// Process-wide totals over every DecodeStatsScope. Counters only grow, so exporters can sample and diff them.
+struct DecodeCounters {
+  std::atomic<unsigned long> decodes;
+  std::atomic<unsigned long> compressedBytes;
+  std::atomic<unsigned long> decompressedBytes;
+  std::atomic<unsigned long> bytesAllocated;
+  std::atomic<unsigned long> filterTypeRows[5];
+  std::atomic<unsigned long long> stageNanoseconds[DECODE_STAGE_COUNT];
+  // One histogram per stage; the last one is the wall time of whole decodes.
+  std::atomic<unsigned long> latencyHistogram[DECODE_STAGE_COUNT + 1][LATENCY_BUCKETS];
+};
+
+/* What one decode spent its time and memory on. Stats are only recorded when the library is built with
+-DPNG_DECODER_STATS; otherwise every recording site compiles to nothing and the fields stay 0.*/
+struct DecodeStats {
+  unsigned long long stageNanoseconds[DECODE_STAGE_COUNT];
+  unsigned long long totalNanoseconds; // Wall time of the DecodeStatsScope
+  unsigned long bytesAllocated;        // Bytes requested from malloc and realloc for file data and output buffers
+  unsigned long reallocCount;
+  unsigned long filterTypeRows[5];     // Scan lines unfiltered with each filter type
+  unsigned long compressedBytes;       // Compressed bytes consumed by inflate
+  unsigned long decompressedBytes;
+
+  // The stats the decodes on this thread record into, or null outside a DecodeStatsScope.
+  static thread_local DecodeStats * current;
+  // Called as each DecodeStatsScope ends. Set it to null to stop exporting.
+  static std::atomic<DecodeStatsHook> hook;
+  static DecodeCounters counters;
+
+  DecodeStats();
+  void Reset();
+  // Adds the counts and stage times of other, e.g. stats recorded on helper threads, to these.
+  void Add(const DecodeStats& other);
+  // Decompressed bytes per compressed byte, or 0 if nothing was inflated.
+  double GetCompressionRatio() const;
+
+  static void RecordAllocation(unsigned long bytes, bool reallocated);
+  static void RecordStream(unsigned long compressedBytes, unsigned long decompressedBytes);
+  static unsigned int GetLatencyBucket(unsigned long long nanoseconds);
+};
+
+/* Makes every decode on this thread record into stats until the scope ends, then adds stats to
+DecodeStats::counters and calls DecodeStats::hook. Scopes nest; the outer stats are restored on exit.*/
+class DecodeStatsScope {
+private:
+  DecodeStats& stats;
+  DecodeStats * previous;
+  std::chrono::steady_clock::time_point start;
+
+public:
+  explicit DecodeStatsScope(DecodeStats& stats);
+  DecodeStatsScope(const DecodeStatsScope&) = delete;
+  DecodeStatsScope& operator=(const DecodeStatsScope&) = delete;
+  ~DecodeStatsScope();
+};
+
+/* Adds the time from its construction to its destruction to one stage of the current stats, if there are any.
+Time the same thread records into excluded meanwhile, such as inflating the rows a loop then unfilters, is
+left out, so one timer can cover a whole loop that interleaves two stages.*/
+class StageTimer {
+private:
+  DecodeStats * stats;
+  DECODE_STAGES stage;
+  DECODE_STAGES excluded;
+  unsigned long long excludedStart;
+  std::chrono::steady_clock::time_point start;
+
+public:
+  explicit StageTimer(DECODE_STAGES stage, DECODE_STAGES excluded = DECODE_STAGE_COUNT) {
+    this->stats = DecodeStats::current;
+    this->stage = stage;
+    this->excluded = excluded;
+    this->excludedStart = 0;
+    if (this->stats != nullptr) {
+      if (excluded != DECODE_STAGE_COUNT) {
+        this->excludedStart = this->stats->stageNanoseconds[excluded];
+      }
+      this->start = std::chrono::steady_clock::now();
+    }
+  }
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+  ~StageTimer() {
+    if (this->stats != nullptr) {
+      unsigned long long nanoseconds = static_cast<unsigned long long>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - this->start).count());
+      if (this->excluded != DECODE_STAGE_COUNT) {
+        nanoseconds -= std::min(nanoseconds, this->stats->stageNanoseconds[this->excluded] - this->excludedStart);
+      }
+      this->stats->stageNanoseconds[this->stage] += nanoseconds;
+    }
+  }
+};
+
+/* Counts scan lines per filter type in a local array and adds the counts to the stats that were current when
+it was constructed, if there were any, once it is destroyed. Counters must be destroyed on the thread that
+constructed them, but may count rows unfiltered on other threads.*/
+class FilterTypeCounter {
+private:
+  DecodeStats * stats;
+  unsigned long filterTypeRows[5];
+
+public:
+  FilterTypeCounter() {
+    this->stats = DecodeStats::current;
+    for (unsigned int i = 0; i < 5; ++i) {
+      this->filterTypeRows[i] = 0;
+    }
+  }
+  FilterTypeCounter(const FilterTypeCounter&) = delete;
+  FilterTypeCounter& operator=(const FilterTypeCounter&) = delete;
+  ~FilterTypeCounter() {
+    if (this->stats != nullptr) {
+      for (unsigned int i = 0; i < 5; ++i) {
+        this->stats->filterTypeRows[i] += this->filterTypeRows[i];
+      }
+    }
+  }
+  void Add(unsigned char filterType) {
+    if (filterType < 5) {
+      this->filterTypeRows[filterType] += 1;
+    }
+  }
+};
+
+#ifdef PNG_DECODER_STATS
+#define DECODE_STATS_TIMER(stage) StageTimer decodeStatsTimer(stage)
+#define DECODE_STATS_TIMER_EXCLUDING(stage, excluded) StageTimer decodeStatsTimer(stage, excluded)
+#define DECODE_STATS_ALLOCATION(bytes, reallocated) DecodeStats::RecordAllocation(bytes, reallocated)
+#define DECODE_STATS_FILTER_COUNTER FilterTypeCounter decodeStatsFilterCounter
+#define DECODE_STATS_FILTER_TYPE(filterType) decodeStatsFilterCounter.Add(filterType)
+#define DECODE_STATS_STREAM(compressedBytes, decompressedBytes) DecodeStats::RecordStream(compressedBytes, decompressedBytes)
+#else
+#define DECODE_STATS_TIMER(stage)
+#define DECODE_STATS_TIMER_EXCLUDING(stage, excluded)
+#define DECODE_STATS_ALLOCATION(bytes, reallocated)
+#define DECODE_STATS_FILTER_COUNTER
+#define DECODE_STATS_FILTER_TYPE(filterType)
+#define DECODE_STATS_STREAM(compressedBytes, decompressedBytes)
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef DECODER_CONTEXT_H
+#define DECODER_CONTEXT_H
+
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "zlib.h"
+#include "Deflate.h"
+
+enum SCRATCH_BUFFERS {
+  DECOMPRESSED_BUFFER, // Inflated scan lines with their filter bytes
+  SCAN_LINE_BUFFER,    // Ring of unfiltered scan lines for converted and Adam7 decodes
+  CONVERTED_BUFFER,    // One Adam7 pass scan line in the output format
+  OUTPUT_BUFFER,       // The decoded image returned by PNG_Decoder::Decode
+  SCRATCH_BUFFER_COUNT
+};
+
+/* Decode state kept between images, meant to be owned by one thread. The zlib stream is initialized once and
+reset with inflateReset for every image after that, the native inflater reuses one set of dynamic Huffman tables,
+and scratch buffers grow to the largest image decoded. Once a context has decoded an image, decoding another
+image of the same size and format allocates nothing. A context must not be used by two decodes at once.
+
+Scratch sizes come from untrusted headers, so a buffer larger than maxBufferSize is refused before anything is
+allocated, and Trim frees buffers larger than maxRetainedSize so one huge image does not stay resident.*/
+class DecoderContext {
+private:
+  struct Buffer {
+    std::unique_ptr<char[]> data; // Left uninitialized; decodes write every byte they read back
+    unsigned long capacity;
+  };
+
+  z_stream stream;
+  bool streamOpen;
+  DecodeTables * dynamicTables;
+  Buffer buffers[SCRATCH_BUFFER_COUNT];
+  unsigned long allocations;
+  unsigned long maxBufferSize;
+  unsigned long maxRetainedSize;
+
+  // zlib's allocator for the stream, counted in allocations.
+  static void * ZAlloc(void * opaque, unsigned int items, unsigned int size);
+  static void ZFree(void * opaque, void * address);
+
+public:
+  static constexpr unsigned long defaultMaxBufferSize = 1ul << 30;
+  static constexpr unsigned long defaultMaxRetainedSize = 64ul << 20;
+
+  explicit DecoderContext(unsigned long maxBufferSize = defaultMaxBufferSize, unsigned long maxRetainedSize = defaultMaxRetainedSize);
+  DecoderContext(const DecoderContext&) = delete;
+  DecoderContext& operator=(const DecoderContext&) = delete;
+  ~DecoderContext();
+
+  /* The stream, ready to inflate a new zlib stream from compressed into decompressed. The first call runs
+  inflateInit; later calls only run inflateReset, which keeps zlib's state and window.*/
+  z_stream * ResetStream(char * compressed, unsigned int availableIn, char * decompressed, unsigned int availableOut);
+  DecodeTables * GetDecodeTables();
+  /* At least size bytes of buffer. The contents are uninitialized or left over from earlier decodes. Throws
+  std::length_error, before allocating, if size is larger than the maximum buffer size.*/
+  char * GetBuffer(SCRATCH_BUFFERS buffer, unsigned long size);
+  unsigned long GetBufferCapacity(SCRATCH_BUFFERS buffer) const;
+  void SetLimits(unsigned long maxBufferSize, unsigned long maxRetainedSize);
+  unsigned long GetMaxBufferSize() const;
+  unsigned long GetMaxRetainedSize() const;
+  // Frees every scratch buffer larger than the maximum retained size. Pointers into the freed buffers become invalid.
+  void Trim();
+  // Heap allocations the context has made: buffer growth, the decode tables and zlib's state and window.
+  unsigned long GetAllocationCount() const;
+  // Frees the stream, tables and buffers. The context can still be used; it warms up again.
+  void Release();
+};
+
+#endif
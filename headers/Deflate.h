@@ -0,0 +1,33 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "Chunk.h"
+
+// Decode tables for one dynamic Huffman block, defined in Deflate.cpp.
+struct DecodeTables;
+
+/* An in-tree DEFLATE decoder for whole buffers. The output window is the full decompressed image, so matches are
+copied straight out of it with no sliding window, and the decode loop can refill a 64-bit bit buffer and copy
+matches eight bytes at a time. Literal/length codes are looked up in a table that decodes two literals at once
+whenever both codes fit in it.*/
+class Deflate {
+public:
+  /* Decodes the zlib stream in compressed, then in the IDAT chunks in [chunk, end), until decompressedSize bytes
+  are written. Like zlib's inflate() filling a fixed window, decoding stops once the output is full, so the
+  Adler-32 trailer is not read. Throws if the stream is invalid or ends before the output is full.
+  Dynamic blocks are decoded with dynamicTables if given, otherwise with tables allocated for this call.*/
+  static void InflateInto(const char * compressed, unsigned long compressedSize, const Chunk * chunk, const Chunk * end,
+    char * decompressed, unsigned long decompressedSize, DecodeTables * dynamicTables = nullptr);
+  // Tables a caller can keep and pass to every InflateInto call. Free them with FreeDecodeTables.
+  static DecodeTables * AllocateDecodeTables();
+  static void FreeDecodeTables(DecodeTables * tables);
+};
+
+#endif
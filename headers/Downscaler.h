@@ -0,0 +1,53 @@
+#ifndef DOWNSCALER_H
+#define DOWNSCALER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/* Area-averages the scan lines of one image into a smaller image as they are decoded. Every output pixel is
+the mean of the input area it covers, with input pixels on its edges weighted by how much of them it covers,
+so any size down to 1x1 works and power-of-two sizes give an exact box filter. Only one row of column sums
+and two output rows of accumulators are held, never the full image. Samples are averaged channel by channel;
+alpha is not premultiplied. Output pixels keep the bit depth and channel layout of the input.*/
+class Downscaler {
+private:
+  unsigned int width;
+  unsigned int height;
+  unsigned int outputWidth;
+  unsigned int outputHeight;
+  unsigned char bitDepth;
+  unsigned int channels;
+  bool bigEndian;
+  unsigned int rowsAdded;
+  unsigned int currentRow; // Output row the next input row starts in
+  std::vector<unsigned int> outputColumns; // Output column each input column starts in
+  std::vector<unsigned int> firstWeights;  // Part of each input column inside its first output column
+  std::vector<uint64_t> rowSums;           // The current input row summed into output columns
+  std::vector<uint64_t> accumulators;      // Two output rows: the current one and the next
+  unsigned int currentSlot;                // Which half of accumulators holds the current output row
+
+  void SumScanLine(const char * scanLine);
+  void WriteRow(const uint64_t * sums, char * output) const;
+
+public:
+  /* Downscales a width x height image of channels samples of bitDepth bits per pixel (1, 2, 4, 8 or 16; sub-byte
+  samples packed from the most significant bit) to outputWidth x outputHeight. 16-bit samples are big-endian
+  as in a PNG unless bigEndian is false. Throws if the output is empty or larger than the input.*/
+  Downscaler(unsigned int width, unsigned int height, unsigned int outputWidth, unsigned int outputHeight, unsigned char bitDepth,
+    unsigned int channels, bool bigEndian = true);
+
+  unsigned int GetOutputWidth() const;
+  unsigned int GetOutputHeight() const;
+  unsigned long GetOutputScanLineWidth() const;
+  unsigned long GetOutputDataSize() const;
+  unsigned int GetRowsAdded() const;
+  /* Adds the next input scan line, in image order. Each output row is written to its place in output, sized
+  with GetOutputDataSize, as soon as the last input row it covers is added. Throws after height rows.*/
+  void AddScanLine(const char * scanLine, char * output);
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PNG_DECODER_X86
+#endif
+
+enum SIMD_TYPES {
+  SCALAR,
+  SSE2,
+  SSSE3,
+  AVX2
+};
+
+// Removes one filter from one scan line. priorScanLine is ignored by the first scan line filters.
+typedef void (*ScanLineFilter)(char * scanLine, unsigned int scanLineWidth, char * buffer, char * priorScanLine);
+
+/* Filter removal routines specialized for one bytes-per-pixel value, indexed by filter type (0 - 4).
+The first scan line of an image has no prior scan line, so it gets its own branch-free variants.*/
+struct ScanLineFilters {
+  ScanLineFilter firstScanLine[5];
+  ScanLineFilter scanLine[5];
+};
+
+class Filter {
+public:
+  // The best instruction set supported by this CPU, detected once at startup.
+  static SIMD_TYPES systemType;
+  static SIMD_TYPES LoadSimdType();
+
+  /* Returns the filters for bpp (1, 2, 3, 4, 6 or 8), using the best kernels available at or below simdType.
+  Look this up once per image. GetScanLineFilters(bpp, SIMD_TYPES::SCALAR) never uses vector instructions.*/
+  static ScanLineFilters GetScanLineFilters(unsigned int bpp, SIMD_TYPES simdType = Filter::systemType);
+  // Removes filterType from scanLine into buffer. scanLine and buffer may be the same pointer.
+  static void UnfilterScanLine(const ScanLineFilters& filters, unsigned char filterType, char * scanLine, unsigned int scanLineWidth,
+    char * buffer, char * priorScanLine = nullptr);
+  static unsigned int PaethPredictor(int priorSub, int priorUp, int priorUpSub);
+  /* Applies filterType to scanLine into buffer, the reverse of UnfilterScanLine. A null priorScanLine reads as
+  zeros, like the first scan line of an image. scanLine and buffer must not overlap. Uses SSE2 when simdType allows.*/
+  static void FilterScanLine(unsigned char filterType, const char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp,
+    const char * priorScanLine = nullptr, SIMD_TYPES simdType = Filter::systemType);
+  /* Sum of the magnitudes of a filtered scan line's bytes read as signed, the cost libpng minimizes when it picks a
+  filter per scan line. Lower sums usually compress smaller. Uses SSE2 or AVX2 sums of absolute differences when simdType allows.*/
+  static unsigned long SumAbsoluteValues(const char * scanLine, unsigned int scanLineWidth, SIMD_TYPES simdType = Filter::systemType);
+
+  // Generic filter removal for any bpp. These are the reference the specialized filters must match bit for bit.
+  static void RemoveSubFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp);
+  static void RemoveUpFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * priorScanLine = nullptr);
+  static void RemoveAverageFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp, char * priorScanLine = nullptr);
+  static void RemovePaethFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp, char * priorScanLine = nullptr);
+  /* Generic filters for encoding. Every output byte depends only on unfiltered bytes, so these loops carry no
+  dependency from byte to byte.*/
+  static void ApplySubFilter(const char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp);
+  static void ApplyUpFilter(const char * scanLine, unsigned int scanLineWidth, char * buffer, const char * priorScanLine = nullptr);
+  static void ApplyAverageFilter(const char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp,
+    const char * priorScanLine = nullptr);
+  static void ApplyPaethFilter(const char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp,
+    const char * priorScanLine = nullptr);
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "zlib.h"
+#include "BatchDecoder.h"
+#include "Crc.h"
+
+// Decoded images are shared by the cache and every caller holding one, and never change once decoded.
+typedef std::shared_ptr<const DecodedImage> SharedImage;
+
+/* Identifies one decode. Files are keyed by path, modification time and size, so a rewritten file is decoded
+again. Buffers are keyed by their bytes, so equal bytes in different buffers share an entry. Their CRC-32 and
+Adler-32 only pick the bucket; keys are equal only if the bytes compare equal, so a forged checksum match
+cannot return another buffer's image.*/
+struct ImageCacheKey {
+  std::string fileName;        // Empty for buffers
+  long long modifiedTime;      // File modification time in file clock ticks, 0 for buffers
+  unsigned long long size;     // File or buffer size in bytes
+  unsigned int crc;            // Buffers only
+  unsigned int adler;          // Buffers only
+  const uint8_t * data;        // Buffers only: the caller's bytes in a lookup, or bytes once stored in the cache
+  std::shared_ptr<const std::vector<uint8_t>> bytes; // Buffers only: the cache's copy of the bytes
+  PIXEL_FORMATS pixelFormat;
+
+  bool operator==(const ImageCacheKey& other) const;
+  // This key with its own copy of a buffer's bytes, so it stays valid after the caller's buffer is gone.
+  ImageCacheKey Store() const;
+};
+
+struct ImageCacheKeyHash {
+  size_t operator()(const ImageCacheKey& key) const;
+};
+
+struct ImageCacheCounters {
+  unsigned long hits;      // Lookups answered from a decoded entry
+  unsigned long misses;    // Lookups that decoded
+  unsigned long coalesced; // Lookups that waited for a decode another thread had already started
+  unsigned long evictions;
+  unsigned long images;    // Entries held now
+  unsigned long bytes;     // Pixel bytes held now, and the source bytes of cached buffers
+};
+
+/* An in-process cache of decoded images under a byte budget, evicting the least recently used images first.
+Lookups may come from any thread. Concurrent lookups of an image that is not cached yet are coalesced: one
+thread decodes it on its own stack while the others wait for that result. Evicted images stay valid for
+callers still holding them. Failed decodes are returned but never cached.*/
+class ImageCache {
+private:
+  struct Entry {
+    std::shared_future<SharedImage> image;
+    bool ready;
+    unsigned long bytes;
+    std::list<ImageCacheKey>::iterator position; // In lru, once ready
+  };
+
+  unsigned long budget;
+  mutable std::mutex mutex;
+  std::unordered_map<ImageCacheKey, Entry, ImageCacheKeyHash> entries;
+  std::list<ImageCacheKey> lru; // Decoded entries, most recently used first
+  ImageCacheCounters counters;
+
+  // Returns the cached image for key, or runs decode and caches its result.
+  SharedImage Lookup(const ImageCacheKey& key, const std::function<void(DecodedImage& image)>& decode);
+  // Drops least recently used images until the cache fits its budget. The mutex must be held.
+  void Evict();
+
+public:
+  explicit ImageCache(unsigned long budget);
+  ImageCache(const ImageCache&) = delete;
+  ImageCache& operator=(const ImageCache&) = delete;
+
+  SharedImage Get(const std::filesystem::path& fileName, PIXEL_FORMATS pixelFormat = PIXEL_FORMATS::RAW);
+  // The buffer is only read during the call. A decoded copy of it is cached, along with a copy of its bytes to compare on later lookups.
+  SharedImage Get(const uint8_t * data, size_t size, PIXEL_FORMATS pixelFormat = PIXEL_FORMATS::RAW);
+  ImageCacheCounters GetCounters() const;
+  unsigned long GetBudget() const;
+  // Evicts images right away if the new budget is smaller than what is held.
+  void SetBudget(unsigned long budget);
+  // Drops every decoded image. Decodes in progress still finish and are cached.
+  void Clear();
+};
+
+#endif
@@ -1,23 +1,69 @@
 #ifndef ZLIB_INFLATE_H
 #define ZLIB_INFLATE_H
 
+#include <algorithm>
 #include <stdexcept>
 #include <iostream>
 #include <string>
 #include <climits>
+#include <atomic>
+#include <vector>
 
 #include "zlib.h"
+#include "Chunk.h"
+#include "DecodeStats.h"
+#include "DecoderContext.h"
+#include "Deflate.h"
+
+enum INFLATE_BACKENDS {
+  ZLIB,  // zlib's inflate()
+  NATIVE // The in-tree whole-buffer decoder, Deflate
+};
+
+/* A part of the IDAT zlib stream that starts on a byte-aligned block boundary with no references to earlier data,
+so it can be inflated on its own. An iDOT chunk also gives the rows of each segment; segments found by
+scanning for full flushes only know their rows once they are inflated.*/
+struct StreamSegment {
+  const Chunk * chunk;   // The IDAT chunk the segment starts in
+  unsigned long offset;  // Into chunk's data
+  unsigned int firstRow;
+  unsigned int numRows;  // 0 when the rows are not known before inflating
+};
 
 class Inflate {
 private:
-  /* Reallocates *decompressed using std::realloc(*decompressed, size * sizeof(char)).
-  Used by ZInflate() to allocate more memory to the zlib inflate() output if needed.
-  After successful reallocation, the z_stream object's avail_out and next_out properties will be updated.
-  The z_stream object will then be ready to be passed to zlib inflate() once again.*/
-  static void ReallocDecompressed(z_stream * stream, char ** decompressed, unsigned long size);
+  static void ThrowInflateError(z_stream * stream, int inflateStatus);
+  static void ZInflateStep(z_stream * stream);
 public:
+  /* The backend InflateInto uses: NATIVE, or ZLIB when built with -DPNG_DECODER_ZLIB_INFLATE. It may be changed
+  at runtime. Streaming decodes, which inflate a few scan lines at a time, always use zlib.*/
+  static std::atomic<INFLATE_BACKENDS> backend;
+  /* Inflates the zlib stream in compressed, then in the IDAT chunks in [chunk, end), until decompressedSize bytes
+  are written. Throws if the compressed data ends before the output is full. Both backends give identical output.
+  With a context, zlib reuses its stream and the native backend its tables instead of allocating new ones.*/
+  static void InflateInto(char * compressed, unsigned long compressedSize, const Chunk * chunk, const Chunk * end, char * decompressed,
+    unsigned long decompressedSize, INFLATE_BACKENDS backendType = Inflate::backend, DecoderContext * context = nullptr);
   static z_stream CreateZStream(char * compressed, unsigned int availableIn, char ** decompressed, unsigned int availableOut);
-  static void ZInflate(z_stream * stream, char ** decompressed);
+  // A negative windowBits inflates raw deflate data without a zlib header.
+  static void ZInflateInit(z_stream * stream, int windowBits = MAX_WBITS);
+  /* Inflates until the stream's avail_out reaches 0, without reallocating next_out.
+  Throws if the compressed data ends before the output window is full.*/
+  static void ZInflateFill(z_stream * stream);
+  /* Like ZInflateFill, but whenever the stream runs out of input it continues with the data of the next
+  IDAT chunk in [chunk, end), in place, so IDAT chunks never need to be joined. chunk is advanced past
+  every chunk that has been fed to the stream.*/
+  static void ZInflateFill(z_stream * stream, const Chunk *& chunk, const Chunk * end);
+  /* Like the above, but first feeds the compressedLeft bytes that follow the stream's input, at most UINT_MAX at a time,
+  since zlib counts its input in unsigned int. Joined buffers of any size are inflated this way.*/
+  static void ZInflateFill(z_stream * stream, unsigned long& compressedLeft, const Chunk *& chunk, const Chunk * end);
+  static void ZInflateEnd(z_stream * stream);
+  /* Inflates segment on a stream of its own, up to the start of next, or up to end if next is null. Only the
+  segment at the start of the stream has a zlib header. Fills decompressed with decompressedSize bytes; with
+  decompressed null, writes into grown instead, growing it as needed up to decompressedSize bytes. Returns the
+  bytes written. Throws if the data refers to bytes before the segment, or if a segment followed by next does
+  not end exactly where next starts, on the byte-aligned block boundary a full flush leaves.*/
+  static unsigned long InflateSegment(const StreamSegment& segment, const StreamSegment * next, const Chunk * end, bool zlibHeader,
+    char * decompressed, unsigned long decompressedSize, std::vector<char>& grown);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,33 @@
+#ifndef INTERLACE_H
+#define INTERLACE_H
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+/* Adam7 interlacing, according to http://www.libpng.org/pub/png/spec/1.2/PNG-DataRep.html#DR.Interlaced-data-order
+An interlaced image is stored as seven reduced images (passes 0 - 6), each filtered on its own.*/
+class Interlace {
+public:
+  static const unsigned int numPasses = 7;
+  static const unsigned int xStart[numPasses];
+  static const unsigned int yStart[numPasses];
+  static const unsigned int xStep[numPasses];
+  static const unsigned int yStep[numPasses];
+
+  // Width and height in pixels of one pass. Either may be 0, in which case the pass is empty and not stored.
+  static unsigned int GetPassWidth(unsigned int pass, unsigned int width);
+  static unsigned int GetPassHeight(unsigned int pass, unsigned int height);
+  /* Writes the pixels of one unfiltered pass scan line to their places in the matching image scan line, where
+  width is the image width. Whole-byte pixels are copied with a loop specialized on their size, sub-byte pixels
+  bit by bit. Padding bits at the end of sub-byte image scan lines are cleared.*/
+  static void ScatterScanLine(const char * passScanLine, unsigned int pass, unsigned int width, char * imageScanLine,
+    unsigned int bitsPerPixel);
+  /* Grows every pixel of a finished pass into the block it stands for until later passes arrive, e.g. 8x8 for
+  pass 0, so the partly decoded image is a complete low resolution preview. Later passes overwrite the blocks.*/
+  static void FillPassBlocks(char * image, unsigned int pass, unsigned int width, unsigned int height, unsigned int bitsPerPixel,
+    unsigned long scanLineWidth);
+};
+
+#endif
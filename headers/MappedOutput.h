@@ -0,0 +1,48 @@
+#ifndef MAPPED_OUTPUT_H
+#define MAPPED_OUTPUT_H
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* A decode output backed by a file instead of memory, for images larger than RAM. The file is created at its
+full size and mapped shared, so written bytes go to the page cache and from there to disk. Released ranges
+stay in the file but leave this process's resident memory; the kernel writes them back and evicts them as
+needed, so only the part of the output written since the last release stays resident.*/
+class MappedOutput {
+private:
+  std::filesystem::path fileName;
+  char * data;
+  unsigned long size;
+
+public:
+  MappedOutput();
+  // Same as Open; check IsOpen afterwards.
+  MappedOutput(const std::filesystem::path& fileName, unsigned long size);
+  MappedOutput(const MappedOutput&) = delete;
+  MappedOutput& operator=(const MappedOutput&) = delete;
+  ~MappedOutput();
+
+  /* Creates fileName, or truncates it if it exists, at size bytes and maps it for writing. The file is sparse
+  until written. Returns false if it cannot be created or mapped.*/
+  bool Open(const std::filesystem::path& fileName, unsigned long size);
+  // Unmaps the file. Written bytes still reach it; Flush first to wait for them.
+  void Close();
+  bool IsOpen() const;
+  std::filesystem::path GetFile() const;
+  char * GetData() const;
+  unsigned long GetSize() const;
+  /* Starts writing back the size bytes at offset and drops them from resident memory. Reading or writing them
+  again later is still valid and faults them back in from the file.*/
+  void Release(unsigned long offset, unsigned long size);
+  // Writes every dirty page back to the file and waits for it. Returns false if that fails.
+  bool Flush();
+};
+
+#endif
@@ -1,7 +1,9 @@
 #ifndef PNG_DECODER_H
 #define PNG_DECODER_H
 
+#include <algorithm>
 #include <iostream>
+#include <iterator>
 #include <string>
 #include <fstream>
 #include <filesystem>
@@ -9,39 +11,166 @@
 #include <vector>
 #include <climits>
 #include <cmath>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "BlockRing.h"
 #include "Chunk.h"
+#include "DecoderContext.h"
+#include "Downscaler.h"
 #include "Endian.h"
+#include "Filter.h"
 #include "Inflate.h"
+#include "Interlace.h"
+#include "MappedOutput.h"
+#include "PixelConverter.h"
+#include "ThreadPool.h"
+
+enum LOAD_TYPES {
+  STREAM, // Copy the file into memory with std::ifstream
+  MMAP,   // Map the file read-only; chunks point straight into the mapping
+  BUFFER  // Borrow a caller-owned buffer; chunks point straight into it
+};
+
+// The IHDR fields of a PNG, read without loading the rest of the file.
+struct IHDR {
+  unsigned int width;
+  unsigned int height;
+  unsigned char bitDepth;
+  unsigned char colorType;
+  unsigned char compressionMethod;
+  unsigned char filterMethod;
+  unsigned char interlaceMethod;
+  unsigned long unfilteredDataSize; // Bytes the decoded image will take, from GetUnfilteredDataSize
+};
+
+// A window of an image: rows [firstRow, lastRow) and columns [firstColumn, lastColumn).
+struct Region {
+  unsigned int firstRow;
+  unsigned int lastRow;
+  unsigned int firstColumn;
+  unsigned int lastColumn;
+};
+
+// Receives one unfiltered scan line (without its filter byte) and its row index.
+typedef std::function<void(const char * scanLine, unsigned int row)> ScanLineCallback;
+/* Receives the whole unfiltered image after each of the seven Adam7 passes (0 - 6) is decoded. Pixels not yet decoded are
+filled from their nearest decoded neighbor, so every call sees a complete preview; the image is final after pass 6.*/
+typedef std::function<void(const char * unfilteredData, unsigned int pass)> PassCallback;
 
 class PNG_Decoder {
 private:
   std::filesystem::path fileName;
-  unsigned int fileSize;
+  unsigned long fileSize;
   char * bytes;
+  LOAD_TYPES loadType;
+  bool mapped;
+  bool borrowed;
+  bool verifyCrc;
   int numChunks;
   std::vector<Chunk> chunks;
   
   // Private methods
   void LoadBytes();
+  void ReadBytes();
+  void MapBytes();
+  void BorrowBytes(const uint8_t * data, size_t size);
+  void ReleaseBytes();
   bool IsValid() const;
   void LoadChunks();
+  static void ReadIhdr(const char * bytes, IHDR& ihdr);
   static unsigned int GetNumChannels(unsigned char colorType);
-  static void RemoveSubFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp);
-  static void RemoveUpFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * priorScanLine = nullptr);
-  static void RemoveAverageFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp, char * priorScanLine = nullptr);
-  static unsigned int PaethPredictor(int priorSub, int priorUp, int priorUpSub);
-  static void RemovePaethFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp, char * priorScanLine = nullptr);
+  // Throws std::overflow_error if a scan line and its filter byte would not fit in unsigned int.
+  static unsigned long GetScanLineWidth(unsigned int width, unsigned char bitDepth, unsigned char colorType);
+  // a * b, or std::overflow_error if the product does not fit in unsigned long.
+  static unsigned long MultiplySizes(unsigned long a, unsigned long b);
+  static unsigned int GetBytesPerPixel(unsigned char bitDepth, unsigned char colorType);
+  // Size of the decoded image in the converter's format, or unfiltered if converter is null. Throws if the converter is for another image type.
+  static unsigned long GetOutputDataSize(unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType,
+    const PixelConverter * converter);
+  /* Inflate compressedData, then the IDAT chunks in [chunk, end). The public static methods pass no chunks;
+  the member methods pass no compressedData and inflate the IDAT chunks in place.*/
+  static unsigned long InflateDataInto(char * compressedData, unsigned long compressedDataSize, const Chunk * chunk, const Chunk * end,
+    char * decompressedData, unsigned long decompressedDataCapacity, unsigned int width, unsigned int height, unsigned char bitDepth,
+    unsigned char colorType, unsigned char interlaceMethod, DecoderContext * context);
+  static unsigned long InflateScanLines(char * compressedData, unsigned long compressedDataSize, const Chunk * chunk, const Chunk * end,
+    unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType, const ScanLineCallback& onScanLine,
+    const PixelConverter * converter);
+  /* With pipelined set, inflate on a second thread into a ring of scan line blocks while the calling thread
+  unfilters finished blocks into unfilteredData, so inflate and unfilter overlap on separate cores.
+  Interlaced images are always decoded serially. A converter converts each scan line right after it is unfiltered.*/
+  static unsigned long InflateUnfilteredInto(char * compressedData, unsigned long compressedDataSize, const Chunk * chunk,
+    const Chunk * end, char * unfilteredData, unsigned long unfilteredDataCapacity, unsigned int width, unsigned int height,
+    unsigned char bitDepth, unsigned char colorType, unsigned char interlaceMethod, bool pipelined, const PixelConverter * converter);
+  // Inflates and unfilters an Adam7 image pass by pass, scattering each pass scan line into unfilteredData.
+  static unsigned long InflateInterlacedInto(char * compressedData, unsigned long compressedDataSize, const Chunk * chunk,
+    const Chunk * end, char * unfilteredData, unsigned long unfilteredDataCapacity, unsigned int width, unsigned int height,
+    unsigned char bitDepth, unsigned char colorType, const PassCallback& onPass, const PixelConverter * converter);
+  /* Decodes only the rows and columns of region. Inflating stops after region.lastRow, rows above the region are
+  unfiltered only when the next row's filter reads them, and only bytes up to region.lastColumn are unfiltered.
+  Adam7 images store rows out of order, so they are decoded whole and then cropped.*/
+  static unsigned long InflateRegionInto(char * compressedData, unsigned long compressedDataSize, const Chunk * chunk, const Chunk * end,
+    char * regionData, unsigned long regionDataCapacity, unsigned int width, unsigned int height, unsigned char bitDepth,
+    unsigned char colorType, unsigned char interlaceMethod, const Region& region, const PixelConverter * converter);
+  /* The independent segments of the IDAT chunks in [chunk, end): those of a valid iDOT chunk, or with scanFullFlush
+  set, full flushes at least 64 KiB of compressed data apart. Returns a single segment when there are none.*/
+  static std::vector<StreamSegment> FindSegments(const Chunk * chunk, const Chunk * end, unsigned int height, bool scanFullFlush);
+  /* Inflates every segment on its own core of pool into decompressedData, then fills firstRows with the first row
+  of each band of rows the segments hold. Returns false if any segment turns out not to be independent.*/
+  static bool InflateSegments(const std::vector<StreamSegment>& segments, const Chunk * end, char * decompressedData,
+    unsigned long decompressedDataSize, unsigned long rowSize, ThreadPool& pool, std::vector<unsigned int>& firstRows);
+  /* Up to four bands per thread of numThreads, of at least 64 KiB each, split as evenly as the image allows. Every band
+  starts at row 0 or at a row filtered with None or Sub, which does not read the row above. Returns the first row
+  of each band; just row 0 if the image has no such rows or is too small to split.*/
+  static std::vector<unsigned int> FindRestartRows(const char * decompressedData, unsigned long rowSize, unsigned int height,
+    unsigned int numThreads);
+  /* Unfilters the bands of rows starting at firstRows. Bands whose first row is filtered with None or Sub do not
+  read the band above, so they are unfiltered in parallel; the rest follow in order once the rows above are done.
+  With inPlace set, converted rows are unfiltered in place in decompressedData before they are converted.
+  Otherwise decompressedData is left as it is, and every band of a converted image must start at a restart row.*/
+  static void UnfilterBandsInto(char * decompressedData, char * unfilteredData, const std::vector<unsigned int>& firstRows,
+    unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType, const PixelConverter * converter,
+    bool inPlace, ThreadPool& pool);
+  static unsigned long InflateSegmentsInto(const Chunk * chunk, const Chunk * end, char * unfilteredData,
+    unsigned long unfilteredDataCapacity, unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType,
+    unsigned char interlaceMethod, bool scanFullFlush, const PixelConverter * converter, ThreadPool * pool);
+  // Like pool.ParallelFor, but rethrows the first error of any task and adds the stats the tasks record to the caller's.
+  static void RunTasks(ThreadPool& pool, unsigned long count, const std::function<void(unsigned long)>& task);
+  // One pool, sized to the machine, for the segment decodes of every decoder that is not given a pool.
+  static ThreadPool& GetSharedPool();
+  // Copies width pixels starting at firstColumn to the start of output, shifting sub-byte pixels into place.
+  static void CropScanLine(const char * scanLine, unsigned int firstColumn, unsigned int width, unsigned int bitsPerPixel, char * output);
+  // size bytes of the context's buffer, or of fallback when there is no context.
+  static char * GetScratch(DecoderContext * context, SCRATCH_BUFFERS buffer, unsigned long size, std::vector<char>& fallback);
+  // A downscaler for scan lines of this PNG converted by converter, or unfiltered if converter is null.
+  Downscaler CreateDownscaler(unsigned int outputWidth, unsigned int outputHeight, const PixelConverter * converter) const;
+  // A converter for format, or null for RAW. Throws if the PNG cannot be converted to format.
+  std::unique_ptr<PixelConverter> CreatePixelConverter(PIXEL_FORMATS format) const;
 
 public:
   // Constructors & Deconstructors
   PNG_Decoder();
-  PNG_Decoder(std::filesystem::path fileName);
+  // verifyCrc checks the CRC of every chunk while loading; trusted inputs may skip it.
+  PNG_Decoder(std::filesystem::path fileName, LOAD_TYPES loadType = LOAD_TYPES::STREAM, bool verifyCrc = true);
+  /* Decodes a PNG already in memory without copying it. The buffer is borrowed: it must stay valid and unchanged
+  until the decoder is closed, and it is never written to or freed.*/
+  PNG_Decoder(const uint8_t * data, size_t size, bool verifyCrc = true);
+  PNG_Decoder(const PNG_Decoder&) = delete;
+  PNG_Decoder& operator=(const PNG_Decoder&) = delete;
   ~PNG_Decoder();
 
   // Getters & Setters
   std::filesystem::path GetFile() const;
   char * GetBytes() const;
+  LOAD_TYPES GetLoadType() const;
+  bool GetVerifyCrc() const;
   int GetNumChunks() const;
   const std::vector<Chunk>& GetChunks() const;
   unsigned int GetWidth() const;
@@ -53,13 +182,102 @@ public:
   unsigned char GetInterlaceMethod() const;
 
   // Methods
-  void Open(const std::filesystem::path fileName);
+  void Open(const std::filesystem::path fileName, LOAD_TYPES loadType = LOAD_TYPES::STREAM, bool verifyCrc = true);
+  void Open(const uint8_t * data, size_t size, bool verifyCrc = true);
   void Close();
   bool IsOpen() const;
   unsigned long AllocateCompressedData(char *& compressedData) const;
-  static unsigned long AllocateDecompressedData(char * compressedData, unsigned long compressedDataSize, char *& decompressedData);
+  static unsigned long AllocateDecompressedData(char * compressedData, unsigned long compressedDataSize, char *& decompressedData,
+    unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType, unsigned char interlaceMethod = 0);
   static unsigned long AllocateUnfilteredData(char * decompressedData, char *& unfilteredData, unsigned int width,
-    unsigned int height, unsigned char bitDepth, unsigned char colorType);
+    unsigned int height, unsigned char bitDepth, unsigned char colorType, unsigned char interlaceMethod = 0,
+    const PixelConverter * converter = nullptr, ThreadPool * pool = nullptr);
+  /* Reads only the signature and IHDR chunk (the first 33 bytes) with a single pread, validates them and the
+  IHDR CRC, and fills ihdr. Returns false if the file is missing, too short or not a valid PNG.*/
+  static bool Probe(const std::filesystem::path& fileName, IHDR& ihdr);
+  // Same as above for a PNG in memory; only the first 33 bytes are read.
+  static bool Probe(const uint8_t * data, size_t size, IHDR& ihdr);
+  /* Exact buffer sizes computed from the IHDR values. Decompressed data includes one filter byte per scan line,
+  and for Adam7 images (interlaceMethod 1) holds the seven passes one after another. Sizes are 64-bit; they
+  throw std::overflow_error rather than wrap, and for scan lines of 4 GiB or more, which zlib cannot fill.*/
+  static unsigned long GetDecompressedDataSize(unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType,
+    unsigned char interlaceMethod = 0);
+  static unsigned long GetUnfilteredDataSize(unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType);
+  // Unfiltered size of region. Converted regions take converter.GetOutputDataSize(region width, region height).
+  static unsigned long GetRegionDataSize(const Region& region, unsigned char bitDepth, unsigned char colorType);
+  /* Decode into caller-owned buffers. Buffers smaller than the sizes above are rejected before any work is done.
+  Methods taking a converter write its format instead; size their buffers with converter.GetOutputDataSize.
+  Methods taking a context take their scratch buffers from it instead of allocating them. Methods taking a pool split
+  non-interlaced images at rows filtered with None or Sub, which do not read the row above, and unfilter the bands
+  in parallel on it.*/
+  static unsigned long DecompressDataInto(char * compressedData, unsigned long compressedDataSize, char * decompressedData,
+    unsigned long decompressedDataCapacity, unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType,
+    unsigned char interlaceMethod = 0);
+  static unsigned long UnfilterDataInto(char * decompressedData, char * unfilteredData, unsigned long unfilteredDataCapacity,
+    unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType, unsigned char interlaceMethod = 0,
+    const PixelConverter * converter = nullptr, DecoderContext * context = nullptr, ThreadPool * pool = nullptr);
+  /* Same as UnfilterDataInto, but hands each unfiltered (or converted) scan line to onScanLine in row order instead
+  of writing an image, so callers can store rows in their own layout while they are still in cache. Adam7 images
+  are unfiltered whole into a scratch buffer first. Returns the size the image would have, or 0 on failure.*/
+  static unsigned long UnfilterScanLines(char * decompressedData, unsigned int width, unsigned int height, unsigned char bitDepth,
+    unsigned char colorType, unsigned char interlaceMethod, const ScanLineCallback& onScanLine, const PixelConverter * converter = nullptr,
+    DecoderContext * context = nullptr);
+  // Inflates and unfilters one scan line at a time, holding only two scan lines in memory. Interlaced images are rejected.
+  static unsigned long DecodeScanLines(char * compressedData, unsigned long compressedDataSize, unsigned int width,
+    unsigned int height, unsigned char bitDepth, unsigned char colorType, const ScanLineCallback& onScanLine,
+    const PixelConverter * converter = nullptr);
+  /* Inflates and unfilters straight into unfilteredData without a full decompressed buffer. With pipelined set,
+  inflating runs on its own thread one block of scan lines ahead of unfiltering. Both produce identical output.*/
+  static unsigned long DecodeDataInto(char * compressedData, unsigned long compressedDataSize, char * unfilteredData,
+    unsigned long unfilteredDataCapacity, unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType,
+    unsigned char interlaceMethod = 0, bool pipelined = false, const PixelConverter * converter = nullptr);
+  /* Decodes only region into regionData, one region row after another. Inflating stops once the last row of the
+  region is decoded, so bands near the top of an image cost a fraction of a full decode.*/
+  static unsigned long DecodeRegionInto(char * compressedData, unsigned long compressedDataSize, char * regionData,
+    unsigned long regionDataCapacity, unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType,
+    const Region& region, unsigned char interlaceMethod = 0, const PixelConverter * converter = nullptr);
+  // Same as above, but inflate the open PNG's IDAT chunks in place instead of a joined copy of them.
+  unsigned long AllocateDecompressedData(char *& decompressedData) const;
+  unsigned long DecompressDataInto(char * decompressedData, unsigned long decompressedDataCapacity,
+    DecoderContext * context = nullptr) const;
+  /* A converter from this PNG's IHDR, PLTE and tRNS chunks. The decode methods below convert with one when
+  given a format other than RAW; size their buffers with its GetOutputDataSize.*/
+  PixelConverter GetPixelConverter(PIXEL_FORMATS format) const;
+  unsigned long DecodeScanLines(const ScanLineCallback& onScanLine, PIXEL_FORMATS format = PIXEL_FORMATS::RAW) const;
+  unsigned long DecodeDataInto(char * unfilteredData, unsigned long unfilteredDataCapacity, PIXEL_FORMATS format = PIXEL_FORMATS::RAW,
+    bool pipelined = false) const;
+  unsigned long DecodeRegionInto(char * regionData, unsigned long regionDataCapacity, const Region& region,
+    PIXEL_FORMATS format = PIXEL_FORMATS::RAW) const;
+  /* Decodes a thumbnail: every scan line is area-averaged into outputData, outputWidth x outputHeight pixels in format,
+  as soon as it is unfiltered, so only O(width) memory is used besides the output. Size outputData with
+  GetDownscaledDataSize. Palette images must be downscaled to GRAY8, RGB8 or RGBA8. Adam7 images are decoded
+  whole first, since their rows are stored out of order.*/
+  unsigned long DecodeDownscaledInto(char * outputData, unsigned long outputDataCapacity, unsigned int outputWidth,
+    unsigned int outputHeight, PIXEL_FORMATS format = PIXEL_FORMATS::RAW) const;
+  unsigned long GetDownscaledDataSize(unsigned int outputWidth, unsigned int outputHeight, PIXEL_FORMATS format = PIXEL_FORMATS::RAW) const;
+  /* Inflates and unfilters into the context's output buffer and returns it, or nullptr on failure. The image
+  stays valid until the context decodes again. Reopen one decoder with Open and decode with one context per
+  thread: once warmed up, decoding images of the same size and format makes no heap allocations.*/
+  const char * Decode(DecoderContext& context, unsigned long& size, PIXEL_FORMATS format = PIXEL_FORMATS::RAW) const;
+  /* Inflates and unfilters the independent segments of the IDAT stream on separate cores of pool, or of a pool
+  shared by every decoder if pool is null. Segments come from the iDOT chunk Apple's encoder writes or, with
+  scanFullFlush set, from full flushes found in the compressed data. Images without segments, Adam7 images and
+  segments that turn out not to be independent are decoded serially instead. The output matches DecodeDataInto.*/
+  unsigned long DecodeSegmentsInto(char * unfilteredData, unsigned long unfilteredDataCapacity, PIXEL_FORMATS format = PIXEL_FORMATS::RAW,
+    bool scanFullFlush = false, ThreadPool * pool = nullptr) const;
+  // How many segments DecodeSegmentsInto would inflate in parallel; 1 if the stream has none.
+  unsigned int GetNumSegments(bool scanFullFlush = false) const;
+  /* Decodes into unfilteredData, calling onPass as each Adam7 pass completes so a coarse preview can be shown
+  before the rest is inflated. Non-interlaced images are decoded normally and report only pass 6.*/
+  unsigned long DecodeProgressive(char * unfilteredData, unsigned long unfilteredDataCapacity, const PassCallback& onPass,
+    PIXEL_FORMATS format = PIXEL_FORMATS::RAW) const;
+  /* Decodes out of core into a file-backed output, sized like the buffers of DecodeDataInto, for images larger
+  than memory. Scan lines are streamed into it one at a time, and every residentBytes of written rows are
+  released to the file, so the output holds about that much resident memory and the decode O(width) besides.
+  Adam7 images write every pass across the whole output, so the kernel evicts it as memory runs short instead.
+  For a tiled or other custom store, DecodeScanLines hands over each row in turn.*/
+  unsigned long DecodeMappedInto(MappedOutput& output, PIXEL_FORMATS format = PIXEL_FORMATS::RAW,
+    unsigned long residentBytes = 64ul << 20) const;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,84 @@
+#ifndef PNG_ENCODER_H
+#define PNG_ENCODER_H
+
+#include <algorithm>
+#include <climits>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Chunk.h"
+#include "Crc.h"
+#include "Filter.h"
+#include "PNG_Decoder.h"
+#include "ThreadPool.h"
+#include "zlib.h"
+
+/* Encodes non-interlaced PNGs from unfiltered scan lines laid out like PNG_Decoder's RAW output. Rows are split
+into bands of about bandSize filtered bytes, and each band is filtered and deflated on its own core, the way pigz
+compresses. Every band is an independent raw deflate stream ending in a sync flush, so the bands join into one
+zlib stream, each starting a new IDAT chunk, and PNG_Decoder::DecodeSegmentsInto with scanFullFlush set can
+inflate them in parallel again. The Adler-32 of each band is combined into the stream's trailer.*/
+class PNG_Encoder {
+private:
+  unsigned int width;
+  unsigned int height;
+  unsigned char bitDepth;
+  unsigned char colorType;
+  int compressionLevel;
+  bool adaptiveFilters;
+  unsigned long bandSize;
+  ThreadPool * pool;
+  std::vector<char> palette;
+  std::vector<char> transparency;
+
+  // Private methods
+  static void AppendUint32(std::vector<char>& png, unsigned int value);
+  // Appends a chunk's length and type and returns where it starts. EndChunk fills in the length and appends the CRC.
+  static unsigned long BeginChunk(std::vector<char>& png, unsigned int chunkType);
+  static void EndChunk(std::vector<char>& png, unsigned long chunkStart);
+  static void AppendChunk(std::vector<char>& png, unsigned int chunkType, const char * data, unsigned long dataLength);
+  // One pool, sized to the machine, for every encoder that is not given a pool.
+  static ThreadPool& GetSharedPool();
+  /* Writes rows [firstRow, lastRow) with their filter bytes into filteredData. With adaptive filters each row gets
+  the filter whose output has the smallest Filter::SumAbsoluteValues; palette and sub-byte images are left unfiltered.*/
+  void FilterRows(const char * unfilteredData, unsigned int firstRow, unsigned int lastRow, char * filteredData) const;
+  /* Filters and deflates rows [firstRow, lastRow) as a raw deflate stream of their own. The last band ends the
+  stream; the others end with a sync flush. adler is set to the Adler-32 of the filtered rows.*/
+  void CompressBand(const char * unfilteredData, unsigned int firstRow, unsigned int lastRow, bool last, std::vector<char>& compressed,
+    unsigned long& adler) const;
+
+public:
+  static constexpr unsigned long defaultBandSize = 256 * 1024;
+  // IDAT chunks longer than this are split, well below the PNG limit of 2^31 - 1 bytes.
+  static constexpr unsigned long maxIdatSize = 1ul << 30;
+
+  /* Throws std::invalid_argument for an empty image, a bitDepth and colorType PNG does not allow, or a compressionLevel
+  outside 0 - 9. A null pool uses one shared by every encoder.*/
+  PNG_Encoder(unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType, int compressionLevel = 6,
+    ThreadPool * pool = nullptr);
+
+  unsigned int GetWidth() const;
+  unsigned int GetHeight() const;
+  unsigned char GetBitDepth() const;
+  unsigned char GetColorType() const;
+  // Bytes of unfiltered data Encode expects, as PNG_Decoder::GetUnfilteredDataSize.
+  unsigned long GetUnfilteredDataSize() const;
+  // Written as the PLTE and tRNS chunks. Color type 3 requires a palette.
+  void SetPalette(const std::vector<char>& palette, const std::vector<char>& transparency = std::vector<char>());
+  // Off writes every row with filter None. On by default.
+  void SetAdaptiveFilters(bool adaptiveFilters);
+  /* Filtered bytes per band, rounded to whole rows. Smaller bands spread small images across more cores; every
+  band restarts deflate's window, which costs some compression.*/
+  void SetBandSize(unsigned long bandSize);
+  /* Encodes unfilteredData into png, replacing its contents. unfilteredData must hold GetUnfilteredDataSize bytes.
+  Returns the size of the PNG, or 0 on failure.*/
+  unsigned long Encode(const char * unfilteredData, unsigned long unfilteredDataSize, std::vector<char>& png) const;
+  // Same as above, written to fileName. Returns false on failure.
+  bool EncodeFile(const char * unfilteredData, unsigned long unfilteredDataSize, const std::filesystem::path& fileName) const;
+};
+
+#endif
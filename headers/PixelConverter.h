@@ -0,0 +1,72 @@
+#ifndef PIXEL_CONVERTER_H
+#define PIXEL_CONVERTER_H
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "Endian.h"
+#include "Filter.h"
+
+enum PIXEL_FORMATS {
+  RAW,         // Samples as stored: packed sub-byte samples, big-endian 16-bit samples and palette indices
+  HOST_ENDIAN, // Same as RAW, but 16-bit samples are in host byte order
+  GRAY8,       // 1 byte per pixel. Color is converted to luminance (BT.709) and alpha is dropped, not composited
+  RGB8,        // 3 bytes per pixel. Alpha is dropped, not composited
+  RGBA8        // 4 bytes per pixel. Alpha comes from the image or its tRNS chunk, otherwise it is 255
+};
+
+// Converts count 16-bit samples, e.g. to their high bytes or to host byte order.
+typedef void (*SampleConverter)(const char * samples, unsigned int count, char * output);
+// Rearranges width pixels of 8-bit samples into another channel layout.
+typedef void (*ChannelMapper)(const unsigned char * input, unsigned int width, char * output);
+
+// Per-image values the conversion kernels read.
+struct ConversionTables {
+  unsigned int inputChannels;
+  unsigned int outputChannels;
+  unsigned char lookupTable[256][4]; // Output pixel for every sample of a palette or 1 - 8 bit grayscale image
+  bool hasKey;
+  unsigned short key[3]; // The gray or RGB sample value tRNS marks transparent
+  SampleConverter convertSamples;
+  ChannelMapper mapChannels;
+};
+
+typedef void (*ScanLineConverter)(const char * scanLine, unsigned int width, char * output, const ConversionTables& tables);
+
+/* Converts unfiltered scan lines of one image into a PIXEL_FORMATS layout. Sub-byte samples are expanded,
+palette and tRNS lookups applied, and 16-bit samples byte swapped or reduced to their high byte. Build one
+per image, next to its ScanLineFilters, and convert each scan line while it is still in cache.*/
+class PixelConverter {
+private:
+  unsigned char bitDepth;
+  unsigned char colorType;
+  PIXEL_FORMATS format;
+  ConversionTables tables;
+  ScanLineConverter converter;
+
+  void LoadLookupTable(const char * palette, unsigned int paletteLength, const char * transparency, unsigned int transparencyLength);
+  void LoadKey(const char * transparency, unsigned int transparencyLength);
+
+public:
+  /* palette and transparency are the PLTE and tRNS chunk data, if the image has them. Palette images need a
+  palette for every format except RAW and HOST_ENDIAN. Kernels are chosen for the best instruction set at or
+  below simdType; SIMD_TYPES::SCALAR never uses vector instructions.*/
+  PixelConverter(unsigned char bitDepth, unsigned char colorType, PIXEL_FORMATS format, const char * palette = nullptr,
+    unsigned int paletteLength = 0, const char * transparency = nullptr, unsigned int transparencyLength = 0,
+    SIMD_TYPES simdType = Filter::systemType);
+
+  PIXEL_FORMATS GetFormat() const;
+  unsigned char GetBitDepth() const;
+  unsigned char GetColorType() const;
+  // Output sizes. Only RAW and HOST_ENDIAN can have sub-byte pixels. Data sizes too large for unsigned long throw std::overflow_error.
+  unsigned int GetOutputBitsPerPixel() const;
+  unsigned long GetOutputScanLineWidth(unsigned int width) const;
+  unsigned long GetOutputDataSize(unsigned int width, unsigned int height) const;
+  // Converts one unfiltered scan line of width pixels (without its filter byte) into output.
+  void ConvertScanLine(const char * scanLine, unsigned int width, char * output) const;
+};
+
+#endif
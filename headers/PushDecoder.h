@@ -0,0 +1,93 @@
+#ifndef PUSH_DECODER_H
+#define PUSH_DECODER_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "zlib.h"
+#include "Crc.h"
+#include "DecodeStats.h"
+#include "Endian.h"
+#include "Filter.h"
+#include "PNG_Decoder.h"
+#include "PixelConverter.h"
+
+enum PUSH_STATES {
+  HEADER,      // Waiting for the signature and IHDR chunk
+  CHUNK_START, // Waiting for a chunk's length and type
+  CHUNK_DATA,
+  CHUNK_CRC,
+  COMPLETE,    // IEND was read after every scan line
+  FAILED
+};
+
+// Receives the IHDR of a pushed PNG as soon as it arrives, before any scan line.
+typedef std::function<void(const IHDR& ihdr)> HeaderCallback;
+
+/* Decodes a PNG as its bytes arrive, e.g. from a socket, instead of waiting for the whole file. Chunks are parsed
+as soon as they are complete, IDAT data is inflated the moment it is pushed, and every scan line is unfiltered and
+handed to onScanLine as soon as its last byte is inflated. Pushed IDAT data is never buffered: only two scan lines,
+the zlib window and the palette are held. Like DecodeScanLines, it needs rows in image order, so Adam7 images are rejected.*/
+class PushDecoder {
+private:
+  ScanLineCallback onScanLine;
+  HeaderCallback onHeader;
+  PIXEL_FORMATS format;
+  bool verifyCrc;
+  PUSH_STATES state;
+  std::vector<char> pending; // Bytes of the IHDR, a chunk start or a CRC still arriving
+  unsigned int chunkType;
+  unsigned int chunkRemaining;
+  unsigned int crc;
+  bool hasHeader;
+  IHDR ihdr;
+  std::vector<char> palette;
+  std::vector<char> transparency;
+
+  std::unique_ptr<PixelConverter> converter;
+  ScanLineFilters filters;
+  z_stream stream;
+  bool streamOpen;
+  unsigned int scanLineWidth;
+  std::vector<char> scanLines; // Ring of two scan lines, each prefixed by its filter byte
+  char * currentScanLine;
+  char * priorScanLine;
+  std::vector<char> convertedScanLine;
+  unsigned int scanLineFill; // Bytes of the current scan line inflated so far
+  unsigned int rowsDecoded;
+
+  // Moves up to size bytes into pending until it holds count bytes. Returns the bytes taken.
+  size_t Gather(const char * data, size_t size, size_t count);
+  void Consume(const char * data, size_t size);
+  void StartChunk();
+  void FinishChunk();
+  void StartImage();
+  void InflateData(const char * data, unsigned int size);
+  void FinishScanLine();
+
+public:
+  /* Scan lines are converted to format, or left unfiltered for RAW. onHeader, if set, is called once the IHDR
+  is read, which is the earliest point the output size is known.*/
+  PushDecoder(const ScanLineCallback& onScanLine, PIXEL_FORMATS format = PIXEL_FORMATS::RAW, bool verifyCrc = true,
+    const HeaderCallback& onHeader = nullptr);
+  PushDecoder(const PushDecoder&) = delete;
+  PushDecoder& operator=(const PushDecoder&) = delete;
+  ~PushDecoder();
+
+  /* Feeds the next size bytes of the PNG, in any split. Returns false once the PNG is found to be invalid;
+  later pushes are ignored and also return false. Bytes after the IEND chunk are ignored.*/
+  bool Push(const uint8_t * data, size_t size);
+  PUSH_STATES GetState() const;
+  // True once every scan line was delivered and the IEND chunk was read.
+  bool IsComplete() const;
+  bool HasHeader() const;
+  // The IHDR, once HasHeader() is true. Throws before that.
+  const IHDR& GetHeader() const;
+  unsigned int GetRowsDecoded() const;
+};
+
+#endif
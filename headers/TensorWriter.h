@@ -0,0 +1,63 @@
+#ifndef TENSOR_WRITER_H
+#define TENSOR_WRITER_H
+
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "PixelConverter.h"
+
+enum TENSOR_LAYOUTS {
+  NHWC, // Image, row, column, channel: each pixel's channels side by side
+  NCHW  // Image, channel, row, column: one plane per channel
+};
+
+enum TENSOR_TYPES {
+  UINT8,   // Samples as decoded; scale, mean and std are not applied
+  FLOAT16, // IEEE 754 half precision, rounded to nearest even, in host byte order
+  FLOAT32
+};
+
+// The shape, layout and element type of a batch tensor, and the normalization float tensors apply.
+struct TensorOptions {
+  unsigned int width;
+  unsigned int height;
+  PIXEL_FORMATS format;  // GRAY8, RGB8 or RGBA8, which also sets the number of channels
+  TENSOR_LAYOUTS layout;
+  TENSOR_TYPES type;
+  float scale;           // Float elements are (sample * scale - mean[c]) / std[c], e.g. scale 1 / 255
+  float mean[4];
+  float std[4];
+};
+
+/* Writes 8-bit pixel rows of one image into its place in a batch tensor, converting and normalizing each sample
+on the way. The element for every sample value of every channel is computed once up front, so the fused row
+write is one table lookup per sample. Pixels come from a PixelConverter for options.format.*/
+class TensorWriter {
+private:
+  TensorOptions options;
+  unsigned int channels;
+  unsigned long elementSize;
+  unsigned char byteTable[4][256];
+  uint16_t halfTable[4][256];
+  float floatTable[4][256];
+
+public:
+  // Throws std::invalid_argument for an empty shape, a format other than GRAY8, RGB8 or RGBA8, or a zero std.
+  explicit TensorWriter(const TensorOptions& options);
+
+  const TensorOptions& GetOptions() const;
+  unsigned int GetNumChannels() const;
+  unsigned long GetElementSize() const;
+  // Bytes of one image, and of numImages images. Sizes too large for unsigned long throw std::overflow_error.
+  unsigned long GetImageSize() const;
+  unsigned long GetTensorSize(unsigned long numImages) const;
+  // Writes row y of width pixels into image, which points at the image's first byte in the tensor.
+  void WriteRow(const char * row, unsigned int y, char * image) const;
+  // Rounds value to the nearest half precision float, ties to even; out of range values become infinity.
+  static uint16_t ToHalf(float value);
+};
+
+#endif
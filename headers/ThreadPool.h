@@ -0,0 +1,61 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* A fixed-size work-stealing thread pool. Every worker owns a task deque: it runs its own tasks oldest
+first and, when empty, steals the newest task from another worker. Tasks submitted from a worker thread
+go to that worker's own deque.*/
+class ThreadPool {
+private:
+  struct Worker {
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable idle;
+  std::atomic<unsigned int> nextWorker;
+  std::atomic<unsigned long> queued;
+  unsigned long unfinished;
+  std::exception_ptr error; // The first exception a submitted task threw since the last Wait
+  bool stopping;
+
+  bool PopTask(unsigned int index, std::function<void()>& task);
+  void RunTask(std::function<void()>& task);
+  void Run(unsigned int index);
+
+public:
+  // numThreads 0 uses one thread per hardware thread.
+  ThreadPool(unsigned int numThreads = 0);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  // Finishes every submitted task, then joins the workers.
+  ~ThreadPool();
+
+  unsigned int GetNumThreads() const;
+  // Whether the calling thread is a worker of any pool.
+  static bool IsWorkerThread();
+  // An exception thrown by the task is kept for Wait to rethrow.
+  void Submit(std::function<void()> task);
+  /* Blocks until every submitted task has finished, then rethrows the first exception a task threw since the
+  last Wait. Must not be called from a task.*/
+  void Wait();
+  /* Runs task(0) ... task(count - 1) on the pool and blocks until they have all finished. The calling
+  thread runs tasks while it waits, so this may also be called from inside a task. If any task throws,
+  the first exception is rethrown once every task has finished.*/
+  void ParallelFor(unsigned long count, const std::function<void(unsigned long)>& task);
+};
+
+#endif
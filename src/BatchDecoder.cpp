@@ -0,0 +1,379 @@
+#include "BatchDecoder.h"
+
+// Private
+BatchDecoder::SlotGuard::SlotGuard(BatchDecoder& batchDecoder) : batchDecoder(batchDecoder) {
+}
+
+BatchDecoder::SlotGuard::~SlotGuard() {
+  this->batchDecoder.ReleaseSlot();
+}
+
+void BatchDecoder::AcquireSlot() {
+  std::unique_lock<std::mutex> lock(this->mutex);
+  this->slotFree.wait(lock, [this]() { return this->inFlight < this->maxInFlight; });
+  this->inFlight += 1;
+}
+
+void BatchDecoder::ReleaseSlot() {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->inFlight -= 1;
+  }
+  this->slotFree.notify_all();
+}
+
+DecoderContext& BatchDecoder::GetThreadContext(DecoderContext& temporary) {
+  if (!ThreadPool::IsWorkerThread()) {
+    return temporary;
+  }
+  // Keeps this worker's inflate state and scratch buffers, up to the retained size, for every later image.
+  static thread_local DecoderContext context;
+  context.SetLimits(temporary.GetMaxBufferSize(), temporary.GetMaxRetainedSize());
+  return context;
+}
+
+void BatchDecoder::CheckBufferSize(const DecoderContext& context, unsigned long size) {
+  if (size > context.GetMaxBufferSize()) {
+    throw std::length_error("The image needs a buffer of " + std::to_string(size) + " bytes, over the limit of " +
+      std::to_string(context.GetMaxBufferSize()) + " bytes.");
+  }
+}
+
+void BatchDecoder::ResetImage(DecodedImage& image, PIXEL_FORMATS pixelFormat) {
+  image.success = false;
+  image.width = 0;
+  image.height = 0;
+  image.bitDepth = 0;
+  image.colorType = 0;
+  image.pixelFormat = pixelFormat;
+  image.unfilteredData.clear();
+}
+
+void BatchDecoder::DecodeImage(PNG_Decoder& decoder, DecodedImage& image, PIXEL_FORMATS pixelFormat, DecoderContext& context) {
+  BatchDecoder::ResetImage(image, pixelFormat);
+  if (!decoder.IsOpen()) {
+    return;
+  }
+  image.width = decoder.GetWidth();
+  image.height = decoder.GetHeight();
+  image.bitDepth = decoder.GetBitDepth();
+  image.colorType = decoder.GetColorType();
+  unsigned char interlaceMethod = decoder.GetInterlaceMethod();
+
+  /* Headers too large to decode make the sizes throw std::overflow_error, and headers over the context's limit
+  std::length_error, which fail the image like any malformed header before anything is allocated.*/
+  unsigned long decompressedDataSize = 0;
+  unsigned long unfilteredDataSize = 0;
+  try {
+    decompressedDataSize = PNG_Decoder::GetDecompressedDataSize(image.width, image.height, image.bitDepth, image.colorType,
+      interlaceMethod);
+    unfilteredDataSize = PNG_Decoder::GetUnfilteredDataSize(image.width, image.height, image.bitDepth, image.colorType);
+    BatchDecoder::CheckBufferSize(context, std::max(decompressedDataSize, unfilteredDataSize));
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return;
+  }
+  char * decompressedData = context.GetBuffer(SCRATCH_BUFFERS::DECOMPRESSED_BUFFER, decompressedDataSize);
+  if (decoder.DecompressDataInto(decompressedData, decompressedDataSize, &context) == 0) {
+    return;
+  }
+
+  if (pixelFormat == PIXEL_FORMATS::RAW) {
+    image.unfilteredData.resize(unfilteredDataSize);
+    image.success = PNG_Decoder::UnfilterDataInto(decompressedData, image.unfilteredData.data(), image.unfilteredData.size(),
+      image.width, image.height, image.bitDepth, image.colorType, interlaceMethod, nullptr, &context) != 0;
+  } else {
+    try {
+      PixelConverter converter = decoder.GetPixelConverter(pixelFormat);
+      unsigned long outputDataSize = converter.GetOutputDataSize(image.width, image.height);
+      BatchDecoder::CheckBufferSize(context, outputDataSize);
+      image.unfilteredData.resize(outputDataSize);
+      image.success = PNG_Decoder::UnfilterDataInto(decompressedData, image.unfilteredData.data(), image.unfilteredData.size(),
+        image.width, image.height, image.bitDepth, image.colorType, interlaceMethod, &converter, &context) != 0;
+    } catch(const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+    }
+  }
+  if (!image.success) {
+    image.unfilteredData.clear();
+  }
+}
+
+bool BatchDecoder::DecodeTensorImage(PNG_Decoder& decoder, const std::string& name, const TensorWriter& writer, char * image,
+  DecoderContext& context) {
+  if (!decoder.IsOpen()) {
+    return false;
+  }
+  const TensorOptions& options = writer.GetOptions();
+  unsigned int width = decoder.GetWidth();
+  unsigned int height = decoder.GetHeight();
+  if (width != options.width || height != options.height) {
+    std::cerr << name << " is " << width << "x" << height << ", not " << options.width << "x" << options.height << " like the tensor."
+      << std::endl;
+    return false;
+  }
+
+  try {
+    unsigned char bitDepth = decoder.GetBitDepth();
+    unsigned char colorType = decoder.GetColorType();
+    unsigned char interlaceMethod = decoder.GetInterlaceMethod();
+    unsigned long decompressedDataSize = PNG_Decoder::GetDecompressedDataSize(width, height, bitDepth, colorType, interlaceMethod);
+    char * decompressedData = context.GetBuffer(SCRATCH_BUFFERS::DECOMPRESSED_BUFFER, decompressedDataSize);
+    if (decoder.DecompressDataInto(decompressedData, decompressedDataSize, &context) == 0) {
+      return false;
+    }
+
+    PixelConverter converter = decoder.GetPixelConverter(options.format);
+    return PNG_Decoder::UnfilterScanLines(decompressedData, width, height, bitDepth, colorType, interlaceMethod,
+      [&writer, image](const char * scanLine, unsigned int row) { writer.WriteRow(scanLine, row, image); }, &converter, &context) != 0;
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return false;
+  }
+}
+
+unsigned long BatchDecoder::DecodeTensor(size_t numImages,
+  const std::function<void(size_t index, PNG_Decoder& decoder, std::string& name)>& open, const TensorOptions& options, char * tensor,
+  unsigned long tensorCapacity, std::vector<bool> * decoded) {
+  if (decoded != nullptr) {
+    decoded->assign(numImages, false);
+  }
+
+  unsigned long imageSize = 0;
+  try {
+    TensorWriter writer(options);
+    imageSize = writer.GetImageSize();
+    unsigned long tensorSize = writer.GetTensorSize(numImages);
+    if (tensor == nullptr || tensorCapacity < tensorSize) {
+      throw std::invalid_argument("Tensor buffer is too small: " + std::to_string(tensorSize) + " bytes required.");
+    }
+
+    // One byte per image rather than a std::vector<bool>, whose packed bits cannot be set from several threads.
+    std::vector<unsigned char> succeeded(numImages, 0);
+    this->pool.ParallelFor(numImages, [&](unsigned long i) {
+      char * image = tensor + i * imageSize;
+      std::string name;
+      PNG_Decoder decoder;
+      DecoderContext temporary(this->maxBufferSize, this->maxRetainedSize);
+      open(i, decoder, name);
+      DecoderContext& context = BatchDecoder::GetThreadContext(temporary);
+      if (BatchDecoder::DecodeTensorImage(decoder, name, writer, image, context)) {
+        succeeded[i] = 1;
+      } else {
+        std::memset(image, 0, imageSize);
+      }
+      context.Trim();
+    });
+
+    unsigned long numDecoded = 0;
+    for (size_t i = 0; i < numImages; ++i) {
+      if (succeeded[i] != 0) {
+        numDecoded += 1;
+        if (decoded != nullptr) {
+          (*decoded)[i] = true;
+        }
+      }
+    }
+    return numDecoded;
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+}
+
+// Constructors & Deconstructors
+BatchDecoder::BatchDecoder(unsigned int numThreads, unsigned int maxInFlight, PIXEL_FORMATS pixelFormat) : pool(numThreads) {
+  this->pixelFormat = pixelFormat;
+  this->maxInFlight = (maxInFlight == 0) ? 2 * this->pool.GetNumThreads() : maxInFlight;
+  this->inFlight = 0;
+  this->maxBufferSize = DecoderContext::defaultMaxBufferSize;
+  this->maxRetainedSize = DecoderContext::defaultMaxRetainedSize;
+}
+
+// Methods
+unsigned int BatchDecoder::GetNumThreads() const {
+  return this->pool.GetNumThreads();
+}
+
+unsigned int BatchDecoder::GetMaxInFlight() const {
+  return this->maxInFlight;
+}
+
+PIXEL_FORMATS BatchDecoder::GetPixelFormat() const {
+  return this->pixelFormat;
+}
+
+void BatchDecoder::SetBufferLimits(unsigned long maxBufferSize, unsigned long maxRetainedSize) {
+  this->maxBufferSize = maxBufferSize;
+  this->maxRetainedSize = maxRetainedSize;
+}
+
+unsigned long BatchDecoder::GetMaxBufferSize() const {
+  return this->maxBufferSize;
+}
+
+unsigned long BatchDecoder::GetMaxRetainedSize() const {
+  return this->maxRetainedSize;
+}
+
+void BatchDecoder::DecodeFile(DecodedImage& image, PIXEL_FORMATS pixelFormat, DecoderContext& context) {
+  image.stats.Reset();
+  BatchDecoder::ResetImage(image, pixelFormat);
+  try {
+#ifdef PNG_DECODER_STATS
+    DecodeStatsScope statsScope(image.stats);
+#endif
+    PNG_Decoder decoder(image.fileName, LOAD_TYPES::MMAP);
+    BatchDecoder::DecodeImage(decoder, image, pixelFormat, context);
+  } catch(const std::exception& e) {
+    // Running out of memory fails this image only; the task that decodes it must not throw.
+    std::cerr << e.what() << std::endl;
+    BatchDecoder::ResetImage(image, pixelFormat);
+  }
+  context.Trim();
+}
+
+void BatchDecoder::DecodeBuffer(DecodedImage& image, const uint8_t * data, size_t size, PIXEL_FORMATS pixelFormat,
+  DecoderContext& context) {
+  image.stats.Reset();
+  BatchDecoder::ResetImage(image, pixelFormat);
+  try {
+#ifdef PNG_DECODER_STATS
+    DecodeStatsScope statsScope(image.stats);
+#endif
+    PNG_Decoder decoder(data, size);
+    BatchDecoder::DecodeImage(decoder, image, pixelFormat, context);
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    BatchDecoder::ResetImage(image, pixelFormat);
+  }
+  context.Trim();
+}
+
+void BatchDecoder::Decode(const std::vector<std::filesystem::path>& fileNames, const DecodedImageCallback& onDecoded) {
+  size_t remaining = fileNames.size();
+  std::exception_ptr error;
+  std::mutex doneMutex;
+  std::condition_variable done;
+
+  for (size_t i = 0; i < fileNames.size(); ++i) {
+    this->AcquireSlot();
+    this->pool.Submit([&, i]() {
+      std::exception_ptr taskError;
+      try {
+        // Declared before the image, so the image is freed before its slot is released.
+        SlotGuard slot(*this);
+        DecodedImage image;
+        DecoderContext temporary(this->maxBufferSize, this->maxRetainedSize);
+        image.fileName = fileNames[i];
+        image.index = i;
+        BatchDecoder::DecodeFile(image, this->pixelFormat, BatchDecoder::GetThreadContext(temporary));
+        try {
+          onDecoded(image);
+        } catch(const std::exception& e) {
+          std::cerr << e.what() << std::endl;
+        }
+      } catch(...) {
+        taskError = std::current_exception();
+      }
+
+      std::lock_guard<std::mutex> lock(doneMutex);
+      if (taskError != nullptr && error == nullptr) {
+        error = taskError;
+      }
+      remaining -= 1;
+      if (remaining == 0) {
+        done.notify_all();
+      }
+    });
+  }
+
+  std::unique_lock<std::mutex> lock(doneMutex);
+  done.wait(lock, [&remaining]() { return remaining == 0; });
+  if (error != nullptr) {
+    std::rethrow_exception(error);
+  }
+}
+
+std::future<DecodedImage> BatchDecoder::Submit(const std::filesystem::path& fileName) {
+  std::shared_ptr<std::promise<DecodedImage>> promise = std::make_shared<std::promise<DecodedImage>>();
+  std::future<DecodedImage> result = promise->get_future();
+
+  this->AcquireSlot();
+  this->pool.Submit([this, promise, fileName]() {
+    DecodedImage image;
+    try {
+      SlotGuard slot(*this);
+      DecoderContext temporary(this->maxBufferSize, this->maxRetainedSize);
+      image.fileName = fileName;
+      image.index = 0;
+      BatchDecoder::DecodeFile(image, this->pixelFormat, BatchDecoder::GetThreadContext(temporary));
+    } catch(...) {
+      promise->set_exception(std::current_exception());
+      return;
+    }
+    promise->set_value(std::move(image));
+  });
+  return result;
+}
+
+std::future<DecodedImage> BatchDecoder::Submit(const uint8_t * data, size_t size) {
+  std::shared_ptr<std::promise<DecodedImage>> promise = std::make_shared<std::promise<DecodedImage>>();
+  std::future<DecodedImage> result = promise->get_future();
+
+  this->AcquireSlot();
+  this->pool.Submit([this, promise, data, size]() {
+    DecodedImage image;
+    try {
+      SlotGuard slot(*this);
+      DecoderContext temporary(this->maxBufferSize, this->maxRetainedSize);
+      image.index = 0;
+      BatchDecoder::DecodeBuffer(image, data, size, this->pixelFormat, BatchDecoder::GetThreadContext(temporary));
+    } catch(...) {
+      promise->set_exception(std::current_exception());
+      return;
+    }
+    promise->set_value(std::move(image));
+  });
+  return result;
+}
+
+std::vector<ProbedImage> BatchDecoder::Probe(const std::filesystem::path& directory) {
+  std::vector<ProbedImage> images;
+  try {
+    for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(directory)) {
+      if (entry.is_regular_file()) {
+        images.push_back(ProbedImage{entry.path(), false, IHDR()});
+      }
+    }
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return std::vector<ProbedImage>();
+  }
+
+  // Probes are a single small read each, so hand them out in batches to keep task overhead below the I/O cost.
+  const size_t batchSize = 256;
+  this->pool.ParallelFor((images.size() + batchSize - 1) / batchSize, [&images, batchSize](unsigned long batch) {
+    size_t end = std::min(images.size(), (batch + 1) * batchSize);
+    for (size_t i = batch * batchSize; i < end; ++i) {
+      images[i].success = PNG_Decoder::Probe(images[i].fileName, images[i].ihdr);
+    }
+  });
+  return images;
+}
+
+unsigned long BatchDecoder::DecodeTensor(const std::vector<std::filesystem::path>& fileNames, const TensorOptions& options,
+  char * tensor, unsigned long tensorCapacity, std::vector<bool> * decoded) {
+  return this->DecodeTensor(fileNames.size(), [&fileNames](size_t index, PNG_Decoder& decoder, std::string& name) {
+    name = "'" + fileNames[index].string() + "'";
+    decoder.Open(fileNames[index], LOAD_TYPES::MMAP);
+  }, options, tensor, tensorCapacity, decoded);
+}
+
+unsigned long BatchDecoder::DecodeTensor(const std::vector<std::pair<const uint8_t *, size_t>>& buffers, const TensorOptions& options,
+  char * tensor, unsigned long tensorCapacity, std::vector<bool> * decoded) {
+  return this->DecodeTensor(buffers.size(), [&buffers](size_t index, PNG_Decoder& decoder, std::string& name) {
+    name = "Image " + std::to_string(index);
+    decoder.Open(buffers[index].first, buffers[index].second);
+  }, options, tensor, tensorCapacity, decoded);
+}
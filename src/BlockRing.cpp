@@ -0,0 +1,53 @@
+#include "BlockRing.h"
+
+// Constructors & Deconstructors
+BlockRing::BlockRing(unsigned long blockSize, unsigned long numBlocks) : storage(blockSize * numBlocks) {
+  this->blockSize = blockSize;
+  this->numBlocks = numBlocks;
+  this->head = 0;
+  this->tail = 0;
+  this->cancelled = false;
+}
+
+// Methods
+unsigned long BlockRing::GetBlockSize() const {
+  return this->blockSize;
+}
+
+char * BlockRing::AcquireWrite() {
+  unsigned long head = this->head.load(std::memory_order_relaxed);
+  while (head - this->tail.load(std::memory_order_acquire) == this->numBlocks) {
+    if (this->cancelled.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    std::this_thread::yield();
+  }
+  return this->cancelled.load(std::memory_order_acquire) ? nullptr : this->storage.data() + (head % this->numBlocks) * this->blockSize;
+}
+
+void BlockRing::CommitWrite() {
+  this->head.store(this->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+char * BlockRing::AcquireRead() {
+  unsigned long tail = this->tail.load(std::memory_order_relaxed);
+  while (this->head.load(std::memory_order_acquire) == tail) {
+    if (this->cancelled.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    std::this_thread::yield();
+  }
+  return this->cancelled.load(std::memory_order_acquire) ? nullptr : this->storage.data() + (tail % this->numBlocks) * this->blockSize;
+}
+
+void BlockRing::CommitRead() {
+  this->tail.store(this->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void BlockRing::Cancel() {
+  this->cancelled.store(true, std::memory_order_release);
+}
+
+bool BlockRing::IsCancelled() const {
+  return this->cancelled.load(std::memory_order_acquire);
+}
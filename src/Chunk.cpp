@@ -55,3 +55,10 @@ unsigned int Chunk::GetCrc() const {
 bool Chunk::IsAncillary() const {
   return this->ancillary;
 }
+
+bool Chunk::IsCrcValid() const {
+  if (this->chunk == nullptr) {
+    return false;
+  }
+  return Crc::Crc32(this->chunk + 4, static_cast<size_t>(this->dataLength) + 4) == this->crc;
+}
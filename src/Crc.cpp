@@ -0,0 +1,143 @@
+#include "Crc.h"
+
+#ifdef PNG_DECODER_X86
+#include <immintrin.h>
+#endif
+
+unsigned int Crc::tables[8][256];
+bool Crc::tablesLoaded = Crc::LoadTables();
+bool Crc::pclmulSupported = Crc::LoadPclmulSupported();
+
+// Private
+bool Crc::LoadTables() {
+  for (unsigned int i = 0; i < 256; ++i) {
+    unsigned int crc = i;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : (crc >> 1);
+    }
+    Crc::tables[0][i] = crc;
+  }
+  // tables[k][i] is the CRC of byte i followed by k zero bytes.
+  for (unsigned int i = 0; i < 256; ++i) {
+    for (int k = 1; k < 8; ++k) {
+      unsigned int prior = Crc::tables[k - 1][i];
+      Crc::tables[k][i] = (prior >> 8) ^ Crc::tables[0][prior & 0xFF];
+    }
+  }
+  return true;
+}
+
+unsigned int Crc::SlicingUpdate(unsigned int state, const unsigned char * data, size_t length) {
+  while (length >= 8) {
+    unsigned int one = (data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<unsigned int>(data[3]) << 24)) ^ state;
+    unsigned int two = data[4] | (data[5] << 8) | (data[6] << 16) | (static_cast<unsigned int>(data[7]) << 24);
+    state = Crc::tables[7][one & 0xFF] ^ Crc::tables[6][(one >> 8) & 0xFF] ^ Crc::tables[5][(one >> 16) & 0xFF] ^ Crc::tables[4][one >> 24]
+      ^ Crc::tables[3][two & 0xFF] ^ Crc::tables[2][(two >> 8) & 0xFF] ^ Crc::tables[1][(two >> 16) & 0xFF] ^ Crc::tables[0][two >> 24];
+    data += 8;
+    length -= 8;
+  }
+  while (length > 0) {
+    state = Crc::tables[0][(state ^ *data) & 0xFF] ^ (state >> 8);
+    ++data;
+    --length;
+  }
+  return state;
+}
+
+#ifdef PNG_DECODER_X86
+/* Folds 64 bytes per iteration with carry-less multiplication, then reduces to 32 bits with a Barrett
+reduction, following Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+length must be at least 64 and a multiple of 16.*/
+__attribute__((target("pclmul,sse4.1")))
+static unsigned int PclmulUpdate(unsigned int state, const unsigned char * data, size_t length) {
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+  __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x00));
+  __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x10));
+  __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x20));
+  __m128i x4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(state)));
+  data += 64;
+  length -= 64;
+
+  // Fold four 128 bit lanes in parallel.
+  while (length >= 64) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x30)));
+    data += 64;
+    length -= 64;
+  }
+
+  // Fold the four lanes into one, then fold in any remaining 16 byte blocks.
+  __m128i lanes[3] = {x2, x3, x4};
+  for (const __m128i& lane : lanes) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, lane), x5);
+  }
+  while (length >= 16) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128(reinterpret_cast<const __m128i *>(data))), x5);
+    data += 16;
+    length -= 16;
+  }
+
+  // Fold 128 bits to 64 bits.
+  __m128i x2Fold = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2Fold);
+  __m128i high = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, low32);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), high);
+
+  // Barrett reduction to 32 bits.
+  __m128i reduced = _mm_and_si128(x1, low32);
+  reduced = _mm_clmulepi64_si128(reduced, poly, 0x10);
+  reduced = _mm_and_si128(reduced, low32);
+  reduced = _mm_clmulepi64_si128(reduced, poly, 0x00);
+  x1 = _mm_xor_si128(x1, reduced);
+  return static_cast<unsigned int>(_mm_extract_epi32(x1, 1));
+}
+#endif
+
+// Public
+bool Crc::LoadPclmulSupported() {
+#ifdef PNG_DECODER_X86
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#else
+  return false;
+#endif
+}
+
+unsigned int Crc::Crc32(const char * data, size_t length, unsigned int crc) {
+  const unsigned char * bytes = reinterpret_cast<const unsigned char *>(data);
+  unsigned int state = ~crc;
+#ifdef PNG_DECODER_X86
+  if (Crc::pclmulSupported && length >= 64) {
+    size_t folded = length & ~static_cast<size_t>(15);
+    state = PclmulUpdate(state, bytes, folded);
+    bytes += folded;
+    length -= folded;
+  }
+#endif
+  return ~Crc::SlicingUpdate(state, bytes, length);
+}
+
+unsigned int Crc::SlicingCrc32(const char * data, size_t length, unsigned int crc) {
+  return ~Crc::SlicingUpdate(~crc, reinterpret_cast<const unsigned char *>(data), length);
+}
@@ -0,0 +1,115 @@
+#include "DecodeStats.h"
+
+thread_local DecodeStats * DecodeStats::current = nullptr;
+std::atomic<DecodeStatsHook> DecodeStats::hook(nullptr);
+DecodeCounters DecodeStats::counters = {};
+
+// DecodeStats
+DecodeStats::DecodeStats() {
+  this->Reset();
+}
+
+void DecodeStats::Reset() {
+  for (unsigned int i = 0; i < DECODE_STAGE_COUNT; ++i) {
+    this->stageNanoseconds[i] = 0;
+  }
+  this->totalNanoseconds = 0;
+  this->bytesAllocated = 0;
+  this->reallocCount = 0;
+  for (unsigned int i = 0; i < 5; ++i) {
+    this->filterTypeRows[i] = 0;
+  }
+  this->compressedBytes = 0;
+  this->decompressedBytes = 0;
+}
+
+void DecodeStats::Add(const DecodeStats& other) {
+  for (unsigned int i = 0; i < DECODE_STAGE_COUNT; ++i) {
+    this->stageNanoseconds[i] += other.stageNanoseconds[i];
+  }
+  this->bytesAllocated += other.bytesAllocated;
+  this->reallocCount += other.reallocCount;
+  for (unsigned int i = 0; i < 5; ++i) {
+    this->filterTypeRows[i] += other.filterTypeRows[i];
+  }
+  this->compressedBytes += other.compressedBytes;
+  this->decompressedBytes += other.decompressedBytes;
+}
+
+double DecodeStats::GetCompressionRatio() const {
+  if (this->compressedBytes == 0) {
+    return 0;
+  }
+  return static_cast<double>(this->decompressedBytes) / static_cast<double>(this->compressedBytes);
+}
+
+void DecodeStats::RecordAllocation(unsigned long bytes, bool reallocated) {
+  DecodeStats * stats = DecodeStats::current;
+  if (stats != nullptr) {
+    stats->bytesAllocated += bytes;
+    stats->reallocCount += reallocated ? 1 : 0;
+  }
+}
+
+void DecodeStats::RecordStream(unsigned long compressedBytes, unsigned long decompressedBytes) {
+  DecodeStats * stats = DecodeStats::current;
+  if (stats != nullptr) {
+    stats->compressedBytes += compressedBytes;
+    stats->decompressedBytes += decompressedBytes;
+  }
+}
+
+unsigned int DecodeStats::GetLatencyBucket(unsigned long long nanoseconds) {
+  unsigned int bucket = 0;
+  while (nanoseconds > 1 && bucket + 1 < LATENCY_BUCKETS) {
+    nanoseconds >>= 1;
+    bucket += 1;
+  }
+  return bucket;
+}
+
+// DecodeStatsScope
+DecodeStatsScope::DecodeStatsScope(DecodeStats& stats) : stats(stats) {
+  this->previous = nullptr;
+#ifdef PNG_DECODER_STATS
+  this->previous = DecodeStats::current;
+  DecodeStats::current = &stats;
+  this->start = std::chrono::steady_clock::now();
+#endif
+}
+
+DecodeStatsScope::~DecodeStatsScope() {
+#ifdef PNG_DECODER_STATS
+  DecodeStats::current = this->previous;
+  this->stats.totalNanoseconds += static_cast<unsigned long long>(
+    std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - this->start).count());
+
+  // Relaxed adds: the counters are independent totals, read by exporters without ordering.
+  DecodeCounters& counters = DecodeStats::counters;
+  counters.decodes.fetch_add(1, std::memory_order_relaxed);
+  counters.compressedBytes.fetch_add(this->stats.compressedBytes, std::memory_order_relaxed);
+  counters.decompressedBytes.fetch_add(this->stats.decompressedBytes, std::memory_order_relaxed);
+  counters.bytesAllocated.fetch_add(this->stats.bytesAllocated, std::memory_order_relaxed);
+  for (unsigned int i = 0; i < 5; ++i) {
+    counters.filterTypeRows[i].fetch_add(this->stats.filterTypeRows[i], std::memory_order_relaxed);
+  }
+  for (unsigned int i = 0; i < DECODE_STAGE_COUNT; ++i) {
+    if (this->stats.stageNanoseconds[i] > 0) {
+      counters.stageNanoseconds[i].fetch_add(this->stats.stageNanoseconds[i], std::memory_order_relaxed);
+      counters.latencyHistogram[i][DecodeStats::GetLatencyBucket(this->stats.stageNanoseconds[i])].fetch_add(1,
+        std::memory_order_relaxed);
+    }
+  }
+  counters.latencyHistogram[DECODE_STAGE_COUNT][DecodeStats::GetLatencyBucket(this->stats.totalNanoseconds)].fetch_add(1,
+    std::memory_order_relaxed);
+
+  DecodeStatsHook statsHook = DecodeStats::hook.load(std::memory_order_acquire);
+  if (statsHook != nullptr) {
+    try {
+      statsHook(this->stats);
+    } catch(const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+    }
+  }
+#endif
+}
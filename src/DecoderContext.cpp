@@ -0,0 +1,120 @@
+#include "DecoderContext.h"
+
+// Private
+void * DecoderContext::ZAlloc(void * opaque, unsigned int items, unsigned int size) {
+  static_cast<DecoderContext *>(opaque)->allocations += 1;
+  return std::calloc(items, size);
+}
+
+void DecoderContext::ZFree(void *, void * address) {
+  std::free(address);
+}
+
+// Constructors & Deconstructors
+DecoderContext::DecoderContext(unsigned long maxBufferSize, unsigned long maxRetainedSize) {
+  this->streamOpen = false;
+  this->dynamicTables = nullptr;
+  for (unsigned int i = 0; i < SCRATCH_BUFFER_COUNT; ++i) {
+    this->buffers[i].capacity = 0;
+  }
+  this->allocations = 0;
+  this->maxBufferSize = maxBufferSize;
+  this->maxRetainedSize = maxRetainedSize;
+}
+
+DecoderContext::~DecoderContext() {
+  this->Release();
+}
+
+// Methods
+z_stream * DecoderContext::ResetStream(char * compressed, unsigned int availableIn, char * decompressed, unsigned int availableOut) {
+  if (this->streamOpen) {
+    if (inflateReset(&this->stream) != Z_OK) {
+      throw std::runtime_error("InflateReset failed.");
+    }
+  } else {
+    this->stream.zalloc = DecoderContext::ZAlloc;
+    this->stream.zfree = DecoderContext::ZFree;
+    this->stream.opaque = this;
+    this->stream.next_in = Z_NULL;
+    this->stream.avail_in = 0;
+    if (inflateInit(&this->stream) != Z_OK) {
+      std::string msg = (this->stream.msg != nullptr) ? this->stream.msg : "";
+      throw std::runtime_error("InflateInit failed: " + msg);
+    }
+    this->streamOpen = true;
+  }
+  this->stream.next_in = reinterpret_cast<Bytef *>(compressed);
+  this->stream.avail_in = availableIn;
+  this->stream.next_out = reinterpret_cast<Bytef *>(decompressed);
+  this->stream.avail_out = availableOut;
+  return &this->stream;
+}
+
+DecodeTables * DecoderContext::GetDecodeTables() {
+  if (this->dynamicTables == nullptr) {
+    this->dynamicTables = Deflate::AllocateDecodeTables();
+    this->allocations += 1;
+  }
+  return this->dynamicTables;
+}
+
+char * DecoderContext::GetBuffer(SCRATCH_BUFFERS buffer, unsigned long size) {
+  Buffer& scratch = this->buffers[buffer];
+  if (scratch.capacity < size) {
+    if (size > this->maxBufferSize) {
+      throw std::length_error("A scratch buffer of " + std::to_string(size) + " bytes is over the decoder context's limit of " +
+        std::to_string(this->maxBufferSize) + " bytes.");
+    }
+    // Drop the old buffer first so growing never holds both.
+    scratch.data.reset();
+    scratch.capacity = 0;
+    scratch.data.reset(new char[size]);
+    scratch.capacity = size;
+    this->allocations += 1;
+  }
+  return scratch.data.get();
+}
+
+unsigned long DecoderContext::GetBufferCapacity(SCRATCH_BUFFERS buffer) const {
+  return this->buffers[buffer].capacity;
+}
+
+void DecoderContext::SetLimits(unsigned long maxBufferSize, unsigned long maxRetainedSize) {
+  this->maxBufferSize = maxBufferSize;
+  this->maxRetainedSize = maxRetainedSize;
+}
+
+unsigned long DecoderContext::GetMaxBufferSize() const {
+  return this->maxBufferSize;
+}
+
+unsigned long DecoderContext::GetMaxRetainedSize() const {
+  return this->maxRetainedSize;
+}
+
+void DecoderContext::Trim() {
+  for (unsigned int i = 0; i < SCRATCH_BUFFER_COUNT; ++i) {
+    if (this->buffers[i].capacity > this->maxRetainedSize) {
+      this->buffers[i].data.reset();
+      this->buffers[i].capacity = 0;
+    }
+  }
+}
+
+unsigned long DecoderContext::GetAllocationCount() const {
+  return this->allocations;
+}
+
+void DecoderContext::Release() {
+  if (this->streamOpen) {
+    inflateEnd(&this->stream);
+    this->streamOpen = false;
+  }
+  Deflate::FreeDecodeTables(this->dynamicTables);
+  this->dynamicTables = nullptr;
+  for (unsigned int i = 0; i < SCRATCH_BUFFER_COUNT; ++i) {
+    this->buffers[i].data.reset();
+    this->buffers[i].capacity = 0;
+  }
+}
@@ -0,0 +1,519 @@
+#include "Deflate.h"
+
+/* Table entries pack everything the decode loop needs into 32 bits:
+  bits 0 - 4:   bits of the code (for a subtable, the bits of the primary table)
+  bits 5 - 7:   entry kind
+  bits 8 - 12:  extra bits of a length or distance, or the index bits of a subtable
+  bits 16 - 31: literal bytes, length or distance base, or subtable offset*/
+enum ENTRY_KINDS {
+  LITERAL,
+  LITERAL_PAIR,
+  LENGTH, // Also used for distances in the distance table
+  END_OF_BLOCK,
+  SUBTABLE,
+  INVALID
+};
+
+static const unsigned int maxCodeLength = 15;
+static const unsigned int litLenTableBits = 11;
+static const unsigned int distanceTableBits = 8;
+static const unsigned int precodeTableBits = 7;
+static const unsigned int numLitLenSymbols = 288;
+static const unsigned int numDistanceSymbols = 32;
+static const unsigned int numPrecodeSymbols = 19;
+
+static const unsigned short lengthBases[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115,
+  131, 163, 195, 227, 258};
+static const unsigned char lengthExtraBits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned short distanceBases[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025,
+  1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const unsigned char distanceExtraBits[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12,
+  12, 13, 13};
+static const unsigned char precodeOrder[numPrecodeSymbols] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+// Every code longer than its primary table gets a subtable of at most 2^(15 - tableBits) entries.
+struct DecodeTables {
+  uint32_t litLen[(1 << litLenTableBits) + numLitLenSymbols * (1 << (maxCodeLength - litLenTableBits))];
+  uint32_t distance[(1 << distanceTableBits) + numDistanceSymbols * (1 << (maxCodeLength - distanceTableBits))];
+  uint32_t precode[1 << precodeTableBits];
+};
+
+/* Reads the stream LSB first through a 64-bit buffer. Bits above count may hold the next input bytes from a
+whole-word refill; the next refill ORs the same bytes back into the same place, so they never need clearing.
+Past the end of the input, zero bytes are fed and counted in overread.*/
+struct BitReader {
+  const unsigned char * in;
+  const unsigned char * inEnd;
+  const Chunk * chunk;
+  const Chunk * end;
+  uint64_t bits;
+  unsigned int count;
+  unsigned int overread;
+};
+
+static inline uint32_t MakeEntry(unsigned int kind, unsigned int extraBits, unsigned int value) {
+  return (kind << 5) | (extraBits << 8) | (value << 16);
+}
+
+static inline unsigned int GetCodeBits(uint32_t entry) {
+  return entry & 31;
+}
+
+static inline unsigned int GetKind(uint32_t entry) {
+  return (entry >> 5) & 7;
+}
+
+static inline unsigned int GetExtraBits(uint32_t entry) {
+  return (entry >> 8) & 31;
+}
+
+static inline unsigned int GetValue(uint32_t entry) {
+  return entry >> 16;
+}
+
+static void ThrowTruncated() {
+  throw std::runtime_error("Inflate failed: the compressed data stream is truncated.");
+}
+
+// Moves on to the next IDAT chunk once the current input is used up.
+static inline bool NextInput(BitReader& reader) {
+  while (reader.in == reader.inEnd && reader.chunk != reader.end) {
+    if (reader.chunk->GetChunkType() == ChunkType::IDAT) {
+      reader.in = reinterpret_cast<const unsigned char *>(reader.chunk->GetChunkData());
+      reader.inEnd = reader.in + reader.chunk->GetDataLength();
+    }
+    ++reader.chunk;
+  }
+  return reader.in != reader.inEnd;
+}
+
+static void RefillSlow(BitReader& reader) {
+  while (reader.count <= 56) {
+    uint64_t byte = 0;
+    if (NextInput(reader)) {
+      byte = *reader.in++;
+    } else if (++reader.overread > 8) {
+      ThrowTruncated();
+    }
+    reader.bits |= byte << reader.count;
+    reader.count += 8;
+  }
+}
+
+// Leaves at least 56 bits in the buffer: enough for a length, a distance and their extra bits.
+static inline void Refill(BitReader& reader) {
+  if (reader.inEnd - reader.in >= 8) {
+    uint64_t word;
+    std::memcpy(&word, reader.in, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    reader.bits |= word << reader.count;
+    reader.in += (63 - reader.count) >> 3;
+    reader.count |= 56;
+  } else {
+    RefillSlow(reader);
+  }
+}
+
+static inline unsigned int PeekBits(const BitReader& reader, unsigned int numBits) {
+  return static_cast<unsigned int>(reader.bits & ((uint64_t(1) << numBits) - 1));
+}
+
+static inline void DropBits(BitReader& reader, unsigned int numBits) {
+  reader.bits >>= numBits;
+  reader.count -= numBits;
+}
+
+static inline unsigned int ReadBits(BitReader& reader, unsigned int numBits) {
+  unsigned int value = PeekBits(reader, numBits);
+  DropBits(reader, numBits);
+  return value;
+}
+
+/* Builds the lookup table of a canonical Huffman code from its code lengths. Codes longer than tableBits go in
+subtables after the primary table. symbolEntries gives each symbol's entry without its code bits. Returns false
+for over-subscribed lengths, and for incomplete ones unless they hold a single code, which DEFLATE allows.*/
+static bool BuildTable(const unsigned char * lengths, unsigned int numSymbols, const uint32_t * symbolEntries, unsigned int tableBits,
+  bool allowSingleCode, uint32_t * table) {
+  unsigned int counts[maxCodeLength + 1] = {0};
+  for (unsigned int i = 0; i < numSymbols; ++i) {
+    counts[lengths[i]] += 1;
+  }
+  counts[0] = 0;
+
+  int left = 1;
+  unsigned int maxLength = 0;
+  for (unsigned int length = 1; length <= maxCodeLength; ++length) {
+    left = (left << 1) - static_cast<int>(counts[length]);
+    if (left < 0) {
+      return false;
+    }
+    maxLength = (counts[length] > 0) ? length : maxLength;
+  }
+  if (left > 0 && maxLength > 0 && !(allowSingleCode && maxLength == 1)) {
+    return false;
+  }
+
+  unsigned int nextCodes[maxCodeLength + 2] = {0};
+  for (unsigned int length = 1; length <= maxCodeLength; ++length) {
+    nextCodes[length + 1] = (nextCodes[length] + counts[length]) << 1;
+  }
+
+  unsigned int tableSize = 1u << tableBits;
+  unsigned int subtableBits = (maxLength > tableBits) ? maxLength - tableBits : 0;
+  unsigned int subtableEnd = tableSize;
+  uint32_t invalid = MakeEntry(ENTRY_KINDS::INVALID, 0, 0) | tableBits;
+  for (unsigned int i = 0; i < tableSize; ++i) {
+    table[i] = invalid;
+  }
+
+  for (unsigned int symbol = 0; symbol < numSymbols; ++symbol) {
+    unsigned int length = lengths[symbol];
+    if (length == 0) {
+      continue;
+    }
+    // Codes are stored MSB first, but the stream is read LSB first, so tables are indexed by the reversed code.
+    unsigned int code = nextCodes[length]++;
+    unsigned int reversed = 0;
+    for (unsigned int bit = 0; bit < length; ++bit) {
+      reversed = (reversed << 1) | ((code >> bit) & 1);
+    }
+
+    if (length <= tableBits) {
+      for (unsigned int i = reversed; i < tableSize; i += 1u << length) {
+        table[i] = symbolEntries[symbol] | length;
+      }
+      continue;
+    }
+    unsigned int prefix = reversed & (tableSize - 1);
+    if (GetKind(table[prefix]) != ENTRY_KINDS::SUBTABLE) {
+      table[prefix] = MakeEntry(ENTRY_KINDS::SUBTABLE, subtableBits, subtableEnd) | tableBits;
+      for (unsigned int i = 0; i < (1u << subtableBits); ++i) {
+        table[subtableEnd + i] = invalid;
+      }
+      subtableEnd += 1u << subtableBits;
+    }
+    unsigned int offset = GetValue(table[prefix]);
+    for (unsigned int i = reversed >> tableBits; i < (1u << subtableBits); i += 1u << (length - tableBits)) {
+      table[offset + i] = symbolEntries[symbol] | (length - tableBits);
+    }
+  }
+  return true;
+}
+
+/* Where a literal's code leaves room in the primary table for the code after it, and that code is also a literal,
+the entry decodes both. Entries are visited from the top, so the entry for the remaining bits is still a single.*/
+static void PairLiterals(uint32_t * table) {
+  for (unsigned int i = (1u << litLenTableBits); i-- > 0;) {
+    uint32_t first = table[i];
+    unsigned int firstBits = GetCodeBits(first);
+    if (GetKind(first) != ENTRY_KINDS::LITERAL || firstBits >= litLenTableBits) {
+      continue;
+    }
+    uint32_t second = table[i >> firstBits];
+    unsigned int secondBits = GetCodeBits(second);
+    if (GetKind(second) == ENTRY_KINDS::LITERAL && firstBits + secondBits <= litLenTableBits) {
+      table[i] = MakeEntry(ENTRY_KINDS::LITERAL_PAIR, 0, GetValue(first) | (GetValue(second) << 8)) | (firstBits + secondBits);
+    }
+  }
+}
+
+// The entry of every literal/length and distance symbol, before its code bits are known.
+struct SymbolEntries {
+  uint32_t litLen[numLitLenSymbols];
+  uint32_t distance[numDistanceSymbols];
+};
+
+static const SymbolEntries& GetSymbolEntries() {
+  static const SymbolEntries symbolEntries = [] {
+    SymbolEntries entries;
+    for (unsigned int i = 0; i < numLitLenSymbols; ++i) {
+      if (i < 256) {
+        entries.litLen[i] = MakeEntry(ENTRY_KINDS::LITERAL, 0, i);
+      } else if (i == 256) {
+        entries.litLen[i] = MakeEntry(ENTRY_KINDS::END_OF_BLOCK, 0, 0);
+      } else if (i < 286) {
+        entries.litLen[i] = MakeEntry(ENTRY_KINDS::LENGTH, lengthExtraBits[i - 257], lengthBases[i - 257]);
+      } else {
+        entries.litLen[i] = MakeEntry(ENTRY_KINDS::INVALID, 0, 0);
+      }
+    }
+    for (unsigned int i = 0; i < numDistanceSymbols; ++i) {
+      entries.distance[i] = (i < 30) ? MakeEntry(ENTRY_KINDS::LENGTH, distanceExtraBits[i], distanceBases[i]) :
+        MakeEntry(ENTRY_KINDS::INVALID, 0, 0);
+    }
+    return entries;
+  }();
+  return symbolEntries;
+}
+
+// The fixed Huffman codes of block type 1 never change, so their tables are built once.
+static const DecodeTables& GetFixedTables() {
+  static const std::unique_ptr<DecodeTables> fixedTables = [] {
+    std::unique_ptr<DecodeTables> tables(new DecodeTables);
+    unsigned char lengths[numLitLenSymbols];
+    for (unsigned int i = 0; i < numLitLenSymbols; ++i) {
+      lengths[i] = (i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ? 7 : 8;
+    }
+    BuildTable(lengths, numLitLenSymbols, GetSymbolEntries().litLen, litLenTableBits, false, tables->litLen);
+    PairLiterals(tables->litLen);
+    std::memset(lengths, 5, numDistanceSymbols);
+    BuildTable(lengths, numDistanceSymbols, GetSymbolEntries().distance, distanceTableBits, false, tables->distance);
+    return tables;
+  }();
+  return *fixedTables;
+}
+
+static void ReadDynamicTables(BitReader& reader, DecodeTables& tables) {
+  Refill(reader);
+  unsigned int numLitLenCodes = ReadBits(reader, 5) + 257;
+  unsigned int numDistanceCodes = ReadBits(reader, 5) + 1;
+  unsigned int numPrecodeCodes = ReadBits(reader, 4) + 4;
+  if (numLitLenCodes > 286 || numDistanceCodes > 30) {
+    throw std::runtime_error("Inflate failed: too many length or distance symbols.");
+  }
+
+  unsigned char precodeLengths[numPrecodeSymbols] = {0};
+  for (unsigned int i = 0; i < numPrecodeCodes; ++i) {
+    Refill(reader);
+    precodeLengths[precodeOrder[i]] = static_cast<unsigned char>(ReadBits(reader, 3));
+  }
+  uint32_t precodeEntries[numPrecodeSymbols];
+  for (unsigned int i = 0; i < numPrecodeSymbols; ++i) {
+    precodeEntries[i] = MakeEntry(ENTRY_KINDS::LITERAL, 0, i);
+  }
+  if (!BuildTable(precodeLengths, numPrecodeSymbols, precodeEntries, precodeTableBits, false, tables.precode)) {
+    throw std::runtime_error("Inflate failed: invalid code lengths set.");
+  }
+
+  // Literal/length and distance code lengths form one sequence, so a repeat may cross from one into the other.
+  unsigned char lengths[numLitLenSymbols + numDistanceSymbols] = {0};
+  unsigned int numLengths = numLitLenCodes + numDistanceCodes;
+  for (unsigned int i = 0; i < numLengths;) {
+    Refill(reader);
+    uint32_t entry = tables.precode[PeekBits(reader, precodeTableBits)];
+    if (GetKind(entry) == ENTRY_KINDS::INVALID) {
+      throw std::runtime_error("Inflate failed: invalid code lengths set.");
+    }
+    DropBits(reader, GetCodeBits(entry));
+    unsigned int symbol = GetValue(entry);
+    if (symbol < 16) {
+      lengths[i++] = static_cast<unsigned char>(symbol);
+      continue;
+    }
+
+    unsigned char value = 0;
+    unsigned int repeat = 0;
+    if (symbol == 16) {
+      if (i == 0) {
+        throw std::runtime_error("Inflate failed: invalid bit length repeat.");
+      }
+      value = lengths[i - 1];
+      repeat = 3 + ReadBits(reader, 2);
+    } else if (symbol == 17) {
+      repeat = 3 + ReadBits(reader, 3);
+    } else {
+      repeat = 11 + ReadBits(reader, 7);
+    }
+    if (i + repeat > numLengths) {
+      throw std::runtime_error("Inflate failed: invalid bit length repeat.");
+    }
+    std::memset(lengths + i, value, repeat);
+    i += repeat;
+  }
+
+  unsigned char litLenLengths[numLitLenSymbols] = {0};
+  unsigned char distanceLengths[numDistanceSymbols] = {0};
+  std::memcpy(litLenLengths, lengths, numLitLenCodes);
+  std::memcpy(distanceLengths, lengths + numLitLenCodes, numDistanceCodes);
+  if (litLenLengths[256] == 0) {
+    throw std::runtime_error("Inflate failed: invalid code -- missing end-of-block.");
+  }
+  if (!BuildTable(litLenLengths, numLitLenSymbols, GetSymbolEntries().litLen, litLenTableBits, true, tables.litLen)) {
+    throw std::runtime_error("Inflate failed: invalid literal/lengths set.");
+  }
+  PairLiterals(tables.litLen);
+  if (!BuildTable(distanceLengths, numDistanceSymbols, GetSymbolEntries().distance, distanceTableBits, true, tables.distance)) {
+    throw std::runtime_error("Inflate failed: invalid distances set.");
+  }
+}
+
+static inline uint32_t DecodeEntry(BitReader& reader, const uint32_t * table, unsigned int tableBits) {
+  uint32_t entry = table[PeekBits(reader, tableBits)];
+  if (GetKind(entry) == ENTRY_KINDS::SUBTABLE) {
+    DropBits(reader, tableBits);
+    entry = table[GetValue(entry) + PeekBits(reader, GetExtraBits(entry))];
+  }
+  DropBits(reader, GetCodeBits(entry));
+  return entry;
+}
+
+// Decodes one Huffman block. Returns true once the output is full.
+static bool InflateBlock(BitReader& reader, const DecodeTables& tables, unsigned char * outStart, unsigned char *& out,
+  unsigned char * outEnd) {
+  while (true) {
+    Refill(reader);
+    uint32_t entry = DecodeEntry(reader, tables.litLen, litLenTableBits);
+    unsigned int kind = GetKind(entry);
+    if (kind == ENTRY_KINDS::LITERAL) {
+      *out++ = static_cast<unsigned char>(GetValue(entry));
+      if (out == outEnd) {
+        return true;
+      }
+      continue;
+    } else if (kind == ENTRY_KINDS::LITERAL_PAIR) {
+      *out++ = static_cast<unsigned char>(GetValue(entry));
+      if (out == outEnd) {
+        return true;
+      }
+      *out++ = static_cast<unsigned char>(GetValue(entry) >> 8);
+      if (out == outEnd) {
+        return true;
+      }
+      continue;
+    } else if (kind == ENTRY_KINDS::END_OF_BLOCK) {
+      return false;
+    } else if (kind != ENTRY_KINDS::LENGTH) {
+      throw std::runtime_error("Inflate failed: invalid literal/length code.");
+    }
+
+    unsigned long length = GetValue(entry) + ReadBits(reader, GetExtraBits(entry));
+    entry = DecodeEntry(reader, tables.distance, distanceTableBits);
+    if (GetKind(entry) != ENTRY_KINDS::LENGTH) {
+      throw std::runtime_error("Inflate failed: invalid distance code.");
+    }
+    unsigned long distance = GetValue(entry) + ReadBits(reader, GetExtraBits(entry));
+    if (distance > static_cast<unsigned long>(out - outStart)) {
+      throw std::runtime_error("Inflate failed: invalid distance too far back.");
+    }
+
+    unsigned long remaining = static_cast<unsigned long>(outEnd - out);
+    const unsigned char * source = out - distance;
+    if (distance >= 8 && remaining >= length + 8) {
+      // Every 8-byte copy reads bytes that are already written, and may spill up to 7 bytes past the match.
+      unsigned char * stop = out + length;
+      do {
+        std::memcpy(out, source, 8);
+        out += 8;
+        source += 8;
+      } while (out < stop);
+      out = stop;
+      continue;
+    }
+    length = std::min(length, remaining);
+    if (distance == 1) {
+      std::memset(out, *source, length);
+      out += length;
+    } else {
+      for (unsigned long i = 0; i < length; ++i) {
+        *out++ = *source++;
+      }
+    }
+    if (out == outEnd) {
+      return true;
+    }
+  }
+}
+
+// Copies a stored block. Returns true once the output is full.
+static bool CopyStoredBlock(BitReader& reader, unsigned char *& out, unsigned char * outEnd) {
+  DropBits(reader, reader.count & 7);
+  Refill(reader);
+  unsigned int length = ReadBits(reader, 16);
+  unsigned int complement = ReadBits(reader, 16);
+  if (length != (~complement & 0xFFFF)) {
+    throw std::runtime_error("Inflate failed: invalid stored block lengths.");
+  }
+
+  // Whole bytes left in the bit buffer come first, then the rest is copied straight from the input.
+  while (length > 0 && reader.count >= 8 && out != outEnd) {
+    *out++ = static_cast<unsigned char>(ReadBits(reader, 8));
+    length -= 1;
+  }
+  if (length > 0 && out != outEnd) {
+    // The bit buffer is empty, and the bytes a whole-word refill left above it are about to be copied past.
+    reader.bits = 0;
+    while (length > 0 && out != outEnd) {
+      if (!NextInput(reader)) {
+        ThrowTruncated();
+      }
+      unsigned long size = std::min<unsigned long>({length, static_cast<unsigned long>(reader.inEnd - reader.in),
+        static_cast<unsigned long>(outEnd - out)});
+      std::memcpy(out, reader.in, size);
+      out += size;
+      reader.in += size;
+      length -= static_cast<unsigned int>(size);
+    }
+  }
+  return out == outEnd;
+}
+
+// Methods
+void Deflate::InflateInto(const char * compressed, unsigned long compressedSize, const Chunk * chunk, const Chunk * end,
+  char * decompressed, unsigned long decompressedSize, DecodeTables * dynamicTables) {
+  if (decompressedSize == 0) {
+    return;
+  }
+  BitReader reader;
+  reader.in = reinterpret_cast<const unsigned char *>(compressed);
+  reader.inEnd = reader.in + ((compressed == nullptr) ? 0 : compressedSize);
+  reader.chunk = chunk;
+  reader.end = end;
+  reader.bits = 0;
+  reader.count = 0;
+  reader.overread = 0;
+
+  Refill(reader);
+  unsigned int method = ReadBits(reader, 8);
+  unsigned int flags = ReadBits(reader, 8);
+  if ((method & 0x0F) != 8 || (method >> 4) > 7) {
+    throw std::runtime_error("Inflate failed: unknown compression method.");
+  } else if (((method << 8) | flags) % 31 != 0) {
+    throw std::runtime_error("Inflate failed: incorrect header check.");
+  } else if (flags & 0x20) {
+    throw std::runtime_error("Inflate failed: a preset dictionary is not supported.");
+  }
+
+  unsigned char * outStart = reinterpret_cast<unsigned char *>(decompressed);
+  unsigned char * out = outStart;
+  unsigned char * outEnd = outStart + decompressedSize;
+  std::unique_ptr<DecodeTables> ownedTables;
+  bool full = false;
+  bool finalBlock = false;
+  while (!full) {
+    if (finalBlock) {
+      throw std::runtime_error("Inflate failed: the compressed data stream ended early.");
+    }
+    Refill(reader);
+    finalBlock = ReadBits(reader, 1) == 1;
+    unsigned int blockType = ReadBits(reader, 2);
+    if (blockType == 0) {
+      full = CopyStoredBlock(reader, out, outEnd);
+    } else if (blockType == 1) {
+      full = InflateBlock(reader, GetFixedTables(), outStart, out, outEnd);
+    } else if (blockType == 2) {
+      if (dynamicTables == nullptr) {
+        ownedTables.reset(new DecodeTables);
+        dynamicTables = ownedTables.get();
+      }
+      ReadDynamicTables(reader, *dynamicTables);
+      full = InflateBlock(reader, *dynamicTables, outStart, out, outEnd);
+    } else {
+      throw std::runtime_error("Inflate failed: invalid block type.");
+    }
+  }
+
+  // Zero bytes fed past the end of the input must still be unread.
+  if (reader.count < 8 * reader.overread) {
+    ThrowTruncated();
+  }
+}
+
+DecodeTables * Deflate::AllocateDecodeTables() {
+  return new DecodeTables;
+}
+
+void Deflate::FreeDecodeTables(DecodeTables * tables) {
+  delete tables;
+}
@@ -0,0 +1,190 @@
+#include "Downscaler.h"
+
+/* Positions are measured in units of 1 / (width * outputWidth) of a row: input column x covers
+[x * outputWidth, (x + 1) * outputWidth) and output column c covers [c * width, (c + 1) * width). Every
+output pixel then covers width * height units of area, and every overlap is a whole number of units.*/
+
+static inline unsigned int ReadSample(const unsigned char * scanLine, unsigned long index, unsigned char bitDepth, bool bigEndian) {
+  if (bitDepth == 16 && bigEndian) {
+    return (static_cast<unsigned int>(scanLine[2 * index]) << 8) | scanLine[2 * index + 1];
+  } else if (bitDepth == 16) {
+    uint16_t sample;
+    std::memcpy(&sample, scanLine + 2 * index, 2);
+    return sample;
+  }
+  unsigned long bit = index * bitDepth;
+  return (scanLine[bit / 8] >> (8 - bitDepth - bit % 8)) & ((1u << bitDepth) - 1);
+}
+
+// 8-bit samples with the channel count known at compile time, the common case for thumbnails.
+template <unsigned int channels>
+static void SumColumns(const unsigned char * input, unsigned int width, unsigned int outputWidth, const unsigned int * outputColumns,
+  const unsigned int * firstWeights, uint64_t * sums) {
+  for (unsigned int x = 0; x < width; ++x) {
+    uint64_t * columnSums = sums + static_cast<unsigned long>(outputColumns[x]) * channels;
+    const unsigned char * pixel = input + static_cast<unsigned long>(x) * channels;
+    unsigned int firstWeight = firstWeights[x];
+    if (firstWeight == outputWidth) {
+      for (unsigned int c = 0; c < channels; ++c) {
+        columnSums[c] += static_cast<uint64_t>(pixel[c]) * firstWeight;
+      }
+    } else {
+      for (unsigned int c = 0; c < channels; ++c) {
+        columnSums[c] += static_cast<uint64_t>(pixel[c]) * firstWeight;
+        columnSums[c + channels] += static_cast<uint64_t>(pixel[c]) * (outputWidth - firstWeight);
+      }
+    }
+  }
+}
+
+// Private
+void Downscaler::SumScanLine(const char * scanLine) {
+  const unsigned char * input = reinterpret_cast<const unsigned char *>(scanLine);
+  std::fill(this->rowSums.begin(), this->rowSums.end(), 0);
+  uint64_t * sums = this->rowSums.data();
+  const unsigned int * outputColumns = this->outputColumns.data();
+  const unsigned int * firstWeights = this->firstWeights.data();
+  unsigned int channels = this->channels;
+  if (this->bitDepth == 8) {
+    if (channels == 1) {
+      SumColumns<1>(input, this->width, this->outputWidth, outputColumns, firstWeights, sums);
+    } else if (channels == 2) {
+      SumColumns<2>(input, this->width, this->outputWidth, outputColumns, firstWeights, sums);
+    } else if (channels == 3) {
+      SumColumns<3>(input, this->width, this->outputWidth, outputColumns, firstWeights, sums);
+    } else {
+      SumColumns<4>(input, this->width, this->outputWidth, outputColumns, firstWeights, sums);
+    }
+    return;
+  }
+
+  for (unsigned int x = 0; x < this->width; ++x) {
+    uint64_t * columnSums = sums + static_cast<unsigned long>(outputColumns[x]) * channels;
+    unsigned int firstWeight = firstWeights[x];
+    unsigned int secondWeight = this->outputWidth - firstWeight;
+    for (unsigned int c = 0; c < channels; ++c) {
+      unsigned int sample = ReadSample(input, static_cast<unsigned long>(x) * channels + c, this->bitDepth, this->bigEndian);
+      columnSums[c] += static_cast<uint64_t>(sample) * firstWeight;
+      if (secondWeight != 0) {
+        columnSums[c + channels] += static_cast<uint64_t>(sample) * secondWeight;
+      }
+    }
+  }
+}
+
+void Downscaler::WriteRow(const uint64_t * sums, char * output) const {
+  unsigned char * row = reinterpret_cast<unsigned char *>(output);
+  uint64_t area = static_cast<uint64_t>(this->width) * this->height;
+  unsigned long numSamples = static_cast<unsigned long>(this->outputWidth) * this->channels;
+  if (this->bitDepth < 8) {
+    std::memset(row, 0, this->GetOutputScanLineWidth());
+  }
+  for (unsigned long i = 0; i < numSamples; ++i) {
+    unsigned int sample = static_cast<unsigned int>((sums[i] + area / 2) / area);
+    if (this->bitDepth == 8) {
+      row[i] = static_cast<unsigned char>(sample);
+    } else if (this->bitDepth == 16) {
+      if (this->bigEndian) {
+        row[2 * i] = static_cast<unsigned char>(sample >> 8);
+        row[2 * i + 1] = static_cast<unsigned char>(sample);
+      } else {
+        uint16_t hostSample = static_cast<uint16_t>(sample);
+        std::memcpy(row + 2 * i, &hostSample, 2);
+      }
+    } else {
+      unsigned long bit = i * this->bitDepth;
+      row[bit / 8] |= static_cast<unsigned char>(sample << (8 - this->bitDepth - bit % 8));
+    }
+  }
+}
+
+// Constructors & Deconstructors
+Downscaler::Downscaler(unsigned int width, unsigned int height, unsigned int outputWidth, unsigned int outputHeight, unsigned char bitDepth,
+  unsigned int channels, bool bigEndian) {
+  if (outputWidth == 0 || outputHeight == 0 || outputWidth > width || outputHeight > height) {
+    throw std::invalid_argument("Cannot downscale a " + std::to_string(width) + "x" + std::to_string(height) + " image to " +
+      std::to_string(outputWidth) + "x" + std::to_string(outputHeight) + ".");
+  }
+  if ((bitDepth != 1 && bitDepth != 2 && bitDepth != 4 && bitDepth != 8 && bitDepth != 16) || channels == 0 || channels > 4) {
+    throw std::invalid_argument("Downscaling needs 1 - 4 channels of 1, 2, 4, 8 or 16 bit samples.");
+  }
+  // Sums reach the largest sample times the area of an output pixel in units.
+  if (static_cast<uint64_t>(width) * height > (UINT64_MAX >> 17)) {
+    throw std::invalid_argument("The image is too large to downscale.");
+  }
+  this->width = width;
+  this->height = height;
+  this->outputWidth = outputWidth;
+  this->outputHeight = outputHeight;
+  this->bitDepth = bitDepth;
+  this->channels = channels;
+  this->bigEndian = bigEndian;
+  this->rowsAdded = 0;
+  this->currentRow = 0;
+
+  this->outputColumns.resize(width);
+  this->firstWeights.resize(width);
+  for (unsigned int x = 0; x < width; ++x) {
+    uint64_t start = static_cast<uint64_t>(x) * outputWidth;
+    unsigned int column = static_cast<unsigned int>(start / width);
+    uint64_t boundary = static_cast<uint64_t>(column + 1) * width;
+    this->outputColumns[x] = column;
+    this->firstWeights[x] = static_cast<unsigned int>(std::min<uint64_t>(start + outputWidth, boundary) - start);
+  }
+  this->rowSums.resize(static_cast<size_t>(outputWidth) * channels);
+  this->accumulators.resize(2 * static_cast<size_t>(outputWidth) * channels);
+  this->currentSlot = 0;
+}
+
+// Methods
+unsigned int Downscaler::GetOutputWidth() const {
+  return this->outputWidth;
+}
+
+unsigned int Downscaler::GetOutputHeight() const {
+  return this->outputHeight;
+}
+
+unsigned long Downscaler::GetOutputScanLineWidth() const {
+  return (static_cast<unsigned long>(this->outputWidth) * this->channels * this->bitDepth + 7) / 8;
+}
+
+unsigned long Downscaler::GetOutputDataSize() const {
+  return this->GetOutputScanLineWidth() * this->outputHeight;
+}
+
+unsigned int Downscaler::GetRowsAdded() const {
+  return this->rowsAdded;
+}
+
+void Downscaler::AddScanLine(const char * scanLine, char * output) {
+  if (this->rowsAdded == this->height) {
+    throw std::runtime_error("Every scan line of the image was already added to the downscaler.");
+  }
+  this->SumScanLine(scanLine);
+
+  // Rows are measured like columns: input row y covers [y * outputHeight, (y + 1) * outputHeight).
+  uint64_t start = static_cast<uint64_t>(this->rowsAdded) * this->outputHeight;
+  uint64_t end = start + this->outputHeight;
+  uint64_t boundary = static_cast<uint64_t>(this->currentRow + 1) * this->height;
+  uint64_t firstWeight = std::min(end, boundary) - start;
+  size_t numSamples = this->rowSums.size();
+  uint64_t * currentSums = this->accumulators.data() + this->currentSlot * numSamples;
+  uint64_t * nextSums = this->accumulators.data() + (1 - this->currentSlot) * numSamples;
+  for (size_t i = 0; i < numSamples; ++i) {
+    currentSums[i] += this->rowSums[i] * firstWeight;
+  }
+  if (end > boundary) {
+    for (size_t i = 0; i < numSamples; ++i) {
+      nextSums[i] += this->rowSums[i] * (end - boundary);
+    }
+  }
+  this->rowsAdded += 1;
+
+  if (end >= boundary) {
+    this->WriteRow(currentSums, output + static_cast<unsigned long>(this->currentRow) * this->GetOutputScanLineWidth());
+    std::fill(currentSums, currentSums + numSamples, 0);
+    this->currentSlot = 1 - this->currentSlot;
+    this->currentRow += 1;
+  }
+}
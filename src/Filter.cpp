@@ -0,0 +1,589 @@
+#include "Filter.h"
+
+#ifdef PNG_DECODER_X86
+#include <immintrin.h>
+#endif
+
+SIMD_TYPES Filter::systemType = Filter::LoadSimdType();
+
+// Generic filter removal
+void Filter::RemoveSubFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp) {
+  for (unsigned int i = 0; i < scanLineWidth; ++i) {
+    unsigned int prior = (bpp > i) ? 0 : static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(buffer + (i - bpp)));
+    unsigned int sub = static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(scanLine + i));
+    unsigned int raw = (sub + prior) % 256;
+    buffer[i] = static_cast<char>(raw);
+  }
+}
+
+void Filter::RemoveUpFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * priorScanLine) {
+  for (unsigned int i = 0; i < scanLineWidth; ++i) {
+    unsigned int prior = (priorScanLine == nullptr) ? 0 : static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(priorScanLine + i));
+    unsigned int up = static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(scanLine + i));
+    unsigned int raw = (up + prior) % 256;
+    buffer[i] = static_cast<char>(raw);
+  }
+}
+
+void Filter::RemoveAverageFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp, char * priorScanLine) {
+  for (unsigned int i = 0; i < scanLineWidth; ++i) {
+    unsigned int priorSub = (bpp > i) ? 0 : static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(buffer + (i - bpp)));
+    unsigned int priorUp = (priorScanLine == nullptr) ? 0 : static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(priorScanLine + i));
+    unsigned int average = static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(scanLine + i));
+    unsigned int raw = (average + ((priorSub + priorUp) / 2)) % 256;
+    buffer[i] = static_cast<char>(raw);
+  }
+}
+
+void Filter::RemovePaethFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp, char * priorScanLine) {
+  for (unsigned int i = 0; i < scanLineWidth; ++i) {
+    int priorSub = (bpp > i) ? 0 : static_cast<int>(*reinterpret_cast<unsigned char *>(buffer + (i - bpp)));
+    int priorUp = (priorScanLine == nullptr) ? 0 : static_cast<int>(*reinterpret_cast<unsigned char *>(priorScanLine + i));
+    int priorUpSub = (bpp > i || priorScanLine == nullptr) ? 0 : static_cast<int>(*reinterpret_cast<unsigned char *>(priorScanLine + (i - bpp)));
+    unsigned int paeth = static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(scanLine + i));
+    unsigned int raw = (paeth + Filter::PaethPredictor(priorSub, priorUp, priorUpSub)) % 256;
+    buffer[i] = static_cast<char>(raw);
+  }
+}
+
+// Generic filters for encoding
+void Filter::ApplySubFilter(const char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp) {
+  const unsigned char * raw = reinterpret_cast<const unsigned char *>(scanLine);
+  unsigned int first = std::min(bpp, scanLineWidth);
+  std::memcpy(buffer, scanLine, first);
+  for (unsigned int i = first; i < scanLineWidth; ++i) {
+    buffer[i] = static_cast<char>(raw[i] - raw[i - bpp]);
+  }
+}
+
+void Filter::ApplyUpFilter(const char * scanLine, unsigned int scanLineWidth, char * buffer, const char * priorScanLine) {
+  if (priorScanLine == nullptr) {
+    std::memcpy(buffer, scanLine, scanLineWidth);
+    return;
+  }
+  const unsigned char * raw = reinterpret_cast<const unsigned char *>(scanLine);
+  const unsigned char * prior = reinterpret_cast<const unsigned char *>(priorScanLine);
+  for (unsigned int i = 0; i < scanLineWidth; ++i) {
+    buffer[i] = static_cast<char>(raw[i] - prior[i]);
+  }
+}
+
+void Filter::ApplyAverageFilter(const char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp,
+  const char * priorScanLine) {
+  const unsigned char * raw = reinterpret_cast<const unsigned char *>(scanLine);
+  const unsigned char * prior = reinterpret_cast<const unsigned char *>(priorScanLine);
+  unsigned int first = std::min(bpp, scanLineWidth);
+  if (prior == nullptr) {
+    std::memcpy(buffer, scanLine, first);
+    for (unsigned int i = first; i < scanLineWidth; ++i) {
+      buffer[i] = static_cast<char>(raw[i] - (raw[i - bpp] >> 1));
+    }
+    return;
+  }
+  for (unsigned int i = 0; i < first; ++i) {
+    buffer[i] = static_cast<char>(raw[i] - (prior[i] >> 1));
+  }
+  for (unsigned int i = first; i < scanLineWidth; ++i) {
+    buffer[i] = static_cast<char>(raw[i] - ((raw[i - bpp] + prior[i]) >> 1));
+  }
+}
+
+void Filter::ApplyPaethFilter(const char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp,
+  const char * priorScanLine) {
+  // With no prior scan line Paeth always predicts the left pixel, which is Sub.
+  if (priorScanLine == nullptr) {
+    Filter::ApplySubFilter(scanLine, scanLineWidth, buffer, bpp);
+    return;
+  }
+  const unsigned char * raw = reinterpret_cast<const unsigned char *>(scanLine);
+  const unsigned char * prior = reinterpret_cast<const unsigned char *>(priorScanLine);
+  unsigned int first = std::min(bpp, scanLineWidth);
+  for (unsigned int i = 0; i < first; ++i) {
+    buffer[i] = static_cast<char>(raw[i] - prior[i]);
+  }
+  for (unsigned int i = first; i < scanLineWidth; ++i) {
+    buffer[i] = static_cast<char>(raw[i] - Filter::PaethPredictor(raw[i - bpp], prior[i], prior[i - bpp]));
+  }
+}
+
+
+/* Specialized scalar filters. bpp is a compile time constant and the first scan line has its own variants,
+so the inner loops carry no per-byte branches and the compiler can unroll them. The first bpp bytes of a
+scan line have no left neighbor and are handled before the main loop.*/
+static inline unsigned char PaethPredict(int a, int b, int c) {
+  int pa = std::abs(b - c);
+  int pb = std::abs(a - c);
+  int pc = std::abs(a + b - 2 * c);
+  int nearest = (pb <= pc) ? b : c;
+  return static_cast<unsigned char>((pa <= pb && pa <= pc) ? a : nearest);
+}
+
+static void ScalarRemoveNoneFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * /* priorScanLine */) {
+  if (scanLine != buffer) {
+    std::memmove(buffer, scanLine, scanLineWidth);
+  }
+}
+
+template <unsigned int bpp>
+static void ScalarRemoveSubFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * /* priorScanLine */) {
+  const unsigned char * in = reinterpret_cast<const unsigned char *>(scanLine);
+  unsigned char * out = reinterpret_cast<unsigned char *>(buffer);
+  unsigned int i = 0;
+  for (; i < bpp && i < scanLineWidth; ++i) {
+    out[i] = in[i];
+  }
+  for (; i < scanLineWidth; ++i) {
+    out[i] = static_cast<unsigned char>(in[i] + out[i - bpp]);
+  }
+}
+
+static void ScalarRemoveUpFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * priorScanLine) {
+  const unsigned char * in = reinterpret_cast<const unsigned char *>(scanLine);
+  const unsigned char * up = reinterpret_cast<const unsigned char *>(priorScanLine);
+  unsigned char * out = reinterpret_cast<unsigned char *>(buffer);
+  for (unsigned int i = 0; i < scanLineWidth; ++i) {
+    out[i] = static_cast<unsigned char>(in[i] + up[i]);
+  }
+}
+
+template <unsigned int bpp>
+static void ScalarRemoveFirstAverageFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * /* priorScanLine */) {
+  const unsigned char * in = reinterpret_cast<const unsigned char *>(scanLine);
+  unsigned char * out = reinterpret_cast<unsigned char *>(buffer);
+  unsigned int i = 0;
+  for (; i < bpp && i < scanLineWidth; ++i) {
+    out[i] = in[i];
+  }
+  for (; i < scanLineWidth; ++i) {
+    out[i] = static_cast<unsigned char>(in[i] + (out[i - bpp] >> 1));
+  }
+}
+
+template <unsigned int bpp>
+static void ScalarRemoveAverageFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * priorScanLine) {
+  const unsigned char * in = reinterpret_cast<const unsigned char *>(scanLine);
+  const unsigned char * up = reinterpret_cast<const unsigned char *>(priorScanLine);
+  unsigned char * out = reinterpret_cast<unsigned char *>(buffer);
+  unsigned int i = 0;
+  for (; i < bpp && i < scanLineWidth; ++i) {
+    out[i] = static_cast<unsigned char>(in[i] + (up[i] >> 1));
+  }
+  for (; i < scanLineWidth; ++i) {
+    out[i] = static_cast<unsigned char>(in[i] + ((out[i - bpp] + up[i]) >> 1));
+  }
+}
+
+template <unsigned int bpp>
+static void ScalarRemovePaethFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * priorScanLine) {
+  const unsigned char * in = reinterpret_cast<const unsigned char *>(scanLine);
+  const unsigned char * up = reinterpret_cast<const unsigned char *>(priorScanLine);
+  unsigned char * out = reinterpret_cast<unsigned char *>(buffer);
+  unsigned int i = 0;
+  for (; i < bpp && i < scanLineWidth; ++i) {
+    out[i] = static_cast<unsigned char>(in[i] + up[i]);
+  }
+  for (; i < scanLineWidth; ++i) {
+    out[i] = static_cast<unsigned char>(in[i] + PaethPredict(out[i - bpp], up[i], up[i - bpp]));
+  }
+}
+
+#ifdef PNG_DECODER_X86
+// Vector kernels. Each one decodes as many whole vectors or pixels as it can, then finishes the
+// remaining bytes of the scan line with a scalar loop.
+
+// Pixels are loaded as 4 or 8 bytes, so callers must leave PixelLoadWidth<bpp>() readable bytes at pixel.
+template <unsigned int bpp>
+static constexpr unsigned int PixelLoadWidth() {
+  return (bpp <= 4) ? 4 : 8;
+}
+
+template <unsigned int bpp>
+__attribute__((target("sse2")))
+static inline __m128i LoadPixel(const char * pixel) {
+  if (bpp <= 4) {
+    int value;
+    std::memcpy(&value, pixel, 4);
+    return _mm_cvtsi32_si128(value);
+  }
+  return _mm_loadl_epi64(reinterpret_cast<const __m128i *>(pixel));
+}
+
+// Stores exactly bpp bytes, so the filtered bytes after pixel are intact when decoding in place.
+template <unsigned int bpp>
+__attribute__((target("sse2")))
+static inline void StorePixel(char * pixel, __m128i value) {
+  if (bpp == 8) {
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(pixel), value);
+    return;
+  }
+  int low = _mm_cvtsi128_si32(value);
+  std::memcpy(pixel, &low, (bpp < 4) ? bpp : 4);
+  if (bpp == 6) {
+    short high = static_cast<short>(_mm_extract_epi16(value, 2));
+    std::memcpy(pixel + 4, &high, 2);
+  }
+}
+
+__attribute__((target("sse2")))
+static void Sse2RemoveUpFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * priorScanLine) {
+  unsigned int i = 0;
+  for (; i + 16 <= scanLineWidth; i += 16) {
+    __m128i up = _mm_loadu_si128(reinterpret_cast<const __m128i *>(scanLine + i));
+    __m128i prior = _mm_loadu_si128(reinterpret_cast<const __m128i *>(priorScanLine + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(buffer + i), _mm_add_epi8(up, prior));
+  }
+  for (; i < scanLineWidth; ++i) {
+    buffer[i] = static_cast<char>(static_cast<unsigned char>(scanLine[i]) + static_cast<unsigned char>(priorScanLine[i]));
+  }
+}
+
+__attribute__((target("avx2")))
+static void Avx2RemoveUpFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * priorScanLine) {
+  unsigned int i = 0;
+  for (; i + 32 <= scanLineWidth; i += 32) {
+    __m256i up = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(scanLine + i));
+    __m256i prior = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(priorScanLine + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(buffer + i), _mm256_add_epi8(up, prior));
+  }
+  Sse2RemoveUpFilter(scanLine + i, scanLineWidth - i, buffer + i, priorScanLine + i);
+}
+
+/* Sub is a running sum of pixels along the scan line. Each 16 byte load is summed with log-step shifts,
+then the last decoded pixel of the previous vector is added to every lane. bpp 3 and 6 use 12 of the 16
+bytes so that every vector holds whole pixels.*/
+template <unsigned int bpp>
+__attribute__((target("sse2")))
+static void Sse2RemoveSubFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * /* priorScanLine */) {
+  const unsigned int step = (bpp == 3 || bpp == 6) ? 12 : 16;
+  const __m128i pixelMask = (bpp == 3) ? _mm_set_epi32(0, 0, 0, 0x00FFFFFF) : _mm_set_epi32(0, 0, 0x0000FFFF, -1);
+  __m128i carry = _mm_setzero_si128();
+
+  unsigned int i = 0;
+  for (; i + 16 <= scanLineWidth; i += step) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(scanLine + i));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, bpp));
+    if (bpp == 3 || bpp == 4) {
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 2 * bpp));
+    }
+    x = _mm_add_epi8(x, carry);
+
+    if (step == 16) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(buffer + i), x);
+      carry = (bpp == 4) ? _mm_shuffle_epi32(x, 0xFF) : _mm_shuffle_epi32(x, 0xEE);
+    } else {
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(buffer + i), x);
+      int high = _mm_cvtsi128_si32(_mm_srli_si128(x, 8));
+      std::memcpy(buffer + i + 8, &high, 4);
+
+      __m128i last = _mm_srli_si128(x, 12 - bpp);
+      last = _mm_and_si128(last, pixelMask);
+      if (bpp == 3) {
+        last = _mm_or_si128(last, _mm_slli_si128(last, 3));
+      }
+      carry = _mm_or_si128(last, _mm_slli_si128(last, 6));
+    }
+  }
+  for (; i < scanLineWidth; ++i) {
+    unsigned char prior = (bpp > i) ? 0 : static_cast<unsigned char>(buffer[i - bpp]);
+    buffer[i] = static_cast<char>(static_cast<unsigned char>(scanLine[i]) + prior);
+  }
+}
+
+// Average decodes one pixel per iteration: floor((a + b) / 2) is pavgb rounded down.
+template <unsigned int bpp>
+__attribute__((target("sse2")))
+static void Sse2RemoveAverageFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * priorScanLine) {
+  const __m128i ones = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+
+  unsigned int i = 0;
+  for (; i + PixelLoadWidth<bpp>() <= scanLineWidth; i += bpp) {
+    __m128i b = LoadPixel<bpp>(priorScanLine + i);
+    __m128i x = LoadPixel<bpp>(scanLine + i);
+    __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));
+    a = _mm_add_epi8(x, average);
+    StorePixel<bpp>(buffer + i, a);
+  }
+  for (; i < scanLineWidth; ++i) {
+    unsigned int priorSub = (bpp > i) ? 0 : static_cast<unsigned char>(buffer[i - bpp]);
+    unsigned int priorUp = static_cast<unsigned char>(priorScanLine[i]);
+    buffer[i] = static_cast<char>(static_cast<unsigned char>(scanLine[i]) + ((priorSub + priorUp) / 2));
+  }
+}
+
+/* Paeth decodes one pixel per iteration in 16 bit lanes. With p = a + b - c the three distances are
+|b - c|, |a - c| and |(b - c) + (a - c)|; ties resolve to a, then b, as in PaethPredictor.*/
+template <unsigned int bpp>
+__attribute__((target("ssse3")))
+static void Ssse3RemovePaethFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * priorScanLine) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero;
+  __m128i c = zero;
+
+  unsigned int i = 0;
+  for (; i + PixelLoadWidth<bpp>() <= scanLineWidth; i += bpp) {
+    __m128i b = _mm_unpacklo_epi8(LoadPixel<bpp>(priorScanLine + i), zero);
+    __m128i x = LoadPixel<bpp>(scanLine + i);
+
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+    pa = _mm_abs_epi16(pa);
+    pb = _mm_abs_epi16(pb);
+
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i useA = _mm_cmpeq_epi16(smallest, pa);
+    __m128i useB = _mm_andnot_si128(useA, _mm_cmpeq_epi16(smallest, pb));
+    __m128i useC = _mm_andnot_si128(_mm_or_si128(useA, useB), _mm_set1_epi16(-1));
+    __m128i nearest = _mm_or_si128(_mm_or_si128(_mm_and_si128(useA, a), _mm_and_si128(useB, b)), _mm_and_si128(useC, c));
+
+    x = _mm_add_epi8(x, _mm_packus_epi16(nearest, nearest));
+    StorePixel<bpp>(buffer + i, x);
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+  for (; i < scanLineWidth; ++i) {
+    int priorSub = (bpp > i) ? 0 : static_cast<unsigned char>(buffer[i - bpp]);
+    int priorUpSub = (bpp > i) ? 0 : static_cast<unsigned char>(priorScanLine[i - bpp]);
+    buffer[i] = static_cast<char>(static_cast<unsigned char>(scanLine[i]) + PaethPredict(priorSub,
+      static_cast<unsigned char>(priorScanLine[i]), priorUpSub));
+  }
+}
+
+/* Filters for encoding read only unfiltered bytes, so they need no running state: every vector is one unaligned
+load of the bytes bpp to the left and above. The first bpp bytes and the tail of the scan line are predicted one at a time.*/
+static inline unsigned char PredictByte(unsigned char filterType, const unsigned char * raw, const unsigned char * prior, unsigned int i,
+  unsigned int bpp) {
+  unsigned int left = (i >= bpp) ? raw[i - bpp] : 0;
+  unsigned int up = (prior == nullptr) ? 0 : prior[i];
+  unsigned int upLeft = (prior == nullptr || i < bpp) ? 0 : prior[i - bpp];
+  if (filterType == 1) {
+    return static_cast<unsigned char>(left);
+  } else if (filterType == 2) {
+    return static_cast<unsigned char>(up);
+  } else if (filterType == 3) {
+    return static_cast<unsigned char>((left + up) >> 1);
+  }
+  return static_cast<unsigned char>(Filter::PaethPredictor(left, up, upLeft));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i Sse2Select(__m128i mask, __m128i a, __m128i b) {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// The Paeth predictions for eight bytes widened to 16 bits.
+__attribute__((target("sse2")))
+static inline __m128i Sse2PaethPredict(__m128i a, __m128i b, __m128i c) {
+  __m128i bc = _mm_sub_epi16(b, c);
+  __m128i ac = _mm_sub_epi16(a, c);
+  __m128i sum = _mm_add_epi16(bc, ac);
+  __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(_mm_setzero_si128(), bc));
+  __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(_mm_setzero_si128(), ac));
+  __m128i pc = _mm_max_epi16(sum, _mm_sub_epi16(_mm_setzero_si128(), sum));
+  __m128i notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+  return Sse2Select(notA, Sse2Select(_mm_cmpgt_epi16(pb, pc), c, b), a);
+}
+
+__attribute__((target("sse2")))
+static void Sse2FilterScanLine(unsigned char filterType, const char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp,
+  const char * priorScanLine) {
+  const unsigned char * raw = reinterpret_cast<const unsigned char *>(scanLine);
+  const unsigned char * prior = reinterpret_cast<const unsigned char *>(priorScanLine);
+  const __m128i zero = _mm_setzero_si128();
+  unsigned int i = 0;
+  for (; i < bpp && i < scanLineWidth; ++i) {
+    buffer[i] = static_cast<char>(raw[i] - PredictByte(filterType, raw, prior, i, bpp));
+  }
+  for (; i + 16 <= scanLineWidth; i += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(scanLine + i));
+    __m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i *>(scanLine + i - bpp));
+    __m128i prediction = left;
+    if (filterType == 2) {
+      prediction = _mm_loadu_si128(reinterpret_cast<const __m128i *>(priorScanLine + i));
+    } else if (filterType == 3) {
+      // _mm_avg_epu8 rounds up; the filter rounds down.
+      __m128i up = _mm_loadu_si128(reinterpret_cast<const __m128i *>(priorScanLine + i));
+      prediction = _mm_sub_epi8(_mm_avg_epu8(left, up), _mm_and_si128(_mm_xor_si128(left, up), _mm_set1_epi8(1)));
+    } else if (filterType == 4) {
+      __m128i up = _mm_loadu_si128(reinterpret_cast<const __m128i *>(priorScanLine + i));
+      __m128i upLeft = _mm_loadu_si128(reinterpret_cast<const __m128i *>(priorScanLine + i - bpp));
+      __m128i low = Sse2PaethPredict(_mm_unpacklo_epi8(left, zero), _mm_unpacklo_epi8(up, zero), _mm_unpacklo_epi8(upLeft, zero));
+      __m128i high = Sse2PaethPredict(_mm_unpackhi_epi8(left, zero), _mm_unpackhi_epi8(up, zero), _mm_unpackhi_epi8(upLeft, zero));
+      prediction = _mm_packus_epi16(low, high);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(buffer + i), _mm_sub_epi8(bytes, prediction));
+  }
+  for (; i < scanLineWidth; ++i) {
+    buffer[i] = static_cast<char>(raw[i] - PredictByte(filterType, raw, prior, i, bpp));
+  }
+}
+
+// Filter cost. A byte's magnitude as signed is the smaller of itself and its negation as unsigned.
+__attribute__((target("sse2")))
+static unsigned long Sse2SumAbsoluteValues(const char * scanLine, unsigned int scanLineWidth) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sums = _mm_setzero_si128();
+  unsigned int i = 0;
+  for (; i + 16 <= scanLineWidth; i += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(scanLine + i));
+    __m128i magnitudes = _mm_min_epu8(bytes, _mm_sub_epi8(zero, bytes));
+    sums = _mm_add_epi64(sums, _mm_sad_epu8(magnitudes, zero));
+  }
+  unsigned long sum = static_cast<unsigned long>(_mm_cvtsi128_si64(sums)) +
+    static_cast<unsigned long>(_mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums)));
+  for (; i < scanLineWidth; ++i) {
+    unsigned char byte = static_cast<unsigned char>(scanLine[i]);
+    sum += std::min<unsigned int>(byte, 256 - byte);
+  }
+  return sum;
+}
+
+__attribute__((target("avx2")))
+static unsigned long Avx2SumAbsoluteValues(const char * scanLine, unsigned int scanLineWidth) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i sums = _mm256_setzero_si256();
+  unsigned int i = 0;
+  for (; i + 32 <= scanLineWidth; i += 32) {
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(scanLine + i));
+    __m256i magnitudes = _mm256_min_epu8(bytes, _mm256_sub_epi8(zero, bytes));
+    sums = _mm256_add_epi64(sums, _mm256_sad_epu8(magnitudes, zero));
+  }
+  unsigned long lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), sums);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + Sse2SumAbsoluteValues(scanLine + i, scanLineWidth - i);
+}
+
+#endif
+
+template <unsigned int bpp>
+static ScanLineFilters LoadScanLineFilters(SIMD_TYPES simdType) {
+  // With no prior scan line, Up is None and Paeth always predicts the left pixel, which is Sub.
+  ScanLineFilters filters = {
+    {ScalarRemoveNoneFilter, ScalarRemoveSubFilter<bpp>, ScalarRemoveNoneFilter, ScalarRemoveFirstAverageFilter<bpp>, ScalarRemoveSubFilter<bpp>},
+    {ScalarRemoveNoneFilter, ScalarRemoveSubFilter<bpp>, ScalarRemoveUpFilter, ScalarRemoveAverageFilter<bpp>, ScalarRemovePaethFilter<bpp>}
+  };
+
+#ifdef PNG_DECODER_X86
+  const bool wholePixels = (bpp == 3 || bpp == 4 || bpp == 6 || bpp == 8);
+  if (simdType >= SIMD_TYPES::SSE2) {
+    filters.scanLine[2] = Sse2RemoveUpFilter;
+    if (wholePixels) {
+      filters.firstScanLine[1] = filters.firstScanLine[4] = filters.scanLine[1] = Sse2RemoveSubFilter<bpp>;
+      filters.scanLine[3] = Sse2RemoveAverageFilter<bpp>;
+    }
+  }
+  if (simdType >= SIMD_TYPES::SSSE3 && wholePixels) {
+    filters.scanLine[4] = Ssse3RemovePaethFilter<bpp>;
+  }
+  if (simdType >= SIMD_TYPES::AVX2) {
+    filters.scanLine[2] = Avx2RemoveUpFilter;
+  }
+#endif
+  return filters;
+}
+
+
+// Public
+SIMD_TYPES Filter::LoadSimdType() {
+#ifdef PNG_DECODER_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return SIMD_TYPES::AVX2;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    return SIMD_TYPES::SSSE3;
+  } else if (__builtin_cpu_supports("sse2")) {
+    return SIMD_TYPES::SSE2;
+  }
+#endif
+  return SIMD_TYPES::SCALAR;
+}
+
+ScanLineFilters Filter::GetScanLineFilters(unsigned int bpp, SIMD_TYPES simdType) {
+  switch (bpp) {
+    case 1: return LoadScanLineFilters<1>(simdType);
+    case 2: return LoadScanLineFilters<2>(simdType);
+    case 3: return LoadScanLineFilters<3>(simdType);
+    case 4: return LoadScanLineFilters<4>(simdType);
+    case 6: return LoadScanLineFilters<6>(simdType);
+    case 8: return LoadScanLineFilters<8>(simdType);
+    default: throw std::invalid_argument("Invalid bytes per pixel: " + std::to_string(bpp) + ".");
+  }
+}
+
+void Filter::UnfilterScanLine(const ScanLineFilters& filters, unsigned char filterType, char * scanLine, unsigned int scanLineWidth,
+  char * buffer, char * priorScanLine) {
+  if (filterType > 4) {
+    throw std::invalid_argument("Invalid filter type.");
+  }
+  if (priorScanLine == nullptr) {
+    filters.firstScanLine[filterType](scanLine, scanLineWidth, buffer, priorScanLine);
+  } else {
+    filters.scanLine[filterType](scanLine, scanLineWidth, buffer, priorScanLine);
+  }
+}
+
+void Filter::FilterScanLine(unsigned char filterType, const char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp,
+  const char * priorScanLine, SIMD_TYPES simdType) {
+#ifdef PNG_DECODER_X86
+  // Without a prior scan line Up is None, and Average and Paeth read zeros above; the generic filters cover those.
+  if (simdType >= SIMD_TYPES::SSE2 && (filterType == 1 || (priorScanLine != nullptr && filterType >= 2 && filterType <= 4))) {
+    Sse2FilterScanLine(filterType, scanLine, scanLineWidth, buffer, bpp, priorScanLine);
+    return;
+  }
+#endif
+  switch (filterType) {
+    case 0: std::memcpy(buffer, scanLine, scanLineWidth); break;
+    case 1: Filter::ApplySubFilter(scanLine, scanLineWidth, buffer, bpp); break;
+    case 2: Filter::ApplyUpFilter(scanLine, scanLineWidth, buffer, priorScanLine); break;
+    case 3: Filter::ApplyAverageFilter(scanLine, scanLineWidth, buffer, bpp, priorScanLine); break;
+    case 4: Filter::ApplyPaethFilter(scanLine, scanLineWidth, buffer, bpp, priorScanLine); break;
+    default: throw std::invalid_argument("Invalid filter type.");
+  }
+}
+
+unsigned long Filter::SumAbsoluteValues(const char * scanLine, unsigned int scanLineWidth, SIMD_TYPES simdType) {
+#ifdef PNG_DECODER_X86
+  if (simdType >= SIMD_TYPES::AVX2) {
+    return Avx2SumAbsoluteValues(scanLine, scanLineWidth);
+  } else if (simdType >= SIMD_TYPES::SSE2) {
+    return Sse2SumAbsoluteValues(scanLine, scanLineWidth);
+  }
+#endif
+  unsigned long sum = 0;
+  for (unsigned int i = 0; i < scanLineWidth; ++i) {
+    unsigned char byte = static_cast<unsigned char>(scanLine[i]);
+    sum += std::min<unsigned int>(byte, 256 - byte);
+  }
+  return sum;
+}
+
+unsigned int Filter::PaethPredictor(int priorSub, int priorUp, int priorUpSub) {
+  int a = priorSub;
+  int b = priorUp;
+  int c = priorUpSub;
+  int p = a + b - c;
+  int pa = std::abs(p - a);
+  int pb = std::abs(p - b);
+  int pc = std::abs(p - c);
+  if (pa == pb && pb == pc) {
+    if (pa <= pb && pa <= pc) {
+      return static_cast<unsigned int>(a);
+    } else if (pb <= pc) {
+      return static_cast<unsigned int>(b);
+    } else {
+      return static_cast<unsigned int>(c);
+    }
+  } else {
+    int nearest = a;
+    int smallest = pa;
+    if (pb < smallest) {
+      nearest = b;
+      smallest = pb;
+    }
+    if (pc < smallest) {
+      nearest = c;
+    }
+    return static_cast<unsigned int>(nearest);
+  }
+}
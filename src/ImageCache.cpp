@@ -0,0 +1,172 @@
+#include "ImageCache.h"
+
+// ImageCacheKey
+bool ImageCacheKey::operator==(const ImageCacheKey& other) const {
+  if (this->size != other.size || this->modifiedTime != other.modifiedTime || this->crc != other.crc || this->adler != other.adler ||
+    this->pixelFormat != other.pixelFormat || this->fileName != other.fileName) {
+    return false;
+  }
+  if (this->data == other.data) {
+    return true;
+  }
+  return this->data != nullptr && other.data != nullptr && std::memcmp(this->data, other.data, this->size) == 0;
+}
+
+ImageCacheKey ImageCacheKey::Store() const {
+  ImageCacheKey stored = *this;
+  if (this->data != nullptr && this->bytes == nullptr) {
+    stored.bytes = std::make_shared<const std::vector<uint8_t>>(this->data, this->data + this->size);
+    stored.data = stored.bytes->data();
+  }
+  return stored;
+}
+
+size_t ImageCacheKeyHash::operator()(const ImageCacheKey& key) const {
+  size_t hash = std::hash<std::string>()(key.fileName);
+  for (unsigned long long value : {static_cast<unsigned long long>(key.modifiedTime), key.size,
+    (static_cast<unsigned long long>(key.crc) << 32) | key.adler, static_cast<unsigned long long>(key.pixelFormat)}) {
+    hash ^= std::hash<unsigned long long>()(value) + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2);
+  }
+  return hash;
+}
+
+// Private
+SharedImage ImageCache::Lookup(const ImageCacheKey& key, const std::function<void(DecodedImage& image)>& decode) {
+  std::unique_lock<std::mutex> lock(this->mutex);
+  auto found = this->entries.find(key);
+  if (found != this->entries.end()) {
+    Entry& entry = found->second;
+    if (entry.ready) {
+      this->counters.hits += 1;
+      this->lru.splice(this->lru.begin(), this->lru, entry.position);
+      return entry.image.get();
+    }
+    this->counters.coalesced += 1;
+    std::shared_future<SharedImage> pending = entry.image;
+    lock.unlock();
+    return pending.get();
+  }
+
+  // Publish the pending entry before decoding so later lookups of key wait for this decode.
+  std::shared_ptr<DecodedImage> image = std::make_shared<DecodedImage>();
+  image->success = false;
+  std::promise<SharedImage> promise;
+  this->counters.misses += 1;
+  Entry& entry = this->entries[key.Store()];
+  entry.image = promise.get_future().share();
+  entry.ready = false;
+  entry.bytes = 0;
+  lock.unlock();
+
+  try {
+    decode(*image);
+  } catch(const std::exception& e) {
+    image->success = false;
+    std::cerr << e.what() << std::endl;
+  }
+  SharedImage shared = image;
+
+  lock.lock();
+  // Pending entries are never evicted or cleared, so the entry is still there.
+  auto pending = this->entries.find(key);
+  if (image->success) {
+    const ImageCacheKey& stored = pending->first;
+    pending->second.ready = true;
+    pending->second.bytes = image->unfilteredData.size() + ((stored.bytes == nullptr) ? 0 : stored.bytes->size());
+    this->lru.push_front(stored);
+    pending->second.position = this->lru.begin();
+    this->counters.images += 1;
+    this->counters.bytes += pending->second.bytes;
+    this->Evict();
+  } else {
+    this->entries.erase(pending);
+  }
+  lock.unlock();
+  promise.set_value(shared);
+  return shared;
+}
+
+void ImageCache::Evict() {
+  while (this->counters.bytes > this->budget && !this->lru.empty()) {
+    auto entry = this->entries.find(this->lru.back());
+    this->counters.bytes -= entry->second.bytes;
+    this->counters.images -= 1;
+    this->counters.evictions += 1;
+    this->entries.erase(entry);
+    this->lru.pop_back();
+  }
+}
+
+// Constructors & Deconstructors
+ImageCache::ImageCache(unsigned long budget) {
+  this->budget = budget;
+  this->counters = ImageCacheCounters();
+}
+
+// Methods
+SharedImage ImageCache::Get(const std::filesystem::path& fileName, PIXEL_FORMATS pixelFormat) {
+  ImageCacheKey key = ImageCacheKey();
+  key.fileName = fileName.string();
+  key.pixelFormat = pixelFormat;
+  // A missing file keeps a zero time and size; its decode fails and is not cached.
+  std::error_code error;
+  std::filesystem::file_time_type modifiedTime = std::filesystem::last_write_time(fileName, error);
+  if (!error) {
+    key.modifiedTime = static_cast<long long>(modifiedTime.time_since_epoch().count());
+  }
+  std::uintmax_t fileSize = std::filesystem::file_size(fileName, error);
+  if (!error) {
+    key.size = static_cast<unsigned long long>(fileSize);
+  }
+
+  return this->Lookup(key, [&fileName, pixelFormat](DecodedImage& image) {
+    image.fileName = fileName;
+    // Get runs on the caller's threads, so each miss decodes with a context that is freed when it is done.
+    DecoderContext context;
+    image.index = 0;
+    BatchDecoder::DecodeFile(image, pixelFormat, context);
+  });
+}
+
+SharedImage ImageCache::Get(const uint8_t * data, size_t size, PIXEL_FORMATS pixelFormat) {
+  ImageCacheKey key = ImageCacheKey();
+  key.size = size;
+  key.pixelFormat = pixelFormat;
+  key.data = data;
+  if (data != nullptr) {
+    key.crc = Crc::Crc32(reinterpret_cast<const char *>(data), size);
+    key.adler = static_cast<unsigned int>(adler32_z(adler32_z(0, Z_NULL, 0), data, size));
+  }
+
+  return this->Lookup(key, [data, size, pixelFormat](DecodedImage& image) {
+    DecoderContext context;
+    image.index = 0;
+    BatchDecoder::DecodeBuffer(image, data, size, pixelFormat, context);
+  });
+}
+
+ImageCacheCounters ImageCache::GetCounters() const {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->counters;
+}
+
+unsigned long ImageCache::GetBudget() const {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->budget;
+}
+
+void ImageCache::SetBudget(unsigned long budget) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->budget = budget;
+  this->Evict();
+}
+
+void ImageCache::Clear() {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  for (const ImageCacheKey& key : this->lru) {
+    this->entries.erase(key);
+  }
+  this->lru.clear();
+  this->counters.images = 0;
+  this->counters.bytes = 0;
+}
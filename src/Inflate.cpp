@@ -1,5 +1,54 @@
 #include "Inflate.h"
 
+#ifdef PNG_DECODER_ZLIB_INFLATE
+std::atomic<INFLATE_BACKENDS> Inflate::backend(INFLATE_BACKENDS::ZLIB);
+#else
+std::atomic<INFLATE_BACKENDS> Inflate::backend(INFLATE_BACKENDS::NATIVE);
+#endif
+
+void Inflate::InflateInto(char * compressed, unsigned long compressedSize, const Chunk * chunk, const Chunk * end, char * decompressed,
+  unsigned long decompressedSize, INFLATE_BACKENDS backendType, DecoderContext * context) {
+  if (backendType == INFLATE_BACKENDS::NATIVE) {
+    DECODE_STATS_TIMER(DECODE_STAGES::INFLATE);
+    Deflate::InflateInto(compressed, compressedSize, chunk, end, decompressed, decompressedSize,
+      (context == nullptr) ? nullptr : context->GetDecodeTables());
+#ifdef PNG_DECODER_STATS
+    for (const Chunk * idat = chunk; idat != end; ++idat) {
+      compressedSize += (idat->GetChunkType() == ChunkType::IDAT) ? idat->GetDataLength() : 0;
+    }
+#endif
+    DECODE_STATS_STREAM(compressedSize, decompressedSize);
+    return;
+  }
+  // zlib counts its input and output in unsigned int, so larger buffers are fed and filled a window at a time.
+  unsigned long compressedLeft = compressedSize;
+  auto fill = [&](z_stream * stream) {
+    for (unsigned long offset = 0; offset < decompressedSize;) {
+      unsigned int window = static_cast<unsigned int>(std::min<unsigned long>(UINT_MAX, decompressedSize - offset));
+      stream->next_out = reinterpret_cast<Bytef *>(decompressed + offset);
+      stream->avail_out = window;
+      Inflate::ZInflateFill(stream, compressedLeft, chunk, end);
+      offset += window;
+    }
+  };
+  if (context != nullptr) {
+    // The context keeps its stream open, so only record what this image inflated.
+    z_stream * stream = context->ResetStream(compressed, 0, decompressed, 0);
+    fill(stream);
+    DECODE_STATS_STREAM(stream->total_in, stream->total_out);
+    return;
+  }
+  z_stream stream = Inflate::CreateZStream(compressed, 0, &decompressed, 0);
+  Inflate::ZInflateInit(&stream);
+  try {
+    fill(&stream);
+  } catch(const std::exception& e) {
+    Inflate::ZInflateEnd(&stream);
+    throw;
+  }
+  Inflate::ZInflateEnd(&stream);
+}
+
 z_stream Inflate::CreateZStream(char * compressed, unsigned int availableIn, char ** decompressed, unsigned int availableOut) {
   z_stream stream;
   stream.next_in = reinterpret_cast<Bytef *>(compressed);
@@ -12,39 +61,137 @@ z_stream Inflate::CreateZStream(char * compressed, unsigned int availableIn, cha
   return stream;
 }
 
-void Inflate::ZInflate(z_stream * stream, char ** decompressed) {
-  if (inflateInit(stream) != Z_OK) {
-    std::string msg = stream->msg;
+void Inflate::ZInflateInit(z_stream * stream, int windowBits) {
+  if (inflateInit2(stream, windowBits) != Z_OK) {
+    std::string msg = (stream->msg != nullptr) ? stream->msg : "";
     throw std::runtime_error("InflateInit failed: " + msg);
   }
+}
+
+void Inflate::ZInflateFill(z_stream * stream) {
+  DECODE_STATS_TIMER(DECODE_STAGES::INFLATE);
+  while (stream->avail_out > 0) {
+    Inflate::ZInflateStep(stream);
+  }
+}
+
+void Inflate::ZInflateFill(z_stream * stream, const Chunk *& chunk, const Chunk * end) {
+  unsigned long compressedLeft = 0;
+  Inflate::ZInflateFill(stream, compressedLeft, chunk, end);
+}
+
+void Inflate::ZInflateFill(z_stream * stream, unsigned long& compressedLeft, const Chunk *& chunk, const Chunk * end) {
+  DECODE_STATS_TIMER(DECODE_STAGES::INFLATE);
+  while (stream->avail_out > 0) {
+    if (stream->avail_in == 0 && compressedLeft > 0) {
+      // next_in already points past the input fed so far.
+      stream->avail_in = static_cast<unsigned int>(std::min<unsigned long>(UINT_MAX, compressedLeft));
+      compressedLeft -= stream->avail_in;
+    }
+    while (stream->avail_in == 0 && chunk != end) {
+      if (chunk->GetChunkType() == ChunkType::IDAT) {
+        stream->next_in = reinterpret_cast<Bytef *>(chunk->GetChunkData());
+        stream->avail_in = chunk->GetDataLength();
+      }
+      ++chunk;
+    }
+    Inflate::ZInflateStep(stream);
+  }
+}
+
+void Inflate::ZInflateEnd(z_stream * stream) {
+  DECODE_STATS_STREAM(stream->total_in, stream->total_out);
+  inflateEnd(stream);
+}
+
+unsigned long Inflate::InflateSegment(const StreamSegment& segment, const StreamSegment * next, const Chunk * end, bool zlibHeader,
+  char * decompressed, unsigned long decompressedSize, std::vector<char>& grown) {
+  DECODE_STATS_TIMER(DECODE_STAGES::INFLATE);
+  const Chunk * chunk = segment.chunk;
+  const Chunk * stop = (next == nullptr) ? end : next->chunk;
+  unsigned long offset = segment.offset;
+  // Points the stream at the segment's next piece of IDAT data. Returns false once the segment has no more.
+  auto refill = [&](z_stream * stream) {
+    while (stream->avail_in == 0 && chunk != end) {
+      unsigned long last = (chunk == stop) ? next->offset : chunk->GetDataLength();
+      if (chunk->GetChunkType() == ChunkType::IDAT && offset < last) {
+        stream->next_in = reinterpret_cast<Bytef *>(chunk->GetChunkData() + offset);
+        stream->avail_in = static_cast<unsigned int>(last - offset);
+      }
+      chunk = (chunk == stop) ? end : chunk + 1;
+      offset = 0;
+    }
+    return stream->avail_in > 0;
+  };
+
+  char * output = decompressed;
+  z_stream stream = Inflate::CreateZStream(nullptr, 0, &output, 0);
+  Inflate::ZInflateInit(&stream, zlibHeader ? MAX_WBITS : -MAX_WBITS);
+  try {
+    int inflateStatus = Z_OK;
+    while (inflateStatus != Z_STREAM_END && stream.total_out < decompressedSize && (stream.avail_in > 0 || refill(&stream))) {
+      if (stream.avail_out == 0 && decompressed == nullptr) {
+        grown.resize(std::min(decompressedSize, std::max<unsigned long>(65536, 2 * grown.size())));
+        stream.next_out = reinterpret_cast<Bytef *>(grown.data() + stream.total_out);
+        stream.avail_out = static_cast<unsigned int>(std::min<unsigned long>(UINT_MAX, grown.size() - stream.total_out));
+      } else if (stream.avail_out == 0) {
+        // Output is given a window of at most UINT_MAX bytes at a time, as zlib counts it in unsigned int.
+        stream.next_out = reinterpret_cast<Bytef *>(decompressed + stream.total_out);
+        stream.avail_out = static_cast<unsigned int>(std::min<unsigned long>(UINT_MAX, decompressedSize - stream.total_out));
+      }
+      inflateStatus = inflate(&stream, Z_SYNC_FLUSH);
+      if (inflateStatus != Z_OK && inflateStatus != Z_STREAM_END && inflateStatus != Z_BUF_ERROR) {
+        Inflate::ThrowInflateError(&stream, inflateStatus);
+      }
+    }
+    if (decompressed != nullptr && stream.total_out < decompressedSize) {
+      throw std::runtime_error("Inflate failed: the segment ended before its rows were inflated.");
+    }
 
-  int inflateStatus = Z_OK;
-  while (inflateStatus != Z_STREAM_END && stream->avail_out > 0) {
-    inflateStatus = inflate(stream, Z_SYNC_FLUSH);
-    if (inflateStatus != Z_OK && inflateStatus != Z_STREAM_END) {
-      std::string msg = "Inflate failed: ";
-      if (stream->msg) {
-        msg.append(stream->msg);
-      } else {
-        msg.append(std::to_string(inflateStatus));
+    if (next != nullptr) {
+      // What is left may only be the flush itself: no more output, and a stream waiting for its next block.
+      char spare;
+      while (inflateStatus != Z_STREAM_END && (stream.avail_in > 0 || refill(&stream))) {
+        stream.next_out = reinterpret_cast<Bytef *>(&spare);
+        stream.avail_out = 1;
+        inflateStatus = inflate(&stream, Z_SYNC_FLUSH);
+        if (stream.avail_out == 0) {
+          throw std::runtime_error("Inflate failed: the segment holds more data than its rows.");
+        } else if (inflateStatus != Z_OK && inflateStatus != Z_STREAM_END && inflateStatus != Z_BUF_ERROR) {
+          Inflate::ThrowInflateError(&stream, inflateStatus);
+        }
+      }
+      // data_type is 128 when inflate stopped before a block header, not in the last block, with no bits left over.
+      if (inflateStatus == Z_STREAM_END || (stream.data_type & 0xFF) != 128) {
+        throw std::runtime_error("Inflate failed: the segment does not end on a full flush.");
       }
-      throw std::runtime_error(msg);
-    } else if (inflateStatus == Z_OK && stream->avail_out == 0) {
-      ReallocDecompressed(stream, decompressed, stream->total_out + UINT_MAX);
     }
+  } catch(const std::exception& e) {
+    Inflate::ZInflateEnd(&stream);
+    throw;
   }
+  unsigned long decompressedBytes = stream.total_out;
+  Inflate::ZInflateEnd(&stream);
+  return decompressedBytes;
+}
 
-  *decompressed = static_cast<char *>(std::realloc(*decompressed, stream->total_out * sizeof(char)));
-  if (*decompressed == nullptr) {
-    throw std::runtime_error("Failed to reallocate memory to store the decompressed data stream.");
+void Inflate::ZInflateStep(z_stream * stream) {
+  int inflateStatus = inflate(stream, Z_SYNC_FLUSH);
+  if (inflateStatus == Z_STREAM_END && stream->avail_out > 0) {
+    throw std::runtime_error("Inflate failed: the compressed data stream ended early.");
+  } else if (inflateStatus == Z_BUF_ERROR) {
+    throw std::runtime_error("Inflate failed: the compressed data stream is truncated.");
+  } else if (inflateStatus != Z_OK && inflateStatus != Z_STREAM_END) {
+    Inflate::ThrowInflateError(stream, inflateStatus);
   }
 }
 
-void Inflate::ReallocDecompressed(z_stream * stream, char ** decompressed, unsigned long size) {
-  *decompressed = static_cast<char *>(std::realloc(*decompressed, size * sizeof(char)));
-  if (*decompressed == nullptr) {
-    throw std::runtime_error("Failed to reallocate memory to store the decompressed data stream.");
+void Inflate::ThrowInflateError(z_stream * stream, int inflateStatus) {
+  std::string msg = "Inflate failed: ";
+  if (stream->msg) {
+    msg.append(stream->msg);
+  } else {
+    msg.append(std::to_string(inflateStatus));
   }
-  stream->avail_out = size - stream->total_out;
-  stream->next_out = reinterpret_cast<Bytef *>((*decompressed) + stream->total_out);
+  throw std::runtime_error(msg);
 }
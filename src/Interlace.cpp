@@ -0,0 +1,113 @@
+#include "Interlace.h"
+
+const unsigned int Interlace::xStart[Interlace::numPasses] = {0, 4, 0, 2, 0, 1, 0};
+const unsigned int Interlace::yStart[Interlace::numPasses] = {0, 0, 4, 0, 2, 0, 1};
+const unsigned int Interlace::xStep[Interlace::numPasses] = {8, 8, 4, 4, 2, 2, 1};
+const unsigned int Interlace::yStep[Interlace::numPasses] = {8, 8, 8, 4, 4, 2, 2};
+
+// The block each pixel of a pass covers in a progressive preview.
+static const unsigned int blockWidths[Interlace::numPasses] = {8, 4, 4, 2, 2, 1, 1};
+static const unsigned int blockHeights[Interlace::numPasses] = {8, 8, 4, 4, 2, 2, 1};
+
+template <unsigned int bytesPerPixel>
+static void ScatterPixels(const char * passScanLine, unsigned int passWidth, char * imageScanLine, unsigned int xStart, unsigned int xStep) {
+  char * pixel = imageScanLine + static_cast<unsigned long>(xStart) * bytesPerPixel;
+  unsigned long stride = static_cast<unsigned long>(xStep) * bytesPerPixel;
+  for (unsigned int i = 0; i < passWidth; ++i) {
+    std::memcpy(pixel, passScanLine + static_cast<unsigned long>(i) * bytesPerPixel, bytesPerPixel);
+    pixel += stride;
+  }
+}
+
+// Sub-byte pixels are packed from the most significant bit, as in the PNG specification.
+static inline unsigned int GetPackedPixel(const char * scanLine, unsigned long x, unsigned int bitsPerPixel) {
+  unsigned long bit = x * bitsPerPixel;
+  unsigned int shift = 8 - bitsPerPixel - static_cast<unsigned int>(bit % 8);
+  return (static_cast<unsigned char>(scanLine[bit / 8]) >> shift) & ((1u << bitsPerPixel) - 1);
+}
+
+static inline void SetPackedPixel(char * scanLine, unsigned long x, unsigned int bitsPerPixel, unsigned int value) {
+  unsigned long bit = x * bitsPerPixel;
+  unsigned int shift = 8 - bitsPerPixel - static_cast<unsigned int>(bit % 8);
+  unsigned int mask = ((1u << bitsPerPixel) - 1) << shift;
+  unsigned char byte = static_cast<unsigned char>(scanLine[bit / 8]);
+  scanLine[bit / 8] = static_cast<char>((byte & ~mask) | (value << shift));
+}
+
+// Methods
+unsigned int Interlace::GetPassWidth(unsigned int pass, unsigned int width) {
+  return (width > Interlace::xStart[pass]) ? (width - Interlace::xStart[pass] + Interlace::xStep[pass] - 1) / Interlace::xStep[pass] : 0;
+}
+
+unsigned int Interlace::GetPassHeight(unsigned int pass, unsigned int height) {
+  return (height > Interlace::yStart[pass]) ? (height - Interlace::yStart[pass] + Interlace::yStep[pass] - 1) / Interlace::yStep[pass] : 0;
+}
+
+void Interlace::ScatterScanLine(const char * passScanLine, unsigned int pass, unsigned int width, char * imageScanLine,
+  unsigned int bitsPerPixel) {
+  unsigned int passWidth = Interlace::GetPassWidth(pass, width);
+  unsigned int xStart = Interlace::xStart[pass];
+  unsigned int xStep = Interlace::xStep[pass];
+  if (bitsPerPixel % 8 != 0) {
+    unsigned long imageScanLineWidth = (static_cast<unsigned long>(width) * bitsPerPixel + 7) / 8;
+    unsigned int paddingBits = static_cast<unsigned int>(imageScanLineWidth * 8 - static_cast<unsigned long>(width) * bitsPerPixel);
+    if (xStep == 1) {
+      // The last pass holds whole image scan lines.
+      std::memcpy(imageScanLine, passScanLine, imageScanLineWidth);
+      imageScanLine[imageScanLineWidth - 1] = static_cast<char>(imageScanLine[imageScanLineWidth - 1] & (0xFF << paddingBits));
+      return;
+    }
+    // The pass starting at x = 0 is the first to reach each scan line, so it clears the padding bits too.
+    if (xStart == 0) {
+      std::memset(imageScanLine, 0, imageScanLineWidth);
+    }
+    for (unsigned int i = 0; i < passWidth; ++i) {
+      SetPackedPixel(imageScanLine, xStart + static_cast<unsigned long>(i) * xStep, bitsPerPixel,
+        GetPackedPixel(passScanLine, i, bitsPerPixel));
+    }
+    return;
+  }
+  if (xStep == 1) {
+    std::memcpy(imageScanLine, passScanLine, static_cast<unsigned long>(passWidth) * (bitsPerPixel / 8));
+    return;
+  }
+
+  switch (bitsPerPixel / 8) {
+    case 1: ScatterPixels<1>(passScanLine, passWidth, imageScanLine, xStart, xStep); break;
+    case 2: ScatterPixels<2>(passScanLine, passWidth, imageScanLine, xStart, xStep); break;
+    case 3: ScatterPixels<3>(passScanLine, passWidth, imageScanLine, xStart, xStep); break;
+    case 4: ScatterPixels<4>(passScanLine, passWidth, imageScanLine, xStart, xStep); break;
+    case 6: ScatterPixels<6>(passScanLine, passWidth, imageScanLine, xStart, xStep); break;
+    case 8: ScatterPixels<8>(passScanLine, passWidth, imageScanLine, xStart, xStep); break;
+    default: throw std::invalid_argument("Invalid bits per pixel: " + std::to_string(bitsPerPixel));
+  }
+}
+
+void Interlace::FillPassBlocks(char * image, unsigned int pass, unsigned int width, unsigned int height, unsigned int bitsPerPixel,
+  unsigned long scanLineWidth) {
+  unsigned int blockWidth = blockWidths[pass];
+  unsigned int blockHeight = blockHeights[pass];
+  unsigned long bytesPerPixel = bitsPerPixel / 8;
+
+  for (unsigned long y = Interlace::yStart[pass]; y < height; y += Interlace::yStep[pass]) {
+    char * scanLine = image + y * scanLineWidth;
+    // Widen each pixel of the pass across its block, then repeat the scan line down the block. Blocks of
+    // earlier passes are at least as tall and aligned, so the rest of the scan line repeats too.
+    if (blockWidth > 1) {
+      for (unsigned long x = Interlace::xStart[pass]; x < width; x += Interlace::xStep[pass]) {
+        unsigned long blockEnd = std::min<unsigned long>(x + blockWidth, width);
+        for (unsigned long fillX = x + 1; fillX < blockEnd; ++fillX) {
+          if (bytesPerPixel > 0) {
+            std::memcpy(scanLine + fillX * bytesPerPixel, scanLine + x * bytesPerPixel, bytesPerPixel);
+          } else {
+            SetPackedPixel(scanLine, fillX, bitsPerPixel, GetPackedPixel(scanLine, x, bitsPerPixel));
+          }
+        }
+      }
+    }
+    unsigned long blockEnd = std::min<unsigned long>(y + blockHeight, height);
+    for (unsigned long fillY = y + 1; fillY < blockEnd; ++fillY) {
+      std::memcpy(image + fillY * scanLineWidth, scanLine, scanLineWidth);
+    }
+  }
+}
@@ -0,0 +1,106 @@
+#include "MappedOutput.h"
+
+// Constructors & Deconstructors
+MappedOutput::MappedOutput() {
+  this->fileName = "";
+  this->data = nullptr;
+  this->size = 0;
+}
+
+MappedOutput::MappedOutput(const std::filesystem::path& fileName, unsigned long size) {
+  this->fileName = "";
+  this->data = nullptr;
+  this->size = 0;
+  this->Open(fileName, size);
+}
+
+MappedOutput::~MappedOutput() {
+  this->Close();
+}
+
+// Methods
+bool MappedOutput::Open(const std::filesystem::path& fileName, unsigned long size) {
+  this->Close();
+  int fileDescriptor = -1;
+  try {
+    if (size == 0) {
+      throw std::invalid_argument("Cannot map an empty output file.");
+    }
+    fileDescriptor = ::open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fileDescriptor < 0) {
+      throw std::runtime_error("Failed to create '" + fileName.string() + "'.");
+    }
+    if (ftruncate(fileDescriptor, static_cast<off_t>(size)) != 0) {
+      throw std::runtime_error("Failed to size '" + fileName.string() + "' to " + std::to_string(size) + " bytes.");
+    }
+
+    void * mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, 0);
+    if (mapping == MAP_FAILED) {
+      throw std::runtime_error("Failed to map '" + fileName.string() + "' into memory.");
+    }
+    // The mapping keeps its own reference to the file.
+    ::close(fileDescriptor);
+
+    this->fileName = fileName;
+    this->data = static_cast<char *>(mapping);
+    this->size = size;
+    // Decodes write front to back.
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    return true;
+  } catch(const std::exception& e) {
+    if (fileDescriptor >= 0) {
+      ::close(fileDescriptor);
+    }
+    std::cerr << e.what() << std::endl;
+    return false;
+  }
+}
+
+void MappedOutput::Close() {
+  if (this->data != nullptr) {
+    munmap(this->data, this->size);
+  }
+  this->fileName = "";
+  this->data = nullptr;
+  this->size = 0;
+}
+
+bool MappedOutput::IsOpen() const {
+  return this->data != nullptr;
+}
+
+std::filesystem::path MappedOutput::GetFile() const {
+  return this->fileName;
+}
+
+char * MappedOutput::GetData() const {
+  return this->data;
+}
+
+unsigned long MappedOutput::GetSize() const {
+  return this->size;
+}
+
+void MappedOutput::Release(unsigned long offset, unsigned long size) {
+  if (this->data == nullptr || offset >= this->size || size == 0) {
+    return;
+  }
+  /* Both calls take whole pages, so the range is widened to the pages it touches. The mapping is shared, so
+  dropping a page that is only partly written loses nothing: its bytes are in the page cache.*/
+  unsigned long pageSize = static_cast<unsigned long>(sysconf(_SC_PAGESIZE));
+  unsigned long start = offset - offset % pageSize;
+  unsigned long length = std::min(size, this->size - offset) + (offset - start);
+  msync(this->data + start, length, MS_ASYNC);
+  madvise(this->data + start, length, MADV_DONTNEED);
+}
+
+bool MappedOutput::Flush() {
+  if (this->data == nullptr) {
+    return false;
+  }
+  if (msync(this->data, this->size, MS_SYNC) != 0) {
+    std::cerr << "Failed to write '" << this->fileName.string() << "' back to disk." << std::endl;
+    return false;
+  }
+  return true;
+}
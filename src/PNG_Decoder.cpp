@@ -2,6 +2,19 @@
 
 // Private
 void PNG_Decoder::LoadBytes() {
+  DECODE_STATS_TIMER(DECODE_STAGES::LOAD);
+  if (this->mapped || this->borrowed) {
+    this->ReleaseBytes();
+  }
+
+  if (this->loadType == LOAD_TYPES::MMAP) {
+    this->MapBytes();
+  } else {
+    this->ReadBytes();
+  }
+}
+
+void PNG_Decoder::ReadBytes() {
   std::ifstream inputStream;
   try {
     inputStream.open(this->fileName.string(), std::ifstream::binary);
@@ -10,12 +23,18 @@ void PNG_Decoder::LoadBytes() {
     }
 
     inputStream.seekg(0, std::ios_base::end);
-    this->fileSize = static_cast<unsigned int>(inputStream.tellg());
+    std::streamoff fileSize = inputStream.tellg();
+    if (fileSize < 0) {
+      throw std::runtime_error("Failed to get the size of '" + this->fileName.string() + "'.");
+    }
+    this->fileSize = static_cast<unsigned long>(fileSize);
 
     if (this->bytes == nullptr) {
       this->bytes = static_cast<char *>(std::malloc(this->fileSize * sizeof(char)));
+      DECODE_STATS_ALLOCATION(this->fileSize, false);
     } else {
       this->bytes = static_cast<char *>(std::realloc(this->bytes, this->fileSize * sizeof(char)));
+      DECODE_STATS_ALLOCATION(this->fileSize, true);
     }
 
     if (this->bytes == nullptr) {
@@ -33,9 +52,7 @@ void PNG_Decoder::LoadBytes() {
       throw std::invalid_argument("'" + this->fileName.string() + "' is not a valid PNG.");
     }
   } catch(const std::exception& e) {
-    this->fileSize = 0;
-    std::free(this->bytes);
-    this->bytes = nullptr;
+    this->ReleaseBytes();
 
     if (inputStream.is_open()) {
       inputStream.close();
@@ -44,9 +61,93 @@ void PNG_Decoder::LoadBytes() {
   }
 }
 
+void PNG_Decoder::MapBytes() {
+  int fileDescriptor = -1;
+  try {
+    this->ReleaseBytes();
+
+    fileDescriptor = ::open(this->fileName.c_str(), O_RDONLY);
+    if (fileDescriptor < 0) {
+      throw std::runtime_error("Failed to open file descriptor for '" + this->fileName.string() + "'.");
+    }
+
+    struct stat fileStat;
+    if (fstat(fileDescriptor, &fileStat) != 0) {
+      throw std::runtime_error("Failed to stat '" + this->fileName.string() + "'.");
+    }
+    if (fileStat.st_size <= 0) {
+      throw std::invalid_argument("'" + this->fileName.string() + "' has an unsupported file size.");
+    }
+
+    void * mapping = mmap(nullptr, static_cast<size_t>(fileStat.st_size), PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+    if (mapping == MAP_FAILED) {
+      throw std::runtime_error("Failed to map '" + this->fileName.string() + "' into memory.");
+    }
+    // The mapping keeps its own reference to the file.
+    ::close(fileDescriptor);
+    fileDescriptor = -1;
+
+    this->bytes = static_cast<char *>(mapping);
+    this->fileSize = static_cast<unsigned long>(fileStat.st_size);
+    this->mapped = true;
+    // Chunks are parsed front to back right away, so ask the kernel to read ahead.
+    madvise(mapping, this->fileSize, MADV_SEQUENTIAL);
+    madvise(mapping, this->fileSize, MADV_WILLNEED);
+
+    if (!this->IsValid()) {
+      throw std::invalid_argument("'" + this->fileName.string() + "' is not a valid PNG.");
+    }
+  } catch(const std::exception& e) {
+    this->ReleaseBytes();
+
+    if (fileDescriptor >= 0) {
+      ::close(fileDescriptor);
+    }
+    std::cerr << e.what() << std::endl;
+  }
+}
+
+void PNG_Decoder::BorrowBytes(const uint8_t * data, size_t size) {
+  try {
+    this->ReleaseBytes();
+    if (data == nullptr) {
+      throw std::invalid_argument("No PNG buffer was given.");
+    }
+
+    // Chunks only ever read through their pointers, so the buffer is never written.
+    this->bytes = const_cast<char *>(reinterpret_cast<const char *>(data));
+    this->fileSize = size;
+    this->borrowed = true;
+
+    if (!this->IsValid()) {
+      throw std::invalid_argument("The PNG buffer is not a valid PNG.");
+    }
+  } catch(const std::exception& e) {
+    this->ReleaseBytes();
+    std::cerr << e.what() << std::endl;
+  }
+}
+
+void PNG_Decoder::ReleaseBytes() {
+  if (this->mapped) {
+    munmap(this->bytes, this->fileSize);
+  } else if (!this->borrowed) {
+    std::free(this->bytes);
+  }
+  this->bytes = nullptr;
+  this->fileSize = 0;
+  this->mapped = false;
+  this->borrowed = false;
+}
+
 bool PNG_Decoder::IsValid() const {
   try {
     // According to http://www.libpng.org/pub/png/spec/1.2/PNG-Structure.html
+    // Signature, then the IHDR chunk: length, type, 13 bytes of data and CRC.
+    if (this->fileSize < 33) {
+      throw std::invalid_argument("The PNG is too small to contain a signature and IHDR chunk.");
+    }
+
     const unsigned char validBytes[] = {137, 80, 78, 71, 13, 10, 26, 10};
     for (int i = 0; i < 8; ++i) {
       if (validBytes[i] != static_cast<unsigned char>(this->bytes[i])) {
@@ -62,8 +163,8 @@ bool PNG_Decoder::IsValid() const {
       throw std::invalid_argument("This PNG does not use the standard filter method.");
     }
 
-    if (static_cast<unsigned int>(this->GetFilterMethod()) != 0) {
-      throw std::invalid_argument("This decoder does not support the interlace method.");
+    if (static_cast<unsigned int>(this->GetInterlaceMethod()) > 1) {
+      throw std::invalid_argument("This PNG does not use a standard interlace method.");
     }
 
     return true;
@@ -74,6 +175,7 @@ bool PNG_Decoder::IsValid() const {
 }
 
 void PNG_Decoder::LoadChunks() {
+  DECODE_STATS_TIMER(DECODE_STAGES::CHUNK_PARSE);
   try {
     if (this->bytes == nullptr) {
       throw std::runtime_error("Failed to load chunks: PNG byte data is empty.");
@@ -84,7 +186,14 @@ void PNG_Decoder::LoadChunks() {
     char * end = this->bytes + this->fileSize;
 
     while (cur < end) {
+      unsigned long remaining = static_cast<unsigned long>(end - cur);
+      if (remaining < 12 || remaining - 12 < Endian::ToHost(*reinterpret_cast<unsigned int *>(cur))) {
+        throw std::invalid_argument("PNG chunk extends past the end of the file.");
+      }
       Chunk curChunk = Chunk(cur);
+      if (this->verifyCrc && !curChunk.IsCrcValid()) {
+        throw std::invalid_argument("PNG chunk " + std::to_string(this->numChunks) + " failed its CRC check.");
+      }
       this->chunks.push_back(curChunk);
       this->numChunks += 1;
       cur += (static_cast<unsigned int>(12) + curChunk.GetDataLength());
@@ -101,6 +210,52 @@ void PNG_Decoder::LoadChunks() {
   }
 }
 
+void PNG_Decoder::ReadIhdr(const char * bytes, IHDR& ihdr) {
+  const unsigned char validBytes[] = {137, 80, 78, 71, 13, 10, 26, 10};
+  for (int i = 0; i < 8; ++i) {
+    if (validBytes[i] != static_cast<unsigned char>(bytes[i])) {
+      throw std::invalid_argument("The first 8 bytes of this PNG do not match the standard.");
+    }
+  }
+
+  // Chunk reads its CRC from past the data, so the length must be checked before the chunk is parsed.
+  if (Endian::ToHost(*reinterpret_cast<const unsigned int *>(bytes + 8)) != 13) {
+    throw std::invalid_argument("The PNG does not start with an IHDR chunk.");
+  }
+  Chunk ihdrChunk(const_cast<char *>(bytes) + 8);
+  if (ihdrChunk.GetChunkType() != ChunkType::IHDR) {
+    throw std::invalid_argument("The PNG does not start with an IHDR chunk.");
+  }
+  if (!ihdrChunk.IsCrcValid()) {
+    throw std::invalid_argument("The IHDR chunk failed its CRC check.");
+  }
+
+  const char * ihdrData = ihdrChunk.GetChunkData();
+  ihdr.width = Endian::ToHost(*reinterpret_cast<const unsigned int *>(ihdrData));
+  ihdr.height = Endian::ToHost(*reinterpret_cast<const unsigned int *>(ihdrData + 4));
+  ihdr.bitDepth = static_cast<unsigned char>(ihdrData[8]);
+  ihdr.colorType = static_cast<unsigned char>(ihdrData[9]);
+  ihdr.compressionMethod = static_cast<unsigned char>(ihdrData[10]);
+  ihdr.filterMethod = static_cast<unsigned char>(ihdrData[11]);
+  ihdr.interlaceMethod = static_cast<unsigned char>(ihdrData[12]);
+
+  if (ihdr.width == 0 || ihdr.height == 0) {
+    throw std::invalid_argument("The PNG has a zero width or height.");
+  }
+  if (PNG_Decoder::GetNumChannels(ihdr.colorType) == 0) {
+    throw std::invalid_argument("The PNG has an invalid color type.");
+  }
+  unsigned int bitDepth = ihdr.bitDepth;
+  bool validBitDepth = (bitDepth == 1 || bitDepth == 2 || bitDepth == 4 || bitDepth == 8 || bitDepth == 16);
+  if (!validBitDepth || (ihdr.colorType == 3 && bitDepth == 16) || (ihdr.colorType != 0 && ihdr.colorType != 3 && bitDepth < 8)) {
+    throw std::invalid_argument("The PNG has an invalid bit depth for its color type.");
+  }
+  if (ihdr.compressionMethod != 0 || ihdr.filterMethod != 0 || ihdr.interlaceMethod > 1) {
+    throw std::invalid_argument("The PNG uses a nonstandard compression, filter or interlace method.");
+  }
+  ihdr.unfilteredDataSize = PNG_Decoder::GetUnfilteredDataSize(ihdr.width, ihdr.height, ihdr.bitDepth, ihdr.colorType);
+}
+
 unsigned int PNG_Decoder::GetNumChannels(unsigned char colorType) {
   unsigned int type = static_cast<unsigned int>(colorType);
   if (type == 0) { // Grayscale
@@ -118,90 +273,765 @@ unsigned int PNG_Decoder::GetNumChannels(unsigned char colorType) {
   }
 }
 
-void PNG_Decoder::RemoveSubFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp) {
-  for (unsigned int i = 0; i < scanLineWidth; ++i) {
-    unsigned int prior = (bpp > i) ? 0 : static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(buffer + (i - bpp)));
-    unsigned int sub = static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(scanLine + i));
-    unsigned int raw = (sub + prior) % 256;
-    buffer[i] = static_cast<char>(raw);
+unsigned long PNG_Decoder::GetScanLineWidth(unsigned int width, unsigned char bitDepth, unsigned char colorType) {
+  unsigned long bits = static_cast<unsigned long>(width) * PNG_Decoder::GetNumChannels(colorType) * bitDepth;
+  unsigned long scanLineWidth = (bits + 7) / 8; // In bytes, NOT INCLUDING FILTER BYTE
+  // zlib fills and the filters restore one scan line and its filter byte at a time, counted in unsigned int.
+  if (scanLineWidth >= UINT_MAX) {
+    throw std::overflow_error("Scan lines of " + std::to_string(scanLineWidth) + " bytes are too wide for this decoder.");
+  }
+  return scanLineWidth;
+}
+
+unsigned long PNG_Decoder::MultiplySizes(unsigned long a, unsigned long b) {
+  if (b != 0 && a > ULONG_MAX / b) {
+    throw std::overflow_error("The image is too large: its size does not fit in " + std::to_string(8 * sizeof(unsigned long)) + " bits.");
+  }
+  return a * b;
+}
+
+unsigned int PNG_Decoder::GetBytesPerPixel(unsigned char bitDepth, unsigned char colorType) {
+  unsigned int bpp = PNG_Decoder::GetNumChannels(colorType) * static_cast<unsigned int>(bitDepth) / 8;
+  return (bpp == 0) ? 1 : bpp;
+}
+
+unsigned long PNG_Decoder::GetOutputDataSize(unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType,
+  const PixelConverter * converter) {
+  if (converter == nullptr) {
+    return PNG_Decoder::GetUnfilteredDataSize(width, height, bitDepth, colorType);
+  }
+  if (converter->GetBitDepth() != bitDepth || converter->GetColorType() != colorType) {
+    throw std::invalid_argument("Pixel converter was built for a different bit depth or color type.");
+  }
+  return converter->GetOutputDataSize(width, height);
+}
+
+unsigned long PNG_Decoder::InflateDataInto(char * compressedData, unsigned long compressedDataSize, const Chunk * chunk, const Chunk * end,
+  char * decompressedData, unsigned long decompressedDataCapacity, unsigned int width, unsigned int height, unsigned char bitDepth,
+  unsigned char colorType, unsigned char interlaceMethod, DecoderContext * context) {
+  try {
+    unsigned long decompressedDataSize = PNG_Decoder::GetDecompressedDataSize(width, height, bitDepth, colorType, interlaceMethod);
+    if (decompressedData == nullptr || decompressedDataCapacity < decompressedDataSize) {
+      throw std::invalid_argument("Decompressed data buffer is too small: " + std::to_string(decompressedDataSize) + " bytes required.");
+    }
+
+    Inflate::InflateInto(compressedData, compressedDataSize, chunk, end, decompressedData, decompressedDataSize, Inflate::backend, context);
+    return decompressedDataSize;
+
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+}
+
+unsigned long PNG_Decoder::InflateScanLines(char * compressedData, unsigned long compressedDataSize, const Chunk * chunk, const Chunk * end,
+  unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType, const ScanLineCallback& onScanLine,
+  const PixelConverter * converter) {
+  z_stream stream;
+  bool streamOpen = false;
+  try {
+    unsigned long outputDataSize = PNG_Decoder::GetOutputDataSize(width, height, bitDepth, colorType, converter);
+
+    unsigned long scanLineWidth = PNG_Decoder::GetScanLineWidth(width, bitDepth, colorType);
+    ScanLineFilters filters = Filter::GetScanLineFilters(PNG_Decoder::GetBytesPerPixel(bitDepth, colorType));
+
+    // Ring of two scan lines, each prefixed by its filter byte. Rows are inflated and unfiltered in place.
+    std::vector<char> scanLines(2 * (scanLineWidth + 1));
+    char * currentScanLine = scanLines.data();
+    char * priorScanLine = scanLines.data() + scanLineWidth + 1;
+    std::vector<char> convertedScanLine((converter == nullptr || height == 0) ? 0 : outputDataSize / height);
+
+    unsigned long compressedLeft = compressedDataSize;
+    stream = Inflate::CreateZStream(compressedData, 0, &currentScanLine, 0);
+    Inflate::ZInflateInit(&stream);
+    streamOpen = true;
+
+    DECODE_STATS_TIMER_EXCLUDING(DECODE_STAGES::UNFILTER, DECODE_STAGES::INFLATE);
+    DECODE_STATS_FILTER_COUNTER;
+    for (unsigned int i = 0; i < height; ++i) {
+      stream.next_out = reinterpret_cast<Bytef *>(currentScanLine);
+      stream.avail_out = static_cast<unsigned int>(scanLineWidth + 1);
+      Inflate::ZInflateFill(&stream, compressedLeft, chunk, end);
+
+      unsigned char filterType = static_cast<unsigned char>(currentScanLine[0]);
+      Filter::UnfilterScanLine(filters, filterType, currentScanLine + 1, scanLineWidth, currentScanLine + 1,
+        (i > 0) ? priorScanLine + 1 : nullptr);
+      DECODE_STATS_FILTER_TYPE(filterType);
+      if (converter == nullptr) {
+        onScanLine(currentScanLine + 1, i);
+      } else {
+        converter->ConvertScanLine(currentScanLine + 1, width, convertedScanLine.data());
+        onScanLine(convertedScanLine.data(), i);
+      }
+      std::swap(currentScanLine, priorScanLine);
+    }
+
+    Inflate::ZInflateEnd(&stream);
+    return outputDataSize;
+  } catch(const std::exception& e) {
+    if (streamOpen) {
+      Inflate::ZInflateEnd(&stream);
+    }
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+}
+
+unsigned long PNG_Decoder::InflateUnfilteredInto(char * compressedData, unsigned long compressedDataSize, const Chunk * chunk,
+  const Chunk * end, char * unfilteredData, unsigned long unfilteredDataCapacity, unsigned int width, unsigned int height,
+  unsigned char bitDepth, unsigned char colorType, unsigned char interlaceMethod, bool pipelined, const PixelConverter * converter) {
+  if (interlaceMethod == 1) {
+    return PNG_Decoder::InflateInterlacedInto(compressedData, compressedDataSize, chunk, end, unfilteredData, unfilteredDataCapacity,
+      width, height, bitDepth, colorType, nullptr, converter);
+  }
+  try {
+    unsigned long unfilteredDataSize = PNG_Decoder::GetOutputDataSize(width, height, bitDepth, colorType, converter);
+    if (unfilteredData == nullptr || unfilteredDataCapacity < unfilteredDataSize) {
+      throw std::invalid_argument("Unfiltered data buffer is too small: " + std::to_string(unfilteredDataSize) + " bytes required.");
+    }
+
+    unsigned long scanLineWidth = PNG_Decoder::GetScanLineWidth(width, bitDepth, colorType);
+    unsigned long outputScanLineWidth = unfilteredDataSize / height;
+    if (!pipelined) {
+      unsigned long decodedSize = PNG_Decoder::InflateScanLines(compressedData, compressedDataSize, chunk, end, width, height, bitDepth,
+        colorType, [&](const char * scanLine, unsigned int row) {
+          char * output = unfilteredData + static_cast<unsigned long>(row) * outputScanLineWidth;
+          if (converter == nullptr) {
+            std::memcpy(output, scanLine, scanLineWidth);
+          } else {
+            converter->ConvertScanLine(scanLine, width, output);
+          }
+        }, nullptr);
+      return (decodedSize == 0) ? 0 : unfilteredDataSize;
+    }
+    ScanLineFilters filters = Filter::GetScanLineFilters(PNG_Decoder::GetBytesPerPixel(bitDepth, colorType));
+
+    // Blocks of about 64 KiB keep the ring in L2 while handing off rarely enough that synchronization is negligible.
+    unsigned long rowSize = scanLineWidth + 1;
+    unsigned int rowsPerBlock = static_cast<unsigned int>(std::min<unsigned long>(height, std::max<unsigned long>(1, 65536 / rowSize)));
+    unsigned int numBlocks = (height + rowsPerBlock - 1) / rowsPerBlock;
+    BlockRing ring(rowsPerBlock * rowSize, 4);
+
+    std::string inflateError;
+#ifdef PNG_DECODER_STATS
+    DecodeStats * stats = DecodeStats::current;
+#endif
+    std::thread inflater([&]() {
+#ifdef PNG_DECODER_STATS
+      // Inflate time goes to the caller's stats. Only this thread writes the inflate fields while it runs.
+      DecodeStats::current = stats;
+#endif
+      z_stream stream;
+      bool streamOpen = false;
+      const Chunk * nextChunk = chunk;
+      unsigned long compressedLeft = compressedDataSize;
+      try {
+        char * block = nullptr;
+        stream = Inflate::CreateZStream(compressedData, 0, &block, 0);
+        Inflate::ZInflateInit(&stream);
+        streamOpen = true;
+        for (unsigned int i = 0; i < numBlocks; ++i) {
+          block = ring.AcquireWrite();
+          if (block == nullptr) {
+            break;
+          }
+          unsigned int rows = std::min(rowsPerBlock, height - i * rowsPerBlock);
+          stream.next_out = reinterpret_cast<Bytef *>(block);
+          stream.avail_out = static_cast<unsigned int>(rows * rowSize);
+          Inflate::ZInflateFill(&stream, compressedLeft, nextChunk, end);
+          ring.CommitWrite();
+        }
+        Inflate::ZInflateEnd(&stream);
+      } catch(const std::exception& e) {
+        if (streamOpen) {
+          Inflate::ZInflateEnd(&stream);
+        }
+        inflateError = e.what();
+        ring.Cancel();
+      }
+    });
+
+    /* Raw output is unfiltered straight into unfilteredData. Converted output is unfiltered in place in the
+    ring and then converted, keeping a copy of each block's last scan line as the prior of the next block.*/
+    std::vector<char> blockPriorScanLine((converter == nullptr) ? 0 : scanLineWidth);
+    try {
+      DECODE_STATS_FILTER_COUNTER;
+      for (unsigned int i = 0; i < numBlocks; ++i) {
+        char * block = ring.AcquireRead();
+        if (block == nullptr) {
+          break;
+        }
+        // Timed per block, so the time spent waiting for the inflater is left out.
+        DECODE_STATS_TIMER(DECODE_STAGES::UNFILTER);
+        unsigned int firstRow = i * rowsPerBlock;
+        unsigned int rows = std::min(rowsPerBlock, height - firstRow);
+        for (unsigned int j = 0; j < rows; ++j) {
+          unsigned long row = firstRow + j;
+          char * scanLine = block + j * rowSize;
+          unsigned char filterType = static_cast<unsigned char>(scanLine[0]);
+          DECODE_STATS_FILTER_TYPE(filterType);
+          if (converter == nullptr) {
+            Filter::UnfilterScanLine(filters, filterType, scanLine + 1, scanLineWidth, unfilteredData + row * scanLineWidth,
+              (row > 0) ? unfilteredData + (row - 1) * scanLineWidth : nullptr);
+            continue;
+          }
+          char * priorScanLine = (j > 0) ? scanLine - rowSize + 1 : (row > 0) ? blockPriorScanLine.data() : nullptr;
+          Filter::UnfilterScanLine(filters, filterType, scanLine + 1, scanLineWidth, scanLine + 1, priorScanLine);
+          converter->ConvertScanLine(scanLine + 1, width, unfilteredData + row * outputScanLineWidth);
+        }
+        if (converter != nullptr) {
+          std::memcpy(blockPriorScanLine.data(), block + (rows - 1) * rowSize + 1, scanLineWidth);
+        }
+        ring.CommitRead();
+      }
+    } catch(...) {
+      ring.Cancel();
+      inflater.join();
+      throw;
+    }
+    inflater.join();
+
+    if (!inflateError.empty()) {
+      throw std::runtime_error(inflateError);
+    }
+    return unfilteredDataSize;
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+}
+
+unsigned long PNG_Decoder::InflateInterlacedInto(char * compressedData, unsigned long compressedDataSize, const Chunk * chunk,
+  const Chunk * end, char * unfilteredData, unsigned long unfilteredDataCapacity, unsigned int width, unsigned int height,
+  unsigned char bitDepth, unsigned char colorType, const PassCallback& onPass, const PixelConverter * converter) {
+  z_stream stream;
+  bool streamOpen = false;
+  try {
+    unsigned long unfilteredDataSize = PNG_Decoder::GetOutputDataSize(width, height, bitDepth, colorType, converter);
+    if (unfilteredData == nullptr || unfilteredDataCapacity < unfilteredDataSize) {
+      throw std::invalid_argument("Unfiltered data buffer is too small: " + std::to_string(unfilteredDataSize) + " bytes required.");
+    }
+
+    unsigned long scanLineWidth = PNG_Decoder::GetScanLineWidth(width, bitDepth, colorType);
+    unsigned long outputScanLineWidth = unfilteredDataSize / height;
+    unsigned int outputBitsPerPixel = (converter == nullptr) ? PNG_Decoder::GetNumChannels(colorType) * bitDepth :
+      converter->GetOutputBitsPerPixel();
+    ScanLineFilters filters = Filter::GetScanLineFilters(PNG_Decoder::GetBytesPerPixel(bitDepth, colorType));
+
+    // Ring of two pass scan lines, each prefixed by its filter byte. No pass is wider than the image.
+    std::vector<char> scanLines(2 * (scanLineWidth + 1));
+    // Converted pass scan lines are scattered in the output format.
+    std::vector<char> convertedScanLine((converter == nullptr) ? 0 : outputScanLineWidth);
+    char * currentScanLine = scanLines.data();
+    char * priorScanLine = scanLines.data() + scanLineWidth + 1;
+
+    unsigned long compressedLeft = compressedDataSize;
+    stream = Inflate::CreateZStream(compressedData, 0, &currentScanLine, 0);
+    Inflate::ZInflateInit(&stream);
+    streamOpen = true;
+
+    DECODE_STATS_TIMER_EXCLUDING(DECODE_STAGES::UNFILTER, DECODE_STAGES::INFLATE);
+    DECODE_STATS_FILTER_COUNTER;
+    for (unsigned int pass = 0; pass < Interlace::numPasses; ++pass) {
+      // Small images have empty passes, which are not stored.
+      unsigned int passWidth = Interlace::GetPassWidth(pass, width);
+      unsigned int passHeight = (passWidth == 0) ? 0 : Interlace::GetPassHeight(pass, height);
+      unsigned long passScanLineWidth = PNG_Decoder::GetScanLineWidth(passWidth, bitDepth, colorType);
+
+      for (unsigned int i = 0; i < passHeight; ++i) {
+        stream.next_out = reinterpret_cast<Bytef *>(currentScanLine);
+        stream.avail_out = static_cast<unsigned int>(passScanLineWidth + 1);
+        Inflate::ZInflateFill(&stream, compressedLeft, chunk, end);
+
+        unsigned char filterType = static_cast<unsigned char>(currentScanLine[0]);
+        Filter::UnfilterScanLine(filters, filterType, currentScanLine + 1, passScanLineWidth, currentScanLine + 1,
+          (i > 0) ? priorScanLine + 1 : nullptr);
+        DECODE_STATS_FILTER_TYPE(filterType);
+        const char * passScanLine = currentScanLine + 1;
+        if (converter != nullptr) {
+          converter->ConvertScanLine(passScanLine, passWidth, convertedScanLine.data());
+          passScanLine = convertedScanLine.data();
+        }
+        unsigned long row = Interlace::yStart[pass] + static_cast<unsigned long>(i) * Interlace::yStep[pass];
+        Interlace::ScatterScanLine(passScanLine, pass, width, unfilteredData + row * outputScanLineWidth, outputBitsPerPixel);
+        std::swap(currentScanLine, priorScanLine);
+      }
+
+      if (onPass) {
+        Interlace::FillPassBlocks(unfilteredData, pass, width, height, outputBitsPerPixel, outputScanLineWidth);
+        onPass(unfilteredData, pass);
+      }
+    }
+
+    Inflate::ZInflateEnd(&stream);
+    return unfilteredDataSize;
+  } catch(const std::exception& e) {
+    if (streamOpen) {
+      Inflate::ZInflateEnd(&stream);
+    }
+    std::cerr << e.what() << std::endl;
+    return 0;
   }
 }
 
-void PNG_Decoder::RemoveUpFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, char * priorScanLine) {
-  for (unsigned int i = 0; i < scanLineWidth; ++i) {
-    unsigned int prior = (priorScanLine == nullptr) ? 0 : static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(priorScanLine + i));
-    unsigned int up = static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(scanLine + i));
-    unsigned int raw = (up + prior) % 256;
-    buffer[i] = static_cast<char>(raw);
+unsigned long PNG_Decoder::InflateRegionInto(char * compressedData, unsigned long compressedDataSize, const Chunk * chunk,
+  const Chunk * end, char * regionData, unsigned long regionDataCapacity, unsigned int width, unsigned int height, unsigned char bitDepth,
+  unsigned char colorType, unsigned char interlaceMethod, const Region& region, const PixelConverter * converter) {
+  z_stream stream;
+  bool streamOpen = false;
+  try {
+    if (region.firstRow >= region.lastRow || region.lastRow > height || region.firstColumn >= region.lastColumn ||
+      region.lastColumn > width) {
+      throw std::invalid_argument("Region is empty or outside the " + std::to_string(width) + "x" + std::to_string(height) + " image.");
+    }
+    unsigned int regionWidth = region.lastColumn - region.firstColumn;
+    unsigned int regionHeight = region.lastRow - region.firstRow;
+    unsigned long regionDataSize = PNG_Decoder::GetOutputDataSize(regionWidth, regionHeight, bitDepth, colorType, converter);
+    if (regionData == nullptr || regionDataCapacity < regionDataSize) {
+      throw std::invalid_argument("Region data buffer is too small: " + std::to_string(regionDataSize) + " bytes required.");
+    }
+    unsigned long regionScanLineWidth = regionDataSize / regionHeight;
+    unsigned int bitsPerPixel = PNG_Decoder::GetNumChannels(colorType) * bitDepth;
+    unsigned int outputBitsPerPixel = (converter == nullptr) ? bitsPerPixel : converter->GetOutputBitsPerPixel();
+
+    if (interlaceMethod == 1) {
+      unsigned long imageScanLineWidth = PNG_Decoder::GetOutputDataSize(width, 1, bitDepth, colorType, converter);
+      std::vector<char> image(PNG_Decoder::MultiplySizes(imageScanLineWidth, height));
+      if (PNG_Decoder::InflateInterlacedInto(compressedData, compressedDataSize, chunk, end, image.data(), image.size(), width, height,
+        bitDepth, colorType, nullptr, converter) == 0) {
+        return 0;
+      }
+      for (unsigned int i = 0; i < regionHeight; ++i) {
+        PNG_Decoder::CropScanLine(image.data() + static_cast<unsigned long>(region.firstRow + i) * imageScanLineWidth,
+          region.firstColumn, regionWidth, outputBitsPerPixel, regionData + i * regionScanLineWidth);
+      }
+      return regionDataSize;
+    }
+
+    // No filter reads to the right of the byte it restores, so scan lines are only unfiltered up to the region's last byte.
+    unsigned long scanLineWidth = PNG_Decoder::GetScanLineWidth(width, bitDepth, colorType);
+    unsigned long unfilteredWidth = PNG_Decoder::GetScanLineWidth(region.lastColumn, bitDepth, colorType);
+    ScanLineFilters filters = Filter::GetScanLineFilters(PNG_Decoder::GetBytesPerPixel(bitDepth, colorType));
+    // Byte-aligned pixels are converted from the region's first column; packed pixels are converted from column 0, then cropped.
+    unsigned int convertFrom = (bitsPerPixel % 8 == 0) ? region.firstColumn : 0;
+    std::vector<char> convertedScanLine((converter == nullptr) ? 0 : converter->GetOutputScanLineWidth(region.lastColumn));
+
+    /* Ring of three scan lines, each prefixed by its filter byte. A row above the region is left filtered until the
+    next row is inflated, and only unfiltered if that row's filter reads its prior scan line.*/
+    std::vector<char> scanLines(3 * (scanLineWidth + 1));
+    char * ring[3] = {scanLines.data(), scanLines.data() + scanLineWidth + 1, scanLines.data() + 2 * (scanLineWidth + 1)};
+
+    char * currentScanLine = ring[0];
+    unsigned long compressedLeft = compressedDataSize;
+    stream = Inflate::CreateZStream(compressedData, 0, &currentScanLine, 0);
+    Inflate::ZInflateInit(&stream);
+    streamOpen = true;
+
+    DECODE_STATS_TIMER_EXCLUDING(DECODE_STAGES::UNFILTER, DECODE_STAGES::INFLATE);
+    DECODE_STATS_FILTER_COUNTER;
+    for (unsigned int i = 0; i < region.lastRow; ++i) {
+      currentScanLine = ring[i % 3];
+      char * priorScanLine = (i > 0) ? ring[(i + 2) % 3] : nullptr;
+      stream.next_out = reinterpret_cast<Bytef *>(currentScanLine);
+      stream.avail_out = static_cast<unsigned int>(scanLineWidth + 1);
+      Inflate::ZInflateFill(&stream, compressedLeft, chunk, end);
+
+      unsigned char filterType = static_cast<unsigned char>(currentScanLine[0]);
+      bool readsPrior = (filterType != 0 && filterType != 1);
+      if (readsPrior && i > 0 && i - 1 < region.firstRow) {
+        // Row i - 2 was unfiltered in turn if row i - 1 reads it.
+        char * priorPriorScanLine = (i > 1) ? ring[(i + 1) % 3] + 1 : nullptr;
+        Filter::UnfilterScanLine(filters, static_cast<unsigned char>(priorScanLine[0]), priorScanLine + 1, unfilteredWidth,
+          priorScanLine + 1, priorPriorScanLine);
+        DECODE_STATS_FILTER_TYPE(static_cast<unsigned char>(priorScanLine[0]));
+      }
+      if (i < region.firstRow) {
+        continue;
+      }
+
+      Filter::UnfilterScanLine(filters, filterType, currentScanLine + 1, unfilteredWidth, currentScanLine + 1,
+        (i > 0) ? priorScanLine + 1 : nullptr);
+      DECODE_STATS_FILTER_TYPE(filterType);
+      char * output = regionData + static_cast<unsigned long>(i - region.firstRow) * regionScanLineWidth;
+      const char * scanLine = currentScanLine + 1 + static_cast<unsigned long>(convertFrom) * (bitsPerPixel / 8);
+      if (converter == nullptr) {
+        PNG_Decoder::CropScanLine(currentScanLine + 1, region.firstColumn, regionWidth, bitsPerPixel, output);
+      } else if (convertFrom == region.firstColumn) {
+        converter->ConvertScanLine(scanLine, regionWidth, output);
+      } else {
+        converter->ConvertScanLine(scanLine, region.lastColumn, convertedScanLine.data());
+        PNG_Decoder::CropScanLine(convertedScanLine.data(), region.firstColumn, regionWidth, outputBitsPerPixel, output);
+      }
+    }
+
+    // Stop without inflating the rows below the region.
+    Inflate::ZInflateEnd(&stream);
+    return regionDataSize;
+  } catch(const std::exception& e) {
+    if (streamOpen) {
+      Inflate::ZInflateEnd(&stream);
+    }
+    std::cerr << e.what() << std::endl;
+    return 0;
   }
 }
 
-void PNG_Decoder::RemoveAverageFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp, char * priorScanLine) {
-  for (unsigned int i = 0; i < scanLineWidth; ++i) {
-    unsigned int priorSub = (bpp > i) ? 0 : static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(buffer + (i - bpp)));
-    unsigned int priorUp = (priorScanLine == nullptr) ? 0 : static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(priorScanLine + i));
-    unsigned int average = static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(scanLine + i));
-    unsigned int raw = (average + ((priorSub + priorUp) / 2)) % 256;
-    buffer[i] = static_cast<char>(raw);
+std::vector<StreamSegment> PNG_Decoder::FindSegments(const Chunk * chunk, const Chunk * end, unsigned int height, bool scanFullFlush) {
+  const Chunk * firstIdat = chunk;
+  const Chunk * idot = nullptr;
+  while (firstIdat != end && firstIdat->GetChunkType() != ChunkType::IDAT) {
+    if (firstIdat->GetChunkType() == ChunkType::iDOT) {
+      idot = firstIdat;
+    }
+    ++firstIdat;
+  }
+  std::vector<StreamSegment> segments;
+
+  /* iDOT holds the number of segments, then the first row, number of rows and offset of the first IDAT chunk
+  of each segment, counted from the start of the iDOT chunk. It is ancillary, so an invalid one is ignored.*/
+  if (idot != nullptr && idot->GetDataLength() >= 4 && firstIdat != end) {
+    const char * data = idot->GetChunkData();
+    unsigned int numSegments = Endian::ToHost(*reinterpret_cast<const unsigned int *>(data));
+    bool valid = numSegments > 1 && idot->GetDataLength() == 4 + 12ul * numSegments;
+    const Chunk * idat = firstIdat;
+    unsigned int nextRow = 0;
+    for (unsigned int i = 0; valid && i < numSegments; ++i) {
+      const char * entry = data + 4 + 12ul * i;
+      unsigned int firstRow = Endian::ToHost(*reinterpret_cast<const unsigned int *>(entry));
+      unsigned int numRows = Endian::ToHost(*reinterpret_cast<const unsigned int *>(entry + 4));
+      unsigned long chunkOffset = Endian::ToHost(*reinterpret_cast<const unsigned int *>(entry + 8));
+      while (idat != end && static_cast<unsigned long>(idat->GetChunk() - idot->GetChunk()) < chunkOffset) {
+        ++idat;
+      }
+      valid = firstRow == nextRow && numRows > 0 && numRows <= height - nextRow && idat != end &&
+        static_cast<unsigned long>(idat->GetChunk() - idot->GetChunk()) == chunkOffset && idat->GetChunkType() == ChunkType::IDAT &&
+        (i > 0 || idat == firstIdat) && (i == 0 || idat != segments.back().chunk);
+      segments.push_back({idat, 0, firstRow, numRows});
+      nextRow += numRows;
+    }
+    if (valid && nextRow == height) {
+      return segments;
+    }
+    segments.clear();
   }
+
+  if (scanFullFlush && firstIdat != end) {
+    /* A full flush ends with an empty stored block, 00 00 FF FF, and the stream restarts right after it. These
+    bytes may also occur by chance; InflateSegments rejects those. Flushes split across two chunks are not found.*/
+    const char pattern[] = {0, 0, static_cast<char>(0xFF), static_cast<char>(0xFF)};
+    std::boyer_moore_horspool_searcher<const char *> searcher(pattern, pattern + 4);
+    const unsigned long minimumSpacing = 65536;
+    unsigned long compressedSize = 0;
+    for (const Chunk * idat = firstIdat; idat != end; ++idat) {
+      compressedSize += (idat->GetChunkType() == ChunkType::IDAT) ? idat->GetDataLength() : 0;
+    }
+    segments.push_back({firstIdat, 0, 0, 0});
+    unsigned long position = 0;
+    unsigned long lastStart = 0;
+    for (const Chunk * idat = firstIdat; idat != end; ++idat) {
+      if (idat->GetChunkType() != ChunkType::IDAT) {
+        continue;
+      }
+      const char * data = idat->GetChunkData();
+      const char * dataEnd = data + idat->GetDataLength();
+      for (const char * found = std::search(data, dataEnd, searcher); found != dataEnd; found = std::search(found, dataEnd, searcher)) {
+        found += 4;
+        unsigned long start = position + static_cast<unsigned long>(found - data);
+        if (start - lastStart >= minimumSpacing && compressedSize - start >= minimumSpacing) {
+          segments.push_back({idat, static_cast<unsigned long>(found - data), 0, 0});
+          lastStart = start;
+        }
+      }
+      position += idat->GetDataLength();
+    }
+    if (segments.size() > 1) {
+      return segments;
+    }
+    segments.clear();
+  }
+
+  segments.push_back({firstIdat, 0, 0, height});
+  return segments;
 }
 
-unsigned int PNG_Decoder::PaethPredictor(int priorSub, int priorUp, int priorUpSub) {
-  int a = priorSub;
-  int b = priorUp;
-  int c = priorUpSub;
-  int p = a + b - c;
-  int pa = std::abs(p - a);
-  int pb = std::abs(p - b);
-  int pc = std::abs(p - c);
-  if (pa == pb && pb == pc) {
-    if (pa <= pb && pa <= pc) {
-      return static_cast<unsigned int>(a);
-    } else if (pb <= pc) {
-      return static_cast<unsigned int>(b);
+bool PNG_Decoder::InflateSegments(const std::vector<StreamSegment>& segments, const Chunk * end, char * decompressedData,
+  unsigned long decompressedDataSize, unsigned long rowSize, ThreadPool& pool, std::vector<unsigned int>& firstRows) {
+  size_t numSegments = segments.size();
+  bool rowsKnown = segments[0].numRows > 0;
+  // Segments found by scanning are inflated into buffers of their own, then copied into place once their sizes are known.
+  std::vector<std::vector<char>> grown(numSegments);
+  std::vector<unsigned long> sizes(numSegments);
+  try {
+    PNG_Decoder::RunTasks(pool, numSegments, [&](unsigned long i) {
+      const StreamSegment& segment = segments[i];
+      const StreamSegment * next = (i + 1 < numSegments) ? &segments[i + 1] : nullptr;
+      if (rowsKnown) {
+        Inflate::InflateSegment(segment, next, end, i == 0, decompressedData + segment.firstRow * rowSize, segment.numRows * rowSize,
+          grown[i]);
+      } else {
+        sizes[i] = Inflate::InflateSegment(segment, next, end, i == 0, nullptr, decompressedDataSize, grown[i]);
+      }
+    });
+  } catch(const std::exception&) {
+    return false;
+  }
+
+  firstRows.clear();
+  if (rowsKnown) {
+    for (const StreamSegment& segment : segments) {
+      firstRows.push_back(segment.firstRow);
+    }
+    return true;
+  }
+  std::vector<unsigned long> offsets(numSegments + 1, 0);
+  for (size_t i = 0; i < numSegments; ++i) {
+    offsets[i + 1] = offsets[i] + sizes[i];
+  }
+  if (offsets[numSegments] < decompressedDataSize) {
+    return false;
+  }
+  PNG_Decoder::RunTasks(pool, numSegments, [&](unsigned long i) {
+    if (offsets[i] < decompressedDataSize) {
+      std::memcpy(decompressedData + offsets[i], grown[i].data(), std::min(sizes[i], decompressedDataSize - offsets[i]));
+    }
+    grown[i] = std::vector<char>();
+  });
+  // Each band starts at the first whole row of a segment.
+  unsigned long numRows = decompressedDataSize / rowSize;
+  for (size_t i = 0; i < numSegments; ++i) {
+    unsigned long row = (offsets[i] + rowSize - 1) / rowSize;
+    if (row < numRows && (firstRows.empty() || row > firstRows.back())) {
+      firstRows.push_back(static_cast<unsigned int>(row));
+    }
+  }
+  return true;
+}
+
+std::vector<unsigned int> PNG_Decoder::FindRestartRows(const char * decompressedData, unsigned long rowSize, unsigned int height,
+  unsigned int numThreads) {
+  unsigned long maxBands = std::min<unsigned long>(4ul * numThreads, rowSize * height / 65536);
+  std::vector<unsigned int> firstRows(1, 0);
+  unsigned long row = 1;
+  for (unsigned long band = 1; band < maxBands; ++band) {
+    // Each band starts at the first restart row at or after its even share of the image.
+    row = std::max(row, static_cast<unsigned long>(height) * band / maxBands);
+    while (row < height && static_cast<unsigned char>(decompressedData[row * rowSize]) > 1) {
+      ++row;
+    }
+    if (row >= height) {
+      break;
+    }
+    firstRows.push_back(static_cast<unsigned int>(row));
+    row += 1;
+  }
+  return firstRows;
+}
+
+void PNG_Decoder::UnfilterBandsInto(char * decompressedData, char * unfilteredData, const std::vector<unsigned int>& firstRows,
+  unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType, const PixelConverter * converter,
+  bool inPlace, ThreadPool& pool) {
+  unsigned long scanLineWidth = PNG_Decoder::GetScanLineWidth(width, bitDepth, colorType);
+  unsigned long rowSize = scanLineWidth + 1;
+  unsigned long outputScanLineWidth = PNG_Decoder::GetOutputDataSize(width, height, bitDepth, colorType, converter) / height;
+  ScanLineFilters filters = Filter::GetScanLineFilters(PNG_Decoder::GetBytesPerPixel(bitDepth, colorType));
+  // Timed once on the calling thread. Each band counts its rows in a counter of its own, added up when this returns.
+  DECODE_STATS_TIMER(DECODE_STAGES::UNFILTER);
+#ifdef PNG_DECODER_STATS
+  std::vector<FilterTypeCounter> bandCounters(firstRows.size());
+#endif
+  auto unfilterBand = [&](unsigned long band) {
+    unsigned long firstRow = firstRows[band];
+    unsigned long lastRow = (band + 1 < firstRows.size()) ? firstRows[band + 1] : height;
+    // Converted rows not unfiltered in place go through a ring of two scan lines of the band's own.
+    std::vector<char> scanLines((converter == nullptr || inPlace) ? 0 : 2 * scanLineWidth);
+    char * currentScanLine = scanLines.data();
+    char * ringPriorScanLine = currentScanLine + scanLines.size() / 2;
+    for (unsigned long row = firstRow; row < lastRow; ++row) {
+      char * scanLine = decompressedData + row * rowSize;
+      unsigned char filterType = static_cast<unsigned char>(scanLine[0]);
+      bool restart = row == 0 || (row == firstRow && filterType < 2);
+      char * output = unfilteredData + row * scanLineWidth;
+      char * priorScanLine = restart ? nullptr : output - scanLineWidth;
+      if (converter != nullptr && inPlace) {
+        output = scanLine + 1;
+        priorScanLine = restart ? nullptr : scanLine - rowSize + 1;
+      } else if (converter != nullptr) {
+        output = currentScanLine;
+        priorScanLine = restart ? nullptr : ringPriorScanLine;
+      }
+      Filter::UnfilterScanLine(filters, filterType, scanLine + 1, scanLineWidth, output, priorScanLine);
+#ifdef PNG_DECODER_STATS
+      bandCounters[band].Add(filterType);
+#endif
+      if (converter != nullptr) {
+        converter->ConvertScanLine(output, width, unfilteredData + row * outputScanLineWidth);
+        std::swap(currentScanLine, ringPriorScanLine);
+      }
+    }
+  };
+
+  std::vector<unsigned long> independentBands;
+  std::vector<unsigned long> dependentBands;
+  for (unsigned long band = 0; band < firstRows.size(); ++band) {
+    unsigned char filterType = static_cast<unsigned char>(decompressedData[static_cast<unsigned long>(firstRows[band]) * rowSize]);
+    if (firstRows[band] == 0 || filterType < 2) {
+      independentBands.push_back(band);
     } else {
-      return static_cast<unsigned int>(c);
+      dependentBands.push_back(band);
     }
-  } else {
-    int nearest = a;
-    int smallest = pa;
-    if (pb < smallest) {
-      nearest = b;
-      smallest = pb;
+  }
+  PNG_Decoder::RunTasks(pool, independentBands.size(), [&](unsigned long i) {
+    unfilterBand(independentBands[i]);
+  });
+  for (unsigned long band : dependentBands) {
+    unfilterBand(band);
+  }
+}
+
+unsigned long PNG_Decoder::InflateSegmentsInto(const Chunk * chunk, const Chunk * end, char * unfilteredData,
+  unsigned long unfilteredDataCapacity, unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType,
+  unsigned char interlaceMethod, bool scanFullFlush, const PixelConverter * converter, ThreadPool * pool) {
+  if (interlaceMethod == 0) {
+    try {
+      std::vector<StreamSegment> segments = PNG_Decoder::FindSegments(chunk, end, height, scanFullFlush);
+      if (segments.size() > 1) {
+        unsigned long unfilteredDataSize = PNG_Decoder::GetOutputDataSize(width, height, bitDepth, colorType, converter);
+        if (unfilteredData == nullptr || unfilteredDataCapacity < unfilteredDataSize) {
+          throw std::invalid_argument("Unfiltered data buffer is too small: " + std::to_string(unfilteredDataSize) + " bytes required.");
+        }
+        ThreadPool& threads = (pool == nullptr) ? PNG_Decoder::GetSharedPool() : *pool;
+        std::vector<char> decompressedData(PNG_Decoder::GetDecompressedDataSize(width, height, bitDepth, colorType));
+        DECODE_STATS_ALLOCATION(decompressedData.size(), false);
+        unsigned long rowSize = decompressedData.size() / height;
+        std::vector<unsigned int> firstRows;
+        if (PNG_Decoder::InflateSegments(segments, end, decompressedData.data(), decompressedData.size(), rowSize, threads, firstRows)) {
+          // Restart rows also split segments whose first row reads the row above, so fewer bands wait for the one before.
+          std::vector<unsigned int> restartRows = PNG_Decoder::FindRestartRows(decompressedData.data(), rowSize, height,
+            threads.GetNumThreads());
+          std::vector<unsigned int> bandRows;
+          std::set_union(firstRows.begin(), firstRows.end(), restartRows.begin(), restartRows.end(), std::back_inserter(bandRows));
+          PNG_Decoder::UnfilterBandsInto(decompressedData.data(), unfilteredData, bandRows, width, height, bitDepth, colorType, converter,
+            true, threads);
+          return unfilteredDataSize;
+        }
+      }
+    } catch(const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return 0;
+    }
+  }
+  // No segments, or segments that are not independent after all: decode serially, which also reports corrupt data.
+  return PNG_Decoder::InflateUnfilteredInto(nullptr, 0, chunk, end, unfilteredData, unfilteredDataCapacity, width, height, bitDepth,
+    colorType, interlaceMethod, false, converter);
+}
+
+void PNG_Decoder::RunTasks(ThreadPool& pool, unsigned long count, const std::function<void(unsigned long)>& task) {
+  std::vector<std::string> errors(count);
+#ifdef PNG_DECODER_STATS
+  DecodeStats * stats = DecodeStats::current;
+  std::vector<DecodeStats> taskStats(count);
+#endif
+  pool.ParallelFor(count, [&](unsigned long i) {
+#ifdef PNG_DECODER_STATS
+    // Tasks may also run on the calling thread, so its stats are restored afterwards.
+    DecodeStats * previous = DecodeStats::current;
+    DecodeStats::current = (stats == nullptr) ? nullptr : &taskStats[i];
+#endif
+    try {
+      task(i);
+    } catch(const std::exception& e) {
+      errors[i] = e.what();
     }
-    if (pc < smallest) {
-      nearest = c;
+#ifdef PNG_DECODER_STATS
+    DecodeStats::current = previous;
+#endif
+  });
+#ifdef PNG_DECODER_STATS
+  for (unsigned long i = 0; stats != nullptr && i < count; ++i) {
+    stats->Add(taskStats[i]);
+  }
+#endif
+  for (const std::string& error : errors) {
+    if (!error.empty()) {
+      throw std::runtime_error(error);
     }
-    return static_cast<unsigned int>(nearest);
   }
 }
 
-void PNG_Decoder::RemovePaethFilter(char * scanLine, unsigned int scanLineWidth, char * buffer, unsigned int bpp, char * priorScanLine) {
-  for (unsigned int i = 0; i < scanLineWidth; ++i) {
-    int priorSub = (bpp > i) ? 0 : static_cast<int>(*reinterpret_cast<unsigned char *>(buffer + (i - bpp)));
-    int priorUp = (priorScanLine == nullptr) ? 0 : static_cast<int>(*reinterpret_cast<unsigned char *>(priorScanLine + i));
-    int priorUpSub = (priorSub == 0 || priorUp == 0) ? 0 : static_cast<int>(*reinterpret_cast<unsigned char *>(priorScanLine + (i - bpp)));
-    unsigned int paeth = static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(scanLine + i));
-    unsigned int raw = (paeth + PNG_Decoder::PaethPredictor(priorSub, priorUp, priorUpSub)) % 256;
-    buffer[i] = static_cast<char>(raw);
+ThreadPool& PNG_Decoder::GetSharedPool() {
+  static ThreadPool pool;
+  return pool;
+}
+
+void PNG_Decoder::CropScanLine(const char * scanLine, unsigned int firstColumn, unsigned int width, unsigned int bitsPerPixel,
+  char * output) {
+  unsigned long firstBit = static_cast<unsigned long>(firstColumn) * bitsPerPixel;
+  unsigned long bits = static_cast<unsigned long>(width) * bitsPerPixel;
+  unsigned long bytes = (bits + 7) / 8;
+  const unsigned char * input = reinterpret_cast<const unsigned char *>(scanLine) + firstBit / 8;
+  unsigned int shift = static_cast<unsigned int>(firstBit % 8);
+  if (shift == 0) {
+    std::memcpy(output, input, bytes);
+  } else {
+    // The last output byte may only need bits from its own input byte; never read past the cropped pixels.
+    unsigned long lastByte = (shift + bits - 1) / 8;
+    for (unsigned long i = 0; i < bytes; ++i) {
+      unsigned int next = (i + 1 <= lastByte) ? input[i + 1] : 0;
+      output[i] = static_cast<char>((input[i] << shift) | (next >> (8 - shift)));
+    }
+  }
+  if (bits % 8 != 0) {
+    // Clear the padding bits after the last pixel.
+    output[bytes - 1] = static_cast<char>(output[bytes - 1] & (0xFF << (8 - bits % 8)));
   }
 }
 
+char * PNG_Decoder::GetScratch(DecoderContext * context, SCRATCH_BUFFERS buffer, unsigned long size, std::vector<char>& fallback) {
+  if (context != nullptr) {
+    return context->GetBuffer(buffer, size);
+  }
+  fallback.resize(size);
+  return fallback.data();
+}
+
 // Constructors & Deconstructors
 PNG_Decoder::PNG_Decoder() {
   this->fileName = "";
   this->fileSize = 0;
   this->bytes = nullptr;
+  this->loadType = LOAD_TYPES::STREAM;
+  this->mapped = false;
+  this->borrowed = false;
+  this->verifyCrc = true;
   this->numChunks = 0;
 }
 
-PNG_Decoder::PNG_Decoder(std::filesystem::path fileName) {
+PNG_Decoder::PNG_Decoder(std::filesystem::path fileName, LOAD_TYPES loadType, bool verifyCrc) {
   this->fileName = fileName;
+  this->fileSize = 0;
   this->bytes = nullptr;
+  this->loadType = loadType;
+  this->mapped = false;
+  this->borrowed = false;
+  this->verifyCrc = verifyCrc;
+  this->numChunks = 0;
   this->LoadBytes();
   this->LoadChunks();
 }
 
+PNG_Decoder::PNG_Decoder(const uint8_t * data, size_t size, bool verifyCrc) {
+  this->fileName = "";
+  this->fileSize = 0;
+  this->bytes = nullptr;
+  this->loadType = LOAD_TYPES::BUFFER;
+  this->mapped = false;
+  this->borrowed = false;
+  this->verifyCrc = verifyCrc;
+  this->numChunks = 0;
+  this->BorrowBytes(data, size);
+  this->LoadChunks();
+}
+
 PNG_Decoder::~PNG_Decoder() {
   this->Close();
 }
@@ -215,6 +1045,14 @@ char * PNG_Decoder::GetBytes() const {
   return this->bytes;
 }
 
+LOAD_TYPES PNG_Decoder::GetLoadType() const {
+  return this->loadType;
+}
+
+bool PNG_Decoder::GetVerifyCrc() const {
+  return this->verifyCrc;
+}
+
 int PNG_Decoder::GetNumChunks() const {
   return this->numChunks;
 }
@@ -282,23 +1120,35 @@ unsigned char PNG_Decoder::GetInterlaceMethod() const {
 }
 
 // Methods
-void PNG_Decoder::Open(const std::filesystem::path fileName) {
+void PNG_Decoder::Open(const std::filesystem::path fileName, LOAD_TYPES loadType, bool verifyCrc) {
   this->fileName = fileName;
+  this->loadType = loadType;
+  this->verifyCrc = verifyCrc;
   this->LoadBytes();
   this->LoadChunks();
 }
 
+void PNG_Decoder::Open(const uint8_t * data, size_t size, bool verifyCrc) {
+  this->fileName = "";
+  this->loadType = LOAD_TYPES::BUFFER;
+  this->verifyCrc = verifyCrc;
+  this->BorrowBytes(data, size);
+  this->LoadChunks();
+}
+
 void PNG_Decoder::Close() {
   this->fileName = "";
-  std::free(this->bytes);
-  this->bytes = nullptr;
+  this->numChunks = 0;
+  this->chunks.resize(0);
+  this->ReleaseBytes();
 }
 
 bool PNG_Decoder::IsOpen() const {
-  return this->fileName.string().compare("") != 0 && this->bytes != nullptr && this->chunks.size() != 0;
+  return this->bytes != nullptr && this->chunks.size() != 0;
 }
 
 unsigned long PNG_Decoder::AllocateCompressedData(char *& compressedData) const {
+  DECODE_STATS_TIMER(DECODE_STAGES::IDAT_GATHER);
   try {
     if (!this->IsOpen()) {
       throw std::runtime_error("Failed to get data size because a PNG is not open.");
@@ -313,18 +1163,20 @@ unsigned long PNG_Decoder::AllocateCompressedData(char *& compressedData) const
 
     if (compressedData == nullptr) {
       compressedData = static_cast<char *>(std::malloc(compressedDataSize * sizeof(char)));
+      DECODE_STATS_ALLOCATION(compressedDataSize, false);
     } else {
       compressedData = static_cast<char *>(std::realloc(compressedData, compressedDataSize * sizeof(char)));
+      DECODE_STATS_ALLOCATION(compressedDataSize, true);
     }
 
     if (compressedData == nullptr) {
       throw std::runtime_error("Failed to allocate memory to store the compressed data.");
     }
 
-    unsigned int currentIndex = 0;
+    unsigned long currentIndex = 0;
     for (const Chunk& chunk: this->chunks) {
       if (chunk.GetChunkType() == ChunkType::IDAT) {
-        std::copy(chunk.GetChunkData(), chunk.GetChunkData() + chunk.GetDataLength() + 1, compressedData + currentIndex);
+        std::copy(chunk.GetChunkData(), chunk.GetChunkData() + chunk.GetDataLength(), compressedData + currentIndex);
         currentIndex += chunk.GetDataLength();
       }
     }
@@ -339,80 +1191,665 @@ unsigned long PNG_Decoder::AllocateCompressedData(char *& compressedData) const
   
 }
 
-unsigned long PNG_Decoder::AllocateDecompressedData(char * compressedData, unsigned long compressedDataSize, char *& decompressedData) {
+unsigned long PNG_Decoder::AllocateDecompressedData(char * compressedData, unsigned long compressedDataSize, char *& decompressedData,
+  unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType, unsigned char interlaceMethod) {
+  unsigned long decompressedDataSize = 0;
   try {
-    if (compressedDataSize > UINT_MAX) {
-      throw std::invalid_argument("Compressed data size is too large for this decoder.");
-    }
+    decompressedDataSize = PNG_Decoder::GetDecompressedDataSize(width, height, bitDepth, colorType, interlaceMethod);
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
 
-    if (decompressedData == nullptr) {
-      decompressedData = static_cast<char *>(std::malloc(UINT_MAX * sizeof(char)));
-    } else {
-      decompressedData = static_cast<char *>(std::realloc(decompressedData, UINT_MAX * sizeof(char)));
+  if (decompressedData == nullptr) {
+    decompressedData = static_cast<char *>(std::malloc(decompressedDataSize * sizeof(char)));
+    DECODE_STATS_ALLOCATION(decompressedDataSize, false);
+  } else {
+    decompressedData = static_cast<char *>(std::realloc(decompressedData, decompressedDataSize * sizeof(char)));
+    DECODE_STATS_ALLOCATION(decompressedDataSize, true);
+  }
+
+  if (decompressedData == nullptr) {
+    std::cerr << "Failed to allocate memory to store the decompressed data." << std::endl;
+    return 0;
+  }
+
+  if (PNG_Decoder::DecompressDataInto(compressedData, compressedDataSize, decompressedData, decompressedDataSize,
+    width, height, bitDepth, colorType, interlaceMethod) == 0) {
+    std::free(decompressedData);
+    decompressedData = nullptr;
+    return 0;
+  }
+  return decompressedDataSize;
+}
+
+unsigned long PNG_Decoder::AllocateUnfilteredData(char * decompressedData, char *& unfilteredData, unsigned int width,
+  unsigned int height, unsigned char bitDepth, unsigned char colorType, unsigned char interlaceMethod, const PixelConverter * converter,
+  ThreadPool * pool) {
+  unsigned long unfilteredDataSize = 0;
+  try {
+    unfilteredDataSize = PNG_Decoder::GetOutputDataSize(width, height, bitDepth, colorType, converter);
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+
+  if (unfilteredData == nullptr) {
+    unfilteredData = static_cast<char *>(std::malloc(unfilteredDataSize * sizeof(char)));
+    DECODE_STATS_ALLOCATION(unfilteredDataSize, false);
+  } else {
+    unfilteredData = static_cast<char *>(std::realloc(unfilteredData, unfilteredDataSize * sizeof(char)));
+    DECODE_STATS_ALLOCATION(unfilteredDataSize, true);
+  }
+
+  if (unfilteredData == nullptr) {
+    std::cerr << "Failed to allocate memory to store the unfiltered data." << std::endl;
+    return 0;
+  }
+
+  if (PNG_Decoder::UnfilterDataInto(decompressedData, unfilteredData, unfilteredDataSize, width, height, bitDepth, colorType,
+    interlaceMethod, converter, nullptr, pool) == 0) {
+    std::free(unfilteredData);
+    unfilteredData = nullptr;
+    return 0;
+  }
+  return unfilteredDataSize;
+}
+
+bool PNG_Decoder::Probe(const std::filesystem::path& fileName, IHDR& ihdr) {
+  int fileDescriptor = -1;
+  try {
+    fileDescriptor = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fileDescriptor < 0) {
+      throw std::runtime_error("Failed to open file descriptor for '" + fileName.string() + "'.");
     }
 
-    if (decompressedData == nullptr) {
-      throw std::runtime_error("Failed to allocate memory to store the decompressed data.");
+    // Signature, then the IHDR chunk: length, type, 13 bytes of data and CRC.
+    char bytes[33];
+    ssize_t bytesRead = pread(fileDescriptor, bytes, sizeof(bytes), 0);
+    ::close(fileDescriptor);
+    fileDescriptor = -1;
+    if (bytesRead != static_cast<ssize_t>(sizeof(bytes))) {
+      throw std::invalid_argument("'" + fileName.string() + "' is too small to contain a signature and IHDR chunk.");
     }
 
-    z_stream stream = Inflate::CreateZStream(compressedData, static_cast<unsigned int>(compressedDataSize), &decompressedData, UINT_MAX);
-    Inflate::ZInflate(&stream, &decompressedData);
-    return stream.total_out;
+    PNG_Decoder::ReadIhdr(bytes, ihdr);
+    return true;
+  } catch(const std::exception& e) {
+    if (fileDescriptor >= 0) {
+      ::close(fileDescriptor);
+    }
+    std::cerr << e.what() << std::endl;
+    return false;
+  }
+}
 
+bool PNG_Decoder::Probe(const uint8_t * data, size_t size, IHDR& ihdr) {
+  try {
+    if (data == nullptr || size < 33) {
+      throw std::invalid_argument("The PNG buffer is too small to contain a signature and IHDR chunk.");
+    }
+    PNG_Decoder::ReadIhdr(reinterpret_cast<const char *>(data), ihdr);
+    return true;
   } catch(const std::exception& e) {
-    std::free(decompressedData);
-    decompressedData = nullptr;
     std::cerr << e.what() << std::endl;
+    return false;
+  }
+}
+
+unsigned long PNG_Decoder::GetDecompressedDataSize(unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType,
+  unsigned char interlaceMethod) {
+  if (interlaceMethod != 1) {
+    unsigned long scanLineWidth = PNG_Decoder::GetScanLineWidth(width, bitDepth, colorType);
+    return PNG_Decoder::MultiplySizes(scanLineWidth + 1, height);
+  }
+
+  unsigned long decompressedDataSize = 0;
+  for (unsigned int pass = 0; pass < Interlace::numPasses; ++pass) {
+    unsigned int passWidth = Interlace::GetPassWidth(pass, width);
+    if (passWidth > 0) {
+      unsigned long passScanLineWidth = PNG_Decoder::GetScanLineWidth(passWidth, bitDepth, colorType);
+      unsigned long passSize = PNG_Decoder::MultiplySizes(passScanLineWidth + 1, Interlace::GetPassHeight(pass, height));
+      if (passSize > ULONG_MAX - decompressedDataSize) {
+        throw std::overflow_error("The image is too large: its size does not fit in " + std::to_string(8 * sizeof(unsigned long)) +
+          " bits.");
+      }
+      decompressedDataSize += passSize;
+    }
+  }
+  return decompressedDataSize;
+}
+
+unsigned long PNG_Decoder::GetUnfilteredDataSize(unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType) {
+  unsigned long scanLineWidth = PNG_Decoder::GetScanLineWidth(width, bitDepth, colorType);
+  return PNG_Decoder::MultiplySizes(scanLineWidth, height);
+}
+
+unsigned long PNG_Decoder::GetRegionDataSize(const Region& region, unsigned char bitDepth, unsigned char colorType) {
+  if (region.firstRow >= region.lastRow || region.firstColumn >= region.lastColumn) {
     return 0;
   }
+  return PNG_Decoder::GetUnfilteredDataSize(region.lastColumn - region.firstColumn, region.lastRow - region.firstRow, bitDepth, colorType);
 }
 
-unsigned long PNG_Decoder::AllocateUnfilteredData(char * decompressedData, char *& unfilteredData, unsigned int width,
-  unsigned int height, unsigned char bitDepth, unsigned char colorType) {
+unsigned long PNG_Decoder::DecompressDataInto(char * compressedData, unsigned long compressedDataSize, char * decompressedData,
+  unsigned long decompressedDataCapacity, unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType,
+  unsigned char interlaceMethod) {
+  return PNG_Decoder::InflateDataInto(compressedData, compressedDataSize, nullptr, nullptr, decompressedData, decompressedDataCapacity,
+    width, height, bitDepth, colorType, interlaceMethod, nullptr);
+}
+
+unsigned long PNG_Decoder::UnfilterDataInto(char * decompressedData, char * unfilteredData, unsigned long unfilteredDataCapacity,
+  unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType, unsigned char interlaceMethod,
+  const PixelConverter * converter, DecoderContext * context, ThreadPool * pool) {
   try {
     unsigned int numScanLines = height;
-    unsigned int channels = PNG_Decoder::GetNumChannels(colorType);
-    double exactScanLineWidth = (width * channels * static_cast<unsigned int>(bitDepth)) / 8.0;
-    unsigned int scanLineWidth = static_cast<unsigned int>(std::ceil(exactScanLineWidth)); // In bytes, NOT INCLUDING FILTER BYTE
-    unsigned int unfilteredDataSize = scanLineWidth * height; // In bytes
-    unsigned int bpp = channels * static_cast<unsigned int>(bitDepth) / 8;
-    bpp = (bpp == 0) ? 1 : bpp;
-
-    if (unfilteredData == nullptr) {
-      unfilteredData = static_cast<char *>(std::malloc(unfilteredDataSize * sizeof(char)));
-    } else {
-      unfilteredData = static_cast<char *>(std::realloc(unfilteredData, unfilteredDataSize * sizeof(char)));
+    unsigned long scanLineWidth = PNG_Decoder::GetScanLineWidth(width, bitDepth, colorType);
+    unsigned long unfilteredDataSize = PNG_Decoder::GetOutputDataSize(width, height, bitDepth, colorType, converter); // In bytes
+    unsigned long outputScanLineWidth = (height == 0) ? 0 : unfilteredDataSize / height;
+    ScanLineFilters filters = Filter::GetScanLineFilters(PNG_Decoder::GetBytesPerPixel(bitDepth, colorType));
+
+    if (unfilteredData == nullptr || unfilteredDataCapacity < unfilteredDataSize) {
+      throw std::invalid_argument("Unfiltered data buffer is too small: " + std::to_string(unfilteredDataSize) + " bytes required.");
     }
 
-    for (unsigned int i = 0; i < numScanLines; ++i) {
-      unsigned int currentIndex = i * (scanLineWidth + 1);
-      unsigned int filterType = static_cast<unsigned int>(*reinterpret_cast<unsigned char *>(decompressedData + currentIndex));
+    // Banded images are timed and counted by UnfilterBandsInto instead.
+    DECODE_STATS_FILTER_COUNTER;
+    if (interlaceMethod == 1) {
+      DECODE_STATS_TIMER(DECODE_STAGES::UNFILTER);
+      // Unfilter each pass into a ring of two pass scan lines, then scatter the pixels into the image.
+      unsigned int bitsPerPixel = (converter == nullptr) ? PNG_Decoder::GetNumChannels(colorType) * bitDepth :
+        converter->GetOutputBitsPerPixel();
+      std::vector<char> scanLines;
+      std::vector<char> convertedScanLines;
+      char * currentScanLine = PNG_Decoder::GetScratch(context, SCRATCH_BUFFERS::SCAN_LINE_BUFFER,
+        2 * scanLineWidth, scanLines);
+      char * priorScanLine = currentScanLine + scanLineWidth;
+      char * convertedScanLine = (converter == nullptr) ? nullptr :
+        PNG_Decoder::GetScratch(context, SCRATCH_BUFFERS::CONVERTED_BUFFER, outputScanLineWidth, convertedScanLines);
+      unsigned long currentIndex = 0;
+      for (unsigned int pass = 0; pass < Interlace::numPasses; ++pass) {
+        unsigned int passWidth = Interlace::GetPassWidth(pass, width);
+        unsigned int passHeight = Interlace::GetPassHeight(pass, height);
+        if (passWidth == 0 || passHeight == 0) {
+          continue;
+        }
+        unsigned long passScanLineWidth = PNG_Decoder::GetScanLineWidth(passWidth, bitDepth, colorType);
+        for (unsigned int i = 0; i < passHeight; ++i) {
+          unsigned char filterType = *reinterpret_cast<unsigned char *>(decompressedData + currentIndex);
+          Filter::UnfilterScanLine(filters, filterType, decompressedData + currentIndex + 1, passScanLineWidth, currentScanLine,
+            (i > 0) ? priorScanLine : nullptr);
+          DECODE_STATS_FILTER_TYPE(filterType);
+          const char * passScanLine = currentScanLine;
+          if (converter != nullptr) {
+            converter->ConvertScanLine(currentScanLine, passWidth, convertedScanLine);
+            passScanLine = convertedScanLine;
+          }
+          unsigned long row = Interlace::yStart[pass] + static_cast<unsigned long>(i) * Interlace::yStep[pass];
+          Interlace::ScatterScanLine(passScanLine, pass, width, unfilteredData + row * outputScanLineWidth, bitsPerPixel);
+          std::swap(currentScanLine, priorScanLine);
+          currentIndex += passScanLineWidth + 1;
+        }
+      }
+      return unfilteredDataSize;
+    }
 
-      if (filterType == 0) { // None
-        std::copy(decompressedData + currentIndex + 1, decompressedData + currentIndex + scanLineWidth + 2, unfilteredData + (i * scanLineWidth));
-      } else if (filterType == 1) { // Sub
-        PNG_Decoder::RemoveSubFilter(decompressedData + currentIndex + 1, scanLineWidth, unfilteredData + (i * scanLineWidth), bpp);
+    if (pool != nullptr) {
+      std::vector<unsigned int> firstRows = PNG_Decoder::FindRestartRows(decompressedData, scanLineWidth + 1, height,
+        pool->GetNumThreads());
+      if (firstRows.size() > 1) {
+        PNG_Decoder::UnfilterBandsInto(decompressedData, unfilteredData, firstRows, width, height, bitDepth, colorType, converter, false,
+          *pool);
+        return unfilteredDataSize;
       }
-      else if (filterType == 2) { // Up
-        char * priorScanline = (i > 0) ? (unfilteredData + ((i - 1) * scanLineWidth)) : nullptr;
-        PNG_Decoder::RemoveUpFilter(decompressedData + currentIndex + 1, scanLineWidth, unfilteredData + (i * scanLineWidth), priorScanline);
+    }
+
+    DECODE_STATS_TIMER(DECODE_STAGES::UNFILTER);
+    if (converter != nullptr) {
+      // Unfilter into a ring of two scan lines and convert each one into the output.
+      std::vector<char> scanLines;
+      char * currentScanLine = PNG_Decoder::GetScratch(context, SCRATCH_BUFFERS::SCAN_LINE_BUFFER,
+        2 * scanLineWidth, scanLines);
+      char * priorScanLine = currentScanLine + scanLineWidth;
+      for (unsigned int i = 0; i < numScanLines; ++i) {
+        unsigned long currentIndex = static_cast<unsigned long>(i) * (scanLineWidth + 1);
+        unsigned char filterType = *reinterpret_cast<unsigned char *>(decompressedData + currentIndex);
+        Filter::UnfilterScanLine(filters, filterType, decompressedData + currentIndex + 1, scanLineWidth, currentScanLine,
+          (i > 0) ? priorScanLine : nullptr);
+        DECODE_STATS_FILTER_TYPE(filterType);
+        converter->ConvertScanLine(currentScanLine, width, unfilteredData + static_cast<unsigned long>(i) * outputScanLineWidth);
+        std::swap(currentScanLine, priorScanLine);
+      }
+      return unfilteredDataSize;
+    }
+
+    for (unsigned int i = 0; i < numScanLines; ++i) {
+      unsigned long currentIndex = static_cast<unsigned long>(i) * (scanLineWidth + 1);
+      unsigned char filterType = *reinterpret_cast<unsigned char *>(decompressedData + currentIndex);
+      char * priorScanline = (i > 0) ? (unfilteredData + (i - 1) * scanLineWidth) : nullptr;
+      Filter::UnfilterScanLine(filters, filterType, decompressedData + currentIndex + 1, scanLineWidth,
+        unfilteredData + i * scanLineWidth, priorScanline);
+      DECODE_STATS_FILTER_TYPE(filterType);
+    }
+
+    return unfilteredDataSize;
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+}
+
+unsigned long PNG_Decoder::UnfilterScanLines(char * decompressedData, unsigned int width, unsigned int height, unsigned char bitDepth,
+  unsigned char colorType, unsigned char interlaceMethod, const ScanLineCallback& onScanLine, const PixelConverter * converter,
+  DecoderContext * context) {
+  try {
+    unsigned long unfilteredDataSize = PNG_Decoder::GetOutputDataSize(width, height, bitDepth, colorType, converter); // In bytes
+    unsigned long outputScanLineWidth = (height == 0) ? 0 : unfilteredDataSize / height;
+
+    if (interlaceMethod == 1) {
+      std::vector<char> image;
+      char * unfilteredData = PNG_Decoder::GetScratch(context, SCRATCH_BUFFERS::OUTPUT_BUFFER, unfilteredDataSize, image);
+      if (PNG_Decoder::UnfilterDataInto(decompressedData, unfilteredData, unfilteredDataSize, width, height, bitDepth, colorType,
+        interlaceMethod, converter, context) == 0) {
+        return 0;
       }
-      else if (filterType == 3) { // Average
-        char * priorScanline = (i > 0) ? (unfilteredData + ((i - 1) * scanLineWidth)) : nullptr;
-        PNG_Decoder::RemoveAverageFilter(decompressedData + currentIndex + 1, scanLineWidth, unfilteredData + (i * scanLineWidth), bpp, priorScanline);
+      for (unsigned int i = 0; i < height; ++i) {
+        onScanLine(unfilteredData + static_cast<unsigned long>(i) * outputScanLineWidth, i);
       }
-      else if (filterType == 4) { // Paeth
-        char * priorScanline = (i > 0) ? (unfilteredData + ((i - 1) * scanLineWidth)) : nullptr;
-        PNG_Decoder::RemovePaethFilter(decompressedData + currentIndex + 1, scanLineWidth, unfilteredData + (i * scanLineWidth), bpp, priorScanline);
+      return unfilteredDataSize;
+    }
+
+    // Unfilter into a ring of two scan lines, converting each one before handing it over.
+    unsigned long scanLineWidth = PNG_Decoder::GetScanLineWidth(width, bitDepth, colorType);
+    ScanLineFilters filters = Filter::GetScanLineFilters(PNG_Decoder::GetBytesPerPixel(bitDepth, colorType));
+    std::vector<char> scanLines;
+    std::vector<char> convertedScanLines;
+    char * currentScanLine = PNG_Decoder::GetScratch(context, SCRATCH_BUFFERS::SCAN_LINE_BUFFER, 2 * scanLineWidth, scanLines);
+    char * priorScanLine = currentScanLine + scanLineWidth;
+    char * convertedScanLine = (converter == nullptr) ? nullptr :
+      PNG_Decoder::GetScratch(context, SCRATCH_BUFFERS::CONVERTED_BUFFER, outputScanLineWidth, convertedScanLines);
+    DECODE_STATS_TIMER(DECODE_STAGES::UNFILTER);
+    DECODE_STATS_FILTER_COUNTER;
+    for (unsigned int i = 0; i < height; ++i) {
+      unsigned long currentIndex = static_cast<unsigned long>(i) * (scanLineWidth + 1);
+      unsigned char filterType = *reinterpret_cast<unsigned char *>(decompressedData + currentIndex);
+      Filter::UnfilterScanLine(filters, filterType, decompressedData + currentIndex + 1, scanLineWidth, currentScanLine,
+        (i > 0) ? priorScanLine : nullptr);
+      DECODE_STATS_FILTER_TYPE(filterType);
+      if (converter != nullptr) {
+        converter->ConvertScanLine(currentScanLine, width, convertedScanLine);
+        onScanLine(convertedScanLine, i);
       } else {
-        throw std::invalid_argument("Invalid filter type.");
+        onScanLine(currentScanLine, i);
       }
+      std::swap(currentScanLine, priorScanLine);
     }
+    return unfilteredDataSize;
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+}
+
+unsigned long PNG_Decoder::DecodeScanLines(char * compressedData, unsigned long compressedDataSize, unsigned int width,
+  unsigned int height, unsigned char bitDepth, unsigned char colorType, const ScanLineCallback& onScanLine,
+  const PixelConverter * converter) {
+  return PNG_Decoder::InflateScanLines(compressedData, compressedDataSize, nullptr, nullptr, width, height, bitDepth, colorType, onScanLine,
+    converter);
+}
+
+unsigned long PNG_Decoder::DecodeDataInto(char * compressedData, unsigned long compressedDataSize, char * unfilteredData,
+  unsigned long unfilteredDataCapacity, unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType,
+  unsigned char interlaceMethod, bool pipelined, const PixelConverter * converter) {
+  return PNG_Decoder::InflateUnfilteredInto(compressedData, compressedDataSize, nullptr, nullptr, unfilteredData, unfilteredDataCapacity,
+    width, height, bitDepth, colorType, interlaceMethod, pipelined, converter);
+}
+
+unsigned long PNG_Decoder::DecodeRegionInto(char * compressedData, unsigned long compressedDataSize, char * regionData,
+  unsigned long regionDataCapacity, unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType,
+  const Region& region, unsigned char interlaceMethod, const PixelConverter * converter) {
+  return PNG_Decoder::InflateRegionInto(compressedData, compressedDataSize, nullptr, nullptr, regionData, regionDataCapacity, width, height,
+    bitDepth, colorType, interlaceMethod, region, converter);
+}
+
+unsigned long PNG_Decoder::AllocateDecompressedData(char *& decompressedData) const {
+  if (!this->IsOpen()) {
+    std::cerr << "Failed to decompress data because a PNG is not open." << std::endl;
+    return 0;
+  }
+
+  unsigned long decompressedDataSize = 0;
+  try {
+    decompressedDataSize = PNG_Decoder::GetDecompressedDataSize(this->GetWidth(), this->GetHeight(), this->GetBitDepth(),
+      this->GetColorType(), this->GetInterlaceMethod());
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+
+  if (decompressedData == nullptr) {
+    decompressedData = static_cast<char *>(std::malloc(decompressedDataSize * sizeof(char)));
+    DECODE_STATS_ALLOCATION(decompressedDataSize, false);
+  } else {
+    decompressedData = static_cast<char *>(std::realloc(decompressedData, decompressedDataSize * sizeof(char)));
+    DECODE_STATS_ALLOCATION(decompressedDataSize, true);
+  }
 
+  if (decompressedData == nullptr) {
+    std::cerr << "Failed to allocate memory to store the decompressed data." << std::endl;
+    return 0;
+  }
+
+  if (this->DecompressDataInto(decompressedData, decompressedDataSize) == 0) {
+    std::free(decompressedData);
+    decompressedData = nullptr;
+    return 0;
+  }
+  return decompressedDataSize;
+}
+
+unsigned long PNG_Decoder::DecompressDataInto(char * decompressedData, unsigned long decompressedDataCapacity,
+  DecoderContext * context) const {
+  if (!this->IsOpen()) {
+    std::cerr << "Failed to decompress data because a PNG is not open." << std::endl;
+    return 0;
+  }
+  const Chunk * firstChunk = this->chunks.data();
+  return PNG_Decoder::InflateDataInto(nullptr, 0, firstChunk, firstChunk + this->chunks.size(), decompressedData, decompressedDataCapacity,
+    this->GetWidth(), this->GetHeight(), this->GetBitDepth(), this->GetColorType(), this->GetInterlaceMethod(), context);
+}
+
+Downscaler PNG_Decoder::CreateDownscaler(unsigned int outputWidth, unsigned int outputHeight, const PixelConverter * converter) const {
+  PIXEL_FORMATS format = (converter == nullptr) ? PIXEL_FORMATS::RAW : converter->GetFormat();
+  if (format == PIXEL_FORMATS::RAW || format == PIXEL_FORMATS::HOST_ENDIAN) {
+    if (this->GetColorType() == 3) {
+      throw std::invalid_argument("Palette indices cannot be averaged; downscale palette images to GRAY8, RGB8 or RGBA8.");
+    }
+    return Downscaler(this->GetWidth(), this->GetHeight(), outputWidth, outputHeight, this->GetBitDepth(),
+      PNG_Decoder::GetNumChannels(this->GetColorType()), format == PIXEL_FORMATS::RAW);
+  }
+  return Downscaler(this->GetWidth(), this->GetHeight(), outputWidth, outputHeight, 8, converter->GetOutputBitsPerPixel() / 8);
+}
+
+unsigned long PNG_Decoder::DecodeDownscaledInto(char * outputData, unsigned long outputDataCapacity, unsigned int outputWidth,
+  unsigned int outputHeight, PIXEL_FORMATS format) const {
+  if (!this->IsOpen()) {
+    std::cerr << "Failed to decode a downscaled image because a PNG is not open." << std::endl;
+    return 0;
+  }
+  try {
+    std::unique_ptr<PixelConverter> converter = this->CreatePixelConverter(format);
+    Downscaler downscaler = this->CreateDownscaler(outputWidth, outputHeight, converter.get());
+    unsigned long outputDataSize = downscaler.GetOutputDataSize();
+    if (outputData == nullptr || outputDataCapacity < outputDataSize) {
+      throw std::invalid_argument("Downscaled data buffer is too small: " + std::to_string(outputDataSize) + " bytes required.");
+    }
+
+    const Chunk * firstChunk = this->chunks.data();
+    const Chunk * end = firstChunk + this->chunks.size();
+    unsigned int width = this->GetWidth();
+    unsigned int height = this->GetHeight();
+    if (this->GetInterlaceMethod() == 1) {
+      std::vector<char> unfilteredData(PNG_Decoder::GetOutputDataSize(width, height, this->GetBitDepth(), this->GetColorType(),
+        converter.get()));
+      if (PNG_Decoder::InflateInterlacedInto(nullptr, 0, firstChunk, end, unfilteredData.data(), unfilteredData.size(), width, height,
+        this->GetBitDepth(), this->GetColorType(), nullptr, converter.get()) == 0) {
+        return 0;
+      }
+      unsigned long scanLineWidth = unfilteredData.size() / height;
+      for (unsigned int i = 0; i < height; ++i) {
+        downscaler.AddScanLine(unfilteredData.data() + static_cast<unsigned long>(i) * scanLineWidth, outputData);
+      }
+      return outputDataSize;
+    }
+
+    if (PNG_Decoder::InflateScanLines(nullptr, 0, firstChunk, end, width, height, this->GetBitDepth(), this->GetColorType(),
+      [&](const char * scanLine, unsigned int) {
+        downscaler.AddScanLine(scanLine, outputData);
+      }, converter.get()) == 0) {
+      return 0;
+    }
+    return outputDataSize;
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+}
+
+unsigned long PNG_Decoder::GetDownscaledDataSize(unsigned int outputWidth, unsigned int outputHeight, PIXEL_FORMATS format) const {
+  try {
+    std::unique_ptr<PixelConverter> converter = this->CreatePixelConverter(format);
+    return this->CreateDownscaler(outputWidth, outputHeight, converter.get()).GetOutputDataSize();
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+}
+
+const char * PNG_Decoder::Decode(DecoderContext& context, unsigned long& size, PIXEL_FORMATS format) const {
+  size = 0;
+  if (!this->IsOpen()) {
+    std::cerr << "Failed to decode data because a PNG is not open." << std::endl;
+    return nullptr;
+  }
+  unsigned int width = this->GetWidth();
+  unsigned int height = this->GetHeight();
+  unsigned char bitDepth = this->GetBitDepth();
+  unsigned char colorType = this->GetColorType();
+  unsigned char interlaceMethod = this->GetInterlaceMethod();
+  try {
+    // PixelConverter holds its tables inline, so a converted decode allocates no more than a RAW one.
+    PixelConverter converter = this->GetPixelConverter(format);
+    const PixelConverter * outputConverter = (format == PIXEL_FORMATS::RAW) ? nullptr : &converter;
+    unsigned long decompressedDataSize = PNG_Decoder::GetDecompressedDataSize(width, height, bitDepth, colorType, interlaceMethod);
+    unsigned long outputDataSize = PNG_Decoder::GetOutputDataSize(width, height, bitDepth, colorType, outputConverter);
+    // The previous output is no longer needed, so free buffers a huge earlier image left over the retained size.
+    context.Trim();
+    char * decompressedData = context.GetBuffer(SCRATCH_BUFFERS::DECOMPRESSED_BUFFER, decompressedDataSize);
+    char * outputData = context.GetBuffer(SCRATCH_BUFFERS::OUTPUT_BUFFER, outputDataSize);
+    if (this->DecompressDataInto(decompressedData, decompressedDataSize, &context) == 0 ||
+      PNG_Decoder::UnfilterDataInto(decompressedData, outputData, outputDataSize, width, height, bitDepth, colorType, interlaceMethod,
+      outputConverter, &context) == 0) {
+      return nullptr;
+    }
+    size = outputDataSize;
+    return outputData;
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return nullptr;
+  }
+}
+
+PixelConverter PNG_Decoder::GetPixelConverter(PIXEL_FORMATS format) const {
+  if (!this->IsOpen()) {
+    throw std::runtime_error("Failed to create a pixel converter because a PNG is not open.");
+  }
+  const char * palette = nullptr;
+  unsigned int paletteLength = 0;
+  const char * transparency = nullptr;
+  unsigned int transparencyLength = 0;
+  for (const Chunk& chunk : this->chunks) {
+    if (chunk.GetChunkType() == ChunkType::PLTE) {
+      palette = chunk.GetChunkData();
+      paletteLength = chunk.GetDataLength();
+    } else if (chunk.GetChunkType() == ChunkType::tRNS) {
+      transparency = chunk.GetChunkData();
+      transparencyLength = chunk.GetDataLength();
+    }
+  }
+  return PixelConverter(this->GetBitDepth(), this->GetColorType(), format, palette, paletteLength, transparency, transparencyLength);
+}
+
+std::unique_ptr<PixelConverter> PNG_Decoder::CreatePixelConverter(PIXEL_FORMATS format) const {
+  if (format == PIXEL_FORMATS::RAW) {
+    return nullptr;
+  }
+  return std::make_unique<PixelConverter>(this->GetPixelConverter(format));
+}
+
+unsigned long PNG_Decoder::DecodeScanLines(const ScanLineCallback& onScanLine, PIXEL_FORMATS format) const {
+  if (!this->IsOpen()) {
+    std::cerr << "Failed to decode scan lines because a PNG is not open." << std::endl;
+    return 0;
+  }
+  if (this->GetInterlaceMethod() == 1) {
+    std::cerr << "Interlaced PNGs cannot be decoded in scan line order; use DecodeDataInto or DecodeProgressive." << std::endl;
+    return 0;
+  }
+  std::unique_ptr<PixelConverter> converter;
+  try {
+    converter = this->CreatePixelConverter(format);
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+  const Chunk * firstChunk = this->chunks.data();
+  return PNG_Decoder::InflateScanLines(nullptr, 0, firstChunk, firstChunk + this->chunks.size(), this->GetWidth(), this->GetHeight(),
+    this->GetBitDepth(), this->GetColorType(), onScanLine, converter.get());
+}
+
+unsigned long PNG_Decoder::DecodeDataInto(char * unfilteredData, unsigned long unfilteredDataCapacity, PIXEL_FORMATS format,
+  bool pipelined) const {
+  if (!this->IsOpen()) {
+    std::cerr << "Failed to decode data because a PNG is not open." << std::endl;
+    return 0;
+  }
+  std::unique_ptr<PixelConverter> converter;
+  try {
+    converter = this->CreatePixelConverter(format);
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+  const Chunk * firstChunk = this->chunks.data();
+  return PNG_Decoder::InflateUnfilteredInto(nullptr, 0, firstChunk, firstChunk + this->chunks.size(), unfilteredData,
+    unfilteredDataCapacity, this->GetWidth(), this->GetHeight(), this->GetBitDepth(), this->GetColorType(), this->GetInterlaceMethod(),
+    pipelined, converter.get());
+}
+
+unsigned long PNG_Decoder::DecodeRegionInto(char * regionData, unsigned long regionDataCapacity, const Region& region,
+  PIXEL_FORMATS format) const {
+  if (!this->IsOpen()) {
+    std::cerr << "Failed to decode a region because a PNG is not open." << std::endl;
+    return 0;
+  }
+  std::unique_ptr<PixelConverter> converter;
+  try {
+    converter = this->CreatePixelConverter(format);
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+  const Chunk * firstChunk = this->chunks.data();
+  return PNG_Decoder::InflateRegionInto(nullptr, 0, firstChunk, firstChunk + this->chunks.size(), regionData, regionDataCapacity,
+    this->GetWidth(), this->GetHeight(), this->GetBitDepth(), this->GetColorType(), this->GetInterlaceMethod(), region, converter.get());
+}
+
+unsigned long PNG_Decoder::DecodeSegmentsInto(char * unfilteredData, unsigned long unfilteredDataCapacity, PIXEL_FORMATS format,
+  bool scanFullFlush, ThreadPool * pool) const {
+  if (!this->IsOpen()) {
+    std::cerr << "Failed to decode data because a PNG is not open." << std::endl;
+    return 0;
+  }
+  std::unique_ptr<PixelConverter> converter;
+  try {
+    converter = this->CreatePixelConverter(format);
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+  const Chunk * firstChunk = this->chunks.data();
+  return PNG_Decoder::InflateSegmentsInto(firstChunk, firstChunk + this->chunks.size(), unfilteredData, unfilteredDataCapacity,
+    this->GetWidth(), this->GetHeight(), this->GetBitDepth(), this->GetColorType(), this->GetInterlaceMethod(), scanFullFlush,
+    converter.get(), pool);
+}
+
+unsigned int PNG_Decoder::GetNumSegments(bool scanFullFlush) const {
+  if (!this->IsOpen()) {
+    return 0;
+  } else if (this->GetInterlaceMethod() == 1) {
+    return 1;
+  }
+  const Chunk * firstChunk = this->chunks.data();
+  return static_cast<unsigned int>(PNG_Decoder::FindSegments(firstChunk, firstChunk + this->chunks.size(), this->GetHeight(),
+    scanFullFlush).size());
+}
+
+unsigned long PNG_Decoder::DecodeProgressive(char * unfilteredData, unsigned long unfilteredDataCapacity, const PassCallback& onPass,
+  PIXEL_FORMATS format) const {
+  if (!this->IsOpen()) {
+    std::cerr << "Failed to decode data because a PNG is not open." << std::endl;
+    return 0;
+  }
+  std::unique_ptr<PixelConverter> converter;
+  try {
+    converter = this->CreatePixelConverter(format);
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+  const Chunk * firstChunk = this->chunks.data();
+  const Chunk * end = firstChunk + this->chunks.size();
+  if (this->GetInterlaceMethod() == 1) {
+    return PNG_Decoder::InflateInterlacedInto(nullptr, 0, firstChunk, end, unfilteredData, unfilteredDataCapacity, this->GetWidth(),
+      this->GetHeight(), this->GetBitDepth(), this->GetColorType(), onPass, converter.get());
+  }
+
+  unsigned long unfilteredDataSize = PNG_Decoder::InflateUnfilteredInto(nullptr, 0, firstChunk, end, unfilteredData,
+    unfilteredDataCapacity, this->GetWidth(), this->GetHeight(), this->GetBitDepth(), this->GetColorType(), 0, false, converter.get());
+  try {
+    if (unfilteredDataSize > 0) {
+      onPass(unfilteredData, Interlace::numPasses - 1);
+    }
     return unfilteredDataSize;
   } catch(const std::exception& e) {
-    std::free(unfilteredData);
-    unfilteredData = nullptr;
+    std::cerr << e.what() << std::endl;
+    return 0;
+  }
+}
+
+unsigned long PNG_Decoder::DecodeMappedInto(MappedOutput& output, PIXEL_FORMATS format, unsigned long residentBytes) const {
+  if (!this->IsOpen()) {
+    std::cerr << "Failed to decode data because a PNG is not open." << std::endl;
+    return 0;
+  }
+  if (!output.IsOpen()) {
+    std::cerr << "Failed to decode data because the mapped output is not open." << std::endl;
+    return 0;
+  }
+  const Chunk * firstChunk = this->chunks.data();
+  const Chunk * end = firstChunk + this->chunks.size();
+  unsigned int width = this->GetWidth();
+  unsigned int height = this->GetHeight();
+  try {
+    std::unique_ptr<PixelConverter> converter = this->CreatePixelConverter(format);
+    if (this->GetInterlaceMethod() == 1) {
+      return PNG_Decoder::InflateInterlacedInto(nullptr, 0, firstChunk, end, output.GetData(), output.GetSize(), width, height,
+        this->GetBitDepth(), this->GetColorType(), nullptr, converter.get());
+    }
+
+    unsigned long outputDataSize = PNG_Decoder::GetOutputDataSize(width, height, this->GetBitDepth(), this->GetColorType(),
+      converter.get());
+    if (output.GetSize() < outputDataSize) {
+      throw std::invalid_argument("Mapped output is too small: " + std::to_string(outputDataSize) + " bytes required.");
+    }
+    unsigned long outputScanLineWidth = outputDataSize / height;
+    char * outputData = output.GetData();
+    unsigned long released = 0;
+    if (PNG_Decoder::InflateScanLines(nullptr, 0, firstChunk, end, width, height, this->GetBitDepth(), this->GetColorType(),
+      [&](const char * scanLine, unsigned int row) {
+        unsigned long written = (static_cast<unsigned long>(row) + 1) * outputScanLineWidth;
+        std::memcpy(outputData + written - outputScanLineWidth, scanLine, outputScanLineWidth);
+        if (written - released >= residentBytes) {
+          output.Release(released, written - released);
+          released = written;
+        }
+      }, converter.get()) == 0) {
+      return 0;
+    }
+    output.Release(released, outputDataSize - released);
+    return outputDataSize;
+  } catch(const std::exception& e) {
     std::cerr << e.what() << std::endl;
     return 0;
   }
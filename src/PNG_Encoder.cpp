@@ -0,0 +1,289 @@
+#include "PNG_Encoder.h"
+
+// Private
+void PNG_Encoder::AppendUint32(std::vector<char>& png, unsigned int value) {
+  png.push_back(static_cast<char>(value >> 24));
+  png.push_back(static_cast<char>(value >> 16));
+  png.push_back(static_cast<char>(value >> 8));
+  png.push_back(static_cast<char>(value));
+}
+
+unsigned long PNG_Encoder::BeginChunk(std::vector<char>& png, unsigned int chunkType) {
+  unsigned long chunkStart = png.size();
+  PNG_Encoder::AppendUint32(png, 0);
+  PNG_Encoder::AppendUint32(png, chunkType);
+  return chunkStart;
+}
+
+void PNG_Encoder::EndChunk(std::vector<char>& png, unsigned long chunkStart) {
+  unsigned long dataLength = png.size() - chunkStart - 8;
+  for (int i = 0; i < 4; ++i) {
+    png[chunkStart + i] = static_cast<char>(dataLength >> (24 - 8 * i));
+  }
+  // The CRC covers the chunk type and data.
+  PNG_Encoder::AppendUint32(png, Crc::Crc32(png.data() + chunkStart + 4, dataLength + 4));
+}
+
+void PNG_Encoder::AppendChunk(std::vector<char>& png, unsigned int chunkType, const char * data, unsigned long dataLength) {
+  unsigned long chunkStart = PNG_Encoder::BeginChunk(png, chunkType);
+  png.insert(png.end(), data, data + dataLength);
+  PNG_Encoder::EndChunk(png, chunkStart);
+}
+
+ThreadPool& PNG_Encoder::GetSharedPool() {
+  static ThreadPool pool;
+  return pool;
+}
+
+void PNG_Encoder::FilterRows(const char * unfilteredData, unsigned int firstRow, unsigned int lastRow, char * filteredData) const {
+  unsigned long scanLineWidth = PNG_Decoder::GetUnfilteredDataSize(this->width, 1, this->bitDepth, this->colorType);
+  // Filters predict from whole bytes, so sub-byte pixels count as one byte, like PNG_Decoder's bytes per pixel.
+  unsigned int bpp = static_cast<unsigned int>(PNG_Decoder::GetUnfilteredDataSize(1, 1, this->bitDepth, this->colorType));
+  bool adaptive = this->adaptiveFilters && this->colorType != 3 && this->bitDepth >= 8;
+  std::vector<char> candidates(adaptive ? 2 * scanLineWidth : 0);
+
+  for (unsigned int i = firstRow; i < lastRow; ++i) {
+    const char * scanLine = unfilteredData + static_cast<unsigned long>(i) * scanLineWidth;
+    const char * priorScanLine = (i > 0) ? scanLine - scanLineWidth : nullptr;
+    char * output = filteredData + static_cast<unsigned long>(i - firstRow) * (scanLineWidth + 1);
+    unsigned char bestType = 0;
+    const char * best = scanLine;
+    if (adaptive) {
+      // Try each filter into whichever candidate buffer does not hold the best result so far.
+      unsigned long bestSum = Filter::SumAbsoluteValues(scanLine, static_cast<unsigned int>(scanLineWidth));
+      unsigned int trial = 0;
+      for (unsigned char filterType = 1; filterType <= 4 && bestSum > 0; ++filterType) {
+        char * candidate = candidates.data() + trial * scanLineWidth;
+        Filter::FilterScanLine(filterType, scanLine, static_cast<unsigned int>(scanLineWidth), candidate, bpp, priorScanLine);
+        unsigned long sum = Filter::SumAbsoluteValues(candidate, static_cast<unsigned int>(scanLineWidth));
+        if (sum < bestSum) {
+          bestSum = sum;
+          bestType = filterType;
+          best = candidate;
+          trial ^= 1;
+        }
+      }
+    }
+    output[0] = static_cast<char>(bestType);
+    std::memcpy(output + 1, best, scanLineWidth);
+  }
+}
+
+void PNG_Encoder::CompressBand(const char * unfilteredData, unsigned int firstRow, unsigned int lastRow, bool last,
+  std::vector<char>& compressed, unsigned long& adler) const {
+  unsigned long rowSize = PNG_Decoder::GetUnfilteredDataSize(this->width, 1, this->bitDepth, this->colorType) + 1;
+  std::vector<char> filteredData(static_cast<unsigned long>(lastRow - firstRow) * rowSize);
+  this->FilterRows(unfilteredData, firstRow, lastRow, filteredData.data());
+  adler = adler32_z(adler32_z(0, nullptr, 0), reinterpret_cast<const Bytef *>(filteredData.data()), filteredData.size());
+
+  z_stream stream = {};
+  // Negative window bits write raw deflate, without a zlib header or trailer of its own. Filtered rows compress best with Z_FILTERED.
+  int strategy = (this->adaptiveFilters && this->colorType != 3 && this->bitDepth >= 8) ? Z_FILTERED : Z_DEFAULT_STRATEGY;
+  if (deflateInit2(&stream, this->compressionLevel, Z_DEFLATED, -MAX_WBITS, 8, strategy) != Z_OK) {
+    throw std::runtime_error("Failed to initialize deflate.");
+  }
+  // Room for the whole band plus the sync flush's empty stored block, grown if deflate still runs out.
+  compressed.resize(deflateBound(&stream, static_cast<uLong>(filteredData.size())) + 16);
+  unsigned long inputLeft = filteredData.size();
+  stream.next_in = reinterpret_cast<Bytef *>(filteredData.data());
+  int deflateStatus = Z_OK;
+  while (true) {
+    // zlib counts input and output in unsigned int, so both are handed over at most UINT_MAX bytes at a time.
+    if (stream.avail_in == 0 && inputLeft > 0) {
+      stream.avail_in = static_cast<unsigned int>(std::min<unsigned long>(UINT_MAX, inputLeft));
+      inputLeft -= stream.avail_in;
+    }
+    if (stream.avail_out == 0) {
+      if (stream.total_out == compressed.size()) {
+        compressed.resize(2 * compressed.size());
+      }
+      stream.next_out = reinterpret_cast<Bytef *>(compressed.data() + stream.total_out);
+      stream.avail_out = static_cast<unsigned int>(std::min<unsigned long>(UINT_MAX, compressed.size() - stream.total_out));
+    }
+    int flush = (inputLeft > 0) ? Z_NO_FLUSH : (last ? Z_FINISH : Z_SYNC_FLUSH);
+    deflateStatus = deflate(&stream, flush);
+    if (deflateStatus == Z_STREAM_ERROR) {
+      deflateEnd(&stream);
+      throw std::runtime_error("Deflate failed.");
+    }
+    // A flush is complete once deflate returns with output space to spare.
+    if (deflateStatus == Z_STREAM_END || (flush == Z_SYNC_FLUSH && stream.avail_in == 0 && stream.avail_out > 0)) {
+      break;
+    }
+  }
+  compressed.resize(stream.total_out);
+  deflateEnd(&stream);
+}
+
+// Constructors & Deconstructors
+PNG_Encoder::PNG_Encoder(unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType, int compressionLevel,
+  ThreadPool * pool) {
+  if (width == 0 || height == 0) {
+    throw std::invalid_argument("Cannot encode an empty image.");
+  }
+  bool validDepth = false;
+  if (colorType == 0) {
+    validDepth = bitDepth == 1 || bitDepth == 2 || bitDepth == 4 || bitDepth == 8 || bitDepth == 16;
+  } else if (colorType == 3) {
+    validDepth = bitDepth == 1 || bitDepth == 2 || bitDepth == 4 || bitDepth == 8;
+  } else if (colorType == 2 || colorType == 4 || colorType == 6) {
+    validDepth = bitDepth == 8 || bitDepth == 16;
+  }
+  if (!validDepth) {
+    throw std::invalid_argument("Invalid bit depth " + std::to_string(bitDepth) + " for color type " + std::to_string(colorType) + ".");
+  }
+  if (compressionLevel < 0 || compressionLevel > 9) {
+    throw std::invalid_argument("Invalid compression level: " + std::to_string(compressionLevel) + ".");
+  }
+  this->width = width;
+  this->height = height;
+  this->bitDepth = bitDepth;
+  this->colorType = colorType;
+  this->compressionLevel = compressionLevel;
+  this->adaptiveFilters = true;
+  this->bandSize = PNG_Encoder::defaultBandSize;
+  this->pool = pool;
+}
+
+// Methods
+unsigned int PNG_Encoder::GetWidth() const {
+  return this->width;
+}
+
+unsigned int PNG_Encoder::GetHeight() const {
+  return this->height;
+}
+
+unsigned char PNG_Encoder::GetBitDepth() const {
+  return this->bitDepth;
+}
+
+unsigned char PNG_Encoder::GetColorType() const {
+  return this->colorType;
+}
+
+unsigned long PNG_Encoder::GetUnfilteredDataSize() const {
+  return PNG_Decoder::GetUnfilteredDataSize(this->width, this->height, this->bitDepth, this->colorType);
+}
+
+void PNG_Encoder::SetPalette(const std::vector<char>& palette, const std::vector<char>& transparency) {
+  this->palette = palette;
+  this->transparency = transparency;
+}
+
+void PNG_Encoder::SetAdaptiveFilters(bool adaptiveFilters) {
+  this->adaptiveFilters = adaptiveFilters;
+}
+
+void PNG_Encoder::SetBandSize(unsigned long bandSize) {
+  this->bandSize = bandSize;
+}
+
+unsigned long PNG_Encoder::Encode(const char * unfilteredData, unsigned long unfilteredDataSize, std::vector<char>& png) const {
+  try {
+    unsigned long expectedSize = this->GetUnfilteredDataSize();
+    if (unfilteredData == nullptr || unfilteredDataSize < expectedSize) {
+      throw std::invalid_argument("Unfiltered data is too small: " + std::to_string(expectedSize) + " bytes required.");
+    }
+    if (this->colorType == 3 && (this->palette.empty() || this->palette.size() % 3 != 0 || this->palette.size() > 768)) {
+      throw std::invalid_argument("Color type 3 needs a palette of 1 - 256 RGB entries.");
+    }
+
+    unsigned long rowSize = PNG_Decoder::GetUnfilteredDataSize(this->width, 1, this->bitDepth, this->colorType) + 1;
+    unsigned long rowsPerBand = std::max<unsigned long>(1, std::min<unsigned long>(this->height, this->bandSize / rowSize));
+    unsigned long numBands = (this->height + rowsPerBand - 1) / rowsPerBand;
+    std::vector<std::vector<char>> bands(numBands);
+    std::vector<unsigned long> adlers(numBands);
+    std::vector<std::string> errors(numBands);
+    ThreadPool& threads = (this->pool == nullptr) ? PNG_Encoder::GetSharedPool() : *this->pool;
+    threads.ParallelFor(numBands, [&](unsigned long i) {
+      try {
+        unsigned int firstRow = static_cast<unsigned int>(i * rowsPerBand);
+        unsigned int lastRow = static_cast<unsigned int>(std::min<unsigned long>(this->height, (i + 1) * rowsPerBand));
+        this->CompressBand(unfilteredData, firstRow, lastRow, i + 1 == numBands, bands[i], adlers[i]);
+      } catch(const std::exception& e) {
+        errors[i] = e.what();
+      }
+    });
+    for (const std::string& error : errors) {
+      if (!error.empty()) {
+        throw std::runtime_error(error);
+      }
+    }
+
+    // The Adler-32 of the whole stream, from those of the bands and their lengths.
+    unsigned long adler = adlers[0];
+    for (unsigned long i = 1; i < numBands; ++i) {
+      unsigned long bandRows = std::min<unsigned long>(this->height - i * rowsPerBand, rowsPerBand);
+      adler = adler32_combine(adler, adlers[i], static_cast<z_off_t>(bandRows * rowSize));
+    }
+
+    unsigned long compressedSize = 0;
+    for (const std::vector<char>& band : bands) {
+      compressedSize += band.size();
+    }
+    png.clear();
+    png.reserve(compressedSize + this->palette.size() + this->transparency.size() + 128 + 12 * numBands);
+    const char signature[] = {static_cast<char>(137), 80, 78, 71, 13, 10, 26, 10};
+    png.insert(png.end(), signature, signature + 8);
+
+    std::vector<char> ihdr;
+    PNG_Encoder::AppendUint32(ihdr, this->width);
+    PNG_Encoder::AppendUint32(ihdr, this->height);
+    ihdr.push_back(static_cast<char>(this->bitDepth));
+    ihdr.push_back(static_cast<char>(this->colorType));
+    ihdr.insert(ihdr.end(), 3, 0); // Compression, filter and interlace methods
+    PNG_Encoder::AppendChunk(png, ChunkType::IHDR, ihdr.data(), ihdr.size());
+    if (!this->palette.empty()) {
+      PNG_Encoder::AppendChunk(png, ChunkType::PLTE, this->palette.data(), this->palette.size());
+    }
+    if (!this->transparency.empty()) {
+      PNG_Encoder::AppendChunk(png, ChunkType::tRNS, this->transparency.data(), this->transparency.size());
+    }
+
+    /* Each band starts a new IDAT chunk, so its sync flush marker is never split across chunks. The zlib header
+    goes in front of the first band: deflate with a 32 KiB window, its level in FLEVEL, and a check value that
+    makes the two bytes a multiple of 31.*/
+    unsigned char compressionFlags = (this->compressionLevel < 2) ? 0 : (this->compressionLevel < 6) ? 1 :
+      (this->compressionLevel == 6) ? 2 : 3;
+    unsigned int zlibHeader = 0x7800 | (compressionFlags << 6);
+    zlibHeader += (31 - zlibHeader % 31) % 31;
+    for (unsigned long i = 0; i < numBands; ++i) {
+      const std::vector<char>& band = bands[i];
+      for (unsigned long offset = 0; offset < band.size() || offset == 0; offset += PNG_Encoder::maxIdatSize) {
+        unsigned long size = std::min(PNG_Encoder::maxIdatSize, band.size() - offset);
+        unsigned long chunkStart = PNG_Encoder::BeginChunk(png, ChunkType::IDAT);
+        if (i == 0 && offset == 0) {
+          png.push_back(static_cast<char>(zlibHeader >> 8));
+          png.push_back(static_cast<char>(zlibHeader));
+        }
+        png.insert(png.end(), band.begin() + offset, band.begin() + offset + size);
+        if (i + 1 == numBands && offset + size == band.size()) {
+          PNG_Encoder::AppendUint32(png, static_cast<unsigned int>(adler));
+        }
+        PNG_Encoder::EndChunk(png, chunkStart);
+      }
+      bands[i] = std::vector<char>();
+    }
+    PNG_Encoder::AppendChunk(png, ChunkType::IEND, nullptr, 0);
+    return png.size();
+  } catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    png.clear();
+    return 0;
+  }
+}
+
+bool PNG_Encoder::EncodeFile(const char * unfilteredData, unsigned long unfilteredDataSize, const std::filesystem::path& fileName) const {
+  std::vector<char> png;
+  if (this->Encode(unfilteredData, unfilteredDataSize, png) == 0) {
+    return false;
+  }
+  std::ofstream outputStream(fileName, std::ofstream::binary);
+  outputStream.write(png.data(), static_cast<std::streamsize>(png.size()));
+  if (!outputStream) {
+    std::cerr << "Failed to write '" << fileName.string() << "'." << std::endl;
+    return false;
+  }
+  return true;
+}
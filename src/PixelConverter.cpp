@@ -0,0 +1,392 @@
+#include "PixelConverter.h"
+
+#ifdef PNG_DECODER_X86
+#include <immintrin.h>
+#endif
+
+// BT.709 luminance with weights scaled to 1 << 15, the same weights libpng uses for RGB to gray.
+static inline unsigned char Luminance(unsigned int red, unsigned int green, unsigned int blue) {
+  return static_cast<unsigned char>((red * 6968 + green * 23434 + blue * 2366 + 16384) >> 15);
+}
+
+// Scalar kernels
+template <unsigned int inputChannels, unsigned int outputChannels>
+static inline void MapPixel(const unsigned char * input, unsigned char * output) {
+  if (outputChannels == 1) {
+    output[0] = (inputChannels <= 2) ? input[0] : Luminance(input[0], input[1], input[2]);
+    return;
+  }
+  for (unsigned int i = 0; i < 3; ++i) {
+    output[i] = (inputChannels <= 2) ? input[0] : input[i];
+  }
+  if (outputChannels == 4) {
+    output[3] = (inputChannels == 2) ? input[1] : (inputChannels == 4) ? input[3] : 255;
+  }
+}
+
+template <unsigned int inputChannels, unsigned int outputChannels>
+static void ScalarMapChannels(const unsigned char * input, unsigned int width, char * output) {
+  if (inputChannels == outputChannels) {
+    std::memcpy(output, input, static_cast<unsigned long>(width) * inputChannels);
+    return;
+  }
+  unsigned char * pixel = reinterpret_cast<unsigned char *>(output);
+  for (unsigned int i = 0; i < width; ++i) {
+    MapPixel<inputChannels, outputChannels>(input + static_cast<unsigned long>(i) * inputChannels, pixel);
+    pixel += outputChannels;
+  }
+}
+
+// 16-bit samples are big-endian, so the high byte comes first.
+static void ScalarReduceSamples(const char * samples, unsigned int count, char * output) {
+  for (unsigned int i = 0; i < count; ++i) {
+    output[i] = samples[2 * static_cast<unsigned long>(i)];
+  }
+}
+
+static void ScalarSwapSamples(const char * samples, unsigned int count, char * output) {
+  for (unsigned long i = 0; i < 2 * static_cast<unsigned long>(count); i += 2) {
+    char high = samples[i];
+    output[i] = samples[i + 1];
+    output[i + 1] = high;
+  }
+}
+
+// Palette images, and grayscale images of 8 bits or less, map every sample through the lookup table.
+template <unsigned int bitDepth, unsigned int outputChannels>
+static void LookupPixels(const char * scanLine, unsigned int width, char * output, const ConversionTables& tables) {
+  const unsigned int pixelsPerByte = 8 / bitDepth;
+  const unsigned int mask = (1u << bitDepth) - 1;
+  for (unsigned int i = 0; i < width; ++i) {
+    unsigned int shift = 8 - bitDepth * (i % pixelsPerByte + 1);
+    unsigned int sample = (static_cast<unsigned char>(scanLine[i / pixelsPerByte]) >> shift) & mask;
+    std::memcpy(output + static_cast<unsigned long>(i) * outputChannels, tables.lookupTable[sample], outputChannels);
+  }
+}
+
+// Grayscale or RGB to RGBA8, where pixels matching the tRNS key at full precision are transparent.
+template <unsigned int inputChannels, unsigned int bytesPerSample>
+static void ConvertKeyedPixels(const char * scanLine, unsigned int width, char * output, const ConversionTables& tables) {
+  const unsigned char * samples = reinterpret_cast<const unsigned char *>(scanLine);
+  unsigned char * pixel = reinterpret_cast<unsigned char *>(output);
+  for (unsigned int i = 0; i < width; ++i) {
+    unsigned char highBytes[inputChannels];
+    bool transparent = true;
+    for (unsigned int j = 0; j < inputChannels; ++j) {
+      unsigned int sample = (bytesPerSample == 2) ? ((samples[0] << 8) | samples[1]) : samples[0];
+      transparent = transparent && (sample == tables.key[j]);
+      highBytes[j] = samples[0];
+      samples += bytesPerSample;
+    }
+    MapPixel<inputChannels, 4>(highBytes, pixel);
+    pixel[3] = transparent ? 0 : 255;
+    pixel += 4;
+  }
+}
+
+static void ConvertSamples(const char * scanLine, unsigned int width, char * output, const ConversionTables& tables) {
+  tables.mapChannels(reinterpret_cast<const unsigned char *>(scanLine), width, output);
+}
+
+// Reduces 16-bit samples a block of pixels at a time, so the reduced samples stay in L1 for mapping.
+static void ConvertWideSamples(const char * scanLine, unsigned int width, char * output, const ConversionTables& tables) {
+  const unsigned int blockWidth = 64;
+  unsigned char buffer[blockWidth * 4];
+  for (unsigned int i = 0; i < width; i += blockWidth) {
+    unsigned int count = std::min(blockWidth, width - i);
+    tables.convertSamples(scanLine + 2 * static_cast<unsigned long>(i) * tables.inputChannels, count * tables.inputChannels,
+      reinterpret_cast<char *>(buffer));
+    tables.mapChannels(buffer, count, output + static_cast<unsigned long>(i) * tables.outputChannels);
+  }
+}
+
+static void SwapSamples(const char * scanLine, unsigned int width, char * output, const ConversionTables& tables) {
+  tables.convertSamples(scanLine, width * tables.inputChannels, output);
+}
+
+#ifdef PNG_DECODER_X86
+// Vector kernels. Each one converts as many whole vectors as fit in the scan line, then finishes with the
+// scalar kernel.
+
+__attribute__((target("sse2")))
+static void Sse2ReduceSamples(const char * samples, unsigned int count, char * output) {
+  // The high byte of a big-endian sample is the low byte of its 16-bit lane.
+  const __m128i highBytes = _mm_set1_epi16(0x00FF);
+  unsigned int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(samples + 2 * static_cast<unsigned long>(i)));
+    __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i *>(samples + 2 * static_cast<unsigned long>(i) + 16));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i),
+      _mm_packus_epi16(_mm_and_si128(first, highBytes), _mm_and_si128(second, highBytes)));
+  }
+  ScalarReduceSamples(samples + 2 * static_cast<unsigned long>(i), count - i, output + i);
+}
+
+__attribute__((target("sse2")))
+static void Sse2SwapSamples(const char * samples, unsigned int count, char * output) {
+  unsigned int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i *>(samples + 2 * static_cast<unsigned long>(i)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + 2 * static_cast<unsigned long>(i)),
+      _mm_or_si128(_mm_slli_epi16(value, 8), _mm_srli_epi16(value, 8)));
+  }
+  ScalarSwapSamples(samples + 2 * static_cast<unsigned long>(i), count - i, output + 2 * static_cast<unsigned long>(i));
+}
+
+// Any channel layout change without luminance is one byte shuffle, plus an opaque alpha where the input has none.
+template <unsigned int inputChannels, unsigned int outputChannels>
+__attribute__((target("ssse3")))
+static void Ssse3MapChannels(const unsigned char * input, unsigned int width, char * output) {
+  const unsigned int step = 16 / std::max(inputChannels, outputChannels);
+  alignas(16) unsigned char shuffle[16];
+  alignas(16) unsigned char alpha[16];
+  for (unsigned int i = 0; i < 16; ++i) {
+    unsigned int pixel = i / outputChannels;
+    unsigned int channel = i % outputChannels;
+    shuffle[i] = 0x80;
+    alpha[i] = 0;
+    if (pixel >= step) {
+      continue;
+    } else if (channel < 3) {
+      shuffle[i] = static_cast<unsigned char>(pixel * inputChannels + ((inputChannels <= 2) ? 0 : channel));
+    } else if (inputChannels == 2 || inputChannels == 4) {
+      shuffle[i] = static_cast<unsigned char>(pixel * inputChannels + inputChannels - 1);
+    } else {
+      alpha[i] = 0xFF;
+    }
+  }
+  __m128i shuffleMask = _mm_load_si128(reinterpret_cast<const __m128i *>(shuffle));
+  __m128i alphaMask = _mm_load_si128(reinterpret_cast<const __m128i *>(alpha));
+
+  // Whole vectors are loaded and stored, so stop while 16 bytes remain on both sides.
+  unsigned long inputWidth = static_cast<unsigned long>(width) * inputChannels;
+  unsigned long outputWidth = static_cast<unsigned long>(width) * outputChannels;
+  unsigned int i = 0;
+  for (; i * inputChannels + 16 <= inputWidth && i * outputChannels + 16 <= outputWidth; i += step) {
+    __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i * inputChannels));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i * outputChannels),
+      _mm_or_si128(_mm_shuffle_epi8(pixels, shuffleMask), alphaMask));
+  }
+  ScalarMapChannels<inputChannels, outputChannels>(input + i * inputChannels, width - i, output + i * outputChannels);
+}
+
+// Spreads R, G and B of 4 pixels into 16-bit lanes and sums the weighted channels with pmaddwd.
+template <unsigned int inputChannels>
+__attribute__((target("ssse3")))
+static void Ssse3Luminance(const unsigned char * input, unsigned int width, char * output) {
+  alignas(16) unsigned char shuffle[2][16];
+  for (unsigned int i = 0; i < 32; ++i) {
+    unsigned int pixel = i / 8;
+    unsigned int channel = (i % 8) / 2;
+    shuffle[i / 16][i % 16] = (i % 2 == 0 && channel < 3) ? static_cast<unsigned char>(pixel * inputChannels + channel) : 0x80;
+  }
+  __m128i lowMask = _mm_load_si128(reinterpret_cast<const __m128i *>(shuffle[0]));
+  __m128i highMask = _mm_load_si128(reinterpret_cast<const __m128i *>(shuffle[1]));
+  const __m128i weights = _mm_setr_epi16(6968, 23434, 2366, 0, 6968, 23434, 2366, 0);
+  const __m128i half = _mm_set1_epi32(16384);
+
+  unsigned long inputWidth = static_cast<unsigned long>(width) * inputChannels;
+  unsigned int i = 0;
+  for (; i + 4 <= width && i * inputChannels + 16 <= inputWidth; i += 4) {
+    __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i * inputChannels));
+    __m128i low = _mm_madd_epi16(_mm_shuffle_epi8(pixels, lowMask), weights);
+    __m128i high = _mm_madd_epi16(_mm_shuffle_epi8(pixels, highMask), weights);
+    __m128i sums = _mm_srli_epi32(_mm_add_epi32(_mm_hadd_epi32(low, high), half), 15);
+    __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(sums, sums), sums);
+    int gray = _mm_cvtsi128_si32(bytes);
+    std::memcpy(output + i, &gray, 4);
+  }
+  ScalarMapChannels<inputChannels, 1>(input + i * inputChannels, width - i, output + i);
+}
+#endif
+
+template <unsigned int inputChannels, unsigned int outputChannels>
+static ChannelMapper LoadChannelMapper(SIMD_TYPES simdType) {
+#ifdef PNG_DECODER_X86
+  if (simdType >= SIMD_TYPES::SSSE3 && inputChannels != outputChannels) {
+    if constexpr (outputChannels == 1 && inputChannels >= 3) {
+      return Ssse3Luminance<inputChannels>;
+    } else {
+      return Ssse3MapChannels<inputChannels, outputChannels>;
+    }
+  }
+#endif
+  return ScalarMapChannels<inputChannels, outputChannels>;
+}
+
+template <unsigned int inputChannels>
+static ChannelMapper LoadChannelMapper(unsigned int outputChannels, SIMD_TYPES simdType) {
+  switch (outputChannels) {
+    case 1: return LoadChannelMapper<inputChannels, 1>(simdType);
+    case 3: return LoadChannelMapper<inputChannels, 3>(simdType);
+    default: return LoadChannelMapper<inputChannels, 4>(simdType);
+  }
+}
+
+template <unsigned int outputChannels>
+static ScanLineConverter LoadLookupConverter(unsigned char bitDepth) {
+  switch (bitDepth) {
+    case 1: return LookupPixels<1, outputChannels>;
+    case 2: return LookupPixels<2, outputChannels>;
+    case 4: return LookupPixels<4, outputChannels>;
+    default: return LookupPixels<8, outputChannels>;
+  }
+}
+
+// Private
+void PixelConverter::LoadLookupTable(const char * palette, unsigned int paletteLength, const char * transparency,
+  unsigned int transparencyLength) {
+  unsigned int maxSample = (1u << this->bitDepth) - 1;
+  for (unsigned int i = 0; i < 256; ++i) {
+    unsigned char rgba[4] = {0, 0, 0, 255};
+    if (this->colorType == 3) {
+      // Indices past the end of the palette decode as opaque black.
+      if (3 * i + 2 < paletteLength) {
+        std::memcpy(rgba, palette + 3 * i, 3);
+      }
+      if (i < transparencyLength) {
+        rgba[3] = static_cast<unsigned char>(transparency[i]);
+      }
+    } else if (i <= maxSample) {
+      // Scale 1, 2 and 4 bit samples to the full 8 bit range.
+      rgba[0] = rgba[1] = rgba[2] = static_cast<unsigned char>(i * 255 / maxSample);
+      rgba[3] = (this->tables.hasKey && i == this->tables.key[0]) ? 0 : 255;
+    }
+
+    unsigned char * entry = this->tables.lookupTable[i];
+    if (this->tables.outputChannels == 1) {
+      entry[0] = (this->colorType == 3) ? Luminance(rgba[0], rgba[1], rgba[2]) : rgba[0];
+    } else {
+      std::memcpy(entry, rgba, this->tables.outputChannels);
+    }
+  }
+}
+
+void PixelConverter::LoadKey(const char * transparency, unsigned int transparencyLength) {
+  const unsigned char * values = reinterpret_cast<const unsigned char *>(transparency);
+  unsigned int keyLength = (this->colorType == 0) ? 2 : (this->colorType == 2) ? 6 : 0;
+  // A key only changes alpha, so only RGBA8 needs it.
+  this->tables.hasKey = (this->format == PIXEL_FORMATS::RGBA8 && keyLength > 0 && transparencyLength >= keyLength);
+  for (unsigned int i = 0; this->tables.hasKey && i < keyLength / 2; ++i) {
+    this->tables.key[i] = static_cast<unsigned short>((values[2 * i] << 8) | values[2 * i + 1]);
+  }
+}
+
+// Constructors & Deconstructors
+PixelConverter::PixelConverter(unsigned char bitDepth, unsigned char colorType, PIXEL_FORMATS format, const char * palette,
+  unsigned int paletteLength, const char * transparency, unsigned int transparencyLength, SIMD_TYPES simdType) {
+  this->bitDepth = bitDepth;
+  this->colorType = colorType;
+  this->format = format;
+  this->converter = nullptr;
+  this->tables.hasKey = false;
+  this->tables.convertSamples = nullptr;
+  this->tables.mapChannels = nullptr;
+
+  switch (colorType) {
+    case 0: this->tables.inputChannels = 1; break;
+    case 2: this->tables.inputChannels = 3; break;
+    case 3: this->tables.inputChannels = 1; break;
+    case 4: this->tables.inputChannels = 2; break;
+    case 6: this->tables.inputChannels = 4; break;
+    default: throw std::invalid_argument("Invalid color type: " + std::to_string(colorType) + ".");
+  }
+  if (bitDepth != 1 && bitDepth != 2 && bitDepth != 4 && bitDepth != 8 && bitDepth != 16) {
+    throw std::invalid_argument("Invalid bit depth: " + std::to_string(bitDepth) + ".");
+  }
+  this->tables.outputChannels = (format == PIXEL_FORMATS::GRAY8) ? 1 : (format == PIXEL_FORMATS::RGB8) ? 3 :
+    (format == PIXEL_FORMATS::RGBA8) ? 4 : 0;
+
+  if (format == PIXEL_FORMATS::RAW) {
+    return;
+  }
+  if (format == PIXEL_FORMATS::HOST_ENDIAN) {
+    if (bitDepth == 16 && Endian::systemType == ENDIAN_TYPES::LITTLE) {
+      this->tables.convertSamples = ScalarSwapSamples;
+#ifdef PNG_DECODER_X86
+      if (simdType >= SIMD_TYPES::SSE2) {
+        this->tables.convertSamples = Sse2SwapSamples;
+      }
+#endif
+      this->converter = SwapSamples;
+    }
+    return;
+  }
+
+  this->LoadKey(transparency, transparencyLength);
+  if (colorType == 3 || (colorType == 0 && bitDepth <= 8)) {
+    if (colorType == 3 && (palette == nullptr || paletteLength < 3)) {
+      throw std::invalid_argument("A palette image needs its PLTE chunk to be converted.");
+    }
+    this->LoadLookupTable(palette, paletteLength, transparency, transparencyLength);
+    unsigned int outputChannels = this->tables.outputChannels;
+    this->converter = (outputChannels == 1) ? LoadLookupConverter<1>(bitDepth) : (outputChannels == 3) ? LoadLookupConverter<3>(bitDepth) :
+      LoadLookupConverter<4>(bitDepth);
+    return;
+  }
+
+  if (this->tables.hasKey) {
+    this->converter = (colorType == 0) ? ConvertKeyedPixels<1, 2> : (bitDepth == 16) ? ConvertKeyedPixels<3, 2> : ConvertKeyedPixels<3, 1>;
+    return;
+  }
+
+  switch (this->tables.inputChannels) {
+    case 1: this->tables.mapChannels = LoadChannelMapper<1>(this->tables.outputChannels, simdType); break;
+    case 2: this->tables.mapChannels = LoadChannelMapper<2>(this->tables.outputChannels, simdType); break;
+    case 3: this->tables.mapChannels = LoadChannelMapper<3>(this->tables.outputChannels, simdType); break;
+    default: this->tables.mapChannels = LoadChannelMapper<4>(this->tables.outputChannels, simdType); break;
+  }
+  if (bitDepth == 16) {
+    this->tables.convertSamples = ScalarReduceSamples;
+#ifdef PNG_DECODER_X86
+    if (simdType >= SIMD_TYPES::SSE2) {
+      this->tables.convertSamples = Sse2ReduceSamples;
+    }
+#endif
+    this->converter = ConvertWideSamples;
+  } else {
+    this->converter = ConvertSamples;
+  }
+}
+
+// Getters & Setters
+PIXEL_FORMATS PixelConverter::GetFormat() const {
+  return this->format;
+}
+
+unsigned char PixelConverter::GetBitDepth() const {
+  return this->bitDepth;
+}
+
+unsigned char PixelConverter::GetColorType() const {
+  return this->colorType;
+}
+
+// Methods
+unsigned int PixelConverter::GetOutputBitsPerPixel() const {
+  if (this->format == PIXEL_FORMATS::RAW || this->format == PIXEL_FORMATS::HOST_ENDIAN) {
+    return this->tables.inputChannels * this->bitDepth;
+  }
+  return 8 * this->tables.outputChannels;
+}
+
+unsigned long PixelConverter::GetOutputScanLineWidth(unsigned int width) const {
+  return (static_cast<unsigned long>(width) * this->GetOutputBitsPerPixel() + 7) / 8;
+}
+
+unsigned long PixelConverter::GetOutputDataSize(unsigned int width, unsigned int height) const {
+  unsigned long scanLineWidth = this->GetOutputScanLineWidth(width);
+  if (height != 0 && scanLineWidth > ULONG_MAX / height) {
+    throw std::overflow_error("The converted image is too large: its size does not fit in " + std::to_string(8 * sizeof(unsigned long)) +
+      " bits.");
+  }
+  return scanLineWidth * height;
+}
+
+void PixelConverter::ConvertScanLine(const char * scanLine, unsigned int width, char * output) const {
+  if (this->converter == nullptr) {
+    std::memcpy(output, scanLine, this->GetOutputScanLineWidth(width));
+    return;
+  }
+  this->converter(scanLine, width, output, this->tables);
+}
@@ -0,0 +1,241 @@
+#include "PushDecoder.h"
+
+// Private
+size_t PushDecoder::Gather(const char * data, size_t size, size_t count) {
+  size_t taken = std::min(size, count - this->pending.size());
+  this->pending.insert(this->pending.end(), data, data + taken);
+  return taken;
+}
+
+void PushDecoder::Consume(const char * data, size_t size) {
+  while (size > 0 && this->state != PUSH_STATES::COMPLETE) {
+    size_t taken = 0;
+    if (this->state == PUSH_STATES::HEADER) {
+      // Signature, then the IHDR chunk: length, type, 13 bytes of data and CRC.
+      taken = this->Gather(data, size, 33);
+      if (this->pending.size() == 33) {
+        if (!PNG_Decoder::Probe(reinterpret_cast<const uint8_t *>(this->pending.data()), 33, this->ihdr)) {
+          throw std::invalid_argument("The pushed data does not start with a valid PNG signature and IHDR chunk.");
+        }
+        if (this->ihdr.interlaceMethod == 1) {
+          throw std::invalid_argument("Interlaced PNGs cannot be decoded one scan line at a time.");
+        }
+        this->hasHeader = true;
+        this->pending.clear();
+        this->state = PUSH_STATES::CHUNK_START;
+        if (this->onHeader) {
+          this->onHeader(this->ihdr);
+        }
+      }
+    } else if (this->state == PUSH_STATES::CHUNK_START) {
+      taken = this->Gather(data, size, 8);
+      if (this->pending.size() == 8) {
+        this->StartChunk();
+      }
+    } else if (this->state == PUSH_STATES::CHUNK_DATA) {
+      unsigned int count = static_cast<unsigned int>(std::min<size_t>(size, this->chunkRemaining));
+      if (this->verifyCrc) {
+        this->crc = Crc::Crc32(data, count, this->crc);
+      }
+      if (this->chunkType == ChunkType::IDAT) {
+        this->InflateData(data, count);
+      } else if (this->chunkType == ChunkType::PLTE) {
+        this->palette.insert(this->palette.end(), data, data + count);
+      } else if (this->chunkType == ChunkType::tRNS) {
+        this->transparency.insert(this->transparency.end(), data, data + count);
+      }
+      this->chunkRemaining -= count;
+      taken = count;
+      if (this->chunkRemaining == 0) {
+        this->state = PUSH_STATES::CHUNK_CRC;
+      }
+    } else if (this->state == PUSH_STATES::CHUNK_CRC) {
+      taken = this->Gather(data, size, 4);
+      if (this->pending.size() == 4) {
+        this->FinishChunk();
+      }
+    }
+    data += taken;
+    size -= taken;
+  }
+}
+
+void PushDecoder::StartChunk() {
+  unsigned int length = Endian::ToHost(*reinterpret_cast<const unsigned int *>(this->pending.data()));
+  if (length > 0x7FFFFFFF) {
+    throw std::invalid_argument("PNG chunk length exceeds 2^31 - 1 bytes.");
+  }
+  this->chunkType = Endian::ToHost(*reinterpret_cast<const unsigned int *>(this->pending.data() + 4));
+  this->crc = this->verifyCrc ? Crc::Crc32(this->pending.data() + 4, 4) : 0;
+  this->chunkRemaining = length;
+  this->pending.clear();
+
+  if (this->chunkType == ChunkType::IDAT && this->scanLines.empty()) {
+    this->StartImage();
+  } else if (this->chunkType == ChunkType::PLTE) {
+    this->palette.clear();
+  } else if (this->chunkType == ChunkType::tRNS) {
+    this->transparency.clear();
+  }
+  this->state = (length == 0) ? PUSH_STATES::CHUNK_CRC : PUSH_STATES::CHUNK_DATA;
+}
+
+void PushDecoder::FinishChunk() {
+  if (this->verifyCrc && Endian::ToHost(*reinterpret_cast<const unsigned int *>(this->pending.data())) != this->crc) {
+    throw std::invalid_argument("A pushed PNG chunk failed its CRC check.");
+  }
+  this->pending.clear();
+  this->state = PUSH_STATES::CHUNK_START;
+
+  if (this->chunkType == ChunkType::IEND) {
+    if (this->rowsDecoded < this->ihdr.height) {
+      throw std::runtime_error("The PNG ended before all of its scan lines were decoded.");
+    }
+    this->state = PUSH_STATES::COMPLETE;
+  }
+}
+
+void PushDecoder::StartImage() {
+  // GetUnfilteredDataSize of one row is the scan line width, and of one pixel the filter's bytes per pixel.
+  this->scanLineWidth = static_cast<unsigned int>(PNG_Decoder::GetUnfilteredDataSize(this->ihdr.width, 1, this->ihdr.bitDepth,
+    this->ihdr.colorType));
+  this->filters = Filter::GetScanLineFilters(static_cast<unsigned int>(PNG_Decoder::GetUnfilteredDataSize(1, 1, this->ihdr.bitDepth,
+    this->ihdr.colorType)));
+  this->scanLines.resize(2 * (static_cast<size_t>(this->scanLineWidth) + 1));
+  this->currentScanLine = this->scanLines.data();
+  this->priorScanLine = this->scanLines.data() + this->scanLineWidth + 1;
+
+  // PLTE and tRNS come before the first IDAT chunk, so the converter can be built now.
+  if (this->format != PIXEL_FORMATS::RAW) {
+    this->converter = std::make_unique<PixelConverter>(this->ihdr.bitDepth, this->ihdr.colorType, this->format,
+      this->palette.empty() ? nullptr : this->palette.data(), static_cast<unsigned int>(this->palette.size()),
+      this->transparency.empty() ? nullptr : this->transparency.data(), static_cast<unsigned int>(this->transparency.size()));
+    this->convertedScanLine.resize(this->converter->GetOutputScanLineWidth(this->ihdr.width));
+  }
+
+  this->stream = Inflate::CreateZStream(nullptr, 0, &this->currentScanLine, 0);
+  Inflate::ZInflateInit(&this->stream);
+  this->streamOpen = true;
+}
+
+void PushDecoder::InflateData(const char * data, unsigned int size) {
+  if (!this->streamOpen) {
+    // Every scan line is decoded; what is left is the Adler-32 trailer.
+    return;
+  }
+  this->stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+  this->stream.avail_in = size;
+  // Unfiltering is timed and counted once per pushed piece of data, not once per scan line.
+  DECODE_STATS_TIMER_EXCLUDING(DECODE_STAGES::UNFILTER, DECODE_STAGES::INFLATE);
+  DECODE_STATS_FILTER_COUNTER;
+  while (this->stream.avail_in > 0 && this->rowsDecoded < this->ihdr.height) {
+    unsigned int rowSize = this->scanLineWidth + 1;
+    this->stream.next_out = reinterpret_cast<Bytef *>(this->currentScanLine + this->scanLineFill);
+    this->stream.avail_out = rowSize - this->scanLineFill;
+    int inflateStatus = Z_OK;
+    {
+      DECODE_STATS_TIMER(DECODE_STAGES::INFLATE);
+      inflateStatus = inflate(&this->stream, Z_SYNC_FLUSH);
+    }
+    this->scanLineFill = rowSize - this->stream.avail_out;
+    if (inflateStatus != Z_OK && inflateStatus != Z_STREAM_END && inflateStatus != Z_BUF_ERROR) {
+      std::string msg = (this->stream.msg != nullptr) ? this->stream.msg : std::to_string(inflateStatus);
+      throw std::runtime_error("Inflate failed: " + msg);
+    }
+    if (this->scanLineFill == rowSize) {
+      DECODE_STATS_FILTER_TYPE(static_cast<unsigned char>(this->currentScanLine[0]));
+      this->FinishScanLine();
+    } else if (inflateStatus == Z_STREAM_END) {
+      throw std::runtime_error("Inflate failed: the compressed data stream ended early.");
+    }
+  }
+
+  if (this->rowsDecoded == this->ihdr.height) {
+    Inflate::ZInflateEnd(&this->stream);
+    this->streamOpen = false;
+  }
+}
+
+void PushDecoder::FinishScanLine() {
+  unsigned char filterType = static_cast<unsigned char>(this->currentScanLine[0]);
+  Filter::UnfilterScanLine(this->filters, filterType, this->currentScanLine + 1, this->scanLineWidth, this->currentScanLine + 1,
+    (this->rowsDecoded > 0) ? this->priorScanLine + 1 : nullptr);
+  if (this->converter == nullptr) {
+    this->onScanLine(this->currentScanLine + 1, this->rowsDecoded);
+  } else {
+    this->converter->ConvertScanLine(this->currentScanLine + 1, this->ihdr.width, this->convertedScanLine.data());
+    this->onScanLine(this->convertedScanLine.data(), this->rowsDecoded);
+  }
+  std::swap(this->currentScanLine, this->priorScanLine);
+  this->scanLineFill = 0;
+  this->rowsDecoded += 1;
+}
+
+// Constructors & Deconstructors
+PushDecoder::PushDecoder(const ScanLineCallback& onScanLine, PIXEL_FORMATS format, bool verifyCrc, const HeaderCallback& onHeader) {
+  this->onScanLine = onScanLine;
+  this->onHeader = onHeader;
+  this->format = format;
+  this->verifyCrc = verifyCrc;
+  this->state = PUSH_STATES::HEADER;
+  this->pending.reserve(33);
+  this->chunkType = 0;
+  this->chunkRemaining = 0;
+  this->crc = 0;
+  this->hasHeader = false;
+  this->ihdr = IHDR();
+  this->streamOpen = false;
+  this->scanLineWidth = 0;
+  this->currentScanLine = nullptr;
+  this->priorScanLine = nullptr;
+  this->scanLineFill = 0;
+  this->rowsDecoded = 0;
+}
+
+PushDecoder::~PushDecoder() {
+  if (this->streamOpen) {
+    Inflate::ZInflateEnd(&this->stream);
+  }
+}
+
+// Methods
+bool PushDecoder::Push(const uint8_t * data, size_t size) {
+  if (this->state == PUSH_STATES::FAILED) {
+    return false;
+  }
+  try {
+    this->Consume(reinterpret_cast<const char *>(data), size);
+    return true;
+  } catch(const std::exception& e) {
+    this->state = PUSH_STATES::FAILED;
+    if (this->streamOpen) {
+      Inflate::ZInflateEnd(&this->stream);
+      this->streamOpen = false;
+    }
+    std::cerr << e.what() << std::endl;
+    return false;
+  }
+}
+
+PUSH_STATES PushDecoder::GetState() const {
+  return this->state;
+}
+
+bool PushDecoder::IsComplete() const {
+  return this->state == PUSH_STATES::COMPLETE;
+}
+
+bool PushDecoder::HasHeader() const {
+  return this->hasHeader;
+}
+
+const IHDR& PushDecoder::GetHeader() const {
+  if (!this->hasHeader) {
+    throw std::runtime_error("The PNG header has not been pushed yet.");
+  }
+  return this->ihdr;
+}
+
+unsigned int PushDecoder::GetRowsDecoded() const {
+  return this->rowsDecoded;
+}
@@ -0,0 +1,136 @@
+#include "TensorWriter.h"
+
+/* Writes width pixels of channels samples, looking each one up in its channel's table. Element c of pixel x lands
+at output + (x * pixelStride + c * channelStride) elements.*/
+template <typename T>
+static void WriteSamples(const unsigned char * samples, unsigned long width, unsigned int channels, const T (*table)[256],
+  unsigned long pixelStride, unsigned long channelStride, char * output) {
+  for (unsigned int c = 0; c < channels; ++c) {
+    const T * channelTable = table[c];
+    char * channelOutput = output + c * channelStride * sizeof(T);
+    for (unsigned long x = 0; x < width; ++x) {
+      T element = channelTable[samples[x * channels + c]];
+      std::memcpy(channelOutput + x * pixelStride * sizeof(T), &element, sizeof(T));
+    }
+  }
+}
+
+// Constructors & Deconstructors
+TensorWriter::TensorWriter(const TensorOptions& options) {
+  if (options.width == 0 || options.height == 0) {
+    throw std::invalid_argument("Tensor images cannot be empty.");
+  }
+  if (options.format == PIXEL_FORMATS::GRAY8) {
+    this->channels = 1;
+  } else if (options.format == PIXEL_FORMATS::RGB8) {
+    this->channels = 3;
+  } else if (options.format == PIXEL_FORMATS::RGBA8) {
+    this->channels = 4;
+  } else {
+    throw std::invalid_argument("Tensors are written from GRAY8, RGB8 or RGBA8 pixels.");
+  }
+  this->options = options;
+  this->elementSize = (options.type == TENSOR_TYPES::UINT8) ? 1 : (options.type == TENSOR_TYPES::FLOAT16) ? 2 : 4;
+
+  for (unsigned int c = 0; c < this->channels; ++c) {
+    if (options.type != TENSOR_TYPES::UINT8 && options.std[c] == 0.0f) {
+      throw std::invalid_argument("Channel " + std::to_string(c) + " has a std of 0.");
+    }
+    for (unsigned int sample = 0; sample < 256; ++sample) {
+      float value = (static_cast<float>(sample) * options.scale - options.mean[c]) / options.std[c];
+      this->byteTable[c][sample] = static_cast<unsigned char>(sample);
+      this->halfTable[c][sample] = (options.type == TENSOR_TYPES::FLOAT16) ? TensorWriter::ToHalf(value) : 0;
+      this->floatTable[c][sample] = (options.type == TENSOR_TYPES::FLOAT32) ? value : 0.0f;
+    }
+  }
+}
+
+// Methods
+const TensorOptions& TensorWriter::GetOptions() const {
+  return this->options;
+}
+
+unsigned int TensorWriter::GetNumChannels() const {
+  return this->channels;
+}
+
+unsigned long TensorWriter::GetElementSize() const {
+  return this->elementSize;
+}
+
+unsigned long TensorWriter::GetImageSize() const {
+  unsigned long pixels = static_cast<unsigned long>(this->options.width) * this->options.height;
+  if (pixels > ULONG_MAX / (this->channels * this->elementSize)) {
+    throw std::overflow_error("The tensor image is too large: its size does not fit in " + std::to_string(8 * sizeof(unsigned long)) +
+      " bits.");
+  }
+  return pixels * this->channels * this->elementSize;
+}
+
+unsigned long TensorWriter::GetTensorSize(unsigned long numImages) const {
+  unsigned long imageSize = this->GetImageSize();
+  if (numImages != 0 && imageSize > ULONG_MAX / numImages) {
+    throw std::overflow_error("The tensor is too large: its size does not fit in " + std::to_string(8 * sizeof(unsigned long)) +
+      " bits.");
+  }
+  return imageSize * numImages;
+}
+
+void TensorWriter::WriteRow(const char * row, unsigned int y, char * image) const {
+  const unsigned char * samples = reinterpret_cast<const unsigned char *>(row);
+  unsigned long width = this->options.width;
+  unsigned long pixelStride = 1;
+  unsigned long channelStride = width * this->options.height;
+  char * output = image + static_cast<unsigned long>(y) * width * this->elementSize;
+  if (this->options.layout == TENSOR_LAYOUTS::NHWC) {
+    pixelStride = this->channels;
+    channelStride = 1;
+    output = image + static_cast<unsigned long>(y) * width * this->channels * this->elementSize;
+    if (this->options.type == TENSOR_TYPES::UINT8) {
+      std::memcpy(output, samples, width * this->channels);
+      return;
+    }
+  }
+
+  if (this->options.type == TENSOR_TYPES::UINT8) {
+    WriteSamples(samples, width, this->channels, this->byteTable, pixelStride, channelStride, output);
+  } else if (this->options.type == TENSOR_TYPES::FLOAT16) {
+    WriteSamples(samples, width, this->channels, this->halfTable, pixelStride, channelStride, output);
+  } else {
+    WriteSamples(samples, width, this->channels, this->floatTable, pixelStride, channelStride, output);
+  }
+}
+
+uint16_t TensorWriter::ToHalf(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+  uint32_t magnitude = bits & 0x7FFFFFFF;
+  if (magnitude > 0x7F800000) { // NaN stays a quiet NaN
+    return sign | 0x7E00;
+  } else if (magnitude >= 0x47800000) { // 65536 and up, which round past the largest half, 65504
+    return sign | 0x7C00;
+  } else if (magnitude < 0x38800000) {
+    // Below 2^-14 halves are subnormal: a multiple of 2^-24 with no implicit bit.
+    uint32_t exponent = magnitude >> 23;
+    if (exponent < 102) {
+      return sign;
+    }
+    uint32_t mantissa = (magnitude & 0x7FFFFF) | 0x800000;
+    uint32_t shift = 126 - exponent;
+    uint32_t half = mantissa >> shift;
+    uint32_t remainder = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1) != 0)) {
+      half += 1;
+    }
+    return sign | static_cast<uint16_t>(half);
+  }
+  // Rebias the exponent from 127 to 15 and round the mantissa from 23 to 10 bits. A carry rounds up into the exponent.
+  uint32_t half = (magnitude - 0x38000000) >> 13;
+  uint32_t remainder = magnitude & 0x1FFF;
+  if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1) != 0)) {
+    half += 1;
+  }
+  return sign | static_cast<uint16_t>(half);
+}
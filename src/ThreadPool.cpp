@@ -0,0 +1,178 @@
+#include "ThreadPool.h"
+
+#include <chrono>
+
+// The pool and worker index of the current thread, so tasks submitted from a worker stay on its deque.
+static thread_local ThreadPool * currentPool = nullptr;
+static thread_local unsigned int currentIndex = 0;
+
+// Private
+bool ThreadPool::PopTask(unsigned int index, std::function<void()>& task) {
+  unsigned int numWorkers = static_cast<unsigned int>(this->workers.size());
+  for (unsigned int i = 0; i < numWorkers; ++i) {
+    Worker& worker = *this->workers[(index + i) % numWorkers];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.tasks.empty()) {
+      continue;
+    }
+    if (i == 0) {
+      task = std::move(worker.tasks.front());
+      worker.tasks.pop_front();
+    } else {
+      task = std::move(worker.tasks.back());
+      worker.tasks.pop_back();
+    }
+    this->queued -= 1;
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::RunTask(std::function<void()>& task) {
+  std::exception_ptr taskError;
+  try {
+    task();
+  } catch(...) {
+    taskError = std::current_exception();
+  }
+  // Release the task's captures before it counts as finished.
+  task = nullptr;
+
+  std::lock_guard<std::mutex> lock(this->mutex);
+  if (taskError != nullptr && this->error == nullptr) {
+    this->error = taskError;
+  }
+  this->unfinished -= 1;
+  if (this->unfinished == 0) {
+    this->idle.notify_all();
+  }
+}
+
+void ThreadPool::Run(unsigned int index) {
+  currentPool = this;
+  currentIndex = index;
+  std::function<void()> task;
+  while (true) {
+    if (this->PopTask(index, task)) {
+      this->RunTask(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if (this->stopping && this->queued == 0) {
+      return;
+    }
+    this->wake.wait(lock, [this]() { return this->stopping || this->queued > 0; });
+  }
+}
+
+// Constructors & Deconstructors
+ThreadPool::ThreadPool(unsigned int numThreads) {
+  if (numThreads == 0) {
+    numThreads = std::thread::hardware_concurrency();
+  }
+  numThreads = (numThreads == 0) ? 1 : numThreads;
+
+  this->nextWorker = 0;
+  this->queued = 0;
+  this->unfinished = 0;
+  this->error = nullptr;
+  this->stopping = false;
+  for (unsigned int i = 0; i < numThreads; ++i) {
+    this->workers.push_back(std::make_unique<Worker>());
+  }
+  for (unsigned int i = 0; i < numThreads; ++i) {
+    this->threads.emplace_back(&ThreadPool::Run, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->stopping = true;
+  }
+  this->wake.notify_all();
+  for (std::thread& thread : this->threads) {
+    thread.join();
+  }
+}
+
+// Methods
+unsigned int ThreadPool::GetNumThreads() const {
+  return static_cast<unsigned int>(this->threads.size());
+}
+
+bool ThreadPool::IsWorkerThread() {
+  return currentPool != nullptr;
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+  unsigned int numWorkers = static_cast<unsigned int>(this->workers.size());
+  unsigned int index = (currentPool == this) ? currentIndex : (this->nextWorker++ % numWorkers);
+  {
+    std::lock_guard<std::mutex> lock(this->workers[index]->mutex);
+    this->workers[index]->tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->unfinished += 1;
+    this->queued += 1;
+  }
+  this->wake.notify_one();
+}
+
+void ThreadPool::Wait() {
+  std::unique_lock<std::mutex> lock(this->mutex);
+  this->idle.wait(lock, [this]() { return this->unfinished == 0; });
+  if (this->error != nullptr) {
+    std::exception_ptr taskError = this->error;
+    this->error = nullptr;
+    std::rethrow_exception(taskError);
+  }
+}
+
+void ThreadPool::ParallelFor(unsigned long count, const std::function<void(unsigned long)>& task) {
+  if (count == 1) {
+    task(0);
+    return;
+  }
+
+  std::atomic<unsigned long> remaining(count);
+  std::exception_ptr error;
+  std::mutex doneMutex;
+  std::condition_variable done;
+  for (unsigned long i = 0; i < count; ++i) {
+    this->Submit([&, i]() {
+      std::exception_ptr taskError;
+      try {
+        task(i);
+      } catch(...) {
+        taskError = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lock(doneMutex);
+      if (taskError != nullptr && error == nullptr) {
+        error = taskError;
+      }
+      if (--remaining == 0) {
+        done.notify_all();
+      }
+    });
+  }
+
+  // Help with queued work instead of blocking a thread, so nested calls from tasks cannot deadlock.
+  unsigned int index = (currentPool == this) ? currentIndex : 0;
+  std::function<void()> queuedTask;
+  while (remaining > 0) {
+    if (this->PopTask(index, queuedTask)) {
+      this->RunTask(queuedTask);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(doneMutex);
+    done.wait_for(lock, std::chrono::milliseconds(1), [&remaining]() { return remaining == 0; });
+  }
+  // The last task may still be notifying; wait for it to release doneMutex before it goes out of scope.
+  std::lock_guard<std::mutex> lock(doneMutex);
+  if (error != nullptr) {
+    std::rethrow_exception(error);
+  }
+}
@@ -1,7 +1,1914 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
 
-int main(int argc, char * argv[]) {
+#include "BatchDecoder.h"
+#include "Crc.h"
+#include "Filter.h"
+#include "ImageCache.h"
+#include "Inflate.h"
+#include "MappedOutput.h"
+#include "PNG_Decoder.h"
+#include "PNG_Encoder.h"
+#include "PushDecoder.h"
+#include "ThreadPool.h"
+#include "zlib.h"
 
+// Counts every operator new in the test binary, so tests can check that a code path allocates nothing.
+static std::atomic<unsigned long> newCalls(0);
 
+void * operator new(size_t size) {
+  newCalls.fetch_add(1, std::memory_order_relaxed);
+  void * address = std::malloc((size == 0) ? 1 : size);
+  if (address == nullptr) {
+    throw std::bad_alloc();
+  }
+  return address;
+}
+
+void operator delete(void * address) noexcept {
+  std::free(address);
+}
+
+void operator delete(void * address, size_t) noexcept {
+  std::free(address);
+}
+
+// Compares the specialized filters for every instruction set this CPU supports against the generic filters, bit for bit.
+int TestFilterKernels() {
+  const char * simdNames[] = {"SCALAR", "SSE2", "SSSE3", "AVX2"};
+  const unsigned int bpps[] = {1, 2, 3, 4, 6, 8};
+  const unsigned int pixelCounts[] = {1, 2, 3, 5, 7, 16, 33, 100, 257};
+  std::mt19937 random(1234);
+  int failures = 0;
+
+  for (int simdType = SIMD_TYPES::SCALAR; simdType <= Filter::systemType; ++simdType) {
+    for (unsigned int bpp : bpps) {
+      ScanLineFilters filters = Filter::GetScanLineFilters(bpp, static_cast<SIMD_TYPES>(simdType));
+      for (unsigned int pixels : pixelCounts) {
+        unsigned int width = pixels * bpp;
+        std::vector<char> scanLine(width);
+        std::vector<char> prior(width);
+        for (unsigned int i = 0; i < width; ++i) {
+          scanLine[i] = static_cast<char>(random());
+          prior[i] = static_cast<char>(random());
+        }
+
+        for (unsigned char filterType = 0; filterType <= 4; ++filterType) {
+          for (int hasPrior = 0; hasPrior <= 1; ++hasPrior) {
+            char * priorScanLine = hasPrior ? prior.data() : nullptr;
+            std::vector<char> expected(scanLine);
+            std::vector<char> actual(width);
+            std::vector<char> inPlace(scanLine);
+
+            if (filterType == 1) {
+              Filter::RemoveSubFilter(scanLine.data(), width, expected.data(), bpp);
+            } else if (filterType == 2) {
+              Filter::RemoveUpFilter(scanLine.data(), width, expected.data(), priorScanLine);
+            } else if (filterType == 3) {
+              Filter::RemoveAverageFilter(scanLine.data(), width, expected.data(), bpp, priorScanLine);
+            } else if (filterType == 4) {
+              Filter::RemovePaethFilter(scanLine.data(), width, expected.data(), bpp, priorScanLine);
+            }
+            Filter::UnfilterScanLine(filters, filterType, scanLine.data(), width, actual.data(), priorScanLine);
+            Filter::UnfilterScanLine(filters, filterType, inPlace.data(), width, inPlace.data(), priorScanLine);
+
+            if (actual != expected || inPlace != expected) {
+              std::cerr << "Filter kernel mismatch: " << simdNames[simdType] << " filter " << static_cast<int>(filterType)
+                << " bpp " << bpp << " width " << width << (hasPrior ? "" : " (first scan line)") << std::endl;
+              failures += 1;
+            }
+          }
+        }
+      }
+    }
+  }
+  return failures;
+}
+
+// Compares both CRC implementations against zlib's crc32 across lengths that exercise every folding path.
+int TestCrc() {
+  const size_t lengths[] = {0, 1, 7, 8, 15, 16, 63, 64, 65, 79, 80, 127, 128, 129, 1000, 4097, 100000};
+  std::mt19937 random(99);
+  std::vector<char> data(100003);
+  for (char& byte : data) {
+    byte = static_cast<char>(random());
+  }
+  int failures = 0;
+
+  for (size_t length : lengths) {
+    for (size_t offset = 0; offset < 3; ++offset) {
+      const char * start = data.data() + offset;
+      unsigned int expected = crc32(0, reinterpret_cast<const Bytef *>(start), static_cast<uInt>(length));
+      unsigned int continued = Crc::Crc32(start + length / 2, length - length / 2, Crc::Crc32(start, length / 2));
+      if (Crc::Crc32(start, length) != expected || Crc::SlicingCrc32(start, length) != expected || continued != expected) {
+        std::cerr << "CRC mismatch: length " << length << " offset " << offset << std::endl;
+        failures += 1;
+      }
+    }
+  }
+  return failures;
+}
+
+static void AppendUint32(std::vector<char>& out, unsigned int value) {
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    out.push_back(static_cast<char>((value >> shift) & 0xFF));
+  }
+}
+
+static void AppendChunk(std::vector<char>& out, const char * type, const std::vector<char>& data) {
+  AppendUint32(out, static_cast<unsigned int>(data.size()));
+  size_t typeStart = out.size();
+  out.insert(out.end(), type, type + 4);
+  out.insert(out.end(), data.begin(), data.end());
+  AppendUint32(out, Crc::Crc32(out.data() + typeStart, data.size() + 4));
+}
+
+/* Writes a PNG of random scan lines with random filter bytes, split across IDAT chunks of at most idatSize bytes.
+Adam7 images (interlaceMethod 1) get random scan lines for every pass. Non-empty palette and transparency are
+written as PLTE and tRNS chunks.*/
+static void WritePng(const std::filesystem::path& fileName, unsigned int width, unsigned int height, unsigned char bitDepth,
+  unsigned char colorType, unsigned int idatSize, unsigned int seed, unsigned char interlaceMethod = 0,
+  const std::vector<char>& palette = std::vector<char>(), const std::vector<char>& transparency = std::vector<char>()) {
+  std::mt19937 random(seed);
+  unsigned int channels = (colorType == 2) ? 3 : (colorType == 4) ? 2 : (colorType == 6) ? 4 : 1;
+  std::vector<char> raw;
+  for (unsigned int pass = 0; pass < Interlace::numPasses; ++pass) {
+    unsigned int passWidth = (interlaceMethod == 1) ? Interlace::GetPassWidth(pass, width) : width;
+    unsigned int passHeight = (interlaceMethod == 1) ? Interlace::GetPassHeight(pass, height) : height;
+    unsigned int scanLineWidth = (passWidth * channels * bitDepth + 7) / 8;
+    for (unsigned int i = 0; passWidth > 0 && i < passHeight; ++i) {
+      raw.push_back(static_cast<char>(random() % 5));
+      for (unsigned int j = 0; j < scanLineWidth; ++j) {
+        raw.push_back(static_cast<char>(random() % 16));
+      }
+    }
+    if (interlaceMethod == 0) {
+      break;
+    }
+  }
+
+  uLongf compressedSize = compressBound(static_cast<uLong>(raw.size()));
+  std::vector<char> compressed(compressedSize);
+  compress2(reinterpret_cast<Bytef *>(compressed.data()), &compressedSize, reinterpret_cast<const Bytef *>(raw.data()),
+    static_cast<uLong>(raw.size()), 6);
+
+  std::vector<char> ihdr;
+  AppendUint32(ihdr, width);
+  AppendUint32(ihdr, height);
+  ihdr.push_back(static_cast<char>(bitDepth));
+  ihdr.push_back(static_cast<char>(colorType));
+  ihdr.insert(ihdr.end(), 2, 0);
+  ihdr.push_back(static_cast<char>(interlaceMethod));
+
+  const char signature[] = {static_cast<char>(137), 80, 78, 71, 13, 10, 26, 10};
+  std::vector<char> png(signature, signature + 8);
+  AppendChunk(png, "IHDR", ihdr);
+  if (!palette.empty()) {
+    AppendChunk(png, "PLTE", palette);
+  }
+  if (!transparency.empty()) {
+    AppendChunk(png, "tRNS", transparency);
+  }
+  for (uLongf offset = 0; offset < compressedSize; offset += idatSize) {
+    uLongf size = std::min<uLongf>(idatSize, compressedSize - offset);
+    AppendChunk(png, "IDAT", std::vector<char>(compressed.begin() + offset, compressed.begin() + offset + size));
+  }
+  AppendChunk(png, "IEND", std::vector<char>());
+
+  std::ofstream outputStream(fileName, std::ofstream::binary);
+  outputStream.write(png.data(), static_cast<std::streamsize>(png.size()));
+}
+
+// Decodes the same images serially, pipelined and through the two-step buffers, which must all agree byte for byte.
+int TestPipelinedDecode() {
+  struct Image { unsigned int width, height; unsigned char bitDepth, colorType; };
+  const Image images[] = {{1, 1, 8, 0}, {17, 5, 1, 0}, {300, 700, 8, 6}, {129, 1000, 16, 2}, {2000, 40, 8, 4}};
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_test.png";
+  int failures = 0;
+
+  unsigned int seed = 0;
+  for (const Image& image : images) {
+    WritePng(fileName, image.width, image.height, image.bitDepth, image.colorType, 4096, seed++);
+    PNG_Decoder decoder(fileName, LOAD_TYPES::MMAP);
+    unsigned long decompressedDataSize = PNG_Decoder::GetDecompressedDataSize(image.width, image.height, image.bitDepth, image.colorType);
+    unsigned long unfilteredDataSize = PNG_Decoder::GetUnfilteredDataSize(image.width, image.height, image.bitDepth, image.colorType);
+    std::vector<char> decompressed(decompressedDataSize);
+    std::vector<char> expected(unfilteredDataSize);
+    std::vector<char> serial(unfilteredDataSize);
+    std::vector<char> pipelined(unfilteredDataSize);
+
+    bool decoded = decoder.DecompressDataInto(decompressed.data(), decompressed.size()) == decompressedDataSize &&
+      PNG_Decoder::UnfilterDataInto(decompressed.data(), expected.data(), expected.size(), image.width, image.height, image.bitDepth,
+        image.colorType) == unfilteredDataSize &&
+      decoder.DecodeDataInto(serial.data(), serial.size(), PIXEL_FORMATS::RAW, false) == unfilteredDataSize &&
+      decoder.DecodeDataInto(pipelined.data(), pipelined.size(), PIXEL_FORMATS::RAW, true) == unfilteredDataSize;
+    if (!decoded || serial != expected || pipelined != expected) {
+      std::cerr << "Pipelined decode mismatch: " << image.width << "x" << image.height << " bit depth " << static_cast<int>(image.bitDepth)
+        << " color type " << static_cast<int>(image.colorType) << std::endl;
+      failures += 1;
+    }
+  }
+  std::filesystem::remove(fileName);
+  return failures;
+}
+
+/* Streams every scan line through the static and member DecodeScanLines. Rows must arrive in order, once each, and match
+UnfilterDataInto byte for byte. Interlaced images must be rejected before any row is handed over.*/
+int TestScanLineDecode() {
+  struct Image { unsigned int width, height; unsigned char bitDepth, colorType; };
+  const Image images[] = {{1, 1, 8, 0}, {17, 5, 1, 0}, {33, 17, 4, 3}, {300, 70, 8, 6}, {129, 100, 16, 2}};
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_test_scan_lines.png";
+  int failures = 0;
+
+  unsigned int seed = 200;
+  for (const Image& image : images) {
+    WritePng(fileName, image.width, image.height, image.bitDepth, image.colorType, 256, seed++);
+    PNG_Decoder decoder(fileName, LOAD_TYPES::MMAP);
+    unsigned long decompressedDataSize = PNG_Decoder::GetDecompressedDataSize(image.width, image.height, image.bitDepth, image.colorType);
+    unsigned long unfilteredDataSize = PNG_Decoder::GetUnfilteredDataSize(image.width, image.height, image.bitDepth, image.colorType);
+    unsigned long scanLineWidth = unfilteredDataSize / image.height;
+    std::vector<char> decompressed(decompressedDataSize);
+    std::vector<char> expected(unfilteredDataSize);
+    bool decoded = decoder.DecompressDataInto(decompressed.data(), decompressed.size()) == decompressedDataSize &&
+      PNG_Decoder::UnfilterDataInto(decompressed.data(), expected.data(), expected.size(), image.width, image.height, image.bitDepth,
+        image.colorType) == unfilteredDataSize;
+
+    char * compressedData = nullptr;
+    unsigned long compressedDataSize = decoder.AllocateCompressedData(compressedData);
+    for (int member = 0; member < 2; ++member) {
+      unsigned int nextRow = 0;
+      bool matches = true;
+      ScanLineCallback onScanLine = [&](const char * scanLine, unsigned int row) {
+        if (row != nextRow || row >= image.height || std::memcmp(scanLine, expected.data() + row * scanLineWidth, scanLineWidth) != 0) {
+          matches = false;
+        }
+        nextRow = row + 1;
+      };
+      unsigned long result = (member == 1) ? decoder.DecodeScanLines(onScanLine) : PNG_Decoder::DecodeScanLines(compressedData,
+        compressedDataSize, image.width, image.height, image.bitDepth, image.colorType, onScanLine);
+      if (!decoded || result != unfilteredDataSize || !matches || nextRow != image.height) {
+        std::cerr << (member == 1 ? "Member" : "Static") << " scan line decode mismatch: " << image.width << "x" << image.height
+          << " bit depth " << static_cast<int>(image.bitDepth) << " color type " << static_cast<int>(image.colorType) << std::endl;
+        failures += 1;
+      }
+    }
+    std::free(compressedData);
+  }
+
+  WritePng(fileName, 37, 29, 8, 2, 256, seed, 1);
+  PNG_Decoder interlaced(fileName);
+  unsigned int rows = 0;
+  if (interlaced.DecodeScanLines([&rows](const char *, unsigned int) { rows += 1; }) != 0 || rows != 0) {
+    std::cerr << "An interlaced PNG was decoded in scan line order." << std::endl;
+    failures += 1;
+  }
+  std::filesystem::remove(fileName);
+  return failures;
+}
+
+/* Buffers one byte short of the exact size must be rejected before inflating or unfiltering starts,
+so they must come back with every byte untouched.*/
+int TestBufferCapacity() {
+  const unsigned int width = 45, height = 31;
+  const unsigned char bitDepth = 8, colorType = 2;
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_test_capacity.png";
+  WritePng(fileName, width, height, bitDepth, colorType, 128, 300);
+  PNG_Decoder decoder(fileName);
+  unsigned long decompressedDataSize = PNG_Decoder::GetDecompressedDataSize(width, height, bitDepth, colorType);
+  unsigned long unfilteredDataSize = PNG_Decoder::GetUnfilteredDataSize(width, height, bitDepth, colorType);
+  const char untouched = static_cast<char>(0xA5);
+  int failures = 0;
+
+  std::vector<char> decompressed(decompressedDataSize, untouched);
+  char * compressedData = nullptr;
+  unsigned long compressedDataSize = decoder.AllocateCompressedData(compressedData);
+  if (PNG_Decoder::DecompressDataInto(compressedData, compressedDataSize, decompressed.data(), decompressedDataSize - 1, width, height,
+      bitDepth, colorType) != 0 || decoder.DecompressDataInto(decompressed.data(), decompressedDataSize - 1) != 0 ||
+      std::count(decompressed.begin(), decompressed.end(), untouched) != static_cast<long>(decompressedDataSize)) {
+    std::cerr << "DecompressDataInto accepted a buffer one byte short." << std::endl;
+    failures += 1;
+  }
+  std::free(compressedData);
+
+  std::vector<char> unfiltered(unfilteredDataSize, untouched);
+  if (decoder.DecompressDataInto(decompressed.data(), decompressedDataSize) != decompressedDataSize ||
+      PNG_Decoder::UnfilterDataInto(decompressed.data(), unfiltered.data(), unfilteredDataSize - 1, width, height, bitDepth,
+        colorType) != 0 ||
+      std::count(unfiltered.begin(), unfiltered.end(), untouched) != static_cast<long>(unfilteredDataSize)) {
+    std::cerr << "UnfilterDataInto accepted a buffer one byte short." << std::endl;
+    failures += 1;
+  }
+  std::filesystem::remove(fileName);
+  return failures;
+}
+
+// Probes a directory of valid PNGs, a PNG with a corrupted IHDR and a short non-PNG file.
+int TestProbe() {
+  std::filesystem::path directory = std::filesystem::temp_directory_path() / "png_decoder_test_probe";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+  for (unsigned int i = 0; i < 300; ++i) {
+    WritePng(directory / ("image" + std::to_string(i) + ".png"), i + 1, 2 * i + 1, 8, 2, 4096, i);
+  }
+  WritePng(directory / "corrupt.png", 4, 4, 8, 6, 4096, 0);
+  std::fstream corrupt(directory / "corrupt.png", std::fstream::in | std::fstream::out | std::fstream::binary);
+  corrupt.seekp(19);
+  corrupt.put(1); // The high byte of the width, covered by the IHDR CRC
+  corrupt.close();
+  std::ofstream(directory / "notes.txt") << "not a png";
+  int failures = 0;
+
+  BatchDecoder batchDecoder(4);
+  std::vector<ProbedImage> images = batchDecoder.Probe(directory);
+  for (const ProbedImage& image : images) {
+    std::string name = image.fileName.stem().string();
+    bool expectSuccess = (name.rfind("image", 0) == 0);
+    unsigned int i = expectSuccess ? static_cast<unsigned int>(std::stoul(name.substr(5))) : 0;
+    bool valid = (image.success == expectSuccess) && (!expectSuccess || (image.ihdr.width == i + 1 && image.ihdr.height == 2 * i + 1 &&
+      image.ihdr.bitDepth == 8 && image.ihdr.colorType == 2 && image.ihdr.unfilteredDataSize == 3ul * (i + 1) * (2 * i + 1)));
+    if (!valid) {
+      std::cerr << "Probe mismatch: " << image.fileName << std::endl;
+      failures += 1;
+    }
+  }
+  if (images.size() != 302) {
+    std::cerr << "Probe found " << images.size() << " files instead of 302." << std::endl;
+    failures += 1;
+  }
+  std::filesystem::remove_all(directory);
+  return failures;
+}
+
+// Sub-byte pixels are packed from the most significant bit.
+static unsigned int GetPixel(const char * scanLine, unsigned long x, unsigned int bitsPerPixel) {
+  unsigned int value = 0;
+  for (unsigned int bit = 0; bit < bitsPerPixel; ++bit) {
+    unsigned long position = x * bitsPerPixel + bit;
+    value = (value << 1) | ((static_cast<unsigned char>(scanLine[position / 8]) >> (7 - position % 8)) & 1);
+  }
+  return value;
+}
+
+static unsigned int GetPixelSample(const std::vector<char>& image, unsigned long scanLineWidth, unsigned long x, unsigned long y,
+  unsigned int bitsPerPixel, unsigned int byte) {
+  if (bitsPerPixel < 8) {
+    return GetPixel(image.data() + y * scanLineWidth, x, bitsPerPixel);
+  }
+  return static_cast<unsigned char>(image[y * scanLineWidth + x * (bitsPerPixel / 8) + byte]);
+}
+
+/* Decodes Adam7 images through every path and compares them with each pass unfiltered as its own image and
+placed pixel by pixel. The first progressive preview must repeat each pass 0 pixel across its 8x8 block.*/
+int TestInterlacedDecode() {
+  struct Image { unsigned int width, height; unsigned char bitDepth, colorType; };
+  const Image images[] = {{1, 1, 8, 6}, {3, 2, 1, 0}, {9, 9, 2, 0}, {33, 17, 4, 3}, {37, 29, 8, 2}, {64, 50, 16, 6}, {21, 13, 16, 4}};
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_test_interlaced.png";
+  int failures = 0;
+
+  unsigned int seed = 100;
+  for (const Image& image : images) {
+    WritePng(fileName, image.width, image.height, image.bitDepth, image.colorType, 64, seed++, 1);
+    PNG_Decoder decoder(fileName);
+    unsigned int channels = (image.colorType == 2) ? 3 : (image.colorType == 4) ? 2 : (image.colorType == 6) ? 4 : 1;
+    unsigned int bitsPerPixel = channels * image.bitDepth;
+    unsigned long scanLineWidth = (static_cast<unsigned long>(image.width) * bitsPerPixel + 7) / 8;
+    unsigned long decompressedDataSize = PNG_Decoder::GetDecompressedDataSize(image.width, image.height, image.bitDepth,
+      image.colorType, 1);
+    unsigned long unfilteredDataSize = scanLineWidth * image.height;
+
+    std::vector<char> decompressed(decompressedDataSize);
+    std::vector<char> expected(unfilteredDataSize);
+    bool decoded = decoder.DecompressDataInto(decompressed.data(), decompressed.size()) == decompressedDataSize;
+    unsigned long passOffset = 0;
+    for (unsigned int pass = 0; decoded && pass < Interlace::numPasses; ++pass) {
+      unsigned int passWidth = Interlace::GetPassWidth(pass, image.width);
+      unsigned int passHeight = Interlace::GetPassHeight(pass, image.height);
+      if (passWidth == 0 || passHeight == 0) {
+        continue;
+      }
+      unsigned long passScanLineWidth = (static_cast<unsigned long>(passWidth) * bitsPerPixel + 7) / 8;
+      std::vector<char> passData(passScanLineWidth * passHeight);
+      decoded = PNG_Decoder::UnfilterDataInto(decompressed.data() + passOffset, passData.data(), passData.size(), passWidth, passHeight,
+        image.bitDepth, image.colorType) == passData.size();
+      passOffset += (passScanLineWidth + 1) * passHeight;
+
+      for (unsigned long y = 0; y < passHeight; ++y) {
+        for (unsigned long x = 0; x < passWidth; ++x) {
+          unsigned long imageX = Interlace::xStart[pass] + x * Interlace::xStep[pass];
+          char * imageScanLine = expected.data() + (Interlace::yStart[pass] + y * Interlace::yStep[pass]) * scanLineWidth;
+          for (unsigned int bit = 0; bit < bitsPerPixel; ++bit) {
+            unsigned long from = x * bitsPerPixel + bit;
+            unsigned long to = imageX * bitsPerPixel + bit;
+            char value = static_cast<char>((static_cast<unsigned char>(passData[y * passScanLineWidth + from / 8]) >> (7 - from % 8)) & 1);
+            imageScanLine[to / 8] = static_cast<char>(imageScanLine[to / 8] | (value << (7 - to % 8)));
+          }
+        }
+      }
+    }
+
+    std::vector<char> unfiltered(unfilteredDataSize);
+    std::vector<char> direct(unfilteredDataSize);
+    std::vector<char> progressive(unfilteredDataSize);
+    std::vector<char> firstPreview;
+    unsigned int passes = 0;
+    decoded = decoded &&
+      PNG_Decoder::UnfilterDataInto(decompressed.data(), unfiltered.data(), unfiltered.size(), image.width, image.height, image.bitDepth,
+        image.colorType, 1) == unfilteredDataSize &&
+      decoder.DecodeDataInto(direct.data(), direct.size(), PIXEL_FORMATS::RAW, true) == unfilteredDataSize &&
+      decoder.DecodeProgressive(progressive.data(), progressive.size(), [&](const char * unfilteredData, unsigned int pass) {
+        if (pass == 0) {
+          firstPreview.assign(unfilteredData, unfilteredData + unfilteredDataSize);
+        }
+        passes += 1;
+      }) == unfilteredDataSize;
+
+    bool previewValid = firstPreview.size() == unfilteredDataSize;
+    for (unsigned long y = 0; previewValid && y < image.height; ++y) {
+      for (unsigned long x = 0; x < image.width; ++x) {
+        for (unsigned int byte = 0; byte < std::max(1u, bitsPerPixel / 8); ++byte) {
+          previewValid = previewValid && GetPixelSample(firstPreview, scanLineWidth, x, y, bitsPerPixel, byte) ==
+            GetPixelSample(expected, scanLineWidth, x & ~7ul, y & ~7ul, bitsPerPixel, byte);
+        }
+      }
+    }
+
+    if (!decoded || unfiltered != expected || direct != expected || progressive != expected || passes != 7 || !previewValid) {
+      std::cerr << "Interlaced decode mismatch: " << image.width << "x" << image.height << " bit depth "
+        << static_cast<int>(image.bitDepth) << " color type " << static_cast<int>(image.colorType) << std::endl;
+      failures += 1;
+    }
+  }
+  std::filesystem::remove(fileName);
+  return failures;
+}
+
+/* Compares every vector conversion kernel with the scalar kernels, checks known conversions, and checks that
+decoding straight to a format matches a RAW decode converted afterwards, for serial, pipelined and Adam7 decodes.*/
+int TestPixelConversion() {
+  const char * formatNames[] = {"RAW", "HOST_ENDIAN", "GRAY8", "RGB8", "RGBA8"};
+  struct Image { unsigned char bitDepth, colorType; };
+  const Image images[] = {{1, 0}, {2, 0}, {4, 0}, {8, 0}, {16, 0}, {8, 2}, {16, 2}, {1, 3}, {2, 3}, {4, 3}, {8, 3}, {8, 4}, {16, 4},
+    {8, 6}, {16, 6}};
+  const unsigned int widths[] = {1, 3, 5, 16, 37, 100, 257};
+  std::mt19937 random(7);
+  std::vector<char> palette(3 * 256);
+  for (char& byte : palette) {
+    byte = static_cast<char>(random());
+  }
+  std::vector<char> transparency = {static_cast<char>(0), static_cast<char>(128), static_cast<char>(255)};
+  int failures = 0;
+
+  for (const Image& image : images) {
+    unsigned int channels = (image.colorType == 2) ? 3 : (image.colorType == 4) ? 2 : (image.colorType == 6) ? 4 : 1;
+    for (int format = PIXEL_FORMATS::RAW; format <= PIXEL_FORMATS::RGBA8; ++format) {
+      // Grayscale and RGB images get a key matching their first pixel, so keyed conversion is exercised too.
+      std::vector<char> key = (image.colorType == 0) ? std::vector<char>(2) : (image.colorType == 2) ? std::vector<char>(6) :
+        (image.colorType == 3) ? transparency : std::vector<char>();
+      for (unsigned int width : widths) {
+        std::vector<char> scanLine((static_cast<unsigned long>(width) * channels * image.bitDepth + 7) / 8);
+        for (char& byte : scanLine) {
+          byte = static_cast<char>(random());
+        }
+        if (image.colorType == 0 || image.colorType == 2) {
+          for (unsigned int i = 0; i < key.size(); ++i) {
+            key[i] = (image.bitDepth == 16) ? scanLine[i] : (i % 2 == 0) ? 0 : scanLine[i / 2];
+          }
+          if (image.bitDepth < 8) {
+            key[1] = static_cast<char>(static_cast<unsigned char>(scanLine[0]) >> (8 - image.bitDepth));
+          }
+        }
+
+        PixelConverter scalar(image.bitDepth, image.colorType, static_cast<PIXEL_FORMATS>(format), palette.data(),
+          static_cast<unsigned int>(palette.size()), key.data(), static_cast<unsigned int>(key.size()), SIMD_TYPES::SCALAR);
+        std::vector<char> expected(scalar.GetOutputScanLineWidth(width));
+        scalar.ConvertScanLine(scanLine.data(), width, expected.data());
+        for (int simdType = SIMD_TYPES::SSE2; simdType <= Filter::systemType; ++simdType) {
+          PixelConverter vector(image.bitDepth, image.colorType, static_cast<PIXEL_FORMATS>(format), palette.data(),
+            static_cast<unsigned int>(palette.size()), key.data(), static_cast<unsigned int>(key.size()), static_cast<SIMD_TYPES>(simdType));
+          std::vector<char> actual(expected.size());
+          vector.ConvertScanLine(scanLine.data(), width, actual.data());
+          if (actual != expected) {
+            std::cerr << "Pixel conversion kernel mismatch: " << formatNames[format] << " bit depth " << static_cast<int>(image.bitDepth)
+              << " color type " << static_cast<int>(image.colorType) << " width " << width << " SIMD type " << simdType << std::endl;
+            failures += 1;
+          }
+        }
+        if (format == PIXEL_FORMATS::RGBA8 && key.size() > 0 && expected[3] != 0 && image.colorType != 3) {
+          std::cerr << "Pixel conversion ignored the tRNS key: bit depth " << static_cast<int>(image.bitDepth) << " color type "
+            << static_cast<int>(image.colorType) << std::endl;
+          failures += 1;
+        }
+      }
+    }
+  }
+
+  // Known values: palette with tRNS, 2-bit grayscale scaling, 16-bit reduction and luminance.
+  const char paletteScanLine[] = {0x1B}; // 2-bit indices 0, 1, 2, 3
+  const char grayScanLine[] = {0x1B};
+  const char wideScanLine[] = {0x12, 0x34, 0x56, 0x78, static_cast<char>(0x9A), static_cast<char>(0xBC)};
+  const char colorScanLine[] = {static_cast<char>(255), 0, 0, 0, static_cast<char>(255), 0};
+  std::vector<char> rgba(16);
+  std::vector<char> gray(4);
+  std::vector<char> rgb(3);
+  PixelConverter(2, 3, PIXEL_FORMATS::RGBA8, palette.data(), 12, transparency.data(), 2).ConvertScanLine(paletteScanLine, 4, rgba.data());
+  bool known = std::equal(palette.begin(), palette.begin() + 3, rgba.begin()) && rgba[3] == 0 && rgba[7] == static_cast<char>(128) &&
+    std::equal(palette.begin() + 9, palette.begin() + 12, rgba.begin() + 12) && rgba[11] == static_cast<char>(255) && rgba[15] == static_cast<char>(255);
+  PixelConverter(2, 0, PIXEL_FORMATS::GRAY8).ConvertScanLine(grayScanLine, 4, gray.data());
+  known = known && gray == std::vector<char>({0, 85, static_cast<char>(170), static_cast<char>(255)});
+  PixelConverter(16, 2, PIXEL_FORMATS::RGB8).ConvertScanLine(wideScanLine, 1, rgb.data());
+  known = known && rgb == std::vector<char>({0x12, 0x56, static_cast<char>(0x9A)});
+  PixelConverter(8, 2, PIXEL_FORMATS::GRAY8).ConvertScanLine(colorScanLine, 2, gray.data());
+  known = known && gray[0] == 54 && gray[1] == static_cast<char>(182);
+  if (!known) {
+    std::cerr << "Pixel conversion produced wrong known values." << std::endl;
+    failures += 1;
+  }
+
+  // Fused decodes against RAW decodes converted row by row.
+  const Image decodes[] = {{4, 3}, {16, 6}, {8, 2}, {2, 0}, {16, 0}};
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_test_convert.png";
+  unsigned int seed = 200;
+  for (const Image& image : decodes) {
+    for (unsigned char interlaceMethod = 0; interlaceMethod <= 1; ++interlaceMethod) {
+      unsigned int width = 45;
+      unsigned int height = 700;
+      WritePng(fileName, width, height, image.bitDepth, image.colorType, 512, seed++, interlaceMethod,
+        (image.colorType == 3) ? std::vector<char>(palette.begin(), palette.begin() + 48) : std::vector<char>(),
+        (image.colorType == 3) ? transparency : std::vector<char>());
+      PNG_Decoder decoder(fileName);
+      unsigned long rawScanLineWidth = PNG_Decoder::GetUnfilteredDataSize(width, 1, image.bitDepth, image.colorType);
+      std::vector<char> raw(rawScanLineWidth * height);
+      bool decoded = decoder.DecodeDataInto(raw.data(), raw.size()) == raw.size();
+
+      for (int format = PIXEL_FORMATS::HOST_ENDIAN; format <= PIXEL_FORMATS::RGBA8; ++format) {
+        PixelConverter converter = decoder.GetPixelConverter(static_cast<PIXEL_FORMATS>(format));
+        unsigned long outputScanLineWidth = converter.GetOutputScanLineWidth(width);
+        std::vector<char> expected(converter.GetOutputDataSize(width, height));
+        for (unsigned int row = 0; row < height; ++row) {
+          converter.ConvertScanLine(raw.data() + row * rawScanLineWidth, width, expected.data() + row * outputScanLineWidth);
+        }
+        std::vector<char> serial(expected.size());
+        std::vector<char> pipelined(expected.size());
+        std::vector<char> progressive(expected.size());
+        decoded = decoded &&
+          decoder.DecodeDataInto(serial.data(), serial.size(), static_cast<PIXEL_FORMATS>(format)) == expected.size() &&
+          decoder.DecodeDataInto(pipelined.data(), pipelined.size(), static_cast<PIXEL_FORMATS>(format), true) == expected.size() &&
+          decoder.DecodeProgressive(progressive.data(), progressive.size(), [](const char *, unsigned int) {},
+            static_cast<PIXEL_FORMATS>(format)) == expected.size();
+        if (!decoded || serial != expected || pipelined != expected || progressive != expected) {
+          std::cerr << "Fused conversion mismatch: " << formatNames[format] << " bit depth " << static_cast<int>(image.bitDepth)
+            << " color type " << static_cast<int>(image.colorType) << " interlace method " << static_cast<int>(interlaceMethod) << std::endl;
+          failures += 1;
+        }
+      }
+    }
+  }
+  std::filesystem::remove(fileName);
+  return failures;
+}
+
+/* Decodes random regions and compares them with the same pixels of a full decode. A band at the top must also decode
+from a stream cut off below it, since inflating stops after the band.*/
+int TestRegionDecode() {
+  struct Image { unsigned int width, height; unsigned char bitDepth, colorType, interlaceMethod; };
+  const Image images[] = {{45, 300, 1, 0, 0}, {33, 200, 2, 0, 0}, {50, 120, 4, 0, 0}, {61, 250, 8, 2, 0}, {40, 90, 16, 6, 0},
+    {29, 31, 16, 4, 0}, {37, 41, 2, 0, 1}, {26, 19, 8, 6, 1}};
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_test_region.png";
+  std::mt19937 random(13);
+  int failures = 0;
+
+  unsigned int seed = 300;
+  for (const Image& image : images) {
+    WritePng(fileName, image.width, image.height, image.bitDepth, image.colorType, 256, seed++, image.interlaceMethod);
+    PNG_Decoder decoder(fileName);
+    unsigned int channels = (image.colorType == 2) ? 3 : (image.colorType == 4) ? 2 : (image.colorType == 6) ? 4 : 1;
+    unsigned int bitsPerPixel = channels * image.bitDepth;
+    unsigned long scanLineWidth = PNG_Decoder::GetUnfilteredDataSize(image.width, 1, image.bitDepth, image.colorType);
+    std::vector<char> full(scanLineWidth * image.height);
+    bool decoded = decoder.DecodeDataInto(full.data(), full.size()) == full.size();
+
+    for (unsigned int i = 0; decoded && i < 20; ++i) {
+      Region region;
+      region.firstRow = random() % image.height;
+      region.lastRow = region.firstRow + 1 + random() % (image.height - region.firstRow);
+      region.firstColumn = random() % image.width;
+      region.lastColumn = region.firstColumn + 1 + random() % (image.width - region.firstColumn);
+      unsigned int regionWidth = region.lastColumn - region.firstColumn;
+      unsigned long regionScanLineWidth = (static_cast<unsigned long>(regionWidth) * bitsPerPixel + 7) / 8;
+
+      std::vector<char> expected(PNG_Decoder::GetRegionDataSize(region, image.bitDepth, image.colorType));
+      for (unsigned long y = 0; y < region.lastRow - region.firstRow; ++y) {
+        for (unsigned long x = 0; x < regionWidth; ++x) {
+          for (unsigned int bit = 0; bit < bitsPerPixel; ++bit) {
+            unsigned long from = (region.firstColumn + x) * bitsPerPixel + bit;
+            unsigned long to = x * bitsPerPixel + bit;
+            const char * fullScanLine = full.data() + (region.firstRow + y) * scanLineWidth;
+            char value = static_cast<char>((static_cast<unsigned char>(fullScanLine[from / 8]) >> (7 - from % 8)) & 1);
+            expected[y * regionScanLineWidth + to / 8] = static_cast<char>(expected[y * regionScanLineWidth + to / 8] | (value << (7 - to % 8)));
+          }
+        }
+      }
+
+      std::vector<char> actual(expected.size());
+      if (decoder.DecodeRegionInto(actual.data(), actual.size(), region) != expected.size() || actual != expected) {
+        std::cerr << "Region decode mismatch: " << image.width << "x" << image.height << " bit depth " << static_cast<int>(image.bitDepth)
+          << " rows " << region.firstRow << "-" << region.lastRow << " columns " << region.firstColumn << "-" << region.lastColumn << std::endl;
+        failures += 1;
+      }
+
+      PixelConverter converter = decoder.GetPixelConverter(PIXEL_FORMATS::RGBA8);
+      std::vector<char> converted(converter.GetOutputDataSize(regionWidth, region.lastRow - region.firstRow));
+      std::vector<char> convertedExpected(converted.size());
+      for (unsigned long y = 0; y < region.lastRow - region.firstRow; ++y) {
+        std::vector<char> convertedScanLine(converter.GetOutputScanLineWidth(image.width));
+        converter.ConvertScanLine(full.data() + (region.firstRow + y) * scanLineWidth, image.width, convertedScanLine.data());
+        std::copy(convertedScanLine.begin() + 4 * region.firstColumn, convertedScanLine.begin() + 4 * region.lastColumn,
+          convertedExpected.begin() + y * 4 * regionWidth);
+      }
+      if (decoder.DecodeRegionInto(converted.data(), converted.size(), region, PIXEL_FORMATS::RGBA8) != converted.size() ||
+        converted != convertedExpected) {
+        std::cerr << "Converted region decode mismatch: " << image.width << "x" << image.height << " bit depth "
+          << static_cast<int>(image.bitDepth) << std::endl;
+        failures += 1;
+      }
+    }
+    if (!decoded) {
+      std::cerr << "Region reference decode failed." << std::endl;
+      failures += 1;
+    }
+
+    if (image.interlaceMethod == 0) {
+      char * compressedData = nullptr;
+      unsigned long compressedDataSize = decoder.AllocateCompressedData(compressedData);
+      Region band = {0, image.height / 8, 0, image.width};
+      std::vector<char> bandData(PNG_Decoder::GetRegionDataSize(band, image.bitDepth, image.colorType));
+      std::vector<char> expectedBand(bandData.size());
+      if (decoder.DecodeRegionInto(expectedBand.data(), expectedBand.size(), band) != bandData.size() ||
+        PNG_Decoder::DecodeRegionInto(compressedData, compressedDataSize / 2, bandData.data(), bandData.size(), image.width, image.height,
+        image.bitDepth, image.colorType, band) != bandData.size() || bandData != expectedBand) {
+        std::cerr << "Top band decode did not stop early: " << image.width << "x" << image.height << std::endl;
+        failures += 1;
+      }
+      std::free(compressedData);
+    }
+  }
+  std::filesystem::remove(fileName);
+  return failures;
+}
+
+static std::vector<char> ReadFile(const std::filesystem::path& fileName) {
+  std::ifstream inputStream(fileName, std::ifstream::binary);
+  return std::vector<char>(std::istreambuf_iterator<char>(inputStream), std::istreambuf_iterator<char>());
+}
+
+// Pushes png in pieces of random sizes (1 byte to maxPiece) and collects the scan lines. Returns false if a push fails.
+static bool PushInPieces(PushDecoder& pushDecoder, const std::vector<char>& png, unsigned int maxPiece, std::mt19937& random) {
+  for (size_t offset = 0; offset < png.size();) {
+    size_t size = std::min<size_t>(1 + random() % maxPiece, png.size() - offset);
+    if (!pushDecoder.Push(reinterpret_cast<const uint8_t *>(png.data() + offset), size)) {
+      return false;
+    }
+    offset += size;
+  }
+  return true;
+}
+
+/* Decodes the same PNGs from their files, from borrowed buffers, pushed a few bytes at a time and through
+BatchDecoder::Submit on a buffer. All must agree. Broken pushed data must be rejected.*/
+int TestBufferDecode() {
+  struct Image { unsigned int width, height; unsigned char bitDepth, colorType; PIXEL_FORMATS format; };
+  const Image images[] = {{1, 1, 8, 0, PIXEL_FORMATS::RAW}, {37, 19, 2, 0, PIXEL_FORMATS::RAW}, {300, 200, 8, 6, PIXEL_FORMATS::RAW},
+    {129, 70, 16, 2, PIXEL_FORMATS::RGB8}, {64, 33, 4, 3, PIXEL_FORMATS::RGBA8}};
+  std::vector<char> palette(3 * 16);
+  std::vector<char> transparency(5);
+  for (size_t i = 0; i < palette.size(); ++i) {
+    palette[i] = static_cast<char>(i * 5);
+  }
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_test_buffer.png";
+  std::mt19937 random(17);
+  int failures = 0;
+
+  unsigned int seed = 100;
+  for (const Image& image : images) {
+    WritePng(fileName, image.width, image.height, image.bitDepth, image.colorType, 512, seed++, 0,
+      (image.colorType == 3) ? palette : std::vector<char>(), (image.colorType == 3) ? transparency : std::vector<char>());
+    std::vector<char> png = ReadFile(fileName);
+    const uint8_t * data = reinterpret_cast<const uint8_t *>(png.data());
+
+    PNG_Decoder fileDecoder(fileName);
+    PNG_Decoder bufferDecoder(data, png.size());
+    unsigned long outputSize = fileDecoder.GetPixelConverter(image.format).GetOutputDataSize(image.width, image.height);
+    std::vector<char> expected(outputSize);
+    std::vector<char> borrowed(outputSize);
+    IHDR fileIhdr;
+    IHDR bufferIhdr;
+    bool valid = fileDecoder.DecodeDataInto(expected.data(), expected.size(), image.format) == outputSize &&
+      bufferDecoder.DecodeDataInto(borrowed.data(), borrowed.size(), image.format) == outputSize && borrowed == expected &&
+      bufferDecoder.GetBytes() == png.data() && bufferDecoder.GetLoadType() == LOAD_TYPES::BUFFER &&
+      PNG_Decoder::Probe(fileName, fileIhdr) && PNG_Decoder::Probe(data, png.size(), bufferIhdr) &&
+      fileIhdr.width == bufferIhdr.width && fileIhdr.unfilteredDataSize == bufferIhdr.unfilteredDataSize;
+
+    // Reopening a file after a borrowed buffer must not free the buffer.
+    bufferDecoder.Open(fileName);
+    valid = valid && bufferDecoder.IsOpen() && bufferDecoder.GetBytes() != png.data();
+
+    for (unsigned int maxPiece : {1u, 7u, 4096u}) {
+      std::vector<char> pushed(outputSize);
+      unsigned long outputScanLineWidth = outputSize / image.height;
+      bool headerFirst = false;
+      PushDecoder pushDecoder([&](const char * scanLine, unsigned int row) {
+        std::copy(scanLine, scanLine + outputScanLineWidth, pushed.begin() + row * outputScanLineWidth);
+      }, image.format, true, [&](const IHDR& ihdr) {
+        headerFirst = ihdr.width == image.width && ihdr.height == image.height;
+      });
+      valid = valid && PushInPieces(pushDecoder, png, maxPiece, random) && pushDecoder.IsComplete() && headerFirst &&
+        pushDecoder.GetRowsDecoded() == image.height && pushed == expected;
+    }
+
+    BatchDecoder batchDecoder(2, 0, image.format);
+    DecodedImage decoded = batchDecoder.Submit(data, png.size()).get();
+    valid = valid && decoded.success && decoded.fileName.empty() && decoded.unfilteredData.size() >= expected.size() &&
+      std::equal(expected.begin(), expected.end(), decoded.unfilteredData.begin());
+    if (!valid) {
+      std::cerr << "Buffer decode mismatch: " << image.width << "x" << image.height << " bit depth " << static_cast<int>(image.bitDepth)
+        << " color type " << static_cast<int>(image.colorType) << std::endl;
+      failures += 1;
+    }
+  }
+
+  // Truncated data never completes, corrupted data fails its CRC check, interlaced images and garbage are rejected.
+  WritePng(fileName, 100, 100, 8, 2, 1000, 7);
+  std::vector<char> png = ReadFile(fileName);
+  auto ignore = [](const char *, unsigned int) {};
+  PushDecoder truncated(ignore);
+  std::vector<char> corruptedPng(png);
+  corruptedPng[png.size() / 2] ^= 0x10;
+  PushDecoder corrupted(ignore);
+  WritePng(fileName, 100, 100, 8, 2, 1000, 7, 1);
+  std::vector<char> interlacedPng = ReadFile(fileName);
+  PushDecoder interlaced(ignore);
+  PushDecoder garbage(ignore);
+  const uint8_t garbageBytes[40] = {137, 80, 78, 71};
+  bool rejected = truncated.Push(reinterpret_cast<const uint8_t *>(png.data()), png.size() - 20) && !truncated.IsComplete() &&
+    !PushInPieces(corrupted, corruptedPng, 100, random) && corrupted.GetState() == PUSH_STATES::FAILED &&
+    !interlaced.Push(reinterpret_cast<const uint8_t *>(interlacedPng.data()), interlacedPng.size()) &&
+    !garbage.Push(garbageBytes, sizeof(garbageBytes)) && !garbage.HasHeader() &&
+    !PNG_Decoder(reinterpret_cast<const uint8_t *>(png.data()), 20).IsOpen();
+  if (!rejected) {
+    std::cerr << "Broken pushed data was not rejected." << std::endl;
+    failures += 1;
+  }
+
+  std::filesystem::remove(fileName);
+  return failures;
+}
+
+static unsigned long hookCalls = 0;
+
+static void CountHookCall(const DecodeStats&) {
+  hookCalls += 1;
+}
+
+/* Decodes inside a DecodeStatsScope, serially and pipelined. With -DPNG_DECODER_STATS every stage must be timed,
+the filter histogram must match the filter bytes and the process counters and hook must see the decode; without
+it the stats must stay empty and the hook must never run.*/
+int TestDecodeStats() {
+  const unsigned int width = 300;
+  const unsigned int height = 200;
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_test_stats.png";
+  WritePng(fileName, width, height, 8, 6, 4096, 16);
+  int failures = 0;
+
+  std::vector<char> decompressed(PNG_Decoder::GetDecompressedDataSize(width, height, 8, 6));
+  std::vector<char> unfiltered(PNG_Decoder::GetUnfilteredDataSize(width, height, 8, 6));
+  unsigned long expectedRows[5] = {0, 0, 0, 0, 0};
+  {
+    PNG_Decoder decoder(fileName);
+    decoder.DecompressDataInto(decompressed.data(), decompressed.size());
+    for (unsigned int i = 0; i < height; ++i) {
+      expectedRows[static_cast<unsigned char>(decompressed[i * (decompressed.size() / height)])] += 1;
+    }
+  }
+
+  DecodeStats::hook = CountHookCall;
+  for (bool pipelined : {false, true}) {
+    DecodeStats stats;
+    unsigned long decodes = DecodeStats::counters.decodes;
+    unsigned long calls = hookCalls;
+    unsigned long decoded = 0;
+    {
+      DecodeStatsScope scope(stats);
+      PNG_Decoder decoder(fileName);
+      decoded = decoder.DecodeDataInto(unfiltered.data(), unfiltered.size(), PIXEL_FORMATS::RAW, pipelined);
+    }
+
+    bool valid = decoded == unfiltered.size();
+#ifdef PNG_DECODER_STATS
+    for (DECODE_STAGES stage : {DECODE_STAGES::LOAD, DECODE_STAGES::CHUNK_PARSE, DECODE_STAGES::INFLATE, DECODE_STAGES::UNFILTER}) {
+      valid = valid && stats.stageNanoseconds[stage] > 0;
+    }
+    for (unsigned int i = 0; i < 5; ++i) {
+      valid = valid && stats.filterTypeRows[i] == expectedRows[i];
+    }
+    valid = valid && stats.stageNanoseconds[DECODE_STAGES::IDAT_GATHER] == 0 && stats.totalNanoseconds > 0 &&
+      stats.bytesAllocated == std::filesystem::file_size(fileName) && stats.decompressedBytes == decompressed.size() &&
+      stats.GetCompressionRatio() > 1 && DecodeStats::counters.decodes == decodes + 1 && hookCalls == calls + 1;
+#else
+    valid = valid && stats.totalNanoseconds == 0 && stats.bytesAllocated == 0 && stats.decompressedBytes == 0 &&
+      stats.filterTypeRows[0] == 0 && DecodeStats::counters.decodes == decodes && hookCalls == calls;
+#endif
+    if (!valid) {
+      std::cerr << "Decode stats mismatch: " << (pipelined ? "pipelined" : "serial") << std::endl;
+      failures += 1;
+    }
+  }
+
+  // Bands unfiltered on pool threads count their rows into the caller's stats.
+  ThreadPool pool(4);
+  DecodeStats stats;
+  unsigned long unfilteredSize = 0;
+  {
+    DecodeStatsScope scope(stats);
+    unfilteredSize = PNG_Decoder::UnfilterDataInto(decompressed.data(), unfiltered.data(), unfiltered.size(), width, height, 8, 6, 0,
+      nullptr, nullptr, &pool);
+  }
+  bool valid = unfilteredSize == unfiltered.size();
+#ifdef PNG_DECODER_STATS
+  valid = valid && stats.stageNanoseconds[DECODE_STAGES::UNFILTER] > 0;
+  for (unsigned int i = 0; i < 5; ++i) {
+    valid = valid && stats.filterTypeRows[i] == expectedRows[i];
+  }
+#endif
+  if (!valid) {
+    std::cerr << "Decode stats mismatch: banded" << std::endl;
+    failures += 1;
+  }
+  DecodeStats::hook = nullptr;
+
+  std::filesystem::remove(fileName);
+  return failures;
+}
+
+// Inflates with one backend, returning false if it throws.
+static bool InflateWith(INFLATE_BACKENDS backend, std::vector<char>& compressed, const std::vector<Chunk>& chunks,
+  std::vector<char>& decompressed) {
+  try {
+    if (chunks.empty()) {
+      Inflate::InflateInto(compressed.data(), compressed.size(), nullptr, nullptr, decompressed.data(), decompressed.size(), backend);
+    } else {
+      Inflate::InflateInto(nullptr, 0, chunks.data(), chunks.data() + chunks.size(), decompressed.data(), decompressed.size(), backend);
+    }
+    return true;
+  } catch(const std::exception& e) {
+    return false;
+  }
+}
+
+/* Fuzz-compares the native inflate backend with zlib on streams from every deflate level and strategy, with flushes
+and window sizes, whole and split into IDAT chunks. Truncated streams must fail on both; corrupted streams must not
+crash the native backend, and whenever both backends accept one they must agree.*/
+int TestInflateBackends() {
+  const int strategies[] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED};
+  std::mt19937 random(14);
+  int failures = 0;
+
+  for (unsigned int iteration = 0; iteration < 400; ++iteration) {
+    // Mix random bytes, short repeats and long runs so every block type and match distance shows up.
+    std::vector<char> raw(random() % 200000);
+    unsigned int alphabet = 1 + random() % 256;
+    for (size_t i = 0; i < raw.size(); ++i) {
+      unsigned int mode = random() % 8;
+      if (mode == 0 || i < 64) {
+        raw[i] = static_cast<char>(random() % alphabet);
+      } else if (mode < 5) {
+        raw[i] = raw[i - 1 - random() % std::min<size_t>(i, 64)];
+      } else {
+        raw[i] = raw[i - 1 - (random() % std::min<size_t>(i, 40000))];
+      }
+    }
+
+    z_stream stream = {};
+    int level = static_cast<int>(random() % 10);
+    deflateInit2(&stream, level, Z_DEFLATED, 8 + static_cast<int>(random() % 8), 1 + static_cast<int>(random() % 9),
+      strategies[random() % 5]);
+    std::vector<char> compressed(deflateBound(&stream, static_cast<uLong>(raw.size())) + 1024);
+    stream.next_in = reinterpret_cast<Bytef *>(raw.data());
+    stream.next_out = reinterpret_cast<Bytef *>(compressed.data());
+    stream.avail_out = static_cast<uInt>(compressed.size());
+    while (stream.avail_in == 0 && stream.next_in != reinterpret_cast<Bytef *>(raw.data() + raw.size())) {
+      stream.avail_in = std::min<uInt>(static_cast<uInt>(raw.data() + raw.size() - reinterpret_cast<char *>(stream.next_in)),
+        1 + random() % 70000);
+      int flush = (random() % 4 == 0) ? Z_SYNC_FLUSH : (random() % 4 == 0) ? Z_FULL_FLUSH : Z_NO_FLUSH;
+      deflate(&stream, flush);
+    }
+    deflate(&stream, Z_FINISH);
+    compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    // Split into IDAT chunks of random sizes, some as small as one byte.
+    std::vector<char> file;
+    std::vector<size_t> offsets;
+    unsigned int maxChunkSize = (random() % 2 == 0) ? 1 + random() % 16 : 1 + random() % 65536;
+    for (size_t offset = 0; offset < compressed.size();) {
+      size_t size = std::min<size_t>(1 + random() % maxChunkSize, compressed.size() - offset);
+      offsets.push_back(file.size());
+      AppendChunk(file, "IDAT", std::vector<char>(compressed.begin() + offset, compressed.begin() + offset + size));
+      offset += size;
+    }
+    std::vector<Chunk> chunks;
+    for (size_t offset : offsets) {
+      chunks.push_back(Chunk(file.data() + offset));
+    }
+
+    // Decoding a prefix of the output is what PNG decodes rely on when trailing data follows the image.
+    size_t outputSize = (random() % 4 == 0) ? random() % (raw.size() + 1) : raw.size();
+    std::vector<char> native(outputSize);
+    std::vector<char> nativeChunked(outputSize);
+    std::vector<char> zlib(outputSize);
+    bool decoded = InflateWith(INFLATE_BACKENDS::NATIVE, compressed, std::vector<Chunk>(), native) &&
+      InflateWith(INFLATE_BACKENDS::NATIVE, compressed, chunks, nativeChunked) &&
+      InflateWith(INFLATE_BACKENDS::ZLIB, compressed, chunks, zlib);
+    if (!decoded || native != zlib || nativeChunked != zlib || !std::equal(zlib.begin(), zlib.end(), raw.begin())) {
+      std::cerr << "Inflate backend mismatch: iteration " << iteration << " level " << level << " size " << raw.size() << std::endl;
+      failures += 1;
+      continue;
+    }
+
+    if (raw.size() > 0 && compressed.size() > 8) {
+      std::vector<char> truncated(compressed.begin(), compressed.begin() + random() % (compressed.size() - 8));
+      std::vector<char> full(raw.size());
+      if (InflateWith(INFLATE_BACKENDS::NATIVE, truncated, std::vector<Chunk>(), full) ||
+        InflateWith(INFLATE_BACKENDS::ZLIB, truncated, std::vector<Chunk>(), full)) {
+        std::cerr << "Truncated inflate did not fail: iteration " << iteration << std::endl;
+        failures += 1;
+      }
+    }
+
+    for (unsigned int i = 0; i < 4 && compressed.size() > 2; ++i) {
+      std::vector<char> corrupted(compressed);
+      for (unsigned int j = 0; j <= random() % 4; ++j) {
+        corrupted[2 + random() % (corrupted.size() - 2)] ^= static_cast<char>(1 << (random() % 8));
+      }
+      std::vector<char> nativeCorrupted(raw.size());
+      std::vector<char> zlibCorrupted(raw.size());
+      if (InflateWith(INFLATE_BACKENDS::NATIVE, corrupted, std::vector<Chunk>(), nativeCorrupted) &&
+        InflateWith(INFLATE_BACKENDS::ZLIB, corrupted, std::vector<Chunk>(), zlibCorrupted) && nativeCorrupted != zlibCorrupted) {
+        std::cerr << "Inflate backends disagree on a corrupted stream: iteration " << iteration << std::endl;
+        failures += 1;
+      }
+    }
+  }
+  return failures;
+}
+
+/* Decodes PNGs of one size again and again with one reused decoder and DecoderContext, on both inflate backends.
+Every decode must match DecodeDataInto, and once the context has decoded one image, later decodes must not grow
+the context or call operator new. Also checks that AllocateDecompressedData allocates the exact size and ends its zlib stream.*/
+int TestDecoderContext() {
+  struct Image { unsigned int width, height; unsigned char bitDepth, colorType, interlaceMethod; PIXEL_FORMATS format; };
+  const Image images[] = {{300, 200, 8, 6, 0, PIXEL_FORMATS::RAW}, {129, 70, 16, 2, 0, PIXEL_FORMATS::RGBA8},
+    {64, 33, 4, 3, 0, PIXEL_FORMATS::RGBA8}, {77, 51, 8, 2, 1, PIXEL_FORMATS::RAW}, {77, 51, 2, 0, 1, PIXEL_FORMATS::RGB8}};
+  std::vector<char> palette(3 * 16);
+  std::vector<char> transparency(5);
+  for (size_t i = 0; i < palette.size(); ++i) {
+    palette[i] = static_cast<char>(i * 7);
+  }
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_test_context.png";
+  INFLATE_BACKENDS defaultBackend = Inflate::backend;
+  int failures = 0;
+
+  for (INFLATE_BACKENDS backend : {INFLATE_BACKENDS::NATIVE, INFLATE_BACKENDS::ZLIB}) {
+    Inflate::backend = backend;
+    unsigned int seed = 300;
+    for (const Image& image : images) {
+      std::vector<std::vector<char>> pngs;
+      for (unsigned int i = 0; i < 3; ++i) {
+        WritePng(fileName, image.width, image.height, image.bitDepth, image.colorType, 700, seed++, image.interlaceMethod,
+          (image.colorType == 3) ? palette : std::vector<char>(), (image.colorType == 3) ? transparency : std::vector<char>());
+        pngs.push_back(ReadFile(fileName));
+      }
+
+      DecoderContext context;
+      PNG_Decoder decoder;
+      bool valid = true;
+      unsigned long warmAllocations = 0;
+      unsigned long warmNewCalls = 0;
+      for (unsigned int round = 0; round < 2 * pngs.size(); ++round) {
+        const std::vector<char>& png = pngs[round % pngs.size()];
+        std::vector<char> expected;
+        {
+          PNG_Decoder expectedDecoder(reinterpret_cast<const uint8_t *>(png.data()), png.size());
+          expected.resize(expectedDecoder.GetPixelConverter(image.format).GetOutputDataSize(image.width, image.height));
+          valid = valid && expectedDecoder.DecodeDataInto(expected.data(), expected.size(), image.format) == expected.size();
+        }
+
+        unsigned long contextNewCalls = newCalls.load();
+        decoder.Open(reinterpret_cast<const uint8_t *>(png.data()), png.size());
+        unsigned long size = 0;
+        const char * decoded = decoder.Decode(context, size, image.format);
+        contextNewCalls = newCalls.load() - contextNewCalls;
+        valid = valid && decoded != nullptr && size == expected.size() && std::equal(expected.begin(), expected.end(), decoded);
+        if (round == 0) {
+          warmAllocations = context.GetAllocationCount();
+        } else {
+          warmNewCalls += contextNewCalls;
+        }
+      }
+      if (!valid || warmNewCalls != 0 || context.GetAllocationCount() != warmAllocations) {
+        std::cerr << "Decoder context mismatch (backend " << backend << "): " << image.width << "x" << image.height << " bit depth "
+          << static_cast<int>(image.bitDepth) << " color type " << static_cast<int>(image.colorType) << ", " << warmNewCalls
+          << " operator new calls and " << context.GetAllocationCount() - warmAllocations << " context allocations after warm-up"
+          << std::endl;
+        failures += 1;
+      }
+    }
+  }
+  Inflate::backend = defaultBackend;
+
+  // The zlib decode must free its stream; the sanitizer build reports a leak otherwise.
+  WritePng(fileName, 90, 40, 8, 2, 500, 11);
+  Inflate::backend = INFLATE_BACKENDS::ZLIB;
+  PNG_Decoder decoder(fileName);
+  char * compressedData = nullptr;
+  char * decompressedData = nullptr;
+  unsigned long compressedDataSize = decoder.AllocateCompressedData(compressedData);
+  unsigned long decompressedDataSize = PNG_Decoder::AllocateDecompressedData(compressedData, compressedDataSize, decompressedData,
+    90, 40, 8, 2);
+  Inflate::backend = defaultBackend;
+  if (decompressedDataSize != PNG_Decoder::GetDecompressedDataSize(90, 40, 8, 2)) {
+    std::cerr << "AllocateDecompressedData returned " << decompressedDataSize << " bytes." << std::endl;
+    failures += 1;
+  }
+  std::free(compressedData);
+  std::free(decompressedData);
+
+  std::filesystem::remove(fileName);
+  return failures;
+}
+
+// Reads sample index of a scan line of bitDepth-bit samples. 16-bit samples are big-endian unless bigEndian is false.
+static unsigned int GetSample(const char * scanLine, unsigned long index, unsigned int bitDepth, bool bigEndian = true) {
+  if (bitDepth == 16) {
+    const unsigned char * sample = reinterpret_cast<const unsigned char *>(scanLine) + 2 * index;
+    uint16_t hostSample;
+    std::memcpy(&hostSample, sample, 2);
+    return bigEndian ? (sample[0] << 8) | sample[1] : hostSample;
+  }
+  return GetPixel(scanLine, index, bitDepth);
+}
+
+/* Decodes thumbnails of every color type and bit depth, at power-of-two and arbitrary sizes, and compares them
+with a full decode averaged pixel by pixel over the exact area each output pixel covers.*/
+int TestDownscale() {
+  struct Image {
+    unsigned int width, height;
+    unsigned char bitDepth, colorType, interlaceMethod;
+    PIXEL_FORMATS format;
+    unsigned int outputWidth, outputHeight;
+  };
+  const Image images[] = {{64, 64, 8, 6, 0, PIXEL_FORMATS::RAW, 16, 16}, {101, 67, 8, 2, 0, PIXEL_FORMATS::RAW, 13, 7},
+    {50, 40, 16, 2, 0, PIXEL_FORMATS::RAW, 7, 9}, {31, 29, 16, 4, 0, PIXEL_FORMATS::HOST_ENDIAN, 30, 4},
+    {45, 33, 1, 0, 0, PIXEL_FORMATS::RAW, 10, 5}, {45, 33, 2, 0, 0, PIXEL_FORMATS::RAW, 45, 33}, {45, 33, 4, 0, 0, PIXEL_FORMATS::RAW, 1, 1},
+    {30, 30, 4, 3, 0, PIXEL_FORMATS::RGBA8, 7, 7}, {20, 20, 16, 6, 0, PIXEL_FORMATS::RGB8, 3, 3},
+    {77, 51, 8, 4, 1, PIXEL_FORMATS::GRAY8, 20, 10}, {64, 48, 8, 2, 1, PIXEL_FORMATS::RAW, 8, 6}};
+  std::vector<char> palette(3 * 16);
+  std::vector<char> transparency(7);
+  for (size_t i = 0; i < palette.size(); ++i) {
+    palette[i] = static_cast<char>(i * 11);
+  }
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_test_downscale.png";
+  int failures = 0;
+
+  unsigned int seed = 500;
+  for (const Image& image : images) {
+    WritePng(fileName, image.width, image.height, image.bitDepth, image.colorType, 300, seed++, image.interlaceMethod,
+      (image.colorType == 3) ? palette : std::vector<char>(), (image.colorType == 3) ? transparency : std::vector<char>());
+    PNG_Decoder decoder(fileName);
+    PixelConverter converter = decoder.GetPixelConverter(image.format);
+    std::vector<char> full(converter.GetOutputDataSize(image.width, image.height));
+    bool valid = decoder.DecodeDataInto(full.data(), full.size(), image.format) == full.size();
+
+    bool converted = image.format != PIXEL_FORMATS::RAW && image.format != PIXEL_FORMATS::HOST_ENDIAN;
+    unsigned int bitDepth = converted ? 8 : image.bitDepth;
+    unsigned int channels = converter.GetOutputBitsPerPixel() / bitDepth;
+    bool bigEndian = image.format != PIXEL_FORMATS::HOST_ENDIAN;
+    unsigned long outputSize = decoder.GetDownscaledDataSize(image.outputWidth, image.outputHeight, image.format);
+    std::vector<char> output(outputSize);
+    valid = valid && outputSize == (static_cast<unsigned long>(image.outputWidth) * channels * bitDepth + 7) / 8 * image.outputHeight &&
+      decoder.DecodeDownscaledInto(output.data(), output.size(), image.outputWidth, image.outputHeight, image.format) == outputSize;
+
+    unsigned long scanLineWidth = full.size() / image.height;
+    unsigned long outputScanLineWidth = outputSize / image.outputHeight;
+    uint64_t area = static_cast<uint64_t>(image.width) * image.height;
+    for (unsigned int oy = 0; valid && oy < image.outputHeight; ++oy) {
+      for (unsigned int ox = 0; valid && ox < image.outputWidth; ++ox) {
+        for (unsigned int c = 0; c < channels; ++c) {
+          uint64_t sum = 0;
+          for (unsigned int y = 0; y < image.height; ++y) {
+            int64_t overlapY = std::min<int64_t>((y + 1) * image.outputHeight, (oy + 1) * image.height) -
+              std::max<int64_t>(y * image.outputHeight, oy * image.height);
+            for (unsigned int x = 0; overlapY > 0 && x < image.width; ++x) {
+              int64_t overlapX = std::min<int64_t>((x + 1) * image.outputWidth, (ox + 1) * image.width) -
+                std::max<int64_t>(x * image.outputWidth, ox * image.width);
+              if (overlapX > 0) {
+                sum += GetSample(full.data() + y * scanLineWidth, x * channels + c, bitDepth, bigEndian) * overlapX * overlapY;
+              }
+            }
+          }
+          unsigned int expected = static_cast<unsigned int>((sum + area / 2) / area);
+          valid = valid && GetSample(output.data() + oy * outputScanLineWidth, ox * channels + c, bitDepth, bigEndian) == expected;
+        }
+      }
+    }
+    if (!valid) {
+      std::cerr << "Downscale mismatch: " << image.width << "x" << image.height << " bit depth " << static_cast<int>(image.bitDepth)
+        << " color type " << static_cast<int>(image.colorType) << " to " << image.outputWidth << "x" << image.outputHeight << std::endl;
+      failures += 1;
+    }
+  }
+
+  // Palette indices cannot be averaged, and thumbnails cannot be larger than the image.
+  WritePng(fileName, 30, 30, 4, 3, 300, 9, 0, palette);
+  PNG_Decoder paletteDecoder(fileName);
+  std::vector<char> output(4 * 30 * 31);
+  if (paletteDecoder.DecodeDownscaledInto(output.data(), output.size(), 10, 10) != 0 ||
+    paletteDecoder.DecodeDownscaledInto(output.data(), output.size(), 31, 30, PIXEL_FORMATS::RGBA8) != 0 ||
+    paletteDecoder.DecodeDownscaledInto(output.data(), 10, 10, 10, PIXEL_FORMATS::RGBA8) != 0) {
+    std::cerr << "An invalid downscale was not rejected." << std::endl;
+    failures += 1;
+  }
+
+  std::filesystem::remove(fileName);
+  return failures;
+}
+
+/* Checks hits, misses and LRU eviction under a budget of two images, that rewritten files and new formats are
+decoded again while equal buffers share an entry, and that concurrent lookups of one image decode it once.*/
+int TestImageCache() {
+  std::filesystem::path directory = std::filesystem::temp_directory_path() / "png_decoder_test_cache";
+  std::filesystem::create_directories(directory);
+  std::vector<std::filesystem::path> fileNames;
+  std::vector<std::vector<char>> expected;
+  for (unsigned int i = 0; i < 3; ++i) {
+    fileNames.push_back(directory / ("image" + std::to_string(i) + ".png"));
+    WritePng(fileNames[i], 64, 64, 8, 6, 1000, 600 + i);
+    PNG_Decoder decoder(fileNames[i]);
+    expected.push_back(std::vector<char>(PNG_Decoder::GetUnfilteredDataSize(64, 64, 8, 6)));
+    decoder.DecodeDataInto(expected[i].data(), expected[i].size());
+  }
+  unsigned long imageSize = expected[0].size();
+  int failures = 0;
+
+  ImageCache cache(2 * imageSize);
+  SharedImage first = cache.Get(fileNames[0]);
+  bool valid = first->success && first->unfilteredData == expected[0] && cache.Get(fileNames[0]) == first;
+  SharedImage second = cache.Get(fileNames[1]);
+  valid = valid && cache.Get(fileNames[0]) == first && cache.Get(fileNames[2])->unfilteredData == expected[2];
+  ImageCacheCounters counters = cache.GetCounters();
+  // The third image evicted the second, the least recently used; holders of the second keep it.
+  valid = valid && counters.hits == 2 && counters.misses == 3 && counters.evictions == 1 && counters.images == 2 &&
+    counters.bytes == 2 * imageSize && second->unfilteredData == expected[1] && cache.Get(fileNames[0]) == first;
+  valid = valid && cache.Get(fileNames[1]) != second && cache.GetCounters().misses == 4;
+  if (!valid) {
+    std::cerr << "Image cache hit, miss or eviction mismatch." << std::endl;
+    failures += 1;
+  }
+
+  // A rewritten file is a new key; the old image is still what earlier callers hold.
+  WritePng(fileNames[0], 64, 64, 8, 6, 1000, 700);
+  std::filesystem::last_write_time(fileNames[0], std::filesystem::last_write_time(fileNames[0]) + std::chrono::seconds(2));
+  SharedImage rewritten = cache.Get(fileNames[0]);
+  std::vector<char> png = ReadFile(fileNames[2]);
+  std::vector<char> copy(png);
+  SharedImage fromBuffer = cache.Get(reinterpret_cast<const uint8_t *>(png.data()), png.size());
+  unsigned long misses = cache.GetCounters().misses;
+  valid = rewritten != first && rewritten->unfilteredData != expected[0] && first->unfilteredData == expected[0] &&
+    fromBuffer->unfilteredData == expected[2] && cache.Get(reinterpret_cast<const uint8_t *>(copy.data()), copy.size()) == fromBuffer &&
+    cache.Get(reinterpret_cast<const uint8_t *>(copy.data()), copy.size(), PIXEL_FORMATS::RGB8)->unfilteredData.size() == 3 * 64 * 64 &&
+    cache.GetCounters().misses == misses + 1;
+  // Failed decodes are returned but not cached.
+  ImageCacheCounters beforeMissing = cache.GetCounters();
+  valid = valid && !cache.Get(directory / "missing.png")->success && !cache.Get(directory / "missing.png")->success &&
+    cache.GetCounters().misses == beforeMissing.misses + 2 && cache.GetCounters().images == beforeMissing.images;
+  cache.Clear();
+  valid = valid && cache.GetCounters().images == 0 && cache.GetCounters().bytes == 0;
+  if (!valid) {
+    std::cerr << "Image cache keys mismatch." << std::endl;
+    failures += 1;
+  }
+
+  // Buffer keys with matching size and checksums are only equal if their bytes are, even once stored.
+  const uint8_t bytes[] = {1, 2, 3, 4};
+  const uint8_t sameBytes[] = {1, 2, 3, 4};
+  const uint8_t otherBytes[] = {4, 3, 2, 1};
+  ImageCacheKey key = ImageCacheKey();
+  key.size = sizeof(bytes);
+  key.crc = 1;
+  key.adler = 2;
+  ImageCacheKey same = key;
+  ImageCacheKey forged = key;
+  key.data = bytes;
+  same.data = sameBytes;
+  forged.data = otherBytes;
+  ImageCacheKey stored = key.Store();
+  if (!(key == same) || key == forged || !(stored == same) || stored == forged || stored.data == key.data) {
+    std::cerr << "Image cache buffer keys did not compare their bytes." << std::endl;
+    failures += 1;
+  }
+
+  // Every thread asks for the same image at once; only one may decode it.
+  ImageCache sharedCache(16 * imageSize);
+  std::vector<SharedImage> results(8);
+  std::atomic<bool> start(false);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < results.size(); ++i) {
+    threads.emplace_back([&, i]() {
+      while (!start.load()) {
+        std::this_thread::yield();
+      }
+      results[i] = sharedCache.Get(fileNames[1]);
+    });
+  }
+  start = true;
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  counters = sharedCache.GetCounters();
+  valid = counters.misses == 1 && counters.hits + counters.coalesced == results.size() - 1;
+  for (const SharedImage& result : results) {
+    valid = valid && result == results[0] && result->unfilteredData == expected[1];
+  }
+  if (!valid) {
+    std::cerr << "Concurrent image cache lookups were not coalesced: " << counters.misses << " misses." << std::endl;
+    failures += 1;
+  }
+
+  std::filesystem::remove_all(directory);
+  return failures;
+}
+
+/* Writes a PNG of random scan lines whose zlib stream is flushed with flush (Z_FULL_FLUSH or Z_SYNC_FLUSH) at each of
+flushOffsets, in bytes of filtered data. With idotRows, each flushed piece gets an IDAT chunk of its own and an iDOT
+chunk gives the pieces those first rows, as Apple's encoder writes it; without, the stream is cut into IDAT chunks
+of idatSize bytes wherever the flushes fall. With restartRows set, rows that start a piece are filtered with Sub.*/
+static void WriteSegmentedPng(const std::filesystem::path& fileName, unsigned int width, unsigned int height, unsigned char bitDepth,
+  unsigned char colorType, unsigned int seed, const std::vector<unsigned long>& flushOffsets, int flush, bool restartRows,
+  const std::vector<unsigned int>& idotRows, unsigned int idatSize = 8192) {
+  std::mt19937 random(seed);
+  unsigned int channels = (colorType == 2) ? 3 : (colorType == 4) ? 2 : (colorType == 6) ? 4 : 1;
+  unsigned long rowSize = (width * channels * bitDepth + 7) / 8 + 1;
+  std::vector<char> raw(rowSize * height);
+  for (unsigned long i = 0; i < raw.size(); ++i) {
+    raw[i] = static_cast<char>((i % rowSize == 0) ? random() % 5 : random() % 16);
+  }
+  for (unsigned long offset : flushOffsets) {
+    if (restartRows && offset % rowSize == 0) {
+      raw[offset] = 1;
+    }
+  }
+
+  std::vector<std::vector<char>> pieces;
+  z_stream stream = {};
+  deflateInit(&stream, 6);
+  std::vector<unsigned long> ends(flushOffsets);
+  ends.push_back(raw.size());
+  unsigned long start = 0;
+  for (unsigned long end : ends) {
+    std::vector<char> piece(deflateBound(&stream, end - start) + 64);
+    stream.next_in = reinterpret_cast<Bytef *>(raw.data() + start);
+    stream.avail_in = static_cast<uInt>(end - start);
+    stream.next_out = reinterpret_cast<Bytef *>(piece.data());
+    stream.avail_out = static_cast<uInt>(piece.size());
+    deflate(&stream, (end == raw.size()) ? Z_FINISH : flush);
+    piece.resize(piece.size() - stream.avail_out);
+    pieces.push_back(piece);
+    start = end;
+  }
+  deflateEnd(&stream);
+
+  std::vector<char> ihdr;
+  AppendUint32(ihdr, width);
+  AppendUint32(ihdr, height);
+  ihdr.push_back(static_cast<char>(bitDepth));
+  ihdr.push_back(static_cast<char>(colorType));
+  ihdr.insert(ihdr.end(), 3, 0);
+  const char signature[] = {static_cast<char>(137), 80, 78, 71, 13, 10, 26, 10};
+  std::vector<char> png(signature, signature + 8);
+  AppendChunk(png, "IHDR", ihdr);
+  if (!idotRows.empty()) {
+    std::vector<char> idot;
+    AppendUint32(idot, static_cast<unsigned int>(idotRows.size()));
+    unsigned int chunkOffset = 12 + 4 + 12 * static_cast<unsigned int>(idotRows.size());
+    for (size_t i = 0; i < idotRows.size(); ++i) {
+      AppendUint32(idot, idotRows[i]);
+      AppendUint32(idot, ((i + 1 < idotRows.size()) ? idotRows[i + 1] : height) - idotRows[i]);
+      AppendUint32(idot, chunkOffset);
+      chunkOffset += 12 + static_cast<unsigned int>(pieces[i].size());
+    }
+    AppendChunk(png, "iDOT", idot);
+    for (const std::vector<char>& piece : pieces) {
+      AppendChunk(png, "IDAT", piece);
+    }
+  } else {
+    std::vector<char> compressed;
+    for (const std::vector<char>& piece : pieces) {
+      compressed.insert(compressed.end(), piece.begin(), piece.end());
+    }
+    for (size_t offset = 0; offset < compressed.size(); offset += idatSize) {
+      size_t size = std::min<size_t>(idatSize, compressed.size() - offset);
+      AppendChunk(png, "IDAT", std::vector<char>(compressed.begin() + offset, compressed.begin() + offset + size));
+    }
+  }
+  AppendChunk(png, "IEND", std::vector<char>());
+  std::ofstream outputStream(fileName, std::ofstream::binary);
+  outputStream.write(png.data(), static_cast<std::streamsize>(png.size()));
+}
+
+/* Decodes iDOT and full-flush segmented images in parallel and compares them with a serial decode, including
+segments that turn out to share data and an iDOT chunk whose rows do not match the stream, which must fall back.*/
+int TestSegmentedDecode() {
+  struct Image {
+    unsigned int width, height;
+    unsigned char bitDepth, colorType;
+    std::vector<unsigned int> flushRows; // Flush before these rows, or every flushBytes if empty
+    unsigned long flushBytes;
+    int flush;
+    bool restartRows;
+    bool idot;
+    std::vector<unsigned int> idotRows;  // When they differ from the flushed rows
+    PIXEL_FORMATS format;
+    unsigned int numSegments;            // What GetNumSegments must find
+  };
+  const Image images[] = {
+    {400, 300, 8, 6, {150}, 0, Z_FULL_FLUSH, false, true, {}, PIXEL_FORMATS::RAW, 2},
+    {400, 300, 8, 6, {150}, 0, Z_FULL_FLUSH, false, true, {}, PIXEL_FORMATS::RGB8, 2},
+    {129, 500, 16, 2, {1, 100, 101, 350, 499}, 0, Z_FULL_FLUSH, true, true, {}, PIXEL_FORMATS::HOST_ENDIAN, 6},
+    {333, 257, 4, 0, {64, 200}, 0, Z_FULL_FLUSH, false, true, {}, PIXEL_FORMATS::GRAY8, 3},
+    {512, 512, 8, 6, {}, 200000, Z_FULL_FLUSH, false, false, {}, PIXEL_FORMATS::RAW, 5},
+    {400, 300, 8, 6, {150}, 0, Z_SYNC_FLUSH, false, true, {}, PIXEL_FORMATS::RAW, 2},
+    {400, 300, 8, 6, {150}, 0, Z_FULL_FLUSH, false, true, {0, 151}, PIXEL_FORMATS::RAW, 2},
+    {512, 512, 8, 6, {}, 200000, Z_SYNC_FLUSH, false, false, {}, PIXEL_FORMATS::RAW, 5}
+  };
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_test_segments.png";
+  ThreadPool pool(3);
+  int failures = 0;
+
+  unsigned int seed = 900;
+  for (const Image& image : images) {
+    unsigned int channels = (image.colorType == 2) ? 3 : (image.colorType == 4) ? 2 : (image.colorType == 6) ? 4 : 1;
+    unsigned long rowSize = (image.width * channels * image.bitDepth + 7) / 8 + 1;
+    std::vector<unsigned long> flushOffsets;
+    std::vector<unsigned int> idotRows = image.idotRows;
+    for (unsigned int row : image.flushRows) {
+      flushOffsets.push_back(row * rowSize);
+    }
+    for (unsigned long offset = image.flushBytes; image.flushBytes > 0 && offset < rowSize * image.height; offset += image.flushBytes) {
+      flushOffsets.push_back(offset);
+    }
+    if (image.idot && idotRows.empty()) {
+      idotRows.push_back(0);
+      idotRows.insert(idotRows.end(), image.flushRows.begin(), image.flushRows.end());
+    }
+    WriteSegmentedPng(fileName, image.width, image.height, image.bitDepth, image.colorType, seed++, flushOffsets, image.flush,
+      image.restartRows, idotRows);
+
+    PNG_Decoder decoder(fileName, LOAD_TYPES::MMAP);
+    unsigned long size = decoder.GetPixelConverter(image.format).GetOutputDataSize(image.width, image.height);
+    std::vector<char> expected(size);
+    std::vector<char> shared(size);
+    std::vector<char> owned(size);
+    bool valid = decoder.DecodeDataInto(expected.data(), expected.size(), image.format) == size &&
+      decoder.GetNumSegments(!image.idot) == image.numSegments && (image.idot || decoder.GetNumSegments(false) == 1) &&
+      decoder.DecodeSegmentsInto(shared.data(), shared.size(), image.format, !image.idot) == size &&
+      decoder.DecodeSegmentsInto(owned.data(), owned.size(), image.format, !image.idot, &pool) == size;
+    if (!valid || shared != expected || owned != expected) {
+      std::cerr << "Segmented decode mismatch: " << image.width << "x" << image.height << ", " << decoder.GetNumSegments(!image.idot)
+        << " segments." << std::endl;
+      failures += 1;
+    }
+  }
+
+  // Images without segments decode serially.
+  WritePng(fileName, 64, 64, 8, 6, 1000, seed);
+  PNG_Decoder decoder(fileName);
+  std::vector<char> expected(PNG_Decoder::GetUnfilteredDataSize(64, 64, 8, 6));
+  std::vector<char> decoded(expected.size());
+  if (decoder.DecodeDataInto(expected.data(), expected.size()) != expected.size() || decoder.GetNumSegments(true) != 1 ||
+    decoder.DecodeSegmentsInto(decoded.data(), decoded.size(), PIXEL_FORMATS::RAW, true) != decoded.size() || decoded != expected) {
+    std::cerr << "Unsegmented decode mismatch." << std::endl;
+    failures += 1;
+  }
+  std::filesystem::remove(fileName);
+  return failures;
+}
+
+/* Unfilters images on a pool, split at their None and Sub rows, and compares them with a serial unfilter: images
+with random filters, with a restart on every row, and with none, which must stay serial. The decompressed data
+must be left unchanged, also when converting.*/
+int TestParallelUnfilter() {
+  struct Image { unsigned int width, height; unsigned char bitDepth, colorType; PIXEL_FORMATS format; int filterType; };
+  const Image images[] = {
+    {1024, 300, 8, 6, PIXEL_FORMATS::RAW, -1}, {2000, 200, 16, 2, PIXEL_FORMATS::HOST_ENDIAN, -1}, {3000, 400, 4, 0, PIXEL_FORMATS::GRAY8, -1},
+    {1500, 300, 8, 2, PIXEL_FORMATS::RGBA8, -1}, {1024, 300, 8, 6, PIXEL_FORMATS::RAW, 1}, {1024, 300, 8, 6, PIXEL_FORMATS::RGB8, 0},
+    {1024, 300, 8, 6, PIXEL_FORMATS::RAW, 4}, {64, 64, 8, 6, PIXEL_FORMATS::RAW, -1}
+  };
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_test_unfilter.png";
+  ThreadPool pool(4);
+  int failures = 0;
+
+  unsigned int seed = 1100;
+  for (const Image& image : images) {
+    WritePng(fileName, image.width, image.height, image.bitDepth, image.colorType, 65536, seed++);
+    PNG_Decoder decoder(fileName);
+    std::vector<char> decompressed(PNG_Decoder::GetDecompressedDataSize(image.width, image.height, image.bitDepth, image.colorType));
+    decoder.DecompressDataInto(decompressed.data(), decompressed.size());
+    unsigned long rowSize = decompressed.size() / image.height;
+    for (unsigned int row = 0; image.filterType >= 0 && row < image.height; ++row) {
+      decompressed[row * rowSize] = static_cast<char>(image.filterType);
+    }
+    std::vector<char> original(decompressed);
+
+    PixelConverter converter = decoder.GetPixelConverter(image.format);
+    const PixelConverter * imageConverter = (image.format == PIXEL_FORMATS::RAW) ? nullptr : &converter;
+    unsigned long size = converter.GetOutputDataSize(image.width, image.height);
+    std::vector<char> expected(size);
+    std::vector<char> parallel(size);
+    char * allocated = nullptr;
+    bool valid = PNG_Decoder::UnfilterDataInto(decompressed.data(), expected.data(), size, image.width, image.height, image.bitDepth,
+        image.colorType, 0, imageConverter) == size &&
+      PNG_Decoder::UnfilterDataInto(decompressed.data(), parallel.data(), size, image.width, image.height, image.bitDepth,
+        image.colorType, 0, imageConverter, nullptr, &pool) == size &&
+      PNG_Decoder::AllocateUnfilteredData(decompressed.data(), allocated, image.width, image.height, image.bitDepth, image.colorType, 0,
+        imageConverter, &pool) == size;
+    valid = valid && parallel == expected && std::memcmp(allocated, expected.data(), size) == 0 && decompressed == original;
+    std::free(allocated);
+    if (!valid) {
+      std::cerr << "Parallel unfilter mismatch: " << image.width << "x" << image.height << " bit depth " << static_cast<int>(image.bitDepth)
+        << " color type " << static_cast<int>(image.colorType) << std::endl;
+      failures += 1;
+    }
+  }
+  std::filesystem::remove(fileName);
+  return failures;
+}
+
+// A PNG of just an IHDR chunk and IEND, enough to probe or open but not to decode.
+static std::vector<char> GetHeaderOnlyPng(unsigned int width, unsigned int height, unsigned char bitDepth, unsigned char colorType) {
+  std::vector<char> ihdr;
+  AppendUint32(ihdr, width);
+  AppendUint32(ihdr, height);
+  ihdr.push_back(static_cast<char>(bitDepth));
+  ihdr.push_back(static_cast<char>(colorType));
+  ihdr.insert(ihdr.end(), 3, 0);
+  const char signature[] = {static_cast<char>(137), 80, 78, 71, 13, 10, 26, 10};
+  std::vector<char> png(signature, signature + 8);
+  AppendChunk(png, "IHDR", ihdr);
+  AppendChunk(png, "IEND", std::vector<char>());
+  return png;
+}
+
+// Sizes past 4 GiB are exact, and sizes past 64 bits or scan lines too wide for zlib are rejected instead of wrapping.
+int TestLargeSizes() {
+  int failures = 0;
+  bool valid = PNG_Decoder::GetUnfilteredDataSize(100000, 100000, 16, 6) == 80000000000ul &&
+    PNG_Decoder::GetDecompressedDataSize(100000, 100000, 8, 2) == 300001ul * 100000 &&
+    PNG_Decoder::GetUnfilteredDataSize(0x3FFFFFFF, 0xFFFFFFFF, 8, 6) == 0xFFFFFFFCul * 0xFFFFFFFFul &&
+    PNG_Decoder::GetDecompressedDataSize(100000, 100000, 8, 2, 1) > 300000ul * 100000;
+  if (!valid) {
+    std::cerr << "Large image sizes are not exact." << std::endl;
+    failures += 1;
+  }
+
+  unsigned int overflows = 0;
+  PixelConverter converter(8, 0, PIXEL_FORMATS::RGBA8);
+  std::vector<std::function<unsigned long()>> sizes = {
+    [] { return PNG_Decoder::GetUnfilteredDataSize(0x7FFFFFFF, 1, 16, 6); },
+    [] { return PNG_Decoder::GetDecompressedDataSize(0x7FFFFFFF, 0x7FFFFFFF, 16, 6, 1); },
+    [&converter] { return converter.GetOutputDataSize(0xFFFFFFFF, 0xFFFFFFFF); }
+  };
+  for (const std::function<unsigned long()>& size : sizes) {
+    try {
+      size();
+    } catch(const std::overflow_error&) {
+      overflows += 1;
+    }
+  }
+  if (overflows != sizes.size()) {
+    std::cerr << "Only " << overflows << " of " << sizes.size() << " oversized images were rejected." << std::endl;
+    failures += 1;
+  }
+
+  // Headers of huge images probe fine; their decodes reject small buffers by the full 64-bit size.
+  std::vector<char> png = GetHeaderOnlyPng(100000, 100000, 16, 6);
+  std::vector<char> tooWide = GetHeaderOnlyPng(0x7FFFFFFF, 2, 16, 6);
+  IHDR ihdr;
+  IHDR tooWideIhdr;
+  PNG_Decoder decoder(reinterpret_cast<const uint8_t *>(png.data()), png.size());
+  std::vector<char> unfilteredData(4096);
+  valid = PNG_Decoder::Probe(reinterpret_cast<const uint8_t *>(png.data()), png.size(), ihdr) &&
+    ihdr.unfilteredDataSize == 80000000000ul && !PNG_Decoder::Probe(reinterpret_cast<const uint8_t *>(tooWide.data()), tooWide.size(),
+    tooWideIhdr) && decoder.IsOpen() && decoder.DecodeDataInto(unfilteredData.data(), unfilteredData.size()) == 0;
+  if (!valid) {
+    std::cerr << "Huge image headers were not handled." << std::endl;
+    failures += 1;
+  }
+  return failures;
+}
+
+/* Decodes a batch where one PNG has a valid header too wide to decode, through Decode and Submit. Both must
+return, with that image reported as failed and every other image decoded.*/
+int TestBatchDecode() {
+  std::filesystem::path directory = std::filesystem::temp_directory_path() / "png_decoder_test_batch";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+  std::vector<std::filesystem::path> fileNames;
+  for (unsigned int i = 0; i < 8; ++i) {
+    fileNames.push_back(directory / ("image" + std::to_string(i) + ".png"));
+    WritePng(fileNames.back(), i + 10, 7, 8, 6, 4096, i);
+  }
+  std::vector<char> tooWide = GetHeaderOnlyPng(2000000000, 1, 16, 6);
+  std::ofstream(fileNames[3], std::ofstream::binary).write(tooWide.data(), static_cast<std::streamsize>(tooWide.size()));
+  int failures = 0;
+
+  BatchDecoder batchDecoder(2, 1);
+  std::vector<unsigned char> succeeded(fileNames.size(), 2);
+  batchDecoder.Decode(fileNames, [&succeeded](DecodedImage& image) {
+    succeeded[image.index] = image.success && image.unfilteredData.size() == 4ul * image.width * image.height;
+  });
+  for (size_t i = 0; i < fileNames.size(); ++i) {
+    if (succeeded[i] != ((i == 3) ? 0 : 1)) {
+      std::cerr << "Batch decode of " << fileNames[i] << " reported " << static_cast<int>(succeeded[i]) << "." << std::endl;
+      failures += 1;
+    }
+  }
+
+  // The oversized header is rejected by DecodeImage itself, which keeps the header's values.
+  DecodedImage image;
+  DecoderContext context;
+  BatchDecoder::DecodeBuffer(image, reinterpret_cast<const uint8_t *>(tooWide.data()), tooWide.size(), PIXEL_FORMATS::RAW, context);
+  if (image.success || image.width != 2000000000 || !image.unfilteredData.empty()) {
+    std::cerr << "The oversized header was not rejected by DecodeImage." << std::endl;
+    failures += 1;
+  }
+
+  // Off the pool, the decode takes its scratch buffers from the caller's context.
+  image.fileName = fileNames[0];
+  BatchDecoder::DecodeFile(image, PIXEL_FORMATS::RAW, context);
+  unsigned long decompressedDataSize = PNG_Decoder::GetDecompressedDataSize(10, 7, 8, 6);
+  if (!image.success || context.GetBufferCapacity(SCRATCH_BUFFERS::DECOMPRESSED_BUFFER) < decompressedDataSize) {
+    std::cerr << "DecodeFile did not decode with the given context." << std::endl;
+    failures += 1;
+  }
+
+  /* A header-only PNG claiming 20000x20000 RGBA8 is over the default buffer limit and must fail before anything is
+  allocated. With no retained size, the context is emptied after every image.*/
+  std::vector<char> tooLarge = GetHeaderOnlyPng(20000, 20000, 8, 6);
+  DecoderContext limited(DecoderContext::defaultMaxBufferSize, 0);
+  unsigned long allocations = limited.GetAllocationCount();
+  BatchDecoder::DecodeBuffer(image, reinterpret_cast<const uint8_t *>(tooLarge.data()), tooLarge.size(), PIXEL_FORMATS::RAW, limited);
+  if (image.success || image.width != 20000 || limited.GetAllocationCount() != allocations) {
+    std::cerr << "A header over the buffer limit was not rejected before allocating." << std::endl;
+    failures += 1;
+  }
+  BatchDecoder::DecodeFile(image, PIXEL_FORMATS::RAW, limited);
+  if (!image.success || limited.GetBufferCapacity(SCRATCH_BUFFERS::DECOMPRESSED_BUFFER) != 0) {
+    std::cerr << "The context kept a buffer over its retained size." << std::endl;
+    failures += 1;
+  }
+  bool refused = false;
+  try {
+    DecoderContext small(1000, 1000);
+    small.GetBuffer(SCRATCH_BUFFERS::OUTPUT_BUFFER, 1001);
+  } catch(const std::length_error&) {
+    refused = true;
+  }
+  if (!refused) {
+    std::cerr << "GetBuffer allocated past the buffer limit." << std::endl;
+    failures += 1;
+  }
+
+  std::future<DecodedImage> bad = batchDecoder.Submit(reinterpret_cast<const uint8_t *>(tooWide.data()), tooWide.size());
+  std::future<DecodedImage> good = batchDecoder.Submit(fileNames[0]);
+  if (bad.get().success || !good.get().success) {
+    std::cerr << "Submitted images were not reported correctly." << std::endl;
+    failures += 1;
+  }
+  std::filesystem::remove_all(directory);
+  return failures;
+}
+
+// Decodes into file-backed outputs, releasing them every few rows, and compares the files with in-memory decodes.
+int TestMappedDecode() {
+  struct Image { unsigned int width, height; unsigned char bitDepth, colorType, interlaceMethod; PIXEL_FORMATS format; };
+  const Image images[] = {
+    {300, 200, 8, 6, 0, PIXEL_FORMATS::RAW}, {129, 77, 16, 2, 0, PIXEL_FORMATS::HOST_ENDIAN}, {40, 33, 1, 0, 0, PIXEL_FORMATS::RAW},
+    {500, 100, 8, 0, 0, PIXEL_FORMATS::RGBA8}, {61, 47, 8, 2, 1, PIXEL_FORMATS::RAW}
+  };
+  std::filesystem::path fileName = std::filesystem::temp_directory_path() / "png_decoder_test_mapped.png";
+  std::filesystem::path outputName = std::filesystem::temp_directory_path() / "png_decoder_test_mapped.raw";
+  int failures = 0;
+
+  unsigned int seed = 1200;
+  for (const Image& image : images) {
+    WritePng(fileName, image.width, image.height, image.bitDepth, image.colorType, 4096, seed++, image.interlaceMethod);
+    PNG_Decoder decoder(fileName, LOAD_TYPES::MMAP);
+    PixelConverter converter = decoder.GetPixelConverter(image.format);
+    unsigned long size = converter.GetOutputDataSize(image.width, image.height);
+    std::vector<char> expected(size);
+    bool valid = decoder.DecodeDataInto(expected.data(), expected.size(), image.format) == size;
+    {
+      MappedOutput output(outputName, size);
+      valid = valid && output.IsOpen() && decoder.DecodeMappedInto(output, image.format, 4096) == size && output.Flush() &&
+        std::memcmp(output.GetData(), expected.data(), size) == 0;
+    }
+    valid = valid && ReadFile(outputName) == expected;
+    if (!valid) {
+      std::cerr << "Mapped decode mismatch: " << image.width << "x" << image.height << " bit depth " << static_cast<int>(image.bitDepth)
+        << " color type " << static_cast<int>(image.colorType) << std::endl;
+      failures += 1;
+    }
+  }
+
+  MappedOutput small(outputName, 16);
+  PNG_Decoder decoder(fileName);
+  if (decoder.DecodeMappedInto(small, PIXEL_FORMATS::RAW) != 0) {
+    std::cerr << "Mapped decode accepted an output that is too small." << std::endl;
+    failures += 1;
+  }
+  small.Close();
+  std::filesystem::remove(fileName);
+  std::filesystem::remove(outputName);
+  return failures;
+}
+
+// Decodes a batch of mixed PNGs into tensors of every layout and type and compares each element with a normalized reference decode.
+int TestTensorDecode() {
+  struct Image { unsigned int width, height; unsigned char bitDepth, colorType, interlaceMethod; };
+  const Image images[] = {{37, 23, 8, 2, 0}, {37, 23, 16, 2, 0}, {37, 23, 8, 6, 1}, {37, 23, 1, 0, 0}, {36, 23, 8, 2, 0}, {37, 23, 8, 0, 0}};
+  const size_t numImages = sizeof(images) / sizeof(images[0]);
+  std::filesystem::path directory = std::filesystem::temp_directory_path() / "png_decoder_test_tensor";
+  std::filesystem::create_directories(directory);
+  int failures = 0;
+
+  const uint16_t halves[] = {TensorWriter::ToHalf(1.0f), TensorWriter::ToHalf(-2.0f), TensorWriter::ToHalf(65504.0f),
+    TensorWriter::ToHalf(65520.0f), TensorWriter::ToHalf(1e-7f), TensorWriter::ToHalf(2.98e-8f), TensorWriter::ToHalf(0.1f)};
+  const uint16_t expectedHalves[] = {0x3C00, 0xC000, 0x7BFF, 0x7C00, 0x0002, 0x0000, 0x2E66};
+  if (std::memcmp(halves, expectedHalves, sizeof(halves)) != 0) {
+    std::cerr << "Half precision conversion mismatch." << std::endl;
+    failures += 1;
+  }
+
+  std::vector<std::filesystem::path> fileNames;
+  std::vector<std::vector<char>> files;
+  std::vector<std::pair<const uint8_t *, size_t>> buffers;
+  for (size_t i = 0; i < numImages; ++i) {
+    fileNames.push_back(directory / ("image" + std::to_string(i) + ".png"));
+    WritePng(fileNames[i], images[i].width, images[i].height, images[i].bitDepth, images[i].colorType, 512, 1300 + i,
+      images[i].interlaceMethod);
+    files.push_back(ReadFile(fileNames[i]));
+  }
+  for (const std::vector<char>& file : files) {
+    buffers.push_back(std::make_pair(reinterpret_cast<const uint8_t *>(file.data()), file.size()));
+  }
+
+  TensorOptions options = {37, 23, PIXEL_FORMATS::RGB8, TENSOR_LAYOUTS::NHWC, TENSOR_TYPES::UINT8, 1.0f / 255,
+    {0.485f, 0.456f, 0.406f, 0}, {0.229f, 0.224f, 0.225f, 1}};
+  BatchDecoder batchDecoder(3);
+  for (int layout = TENSOR_LAYOUTS::NHWC; layout <= TENSOR_LAYOUTS::NCHW; ++layout) {
+    for (int type = TENSOR_TYPES::UINT8; type <= TENSOR_TYPES::FLOAT32; ++type) {
+      options.layout = static_cast<TENSOR_LAYOUTS>(layout);
+      options.type = static_cast<TENSOR_TYPES>(type);
+      TensorWriter writer(options);
+      std::vector<char> tensor(writer.GetTensorSize(numImages), 1);
+      std::vector<char> bufferTensor(tensor.size(), 1);
+      std::vector<bool> decoded;
+      bool valid = batchDecoder.DecodeTensor(fileNames, options, tensor.data(), tensor.size(), &decoded) == numImages - 1 &&
+        batchDecoder.DecodeTensor(buffers, options, bufferTensor.data(), bufferTensor.size()) == numImages - 1 && tensor == bufferTensor;
+
+      for (size_t i = 0; valid && i < numImages; ++i) {
+        const char * image = tensor.data() + i * writer.GetImageSize();
+        if (images[i].width != options.width) {
+          valid = !decoded[i] && std::all_of(image, image + writer.GetImageSize(), [](char byte) { return byte == 0; });
+          continue;
+        }
+        PNG_Decoder decoder(fileNames[i]);
+        std::vector<char> pixels(decoder.GetPixelConverter(options.format).GetOutputDataSize(options.width, options.height));
+        valid = decoded[i] && decoder.DecodeDataInto(pixels.data(), pixels.size(), options.format) == pixels.size();
+        for (unsigned long p = 0; valid && p < pixels.size(); ++p) {
+          unsigned long x = p / 3 % options.width;
+          unsigned long y = p / 3 / options.width;
+          unsigned long c = p % 3;
+          unsigned long index = (options.layout == TENSOR_LAYOUTS::NHWC) ? p : (c * options.height + y) * options.width + x;
+          unsigned char sample = static_cast<unsigned char>(pixels[p]);
+          float value = (static_cast<float>(sample) * options.scale - options.mean[c]) / options.std[c];
+          if (options.type == TENSOR_TYPES::UINT8) {
+            valid = static_cast<unsigned char>(image[index]) == sample;
+          } else if (options.type == TENSOR_TYPES::FLOAT16) {
+            uint16_t element;
+            std::memcpy(&element, image + 2 * index, sizeof(element));
+            valid = element == TensorWriter::ToHalf(value);
+          } else {
+            float element;
+            std::memcpy(&element, image + 4 * index, sizeof(element));
+            valid = element == value;
+          }
+        }
+      }
+      if (!valid) {
+        std::cerr << "Tensor decode mismatch: layout " << layout << " type " << type << std::endl;
+        failures += 1;
+      }
+    }
+  }
+
+  std::vector<char> small(16);
+  if (batchDecoder.DecodeTensor(fileNames, options, small.data(), small.size()) != 0) {
+    std::cerr << "Tensor decode accepted a buffer that is too small." << std::endl;
+    failures += 1;
+  }
+  std::filesystem::remove_all(directory);
+  return failures;
+}
+
+/* Encodes images of every color type and bit depth with different levels, band sizes and filter choices, and
+decodes them back. zlib's uncompress checks the joined IDAT stream's Adler-32 and the decoder checks every CRC.*/
+int TestEncode() {
+  struct Image { unsigned int width, height; unsigned char bitDepth, colorType; };
+  const Image images[] = {{1, 1, 8, 0}, {37, 23, 1, 0}, {64, 50, 2, 0}, {31, 40, 4, 3}, {300, 200, 8, 2}, {129, 77, 16, 2},
+    {100, 90, 8, 4}, {45, 60, 16, 4}, {256, 256, 8, 6}, {77, 33, 16, 6}, {50, 50, 16, 0}, {40, 40, 8, 3}};
+  std::mt19937 random(2500);
+  ThreadPool pool(3);
+  int failures = 0;
+
+  // Filtering must be the exact reverse of unfiltering, and every filter cost kernel must agree with the scalar one.
+  const unsigned int bpps[] = {1, 2, 3, 4, 6, 8};
+  for (unsigned int bpp : bpps) {
+    std::vector<char> scanLine(101 * bpp);
+    std::vector<char> prior(scanLine.size());
+    for (unsigned long i = 0; i < scanLine.size(); ++i) {
+      scanLine[i] = static_cast<char>(random());
+      prior[i] = static_cast<char>(random());
+    }
+    ScanLineFilters filters = Filter::GetScanLineFilters(bpp);
+    unsigned int width = static_cast<unsigned int>(scanLine.size());
+    for (unsigned char filterType = 0; filterType <= 4; ++filterType) {
+      for (int hasPrior = 0; hasPrior <= 1; ++hasPrior) {
+        char * priorScanLine = hasPrior ? prior.data() : nullptr;
+        std::vector<char> filtered(width);
+        std::vector<char> unfiltered(width);
+        Filter::FilterScanLine(filterType, scanLine.data(), width, filtered.data(), bpp, priorScanLine);
+        Filter::UnfilterScanLine(filters, filterType, filtered.data(), width, unfiltered.data(), priorScanLine);
+        bool valid = unfiltered == scanLine;
+        for (int simdType = SIMD_TYPES::SCALAR; simdType <= Filter::systemType; ++simdType) {
+          // Odd widths leave a tail after the last whole vector.
+          for (unsigned int trimmed : {width, width - 5, bpp + 17}) {
+            std::vector<char> expected(trimmed);
+            std::vector<char> actual(trimmed);
+            Filter::FilterScanLine(filterType, scanLine.data(), trimmed, expected.data(), bpp, priorScanLine, SIMD_TYPES::SCALAR);
+            Filter::FilterScanLine(filterType, scanLine.data(), trimmed, actual.data(), bpp, priorScanLine, static_cast<SIMD_TYPES>(simdType));
+            valid = valid && actual == expected;
+          }
+          valid = valid && Filter::SumAbsoluteValues(filtered.data(), width, static_cast<SIMD_TYPES>(simdType)) ==
+            Filter::SumAbsoluteValues(filtered.data(), width, SIMD_TYPES::SCALAR);
+        }
+        if (!valid) {
+          std::cerr << "Filter round trip mismatch: filter " << static_cast<int>(filterType) << " bpp " << bpp
+            << (hasPrior ? "" : " (first scan line)") << std::endl;
+          failures += 1;
+        }
+      }
+    }
+  }
+
+  for (const Image& image : images) {
+    unsigned int channels = (image.colorType == 2) ? 3 : (image.colorType == 4) ? 2 : (image.colorType == 6) ? 4 : 1;
+    unsigned long scanLineWidth = (static_cast<unsigned long>(image.width) * channels * image.bitDepth + 7) / 8;
+    // Smooth gradients with some noise, so every filter wins some rows.
+    std::vector<char> unfilteredData(scanLineWidth * image.height);
+    for (unsigned int y = 0; y < image.height; ++y) {
+      for (unsigned long x = 0; x < scanLineWidth; ++x) {
+        unsigned int value = (y % 3 == 0) ? static_cast<unsigned int>(random()) : static_cast<unsigned int>(x * (y % 7) + y + random() % 4);
+        unfilteredData[y * scanLineWidth + x] = static_cast<char>(value);
+      }
+    }
+    if (image.colorType == 3 && image.bitDepth == 8) {
+      // Indices must stay inside the 16 entry palette.
+      for (char& index : unfilteredData) {
+        index = static_cast<char>(static_cast<unsigned char>(index) % 16);
+      }
+    }
+    if (image.bitDepth < 8 && image.width * image.bitDepth % 8 != 0) {
+      // Padding bits after the last pixel decode as zeros.
+      for (unsigned int y = 0; y < image.height; ++y) {
+        char& last = unfilteredData[y * scanLineWidth + scanLineWidth - 1];
+        last = static_cast<char>(last & (0xFF << (8 - image.width * image.bitDepth % 8)));
+      }
+    }
+
+    for (int level : {1, 6, 9}) {
+      for (unsigned long bandSize : {256ul, PNG_Encoder::defaultBandSize}) {
+        PNG_Encoder encoder(image.width, image.height, image.bitDepth, image.colorType, level, &pool);
+        encoder.SetBandSize(bandSize);
+        encoder.SetAdaptiveFilters(level != 1);
+        if (image.colorType == 3) {
+          encoder.SetPalette(std::vector<char>(48, 7), std::vector<char>(3, static_cast<char>(128)));
+        }
+        std::vector<char> png;
+        bool valid = encoder.Encode(unfilteredData.data(), unfilteredData.size(), png) == png.size() && !png.empty();
+
+        std::vector<char> idat;
+        for (unsigned long offset = 8; valid && offset + 12 <= png.size();) {
+          unsigned int length = (static_cast<unsigned char>(png[offset]) << 24) | (static_cast<unsigned char>(png[offset + 1]) << 16) |
+            (static_cast<unsigned char>(png[offset + 2]) << 8) | static_cast<unsigned char>(png[offset + 3]);
+          if (std::memcmp(png.data() + offset + 4, "IDAT", 4) == 0) {
+            idat.insert(idat.end(), png.begin() + offset + 8, png.begin() + offset + 8 + length);
+          }
+          offset += 12ul + length;
+        }
+        std::vector<char> inflated((scanLineWidth + 1) * image.height);
+        uLongf inflatedSize = static_cast<uLongf>(inflated.size());
+        valid = valid && uncompress(reinterpret_cast<Bytef *>(inflated.data()), &inflatedSize, reinterpret_cast<const Bytef *>(idat.data()),
+          static_cast<uLong>(idat.size())) == Z_OK && inflatedSize == inflated.size();
+
+        PNG_Decoder decoder(reinterpret_cast<const uint8_t *>(png.data()), png.size());
+        std::vector<char> decoded(unfilteredData.size());
+        valid = valid && decoder.IsOpen() && decoder.DecodeDataInto(decoded.data(), decoded.size()) == decoded.size() &&
+          decoded == unfilteredData;
+        if (!valid) {
+          std::cerr << "Encode round trip mismatch: " << image.width << "x" << image.height << " bit depth "
+            << static_cast<int>(image.bitDepth) << " color type " << static_cast<int>(image.colorType) << " level " << level
+            << " band size " << bandSize << std::endl;
+          failures += 1;
+        }
+      }
+    }
+  }
+
+  // Bands of noise compress to more than 64 KiB each, so the decoder finds their sync flushes and inflates them in parallel.
+  PNG_Encoder encoder(512, 512, 8, 6, 6, &pool);
+  encoder.SetBandSize(128 * 1024);
+  std::vector<char> noise(encoder.GetUnfilteredDataSize());
+  for (char& byte : noise) {
+    byte = static_cast<char>(random());
+  }
+  std::vector<char> png;
+  std::vector<char> decoded(noise.size());
+  encoder.Encode(noise.data(), noise.size(), png);
+  PNG_Decoder decoder(reinterpret_cast<const uint8_t *>(png.data()), png.size());
+  if (decoder.GetNumSegments(true) < 2 || decoder.DecodeSegmentsInto(decoded.data(), decoded.size(), PIXEL_FORMATS::RAW, true, &pool) !=
+    decoded.size() || decoded != noise) {
+    std::cerr << "Encoded bands were not decoded as segments." << std::endl;
+    failures += 1;
+  }
+
+  if (encoder.Encode(noise.data(), noise.size() - 1, png) != 0) {
+    std::cerr << "Encoder accepted unfiltered data that is too small." << std::endl;
+    failures += 1;
+  }
+  return failures;
+}
+
+int main() {
+  int failures = 0;
+  failures += TestFilterKernels();
+  failures += TestCrc();
+  failures += TestPipelinedDecode();
+  failures += TestScanLineDecode();
+  failures += TestBufferCapacity();
+  failures += TestProbe();
+  failures += TestInterlacedDecode();
+  failures += TestPixelConversion();
+  failures += TestRegionDecode();
+  failures += TestInflateBackends();
+  failures += TestDecodeStats();
+  failures += TestBufferDecode();
+  failures += TestDecoderContext();
+  failures += TestDownscale();
+  failures += TestImageCache();
+  failures += TestSegmentedDecode();
+  failures += TestParallelUnfilter();
+  failures += TestLargeSizes();
+  failures += TestBatchDecode();
+  failures += TestMappedDecode();
+  failures += TestTensorDecode();
+  failures += TestEncode();
+
+  if (failures > 0) {
+    std::cerr << failures << " test(s) failed." << std::endl;
+    return 1;
+  }
+  std::cout << "All tests passed." << std::endl;
   return 0;
-}
\ No newline at end of file
+}